@@ -21,7 +21,7 @@ const maek = init_maek();
 //======================================================================
 
 //set default targets to build (can be overridden by command line options):
-maek.TARGETS = ["bin/viewer" + (maek.OS === "windows" ? ".exe" : ""), "bin/cube" + (maek.OS === "windows" ? ".exe" : "")];
+maek.TARGETS = ["bin/viewer" + (maek.OS === "windows" ? ".exe" : ""), "bin/cube" + (maek.OS === "windows" ? ".exe" : ""), "bin/compress" + (maek.OS === "windows" ? ".exe" : "")];
 
 // const VULKAN_SDK = process.env.VULKAN_SDK;
 const USER = process.env.USER;
@@ -143,6 +143,66 @@ if (maek.OS === "windows") {
 // rules generally look like:
 //  output = maek.RULE_NAME(input [, output] [, {options}])
 
+// Shader file compilation
+const simple_frag_spv = maek.GLSLC("./src/shaders/simple.shader.frag", "./src/shaders/bin/simple.frag");
+const simple_vert_spv = maek.GLSLC("./src/shaders/simple.shader.vert", "./src/shaders/bin/simple.vert");
+
+const env_frag_spv = maek.GLSLC("./src/shaders/env.shader.frag", "./src/shaders/bin/env.frag");
+const env_vert_spv = maek.GLSLC("./src/shaders/env.shader.vert", "./src/shaders/bin/env.vert");
+
+const lamber_frag_spv = maek.GLSLC("./src/shaders/lamber.shader.frag", "./src/shaders/bin/lamber.frag");
+const lamber_vert_spv = maek.GLSLC("./src/shaders/lamber.shader.vert", "./src/shaders/bin/lamber.vert");
+
+const mirror_frag_spv = maek.GLSLC("./src/shaders/mirror.shader.frag", "./src/shaders/bin/mirror.frag");
+const mirror_vert_spv = maek.GLSLC("./src/shaders/mirror.shader.vert", "./src/shaders/bin/mirror.vert");
+
+const pbr_frag_spv = maek.GLSLC("./src/shaders/pbr.shader.frag", "./src/shaders/bin/pbr.frag");
+const pbr_vert_spv = maek.GLSLC("./src/shaders/pbr.shader.vert", "./src/shaders/bin/pbr.vert");
+
+const depth_frag_spv = maek.GLSLC("./src/shaders/depth.shader.frag", "./src/shaders/bin/depth.frag");
+const depth_vert_spv = maek.GLSLC("./src/shaders/depth.shader.vert", "./src/shaders/bin/depth.vert");
+
+const shadow_debug_frag_spv = maek.GLSLC("./src/shaders/shadow.debug.shader.frag", "./src/shaders/bin/shadow.debug.frag");
+const shadow_debug_vert_spv = maek.GLSLC("./src/shaders/shadow.debug.shader.vert", "./src/shaders/bin/shadow.debug.vert");
+
+const depth_cube_frag_spv = maek.GLSLC("./src/shaders/depth.cube.shader.frag", "./src/shaders/bin/depth.cube.frag");
+const depth_cube_vert_spv = maek.GLSLC("./src/shaders/depth.cube.shader.vert", "./src/shaders/bin/depth.cube.vert");
+
+const shadow_debug_cube_frag_spv = maek.GLSLC("./src/shaders/shadow.debug.cube.shader.frag", "./src/shaders/bin/shadow.debug.cube.frag");
+
+const gbuffer_frag_spv = maek.GLSLC("./src/shaders/gbuffer.shader.frag", "./src/shaders/bin/gbuffer.frag");
+const gbuffer_bindless_frag_spv = maek.GLSLC("./src/shaders/gbuffer.shader.frag", "./src/shaders/bin/gbuffer.bindless.frag", { GLSLCFlags: ['-DBINDLESS'] });
+const gbuffer_vert_spv = maek.GLSLC("./src/shaders/gbuffer.shader.vert", "./src/shaders/bin/gbuffer.vert");
+
+const ssao_frag_spv = maek.GLSLC("./src/shaders/ssao.shader.frag", "./src/shaders/bin/ssao.frag");
+const ssao_vert_spv = maek.GLSLC("./src/shaders/ssao.shader.vert", "./src/shaders/bin/ssao.vert");
+
+const ssao_blur_frag_spv = maek.GLSLC("./src/shaders/ssao.blur.shader.frag", "./src/shaders/bin/ssao.blur.frag");
+const ssao_blur_vert_spv = maek.GLSLC("./src/shaders/ssao.blur.shader.vert", "./src/shaders/bin/ssao.blur.vert");
+
+const cluster_cull_comp_spv = maek.GLSLC("./src/shaders/cluster_cull.shader.comp", "./src/shaders/bin/cluster_cull.comp");
+const brdf_lut_comp_spv = maek.GLSLC("./src/shaders/brdf_lut.shader.comp", "./src/shaders/bin/brdf_lut.comp");
+const env_prefilter_comp_spv = maek.GLSLC("./src/shaders/env_prefilter.shader.comp", "./src/shaders/bin/env_prefilter.comp");
+
+// The compiled SPIR-V is also embedded into the viewer, so bin/viewer does not read ./src/shaders/bin at runtime
+const embedded_shaders_cpp = maek.EMBED_SPIRV([
+	simple_frag_spv, simple_vert_spv,
+	env_frag_spv, env_vert_spv,
+	lamber_frag_spv, lamber_vert_spv,
+	mirror_frag_spv, mirror_vert_spv,
+	pbr_frag_spv, pbr_vert_spv,
+	depth_frag_spv, depth_vert_spv,
+	shadow_debug_frag_spv, shadow_debug_vert_spv,
+	depth_cube_frag_spv, depth_cube_vert_spv,
+	shadow_debug_cube_frag_spv,
+	gbuffer_frag_spv, gbuffer_bindless_frag_spv, gbuffer_vert_spv,
+	ssao_frag_spv, ssao_vert_spv,
+	ssao_blur_frag_spv, ssao_blur_vert_spv,
+	cluster_cull_comp_spv,
+	brdf_lut_comp_spv,
+	env_prefilter_comp_spv,
+], 'objs/src/shaders/embedded_shaders.cpp');
+
 //'[objFile =] CPP(cppFile [, objFileBase] [, options])' compiles a c++ file:
 // cppFile: name of c++ file to compile
 // objFileBase (optional): base name object file to produce (if not supplied, set to options.objDir + '/' + cppFile without the extension)
@@ -150,6 +210,12 @@ if (maek.OS === "windows") {
 // const test_obj = maek.CPP('test.cpp');
 const utils_objects = [
 	maek.CPP('./src/include/utils/json_parser.cpp'),
+	maek.CPP('./src/include/utils/ktx2.cpp'),
+	maek.CPP('./src/include/utils/thread_pool.cpp'),
+	maek.CPP('./src/include/utils/brdf_lut.cpp'),
+	maek.CPP('./src/include/utils/mapped_file.cpp'),
+	maek.CPP('./src/include/utils/cube_scratch.cpp'),
+	maek.CPP('./src/include/utils/bake_manifest.cpp'),
 ];
 
 const controllers_objects = [
@@ -159,10 +225,15 @@ const controllers_objects = [
 
 const math_objects = [
 	maek.CPP('./src/include/math/math_util.cpp'),
+	maek.CPP('./src/include/math/ibl_sampling.cpp'),
 ];
 
 const scene_objects = [
 	maek.CPP('./src/include/scene/bbox.cpp'),
+	maek.CPP('./src/include/scene/render_proxy.cpp'),
+	maek.CPP('./src/include/scene/mesh_simplify.cpp'),
+	maek.CPP('./src/include/scene/meshlet.cpp'),
+	maek.CPP('./src/include/scene/mesh_optimize.cpp'),
 ];
 
 const viewer_objects = [
@@ -172,6 +243,7 @@ const viewer_objects = [
 	...scene_objects,
 	maek.CPP('./src/include/viewer.cpp'),
 	maek.CPP('./src/main.cpp'),
+	maek.CPP(embedded_shaders_cpp, 'objs/src/shaders/embedded_shaders'),
 ]
 
 const cube_objects = [
@@ -180,6 +252,25 @@ const cube_objects = [
 	maek.CPP('./src/cube.cpp'),
 ]
 
+const compress_objects = [
+	...utils_objects,
+	...math_objects,
+	maek.CPP('./src/compress.cpp'),
+]
+
+// Not a default target, build with: node Maekfile.js bin/bench_proxies
+const bench_proxies_objects = [
+	...math_objects,
+	...scene_objects,
+	maek.CPP('./src/bench_proxies.cpp'),
+]
+
+// Not a default target, build with: node Maekfile.js bin/bench_cube
+const bench_cube_objects = [
+	...math_objects,
+	maek.CPP('./src/bench_cube.cpp'),
+]
+
 
 //'[exeFile =] LINK(objFiles, exeFileBase, [, options])' links an array of objects into an executable:
 // objFiles: array of objects to link
@@ -189,44 +280,14 @@ const viewer_exe = maek.LINK(viewer_objects,
 							'bin/viewer');
 const cube_exe = maek.LINK(cube_objects, 
 								'bin/cube');
+const compress_exe = maek.LINK(compress_objects,
+								'bin/compress');
+const bench_proxies_exe = maek.LINK(bench_proxies_objects,
+								'bin/bench_proxies');
+const bench_cube_exe = maek.LINK(bench_cube_objects,
+								'bin/bench_cube');
 // const test_exe = maek.LINK([test_obj, Player_obj, Level_obj], 'test/game-test');
 
-// Shader file compilation
-const simple_frag_spv = maek.GLSLC("./src/shaders/simple.shader.frag", "./src/shaders/bin/simple.frag");
-const simple_vert_spv = maek.GLSLC("./src/shaders/simple.shader.vert", "./src/shaders/bin/simple.vert");
-
-const env_frag_spv = maek.GLSLC("./src/shaders/env.shader.frag", "./src/shaders/bin/env.frag");
-const env_vert_spv = maek.GLSLC("./src/shaders/env.shader.vert", "./src/shaders/bin/env.vert");
-
-const lamber_frag_spv = maek.GLSLC("./src/shaders/lamber.shader.frag", "./src/shaders/bin/lamber.frag");
-const lamber_vert_spv = maek.GLSLC("./src/shaders/lamber.shader.vert", "./src/shaders/bin/lamber.vert");
-
-const mirror_frag_spv = maek.GLSLC("./src/shaders/mirror.shader.frag", "./src/shaders/bin/mirror.frag");
-const mirror_vert_spv = maek.GLSLC("./src/shaders/mirror.shader.vert", "./src/shaders/bin/mirror.vert");
-
-const pbr_frag_spv = maek.GLSLC("./src/shaders/pbr.shader.frag", "./src/shaders/bin/pbr.frag");
-const pbr_vert_spv = maek.GLSLC("./src/shaders/pbr.shader.vert", "./src/shaders/bin/pbr.vert");
-
-const depth_frag_spv = maek.GLSLC("./src/shaders/depth.shader.frag", "./src/shaders/bin/depth.frag");
-const depth_vert_spv = maek.GLSLC("./src/shaders/depth.shader.vert", "./src/shaders/bin/depth.vert");
-
-const shadow_debug_frag_spv = maek.GLSLC("./src/shaders/shadow.debug.shader.frag", "./src/shaders/bin/shadow.debug.frag");
-const shadow_debug_vert_spv = maek.GLSLC("./src/shaders/shadow.debug.shader.vert", "./src/shaders/bin/shadow.debug.vert");
-
-const depth_cube_frag_spv = maek.GLSLC("./src/shaders/depth.cube.shader.frag", "./src/shaders/bin/depth.cube.frag");
-const depth_cube_vert_spv = maek.GLSLC("./src/shaders/depth.cube.shader.vert", "./src/shaders/bin/depth.cube.vert");
-
-const shadow_debug_cube_frag_spv = maek.GLSLC("./src/shaders/shadow.debug.cube.shader.frag", "./src/shaders/bin/shadow.debug.cube.frag");
-
-const gbuffer_frag_spv = maek.GLSLC("./src/shaders/gbuffer.shader.frag", "./src/shaders/bin/gbuffer.frag");
-const gbuffer_vert_spv = maek.GLSLC("./src/shaders/gbuffer.shader.vert", "./src/shaders/bin/gbuffer.vert");
-
-const ssao_frag_spv = maek.GLSLC("./src/shaders/ssao.shader.frag", "./src/shaders/bin/ssao.frag");
-const ssao_vert_spv = maek.GLSLC("./src/shaders/ssao.shader.vert", "./src/shaders/bin/ssao.vert");
-
-const ssao_blur_frag_spv = maek.GLSLC("./src/shaders/ssao.blur.shader.frag", "./src/shaders/bin/ssao.blur.frag");
-const ssao_blur_vert_spv = maek.GLSLC("./src/shaders/ssao.blur.shader.vert", "./src/shaders/bin/ssao.blur.vert");
-
 
 maek.TARGETS.push("./src/shaders/bin/simple.frag" + maek.options.spirvSuffix,
 				"./src/shaders/bin/simple.vert" + maek.options.spirvSuffix,
@@ -246,6 +307,7 @@ maek.TARGETS.push("./src/shaders/bin/simple.frag" + maek.options.spirvSuffix,
 				"./src/shaders/bin/depth.cube.vert" + maek.options.spirvSuffix,
 				"./src/shaders/bin/shadow.debug.cube.frag" + maek.options.spirvSuffix,
 				"./src/shaders/bin/gbuffer.frag" + maek.options.spirvSuffix,
+				"./src/shaders/bin/gbuffer.bindless.frag" + maek.options.spirvSuffix,
 				"./src/shaders/bin/gbuffer.vert" + maek.options.spirvSuffix,
 				"./src/shaders/bin/ssao.frag" + maek.options.spirvSuffix,
 				"./src/shaders/bin/ssao.vert" + maek.options.spirvSuffix,
@@ -562,6 +624,59 @@ function init_maek() {
 		return spirvFile;
 	};
 
+	//maek.EMBED_SPIRV writes a c++ source file that holds the given SPIR-V files as uint32_t arrays:
+	// spirvFiles is an array of .spv file names (they are looked up at runtime by their base name)
+	// cppFile is the c++ file to produce; compile it with maek.CPP and link it into the executable
+	maek.EMBED_SPIRV = (spirvFiles, cppFile) => {
+		const task = async () => {
+			let arrays = '';
+			let entries = '';
+			for (let i = 0; i < spirvFiles.length; ++i) {
+				const data = await fsPromises.readFile(spirvFiles[i]);
+				if (data.length % 4 !== 0) {
+					throw new BuildError(`'${spirvFiles[i]}' is not a valid SPIR-V file (size ${data.length} is not a multiple of 4).`);
+				}
+				let words = [];
+				for (let w = 0; w < data.length; w += 4) {
+					words.push('0x' + data.readUInt32LE(w).toString(16).padStart(8, '0'));
+				}
+				arrays += `static const uint32_t spirv_${i}[] = {\n`;
+				for (let w = 0; w < words.length; w += 8) {
+					arrays += '\t' + words.slice(w, w + 8).join(', ') + ',\n';
+				}
+				arrays += '};\n\n';
+				entries += `\t{ "${path.basename(spirvFiles[i])}", spirv_${i}, sizeof(spirv_${i}) },\n`;
+			}
+			const source = '//generated by Maekfile.js (EMBED_SPIRV); do not edit\n'
+				+ '#include "embedded_shaders.h"\n\n'
+				+ arrays
+				+ 'const EmbeddedShader EMBEDDED_SHADERS[] = {\n' + entries + '};\n\n'
+				+ 'const size_t EMBEDDED_SHADER_COUNT = sizeof(EMBEDDED_SHADERS) / sizeof(EMBEDDED_SHADERS[0]);\n';
+
+			await fsPromises.mkdir(path.dirname(cppFile), { recursive: true });
+			//only touch the file when the shaders changed, so the object file stays cached:
+			let old = null;
+			try {
+				old = await fsPromises.readFile(cppFile, { encoding: 'utf8' });
+			} catch (e) {
+				old = null;
+			}
+			if (old !== source) {
+				await fsPromises.writeFile(cppFile, source, { encoding: 'utf8' });
+				delete hashCache[cppFile];
+			}
+		};
+		task.depends = [...spirvFiles];
+		task.label = `EMBED_SPIRV ${cppFile}`;
+
+		if (cppFile in maek.tasks) {
+			throw new Error(`Task ${task.label} purports to create ${cppFile}, but ${maek.tasks[cppFile].label} already creates that file.`);
+		}
+		maek.tasks[cppFile] = task;
+
+		return cppFile;
+	};
+
 
 	//says something went wrong in building -- should fail loudly:
 	class BuildError extends Error {
@@ -17,13 +17,14 @@ for i in range(0,len(sys.argv)):
 		args = sys.argv[i+1:]
 
 def usage():
-	print("\n\nUsage:\nblender --background --python export-s72.py -- <infile.blend> <outfile.s72> [--collection collection] [--animate <minFrame> <maxFrame>]\nExports objects and transforms in a collection (default: master collection) to a scene'72 (JSON scene) file and associated buffer'72 (raw binary data) files.\n", file=sys.stderr)
+	print("\n\nUsage:\nblender --background --python export-s72.py -- <infile.blend> <outfile.s72> [--collection collection] [--animate <minFrame> <maxFrame>] [--optimize]\nExports objects and transforms in a collection (default: master collection) to a scene'72 (JSON scene) file and associated buffer'72 (raw binary data) files.\n--optimize writes the triangles of every mesh in vertex cache friendly order.\n", file=sys.stderr)
 	exit(1)
 
 infile = None
 s72file = None
 collection_name = None
 frames = None
+optimize = False
 
 i = 0
 while i < len(args):
@@ -42,6 +43,8 @@ while i < len(args):
 			frames = (int(args[i+1]), int(args[i+2]))
 
 			i += 2
+		elif arg == '--optimize':
+			optimize = True
 		else:
 			print(f"ERROR: unrecognized argument '{arg}'.")
 			usage()
@@ -240,6 +243,66 @@ def write_material(mat):
 
 	return idx
 
+#Triangle order for a FIFO post-transform vertex cache of cache_size entries (Tipsify,
+#Sander et al. 2007). tris is a list of vertex key triples; returns the triangle indices in order.
+#The viewer welds vertices by position and numbers them in first use order, so the order survives
+#the trip through the triangle soup and also gives sequential vertex fetches.
+def tipsify(tris, cache_size=16):
+	vertex_ids = {}
+	tri_vertices = []
+	for tri in tris:
+		tri_vertices.append([vertex_ids.setdefault(key, len(vertex_ids)) for key in tri])
+	vertex_tris = [[] for _ in range(len(vertex_ids))]
+	for t, vs in enumerate(tri_vertices):
+		for v in vs:
+			vertex_tris[v].append(t)
+	live = [len(ts) for ts in vertex_tris]
+	timestamps = [0] * len(vertex_ids)
+	time = cache_size + 1
+	emitted = [False] * len(tris)
+	dead_ends = []
+	cursor = 0
+	order = []
+
+	def next_live_vertex():
+		nonlocal cursor
+		while dead_ends:
+			v = dead_ends.pop()
+			if live[v] > 0: return v
+		while cursor < len(live):
+			if live[cursor] > 0: return cursor
+			cursor += 1
+		return -1
+
+	fan = next_live_vertex()
+	while fan >= 0:
+		candidates = []
+		for t in vertex_tris[fan]:
+			if emitted[t]: continue
+			emitted[t] = True
+			order.append(t)
+			for v in tri_vertices[t]:
+				dead_ends.append(v)
+				candidates.append(v)
+				live[v] -= 1
+				if time - timestamps[v] > cache_size:
+					timestamps[v] = time
+					time += 1
+		#next fan: the candidate that stays in the cache the longest while its triangles are emitted
+		fan = -1
+		best = -1
+		for v in candidates:
+			if live[v] == 0: continue
+			priority = 0
+			if time - timestamps[v] + 2 * live[v] <= cache_size:
+				priority = time - timestamps[v]
+			if priority > best:
+				best = priority
+				fan = v
+		if fan < 0:
+			fan = next_live_vertex()
+	return order
+
 def write_attribs(obj, mode):
 	global mesh_mode_to_attributes
 
@@ -304,8 +367,11 @@ def write_attribs(obj, mode):
 
 	count = 0
 	attribs = []
+	tri_positions = []
 	for tri in mesh.loop_triangles:
+		tri_positions.append(tuple(tuple(mesh.vertices[tri.vertices[i]].co) for i in range(0,3)))
 		for i in range(0,3):
+			corner = len(attribs)
 			loop = mesh.loops[tri.loops[i]]
 			assert loop.vertex_index == tri.vertices[i]
 			vertex = mesh.vertices[loop.vertex_index]
@@ -332,8 +398,14 @@ def write_attribs(obj, mode):
 				if s > 255: return 255
 				return s
 			attribs.append(struct.pack('BBBB', c(color[0]), c(color[1]), c(color[2]), 255))
+			attribs[corner:] = [b''.join(attribs[corner:])]
 			count += 1
 
+	if optimize:
+		order = tipsify(tri_positions)
+		attribs = [attribs[t * 3 + i] for t in order for i in range(0,3)]
+		print(f"  Reordered {len(order)} triangles for the vertex cache.")
+
 	#dg_obj.to_mesh_clear()
 
 	with open(b72file, 'wb') as f:
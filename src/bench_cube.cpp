@@ -0,0 +1,178 @@
+//
+//  bench_cube.cpp
+//
+//  CPU cost of the sampling kernels bin/cube spends its time in (sample generation, cube
+//  lookups, a GGX prefiltered texel and a BRDF LUT texel), scalar reference against the
+//  batch kernels of ibl_sampling, with the largest relative difference between the two.
+//
+//  Usage: bin/bench_cube [cube size (default 128)] [samples (default 512)]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "include/math/mathlib.h"
+#include "include/math/ibl_sampling.h"
+
+const uint32_t TEXELS = 4096; // prefiltered texels timed per kernel
+const uint32_t LOOKUPS = 1 << 20;
+const uint32_t LUT_SIZE = 64;
+
+// Smooth gradients plus a few bright spots, like a sky with a sun
+static CubeMap createCube(int size) {
+    CubeMap cube;
+    cube.size = size;
+    cube.texels.resize(6 * size * size);
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> noise(0.0f, 0.1f);
+    for(int f=0; f<6; f++) {
+        for(int t=0; t<size; t++) {
+            for(int s=0; s<size; s++) {
+                float u = (s + 0.5f) / size, v = (t + 0.5f) / size;
+                vec3 c = vec3(0.2f + 0.5f * u, 0.3f + 0.4f * v, 0.5f + 0.1f * f) + vec3(noise(rng));
+                if((s * 7 + t * 13 + f * 5) % 211 == 0) {
+                    c *= 50.0f;
+                }
+                cube.texels[(f*size+t)*size+s] = c;
+            }
+        }
+    }
+    return cube;
+}
+
+static double timeMs(const std::function<void()>& run) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static float relativeDifference(float a, float b) {
+    return std::abs(a - b) / std::max(std::abs(b), 1e-6f);
+}
+
+static void report(const std::string& name, double scalarMs, double batchMs, const std::string& kind, float maxDifference) {
+    std::cout<<name<<": scalar "<<scalarMs<<" ms, batch "<<batchMs<<" ms ("<<scalarMs / std::max(batchMs, 1e-9)
+        <<"x), max "<<kind<<" difference "<<maxDifference<<"\n";
+}
+
+int main(int argc, char ** argv) {
+    int size = argc > 1 ? std::stoi(argv[1]) : 128;
+    uint32_t samples = argc > 2 ? static_cast<uint32_t>(std::stoul(argv[2])) : 512;
+    const float roughness = 0.5f;
+
+    CubePyramid pyramid(createCube(size));
+    std::mt19937 rng(11);
+    std::normal_distribution<float> gaussian(0.0f, 1.0f);
+    std::vector<vec3> normals(TEXELS);
+    for(vec3& N: normals) {
+        N = vec3(gaussian(rng), gaussian(rng), gaussian(rng)).normalized();
+    }
+    std::cout<<IBL_KERNEL_ISA<<" kernels, "<<IBL_LANES<<" lanes, cube "<<size<<", "<<samples<<" samples\n";
+
+    // Sample generation: per texel in the scalar path, once per mip for the batch kernels
+    {
+        vec3 sink = vec3(0.0f);
+        double scalarMs = timeMs([&]{
+            for(uint32_t i=0; i<samples; i++) {
+                sink += ImportanceSampleGGX(Hammersley(i, samples), normals[0], roughness);
+            }
+        });
+        size_t padded = 0;
+        double batchMs = timeMs([&]{
+            padded = SampleTable::ggx(samples, roughness, true, size).x.size();
+        });
+        // printing the sum keeps the scalar loop from being optimized away
+        std::cout<<"sample generation (checksum "<<sink[0]<<", "<<padded<<" padded table entries): scalar "<<scalarMs
+            <<" ms per texel, batch table "<<batchMs<<" ms per mip\n";
+    }
+
+    // Lookups of random directions
+    {
+        std::vector<float> x(LOOKUPS), y(LOOKUPS), z(LOOKUPS), lod(LOOKUPS);
+        std::uniform_real_distribution<float> lods(0.0f, float(pyramid.levels.size()));
+        for(uint32_t i=0; i<LOOKUPS; i++) {
+            vec3 d = vec3(gaussian(rng), gaussian(rng), gaussian(rng));
+            x[i] = d[0];
+            y[i] = d[1];
+            z[i] = d[2];
+            lod[i] = lods(rng);
+        }
+        std::vector<float> r(LOOKUPS), g(LOOKUPS), b(LOOKUPS);
+        std::vector<vec3> expected(LOOKUPS);
+        for(int trilinear=0; trilinear<2; trilinear++) {
+            double scalarMs = timeMs([&]{
+                for(uint32_t i=0; i<LOOKUPS; i++) {
+                    vec3 d = vec3(x[i], y[i], z[i]);
+                    expected[i] = trilinear ? pyramid.lookup(d, lod[i]) : pyramid.levels[0].lookup(d);
+                }
+            });
+            double batchMs = timeMs([&]{
+                lookupCube(pyramid, LOOKUPS, x.data(), y.data(), z.data(), trilinear ? lod.data() : nullptr, r.data(), g.data(), b.data());
+            });
+            float difference = 0.0f;
+            for(uint32_t i=0; i<LOOKUPS; i++) {
+                difference = std::max({difference, relativeDifference(r[i], expected[i][0]),
+                    relativeDifference(g[i], expected[i][1]), relativeDifference(b[i], expected[i][2])});
+            }
+            report(std::string(trilinear ? "trilinear" : "nearest")+" lookup ("+std::to_string(LOOKUPS)+")", scalarMs, batchMs, "relative", difference);
+        }
+    }
+
+    // GGX prefiltered texels with filtered importance sampling, as bin/cube --ggx computes them
+    {
+        std::vector<vec3> expected(TEXELS), result(TEXELS);
+        double scalarMs = timeMs([&]{
+            for(uint32_t i=0; i<TEXELS; i++) {
+                expected[i] = prefilterGGX(pyramid, normals[i], roughness, samples, true);
+            }
+        });
+        double batchMs = timeMs([&]{
+            SampleTable table = SampleTable::ggx(samples, roughness, true, size);
+            for(uint32_t i=0; i<TEXELS; i++) {
+                vec3 T, B;
+                tangentFrameGGX(normals[i], T, B);
+                result[i] = integrateCube(pyramid, table, T, B, normals[i]);
+            }
+        });
+        float difference = 0.0f;
+        for(uint32_t i=0; i<TEXELS; i++) {
+            for(int c=0; c<3; c++) {
+                difference = std::max(difference, relativeDifference(result[i][c], expected[i][c]));
+            }
+        }
+        report("ggx texel ("+std::to_string(TEXELS)+")", scalarMs, batchMs, "relative", difference);
+    }
+
+    // BRDF LUT
+    {
+        std::vector<vec2> expected(LUT_SIZE * LUT_SIZE), result(LUT_SIZE * LUT_SIZE);
+        double scalarMs = timeMs([&]{
+            for(uint32_t t=0; t<LUT_SIZE; t++) {
+                for(uint32_t s=0; s<LUT_SIZE; s++) {
+                    expected[t*LUT_SIZE+s] = IntegrateBRDF((s+0.5f) / LUT_SIZE, (t+0.5f) / LUT_SIZE, samples);
+                }
+            }
+        });
+        double batchMs = timeMs([&]{
+            BrdfSampleTable table(samples);
+            for(uint32_t t=0; t<LUT_SIZE; t++) {
+                for(uint32_t s=0; s<LUT_SIZE; s++) {
+                    result[t*LUT_SIZE+s] = integrateBRDF(table, (s+0.5f) / LUT_SIZE, (t+0.5f) / LUT_SIZE);
+                }
+            }
+        });
+        // A and B are in [0, 1], absolute differences
+        float difference = 0.0f;
+        for(size_t i=0; i<result.size(); i++) {
+            difference = std::max({difference, std::abs(result[i][0] - expected[i][0]), std::abs(result[i][1] - expected[i][1])});
+        }
+        report("brdf texel ("+std::to_string(LUT_SIZE * LUT_SIZE)+")", scalarMs, batchMs, "absolute", difference);
+    }
+    return 0;
+}
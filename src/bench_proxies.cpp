@@ -0,0 +1,278 @@
+//
+//  bench_proxies.cpp
+//
+//  Per-frame simulation thread CPU cost of the render proxy table (transform evaluation,
+//  instance data, frustum culling, gbuffer queue sort and the frame packet's instance
+//  updates), next to the model loop of the previous buildFramePacket over the VkModelList
+//  shared_ptrs, which copied every instance into the packet.
+//
+//  Usage: bin/bench_proxies [proxies (default 50000)] [frames (default 200)]
+//
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "include/math/mathlib.h"
+#include "include/scene/bbox.h"
+#include "include/scene/transform.h"
+#include "include/scene/render_proxy.h"
+#include "include/utils/render_queue.h"
+#include "include/utils/constants.h"
+#include "include/vertex.hpp"
+
+const uint32_t MESH_COUNT = 64;
+const uint32_t MATERIAL_COUNT = 256;
+const uint32_t GROUP_SIZE = 64; // proxies per parent transform
+const uint32_t ANIMATED_EVERY = 10; // one in ten proxies moves every frame
+
+// What the frame packet carries per frame
+struct Packet {
+    std::vector<std::pair<uint32_t, InstanceData>> instanceUpdates;
+    std::vector<uint32_t> gbufferQueue;
+};
+
+struct Scene {
+    std::vector<std::shared_ptr<Transform>> groups;
+    std::vector<std::shared_ptr<Transform>> nodes;
+    std::vector<std::shared_ptr<Bbox>> bounds;
+};
+
+static Scene createScene(uint32_t count) {
+    Scene scene;
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> position(-200.0f, 200.0f);
+    std::uniform_real_distribution<float> size(0.5f, 4.0f);
+    for(uint32_t m=0; m<MESH_COUNT; m++) {
+        auto bbox = std::make_shared<Bbox>();
+        float s = size(rng);
+        bbox->enclose(vec3(-s, -s, -s));
+        bbox->enclose(vec3(s, s, s));
+        scene.bounds.push_back(bbox);
+    }
+    for(uint32_t i=0; i<count; i++) {
+        if(i % GROUP_SIZE == 0) {
+            scene.groups.push_back(std::make_shared<Transform>("group", vec3(position(rng), 0.0f, position(rng)), qua(), vec3(1.0f, 1.0f, 1.0f)));
+        }
+        auto node = std::make_shared<Transform>("node", vec3(position(rng) * 0.1f, position(rng) * 0.1f, position(rng) * 0.1f), qua(), vec3(1.0f, 1.0f, 1.0f));
+        node->parent = scene.groups.back();
+        scene.groups.back()->children.push_back(node);
+        scene.nodes.push_back(node);
+    }
+    return scene;
+}
+
+static void animate(Scene& scene, uint32_t frame) {
+    for(size_t i=0; i<scene.nodes.size(); i+=ANIMATED_EVERY) {
+        scene.nodes[i]->translation[1] = std::sin(0.05f * frame + i) * 5.0f;
+    }
+}
+
+static mat4 cameraView(uint32_t frame) {
+    float angle = 0.01f * frame;
+    return lookAt(vec3(std::cos(angle) * 150.0f, 40.0f, std::sin(angle) * 150.0f), vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f));
+}
+
+// Stand-ins for the previous ViewerApplication types, with the members the model loop reads.
+// Vulkan handles and textures are kept as placeholders so the objects keep their layout
+struct LegacyMesh {
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    Bbox bbox;
+};
+
+struct VkMaterial {
+    int type = 0;
+    std::shared_ptr<void> normalMap = nullptr;
+    std::shared_ptr<void> displacementMap = nullptr;
+    bool hasDisplacement = false;
+    std::shared_ptr<void> albedo = nullptr;
+    std::shared_ptr<void> metalness = nullptr;
+    std::shared_ptr<void> roughness = nullptr;
+    bool bindless = false;
+    MaterialData data = {};
+};
+
+struct VkModel {
+    uint32_t instanceIndex = 0;
+    uint32_t materialIndex = 0;
+    uint32_t meshId = 0;
+    bool ownsGeometry = true;
+    std::shared_ptr<Transform> transform;
+    std::shared_ptr<LegacyMesh> mesh;
+    void* vertexBuffer = nullptr;
+    void* vertexBufferMemory = nullptr;
+    void* indexBuffer = nullptr;
+    void* indexBufferMemory = nullptr;
+    std::vector<void*> descriptorSets;
+    VkMaterial material;
+    bool visible = true;
+};
+
+struct VkModelList {
+    std::vector<std::shared_ptr<VkModel>> simple_models;
+    std::vector<std::shared_ptr<VkModel>> env_models;
+    std::vector<std::shared_ptr<VkModel>> mirror_models;
+    std::vector<std::shared_ptr<VkModel>> pbr_models;
+    std::vector<std::shared_ptr<VkModel>> lamber_models;
+
+    std::vector<std::shared_ptr<VkModel>> getAllModels(){
+        std::vector<std::shared_ptr<VkModel>> models;
+        models.insert(models.end(), simple_models.begin(), simple_models.end());
+        models.insert(models.end(), env_models.begin(), env_models.end());
+        models.insert(models.end(), mirror_models.begin(), mirror_models.end());
+        models.insert(models.end(), pbr_models.begin(), pbr_models.end());
+        models.insert(models.end(), lamber_models.begin(), lamber_models.end());
+
+        return models;
+    }
+};
+
+// What the frame packet carried before, every instance and its version
+struct LegacyPacket {
+    struct {
+        mat4 view;
+    } uboScene;
+    std::vector<uint8_t> visible; // per frame_models
+    std::vector<InstanceData> instances;
+    std::vector<uint32_t> instanceVersions;
+    std::vector<uint32_t> gbufferQueue;
+};
+
+struct LegacyViewer {
+    std::string culling = CULLING_FRUSTUM;
+    VkModelList model_list;
+    std::vector<std::shared_ptr<VkModel>> frame_models;
+    std::vector<mat4> instance_models;
+    std::vector<InstanceData> instance_data;
+    std::vector<uint32_t> instance_versions;
+    std::vector<DrawItem> gbuffer_items;
+    std::vector<DrawItem> sort_scratch;
+
+    // The model loop of the previous buildFramePacket, unchanged
+    void buildFramePacket(LegacyPacket& packet, const mat4& VP) {
+        packet.visible.resize(frame_models.size());
+        gbuffer_items.clear();
+        size_t firstGBufferModel = frame_models.size() - model_list.pbr_models.size() - model_list.lamber_models.size();
+        for(size_t i=0; i<frame_models.size(); i++) {
+            mat4 model = frame_models[i]->transform->model();
+            if(instance_versions[i] == 0 || memcmp(&model, &instance_models[i], sizeof(mat4)) != 0) {
+                instance_models[i] = model;
+                instance_data[i].setModel(model);
+                instance_data[i].setNormal(mat4::transpose(inverse(model)));
+                instance_versions[i]++;
+            }
+            packet.visible[i] = culling == CULLING_NONE || frustum_cull_test(VP * model, frame_models[i]->mesh->bbox);
+
+            // Key the visible gbuffer draws by pipeline variant, then view depth of the bbox center
+            if(i >= firstGBufferModel && packet.visible[i]) {
+                const Bbox& bbox = frame_models[i]->mesh->bbox;
+                vec4 center = vec4((bbox.min[0] + bbox.max[0]) * 0.5f, (bbox.min[1] + bbox.max[1]) * 0.5f, (bbox.min[2] + bbox.max[2]) * 0.5f, 1.0f);
+                float depth = -(packet.uboScene.view * model * center)[2];
+                const VkMaterial& material = frame_models[i]->material;
+                gbuffer_items.push_back({RenderKey::opaque(material.hasDisplacement ? 0 : 1,
+                                                           RenderKey::quantizeDepth(depth),
+                                                           material.bindless ? 0 : static_cast<uint32_t>(i) + 1,
+                                                           frame_models[i]->meshId),
+                                         static_cast<uint32_t>(i)});
+            }
+        }
+        radixSort(gbuffer_items, sort_scratch);
+        packet.gbufferQueue.clear();
+        for(const DrawItem& item: gbuffer_items) {
+            packet.gbufferQueue.push_back(item.index);
+        }
+        packet.instances = instance_data;
+        packet.instanceVersions = instance_versions;
+    }
+};
+
+int main(int argc, char ** argv) {
+    uint32_t count = argc > 1 ? static_cast<uint32_t>(std::stoul(argv[1])) : 50000;
+    uint32_t frames = argc > 2 ? static_cast<uint32_t>(std::stoul(argv[2])) : 200;
+    mat4 proj = perspective(degToRad(60.0f), 16.0f / 9.0f, 0.1f, 1000.0f);
+
+    // Render proxy table
+    double proxyMs = 0.0;
+    size_t proxyDraws = 0;
+    {
+        Scene scene = createScene(count);
+        RenderProxyTable proxies;
+        for(auto& bbox: scene.bounds) {
+            proxies.addMesh(*bbox);
+        }
+        for(uint32_t i=0; i<count; i++) {
+            uint8_t flags = RenderProxyTable::GBUFFER | RenderProxyTable::CASTS_SHADOW;
+            if(i % 2 == 0) {
+                flags |= RenderProxyTable::DISPLACEMENT;
+            }
+            proxies.add(i % MESH_COUNT, i % MATERIAL_COUNT, proxies.addTransform(scene.nodes[i].get()), flags);
+        }
+        proxies.finalize();
+
+        Packet packet;
+        for(uint32_t frame=0; frame<frames; frame++) {
+            animate(scene, frame);
+            mat4 view = cameraView(frame);
+            auto start = std::chrono::high_resolution_clock::now();
+            proxies.update();
+            proxies.buildGBufferQueue(proj * view, view, true, packet.gbufferQueue);
+            packet.instanceUpdates.clear();
+            for(uint32_t i: proxies.changed) {
+                packet.instanceUpdates.emplace_back(i, proxies.instances[i]);
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            proxyMs += std::chrono::duration<double, std::milli>(end - start).count();
+            proxyDraws += packet.gbufferQueue.size();
+        }
+    }
+
+    // Previous shared_ptr model list
+    double legacyMs = 0.0;
+    size_t legacyDraws = 0;
+    {
+        Scene scene = createScene(count);
+        std::vector<std::shared_ptr<LegacyMesh>> meshes;
+        for(auto& bbox: scene.bounds) {
+            meshes.push_back(std::make_shared<LegacyMesh>());
+            meshes.back()->bbox = *bbox;
+        }
+        // Same split as the proxy table: every other model has displacement, all go through the gbuffer
+        LegacyViewer viewer;
+        for(uint32_t i=0; i<count; i++) {
+            auto model = std::make_shared<VkModel>();
+            model->transform = scene.nodes[i];
+            model->mesh = meshes[i % MESH_COUNT];
+            model->meshId = i % MESH_COUNT;
+            model->material.hasDisplacement = i % 2 == 0;
+            (i % 2 == 0 ? viewer.model_list.pbr_models : viewer.model_list.lamber_models).push_back(model);
+        }
+        viewer.frame_models = viewer.model_list.getAllModels();
+        viewer.instance_models.resize(viewer.frame_models.size());
+        viewer.instance_data.resize(viewer.frame_models.size());
+        viewer.instance_versions.assign(viewer.frame_models.size(), 0);
+
+        LegacyPacket packet;
+        for(uint32_t frame=0; frame<frames; frame++) {
+            animate(scene, frame);
+            mat4 view = cameraView(frame);
+            auto start = std::chrono::high_resolution_clock::now();
+            packet.uboScene.view = view;
+            viewer.buildFramePacket(packet, proj * view);
+            auto end = std::chrono::high_resolution_clock::now();
+            legacyMs += std::chrono::duration<double, std::milli>(end - start).count();
+            legacyDraws += packet.gbufferQueue.size();
+        }
+    }
+
+    std::cout<<"proxies "<<count<<" frames "<<frames<<"\n";
+    std::cout<<"proxy table: "<<proxyMs / frames<<" ms/frame, "<<proxyDraws / frames<<" visible draws/frame\n";
+    std::cout<<"shared_ptr models: "<<legacyMs / frames<<" ms/frame, "<<legacyDraws / frames<<" visible draws/frame\n";
+    return 0;
+}
@@ -0,0 +1,602 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "include/utils/stb_image.h"
+#include "include/math/mathlib.h"
+#include "include/utils/constants.h"
+#include "include/utils/ktx2.h"
+
+// Texture compressor: writes material textures and environment cubes as block compressed KTX2
+// files the viewer loads in place of the PNGs.
+//   albedo                          BC7 (mode 6), full mip chain
+//   normal map                      BC5 (x, y; the shaders rebuild z), full mip chain
+//   roughness/metalness/displacement BC4 (red channel), full mip chain
+//   environment cube (RGBE PNG)     BC6H (mode 11), the GGX cube takes its levels from the .ggx.N.png files
+
+/* --------------------------- Blocks --------------------------- */
+
+// Interpolation weights of 4 bit indices (BC6H and BC7), in 64ths
+static const int WEIGHTS4[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+// Bits of one block, written from the least significant bit of byte 0
+struct BlockWriter {
+    uint8_t* bytes;
+    uint32_t bit = 0;
+
+    void write(uint32_t value, uint32_t count) {
+        for(uint32_t i=0; i<count; i++, bit++) {
+            bytes[bit / 8] |= ((value >> i) & 1u) << (bit % 8);
+        }
+    }
+};
+
+// Line through the block along its principal axis (power iteration on the covariance),
+// clipped to the extent of the texels' projections
+template<int C>
+static void principalEndpoints(const float pixels[16][C], float e0[C], float e1[C]) {
+    float mean[C] = {};
+    for(int i=0; i<16; i++) {
+        for(int c=0; c<C; c++) {
+            mean[c] += pixels[i][c] / 16.0f;
+        }
+    }
+    float covariance[C][C] = {};
+    for(int i=0; i<16; i++) {
+        for(int a=0; a<C; a++) {
+            for(int b=0; b<C; b++) {
+                covariance[a][b] += (pixels[i][a] - mean[a]) * (pixels[i][b] - mean[b]);
+            }
+        }
+    }
+    float axis[C];
+    std::fill(axis, axis + C, 1.0f);
+    for(int iteration=0; iteration<8; iteration++) {
+        float next[C] = {};
+        float length = 0.0f;
+        for(int a=0; a<C; a++) {
+            for(int b=0; b<C; b++) {
+                next[a] += covariance[a][b] * axis[b];
+            }
+            length = std::max(length, std::abs(next[a]));
+        }
+        if(length == 0.0f) {
+            break;
+        }
+        for(int a=0; a<C; a++) {
+            axis[a] = next[a] / length;
+        }
+    }
+    float norm = 0.0f;
+    for(int c=0; c<C; c++) {
+        norm += axis[c] * axis[c];
+    }
+    float tMin = 0.0f;
+    float tMax = 0.0f;
+    if(norm > 0.0f) {
+        for(int c=0; c<C; c++) {
+            axis[c] /= std::sqrt(norm);
+        }
+        tMin = INFINITY;
+        tMax = -INFINITY;
+        for(int i=0; i<16; i++) {
+            float t = 0.0f;
+            for(int c=0; c<C; c++) {
+                t += (pixels[i][c] - mean[c]) * axis[c];
+            }
+            tMin = std::min(tMin, t);
+            tMax = std::max(tMax, t);
+        }
+    }
+    for(int c=0; c<C; c++) {
+        e0[c] = mean[c] + axis[c] * tMin;
+        e1[c] = mean[c] + axis[c] * tMax;
+    }
+}
+
+// Least squares endpoints for fixed 4 bit indices, false if the indices do not span a line
+template<int C>
+static bool fitEndpoints(const float pixels[16][C], const uint8_t indices[16], float e0[C], float e1[C]) {
+    float a = 0.0f, b = 0.0f, d = 0.0f;
+    float x0[C] = {};
+    float x1[C] = {};
+    for(int i=0; i<16; i++) {
+        float w = WEIGHTS4[indices[i]] / 64.0f;
+        a += (1.0f - w) * (1.0f - w);
+        b += (1.0f - w) * w;
+        d += w * w;
+        for(int c=0; c<C; c++) {
+            x0[c] += (1.0f - w) * pixels[i][c];
+            x1[c] += w * pixels[i][c];
+        }
+    }
+    float det = a * d - b * b;
+    if(std::abs(det) < 1e-6f) {
+        return false;
+    }
+    for(int c=0; c<C; c++) {
+        e0[c] = (d * x0[c] - b * x1[c]) / det;
+        e1[c] = (a * x1[c] - b * x0[c]) / det;
+    }
+    return true;
+}
+
+// 8 bytes: two 8 bit endpoints and 3 bit indices. Endpoints in decreasing order select the
+// 8 value palette; a flat block stores equal endpoints and index 0
+static void encodeBC4(const uint8_t values[16], uint8_t* out) {
+    uint8_t lo = *std::min_element(values, values + 16);
+    uint8_t hi = *std::max_element(values, values + 16);
+    int palette[8] = {hi, lo, hi, hi, hi, hi, hi, hi};
+    if(hi > lo) {
+        for(int i=1; i<7; i++) {
+            palette[i + 1] = ((7 - i) * hi + i * lo + 3) / 7;
+        }
+    }
+    uint64_t bits = 0;
+    for(int i=0; i<16; i++) {
+        int best = 0;
+        for(int k=1; k<8; k++) {
+            if(std::abs(palette[k] - values[i]) < std::abs(palette[best] - values[i])) {
+                best = k;
+            }
+        }
+        bits |= static_cast<uint64_t>(best) << (3 * i);
+    }
+    out[0] = hi;
+    out[1] = lo;
+    for(int i=0; i<6; i++) {
+        out[2 + i] = static_cast<uint8_t>(bits >> (8 * i));
+    }
+}
+
+// Two BC4 blocks, red then green
+static void encodeBC5(const uint8_t pixels[16][4], uint8_t* out) {
+    for(int c=0; c<2; c++) {
+        uint8_t values[16];
+        for(int i=0; i<16; i++) {
+            values[i] = pixels[i][c];
+        }
+        encodeBC4(values, out + 8 * c);
+    }
+}
+
+// BC7 mode 6: one subset, 7 bit RGBA endpoints with a shared low bit each, 4 bit indices
+struct BC7Mode6 {
+    uint8_t endpoints[2][4]; // 7 bits
+    uint8_t pbits[2];
+    uint8_t indices[16];
+
+    int value(int e, int c) const {
+        return endpoints[e][c] << 1 | pbits[e];
+    }
+
+    // Quantizes e0, e1 and picks the closest palette entry per texel, returns the squared error
+    float quantize(const float pixels[16][4], const float e0[4], const float e1[4]) {
+        const float* source[2] = {e0, e1};
+        for(int e=0; e<2; e++) {
+            float bestError = INFINITY;
+            for(int p=0; p<2; p++) {
+                float error = 0.0f;
+                uint8_t q[4];
+                for(int c=0; c<4; c++) {
+                    q[c] = static_cast<uint8_t>(std::clamp(std::lround((source[e][c] - p) / 2.0f), 0l, 127l));
+                    float diff = static_cast<float>(q[c] << 1 | p) - source[e][c];
+                    error += diff * diff;
+                }
+                if(error < bestError) {
+                    bestError = error;
+                    std::memcpy(endpoints[e], q, 4);
+                    pbits[e] = static_cast<uint8_t>(p);
+                }
+            }
+        }
+        int palette[16][4];
+        for(int k=0; k<16; k++) {
+            for(int c=0; c<4; c++) {
+                palette[k][c] = ((64 - WEIGHTS4[k]) * value(0, c) + WEIGHTS4[k] * value(1, c) + 32) >> 6;
+            }
+        }
+        float total = 0.0f;
+        for(int i=0; i<16; i++) {
+            float bestError = INFINITY;
+            for(int k=0; k<16; k++) {
+                float error = 0.0f;
+                for(int c=0; c<4; c++) {
+                    float diff = palette[k][c] - pixels[i][c];
+                    error += diff * diff;
+                }
+                if(error < bestError) {
+                    bestError = error;
+                    indices[i] = static_cast<uint8_t>(k);
+                }
+            }
+            total += bestError;
+        }
+        return total;
+    }
+
+    void write(uint8_t* out) {
+        // The first index is stored without its high bit, which must be 0
+        if(indices[0] & 8) {
+            std::swap(endpoints[0], endpoints[1]);
+            std::swap(pbits[0], pbits[1]);
+            for(auto& index: indices) {
+                index = 15 - index;
+            }
+        }
+        std::memset(out, 0, 16);
+        BlockWriter writer{out};
+        writer.write(1u << 6, 7);
+        for(int c=0; c<4; c++) {
+            writer.write(endpoints[0][c], 7);
+            writer.write(endpoints[1][c], 7);
+        }
+        writer.write(pbits[0], 1);
+        writer.write(pbits[1], 1);
+        for(int i=0; i<16; i++) {
+            writer.write(indices[i], i == 0 ? 3 : 4);
+        }
+    }
+};
+
+static void encodeBC7(const uint8_t texels[16][4], uint8_t* out) {
+    float pixels[16][4];
+    for(int i=0; i<16; i++) {
+        for(int c=0; c<4; c++) {
+            pixels[i][c] = texels[i][c];
+        }
+    }
+    float e0[4], e1[4];
+    principalEndpoints<4>(pixels, e0, e1);
+    BC7Mode6 best;
+    float bestError = best.quantize(pixels, e0, e1);
+    // One least squares refinement of the endpoints for the chosen indices
+    BC7Mode6 refined;
+    if(fitEndpoints<4>(pixels, best.indices, e0, e1) && refined.quantize(pixels, e0, e1) < bestError) {
+        best = refined;
+    }
+    best.write(out);
+}
+
+// Half float bit pattern of a non negative radiance, the domain BC6H interpolates in
+static float toHalfBits(float f) {
+    if(!(f > 0.0f)) {
+        return 0.0f; // negative and NaN
+    }
+    if(f >= 65504.0f) {
+        return 0x7BFF;
+    }
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(float));
+    int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+    uint32_t half;
+    if(exponent <= 0) {
+        if(exponent < -10) {
+            return 0.0f;
+        }
+        mantissa |= 0x800000;
+        uint32_t shift = static_cast<uint32_t>(14 - exponent);
+        half = (mantissa >> shift) + ((mantissa >> (shift - 1)) & 1);
+    } else {
+        half = (static_cast<uint32_t>(exponent) << 10 | mantissa >> 13) + ((mantissa >> 12) & 1);
+    }
+    return static_cast<float>(std::min(half, 0x7BFFu));
+}
+
+// BC6H mode 11: one region, 10 bit unsigned endpoints without deltas, 4 bit indices
+struct BC6HMode11 {
+    uint16_t endpoints[2][3];
+    uint8_t indices[16];
+
+    // 10 bit endpoint to the 16 bit interpolation domain
+    static int unquantize(int x) {
+        if(x == 0) {
+            return 0;
+        }
+        if(x == 1023) {
+            return 0xFFFF;
+        }
+        return ((x << 16) + 0x8000) >> 10;
+    }
+
+    // pixels and endpoints are half float bit patterns, see toHalfBits
+    float quantize(const float pixels[16][3], const float e0[3], const float e1[3]) {
+        const float* source[2] = {e0, e1};
+        for(int e=0; e<2; e++) {
+            for(int c=0; c<3; c++) {
+                // A 10 bit endpoint x decodes to the half 31 * x + 15
+                endpoints[e][c] = static_cast<uint16_t>(std::clamp(std::lround((source[e][c] - 15.0f) / 31.0f), 0l, 1023l));
+            }
+        }
+        int palette[16][3];
+        for(int k=0; k<16; k++) {
+            for(int c=0; c<3; c++) {
+                int interpolated = ((64 - WEIGHTS4[k]) * unquantize(endpoints[0][c]) + WEIGHTS4[k] * unquantize(endpoints[1][c]) + 32) >> 6;
+                palette[k][c] = (interpolated * 31) >> 6;
+            }
+        }
+        float total = 0.0f;
+        for(int i=0; i<16; i++) {
+            float bestError = INFINITY;
+            for(int k=0; k<16; k++) {
+                float error = 0.0f;
+                for(int c=0; c<3; c++) {
+                    float diff = palette[k][c] - pixels[i][c];
+                    error += diff * diff;
+                }
+                if(error < bestError) {
+                    bestError = error;
+                    indices[i] = static_cast<uint8_t>(k);
+                }
+            }
+            total += bestError;
+        }
+        return total;
+    }
+
+    void write(uint8_t* out) {
+        if(indices[0] & 8) {
+            std::swap(endpoints[0], endpoints[1]);
+            for(auto& index: indices) {
+                index = 15 - index;
+            }
+        }
+        std::memset(out, 0, 16);
+        BlockWriter writer{out};
+        writer.write(0x03, 5);
+        for(int e=0; e<2; e++) {
+            for(int c=0; c<3; c++) {
+                writer.write(endpoints[e][c], 10);
+            }
+        }
+        for(int i=0; i<16; i++) {
+            writer.write(indices[i], i == 0 ? 3 : 4);
+        }
+    }
+};
+
+static void encodeBC6H(const vec3 texels[16], uint8_t* out) {
+    float pixels[16][3];
+    for(int i=0; i<16; i++) {
+        for(int c=0; c<3; c++) {
+            pixels[i][c] = toHalfBits(texels[i][c]);
+        }
+    }
+    float e0[3], e1[3];
+    principalEndpoints<3>(pixels, e0, e1);
+    BC6HMode11 best;
+    float bestError = best.quantize(pixels, e0, e1);
+    BC6HMode11 refined;
+    if(fitEndpoints<3>(pixels, best.indices, e0, e1) && refined.quantize(pixels, e0, e1) < bestError) {
+        best = refined;
+    }
+    best.write(out);
+}
+
+/* --------------------------- Images --------------------------- */
+
+template<typename T>
+struct Image {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<T> texels; // rows top to bottom as they are uploaded
+};
+
+typedef Image<u8vec4> Image8;
+typedef Image<vec3> ImageFloat;
+
+// Compresses image (faces stacked vertically) block by block, block rows are split between hardware threads
+template<typename T>
+static std::vector<uint8_t> encodeLevel(const Image<T>& image, uint32_t faceCount, uint32_t blockSize, const std::function<void(const T[16], uint8_t*)>& encodeBlock) {
+    const uint32_t faceHeight = image.height / faceCount;
+    const uint32_t blocksX = (image.width + 3) / 4;
+    const uint32_t blocksY = (faceHeight + 3) / 4;
+    std::vector<uint8_t> out(static_cast<size_t>(blocksX) * blocksY * faceCount * blockSize);
+
+    auto encodeRows = [&](uint32_t firstRow, uint32_t lastRow) {
+        for(uint32_t row=firstRow; row<lastRow; row++) {
+            uint32_t face = row / blocksY;
+            uint32_t by = row % blocksY;
+            for(uint32_t bx=0; bx<blocksX; bx++) {
+                // Blocks over the edge of a face repeat its last row / column
+                T block[16];
+                for(uint32_t y=0; y<4; y++) {
+                    uint32_t py = face * faceHeight + std::min(by * 4 + y, faceHeight - 1);
+                    for(uint32_t x=0; x<4; x++) {
+                        uint32_t px = std::min(bx * 4 + x, image.width - 1);
+                        block[y * 4 + x] = image.texels[static_cast<size_t>(py) * image.width + px];
+                    }
+                }
+                encodeBlock(block, out.data() + (static_cast<size_t>(row) * blocksX + bx) * blockSize);
+            }
+        }
+    };
+    const uint32_t rows = blocksY * faceCount;
+    size_t workerCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, rows);
+    std::vector<std::thread> workers;
+    for(size_t w=1; w<workerCount; w++) {
+        workers.emplace_back(encodeRows, static_cast<uint32_t>(rows * w / workerCount), static_cast<uint32_t>(rows * (w + 1) / workerCount));
+    }
+    encodeRows(0, static_cast<uint32_t>(rows / workerCount));
+    for(auto& worker: workers) {
+        worker.join();
+    }
+    return out;
+}
+
+// Same orientation as VkTexture2D::load, which flips material textures on load
+static Image8 loadImage(const std::string& path, bool flip) {
+    stbi_set_flip_vertically_on_load(flip);
+    int width, height, channels;
+    unsigned char* pixels = stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+    if(!pixels) {
+        throw std::runtime_error("failed to load texture image at: "+path);
+    }
+    Image8 image;
+    image.width = static_cast<uint32_t>(width);
+    image.height = static_cast<uint32_t>(height);
+    image.texels.resize(image.width * image.height);
+    std::memcpy(image.texels.data(), pixels, image.texels.size() * sizeof(u8vec4));
+    stbi_image_free(pixels);
+    return image;
+}
+
+static ImageFloat loadRgbeCube(const std::string& path) {
+    Image8 rgbe = loadImage(path, false);
+    if(rgbe.height != rgbe.width * 6) {
+        throw std::runtime_error("cube map must have its 6 faces stacked vertically: "+path);
+    }
+    ImageFloat image;
+    image.width = rgbe.width;
+    image.height = rgbe.height;
+    image.texels.reserve(rgbe.texels.size());
+    for(auto& texel: rgbe.texels) {
+        image.texels.push_back(rgbe_to_float(texel));
+    }
+    return image;
+}
+
+// 2x2 box filter (the last row / column of an odd sized level is clamped).
+// Normal maps are renormalized so the shorter averaged normals do not darken lighting
+static Image8 downsample(const Image8& image, bool normalMap) {
+    Image8 next;
+    next.width = std::max(image.width / 2, 1u);
+    next.height = std::max(image.height / 2, 1u);
+    next.texels.resize(next.width * next.height);
+    for(uint32_t y=0; y<next.height; y++) {
+        for(uint32_t x=0; x<next.width; x++) {
+            vec4 sum = vec4(0.0f);
+            for(uint32_t dy=0; dy<2; dy++) {
+                for(uint32_t dx=0; dx<2; dx++) {
+                    uint32_t sx = std::min(x * 2 + dx, image.width - 1);
+                    uint32_t sy = std::min(y * 2 + dy, image.height - 1);
+                    const u8vec4& texel = image.texels[sy * image.width + sx];
+                    sum += vec4(texel[0], texel[1], texel[2], texel[3]);
+                }
+            }
+            vec4 average = sum / 4.0f;
+            if(normalMap) {
+                vec3 n = vec3(average[0], average[1], average[2]) / 127.5f - vec3(1.0f);
+                if(n.norm() > 0.0f) {
+                    n = (n.normalized() + vec3(1.0f)) * 127.5f;
+                    average = vec4(n[0], n[1], n[2], average[3]);
+                }
+            }
+            for(int c=0; c<4; c++) {
+                next.texels[y * next.width + x][c] = static_cast<uint8_t>(std::clamp(average[c] + 0.5f, 0.0f, 255.0f));
+            }
+        }
+    }
+    return next;
+}
+
+/* --------------------------- Files --------------------------- */
+
+static void compressTexture(const std::string& in_file_path, const std::string& flag, const std::string& out_file_path) {
+    Ktx2Image ktx;
+    std::function<void(const u8vec4[16], uint8_t*)> encodeBlock;
+    if(flag == ALBEDO) {
+        ktx.vkFormat = KTX2_FORMAT_BC7_UNORM;
+        encodeBlock = [](const u8vec4 block[16], uint8_t* out) {
+            uint8_t texels[16][4];
+            std::memcpy(texels, block, sizeof(texels));
+            encodeBC7(texels, out);
+        };
+    } else if(flag == NORMAL) {
+        ktx.vkFormat = KTX2_FORMAT_BC5_UNORM;
+        encodeBlock = [](const u8vec4 block[16], uint8_t* out) {
+            uint8_t texels[16][4];
+            std::memcpy(texels, block, sizeof(texels));
+            encodeBC5(texels, out);
+        };
+    } else {
+        ktx.vkFormat = KTX2_FORMAT_BC4_UNORM;
+        encodeBlock = [](const u8vec4 block[16], uint8_t* out) {
+            uint8_t values[16];
+            for(int i=0; i<16; i++) {
+                values[i] = block[i][0];
+            }
+            encodeBC4(values, out);
+        };
+    }
+
+    Image8 image = loadImage(in_file_path, true);
+    ktx.width = image.width;
+    ktx.height = image.height;
+    // Full chain down to 1x1, as VkTexture2D::load builds for PNGs
+    uint32_t levelCount = static_cast<uint32_t>(std::floor(std::log2(std::max(image.width, image.height)))) + 1;
+    for(uint32_t level=0; level<levelCount; level++) {
+        if(level > 0) {
+            image = downsample(image, flag == NORMAL);
+        }
+        ktx.levels.push_back(encodeLevel<u8vec4>(image, 1, Ktx2Image::blockSize(ktx.vkFormat), encodeBlock));
+    }
+
+    size_t uncompressed = 0;
+    size_t compressed = 0;
+    for(uint32_t level=0; level<levelCount; level++) {
+        uncompressed += static_cast<size_t>(ktx.levelWidth(level)) * ktx.levelHeight(level) * 4;
+        compressed += ktx.levels[level].size();
+    }
+    std::cout<<"Save to file: "<<out_file_path<<" ("<<ktx.width<<"x"<<ktx.height<<", "<<levelCount<<" levels, "
+        <<compressed<<" bytes, "<<static_cast<float>(uncompressed) / compressed<<"x smaller than RGBA8)\n";
+    writeKtx2(out_file_path, ktx);
+}
+
+// The original or lambertian cube is one level; for GGX, in_file_path is the environment map and
+// the levels are the prefiltered <name>.ggx.N.png files written by bin/cube
+static void compressCube(const std::string& in_file_path, const std::string& flag, const std::string& out_file_path) {
+    std::vector<std::string> level_file_paths;
+    if(flag == GGX) {
+        std::string common_file_path = in_file_path.substr(0, in_file_path.find_last_of('.'));
+        for(int i=0; i<ENVIRONMENT_MIP_LEVEL; i++) {
+            level_file_paths.push_back(common_file_path+".ggx."+std::to_string(i)+".png");
+        }
+    } else {
+        level_file_paths.push_back(in_file_path);
+    }
+
+    Ktx2Image ktx;
+    ktx.vkFormat = KTX2_FORMAT_BC6H_UFLOAT;
+    ktx.faceCount = 6;
+    std::function<void(const vec3[16], uint8_t*)> encodeBlock = encodeBC6H;
+    for(size_t level=0; level<level_file_paths.size(); level++) {
+        ImageFloat image = loadRgbeCube(level_file_paths[level]);
+        if(level == 0) {
+            ktx.width = image.width;
+            ktx.height = image.width;
+        } else if(image.width != ktx.levelWidth(static_cast<uint32_t>(level))) {
+            throw std::runtime_error("cube level has the wrong size: "+level_file_paths[level]);
+        }
+        std::cout<<"Compress "<<level_file_paths[level]<<"\n";
+        ktx.levels.push_back(encodeLevel<vec3>(image, 6, Ktx2Image::blockSize(ktx.vkFormat), encodeBlock));
+    }
+    std::cout<<"Save to file: "<<out_file_path<<"\n";
+    writeKtx2(out_file_path, ktx);
+}
+
+int main(int argc, char ** argv) {
+    if(argc != 4) {
+        throw std::runtime_error("Require 4 arguments: ./compress <input> --<flag> <output>");
+    }
+    std::string input = argv[1];
+    std::string flag = argv[2];
+    std::string output = argv[3];
+
+    if(flag == ALBEDO || flag == NORMAL || flag == ROUGHNESS || flag == METALNESS || flag == DISPLACEMENT) {
+        compressTexture(input, flag, output);
+    } else if(flag == CUBE || flag == GGX) {
+        compressCube(input, flag, output);
+    } else {
+        throw std::runtime_error("Invalid flag");
+    }
+    return 0;
+}
@@ -2,9 +2,14 @@
 #include <_types/_uint8_t.h>
 #include <stdexcept>
 #include <string>
-#include <random>
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <type_traits>
 
 #include "include/math/vec.h"
 #define STB_IMAGE_IMPLEMENTATION
@@ -14,49 +19,15 @@
 #include "include/math/mathlib.h"
 #include "include/utils/arg_parser.h"
 #include "include/utils/constants.h"
+#include "include/utils/thread_pool.h"
+#include "include/math/ibl_sampling.h"
+#include "include/utils/brdf_lut.h"
+#include "include/utils/cube_scratch.h"
+#include "include/utils/bake_manifest.h"
 
+/* --------------------------- Cube --------------------------- */
 
-enum Face {
-	PositiveX = 0, NegativeX = 1,
-	PositiveY = 2, NegativeY = 3,
-	PositiveZ = 4, NegativeZ = 5,
-};
-
-float RadicalInverse_VdC(uint bits) 
-{
-    bits = (bits << 16u) | (bits >> 16u);
-    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
-    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
-    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
-    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
-    return float(bits) * 2.3283064365386963e-10; // / 0x100000000
-}
-
-vec2 Hammersley(uint i, uint N)
-{
-    return vec2(float(i)/float(N), RadicalInverse_VdC(i));
-} 
-
-/* --------------------------- PBR --------------------------- */
-
-vec3 make_sample(){
-    //attempt to importance sample upper hemisphere (cos-weighted):
-    //based on: http://www.rorydriscoll.com/2009/01/07/better-sampling/
-    static std::mt19937 mt(0x12341234);
-
-    float phi = mt() / float(mt.max()) * 2.0f * M_PI;
-	float cos_t = std::sqrt(mt() / float(mt.max()));
-
-	float sin_t = std::sqrt(1 - cos_t * cos_t);
-	float x = std::cos(phi) * sin_t;
-	float z = std::sin(phi) * sin_t;
-	float y = cos_t;
-
-	return vec3(x, y, z);
-}
-
-
-void prefilterEnvironmentMapLambertian(std::string in_file_path, std::string out_file_path, uint32_t out_size, int samples) {
+CubeMap loadRgbeCube(std::string in_file_path) {
     int texWidth, texHeight, texChannels;
     // load Rgbe Cubemap
     unsigned char* buffer = stbi_load(in_file_path.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
@@ -67,422 +38,544 @@ void prefilterEnvironmentMapLambertian(std::string in_file_path, std::string out
     // convert to float
     int total_pixels = texWidth*texHeight;
     uint8_t * in_data_rgbe = static_cast<uint8_t*>(buffer);
-    std::vector<vec3> in_data;
+    CubeMap cube;
+    cube.size = texWidth;
+    cube.texels.reserve(total_pixels);
     for(int i=0; i<total_pixels*4; i+=4) {
         u8vec4 rgbe = u8vec4(in_data_rgbe[i], in_data_rgbe[i+1], in_data_rgbe[i+2], in_data_rgbe[i+3]);
-        vec3 rgb = rgbe_to_float(rgbe);
-        
-        in_data.push_back(rgb);
+        cube.texels.push_back(rgbe_to_float(rgbe));
     }
+    stbi_image_free(buffer);
+    return cube;
+}
 
-    // Referenced https://github.com/ixchow/15-466-ibl/blob/master/cubes/blur_cube.cpp for cube look up
-    std::string faces[6] = {"PositiveX", "NegativeX", "PositiveY", "NegativeY", "PositiveZ", "NegativeZ"};
-
-    auto lookup = [&in_data,&texWidth , &faces](vec3 const &dir) -> vec3 {
-		float sc, tc, ma;
-		uint32_t f;
-        if (std::abs(dir[0]) >= std::abs(dir[1]) && std::abs(dir[0]) >= std::abs(dir[2])) {
-            if (dir[0] >= 0) { sc = -dir[2]; tc = -dir[1]; ma = dir[0]; f = PositiveX; }
-			else            { sc =  dir[2]; tc = -dir[1]; ma =-dir[0]; f = NegativeX; }
-            
-        } else if (std::abs(dir[1]) >= std::abs(dir[2])) {
-            if (dir[1] >= 0) { sc =  dir[0]; tc =  dir[2]; ma = dir[1]; f = PositiveY; }
-			else            { sc =  dir[0]; tc = -dir[2]; ma =-dir[1]; f = NegativeY; }
-        } else {
-            if (dir[2] >= 0) { sc =  dir[0]; tc = -dir[1]; ma = dir[2]; f = PositiveZ; }
-			else            { sc = -dir[0]; tc = -dir[1]; ma =-dir[2]; f = NegativeZ; }
-        }
-
-		int32_t s = std::floor(0.5f * (sc / ma + 1.0f) * texWidth);
-		s = std::max(0, std::min(int32_t(texWidth)-1, s));
-		int32_t t = std::floor(0.5f * (tc / ma + 1.0f) * texWidth);
-		t = std::max(0, std::min(int32_t(texWidth)-1, t));
-        if(false)
-            std::cout<<faces[f]<<"\n";
-		return in_data[(f*texWidth+t)*texWidth+s];
-	};
-
-    std::vector<vec3> out_data;
-    out_data.reserve(out_size * out_size * 6);
-    // sample each face
-    for(uint32_t f = 0; f < 6; ++f) {
-        vec3 sc; //maps to rightward axis on face
-		vec3 tc; //maps to upward axis on face
-		vec3 ma; //direction to face, normal direction
-		//See OpenGL 4.4 Core Profile specification, Table 8.18:
-		if      (f == PositiveX) { sc = vec3( 0.0f, 0.0f,-1.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3( 1.0f, 0.0f, 0.0f); }
-		else if (f == NegativeX) { sc = vec3( 0.0f, 0.0f, 1.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3(-1.0f, 0.0f, 0.0f); }
-		else if (f == PositiveY) { sc = vec3( 1.0f, 0.0f, 0.0f); tc = vec3( 0.0f, 0.0f, 1.0f); ma = vec3( 0.0f, 1.0f, 0.0f); }
-		else if (f == NegativeY) { sc = vec3( 1.0f, 0.0f, 0.0f); tc = vec3( 0.0f, 0.0f,-1.0f); ma = vec3( 0.0f,-1.0f, 0.0f); }
-		else if (f == PositiveZ) { sc = vec3( 1.0f, 0.0f, 0.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3( 0.0f, 0.0f, 1.0f); }
-		else if (f == NegativeZ) { sc = vec3(-1.0f, 0.0f, 0.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3( 0.0f, 0.0f,-1.0f); }
-        std::cout<<"Sampling face "<<f<<"\n";
-        for (uint32_t t = 0; t < out_size; ++t) {
-			for (uint32_t s = 0; s < out_size; ++s) {
-                vec3 N = (ma
-				            + (2.0f * (s + 0.5f) / out_size - 1.0f) * sc
-				            + (2.0f * (t + 0.5f) / out_size - 1.0f) * tc).normalized();
-				vec3 temp = (abs(N[2]) < 0.99f ? vec3(0.0f, 0.0f, 1.0f) : vec3(1.0f, 0.0f, 0.0f));
-				vec3 TX = cross(N, temp).normalized();
-				vec3 TY = cross(N, TX);
-
-                // Importance sampling
-                vec3 acc = vec3(0.0f);
-                // float total_weight = 0.0f;
-                for(uint32_t i=0; i<samples; i++) {
-                    vec2 u = Hammersley(i, samples);   
-                    float cosTheta = sqrt(1.0 - u[1]);
-                    float sinTheta = sqrt(u[1]);
-                    float phi = 2 * M_PI * u[0];
-                    // float pdf = cosTheta * sinTheta / M_PI;
-   
-
-                    vec3 cartesianCoord =
-                        vec3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
-
-                    vec3 sampleVector =
-                        (cartesianCoord[0] * TX + cartesianCoord[1] * TY +
-                                cartesianCoord[2] * N).normalized();
-
-                    acc += lookup(sampleVector);
-                }
+void saveRgbeCube(std::string out_file_path, const std::vector<u8vec4>& out_data, uint32_t out_size) {
+    std::cout<<"Save to file: "<<out_file_path<<"\n";
+    stbi_write_png(out_file_path.c_str(), out_size, out_size*6, 4, out_data.data(), out_size * 4);
+}
 
-                acc = acc * 1.0f / float(samples) ;
-                // acc = acc * 1.0f / total_weight;
-
-
-                // Fixed pattern sampling
-                // int phiSample = 360;
-                // int thetaSample = 90;
-                // float sampleDeltaPhi = 2.0 * M_PI / phiSample;
-                // float sampleDeltaTheta = 0.5 * M_PI / thetaSample;
-                // int samples = phiSample * thetaSample;
-                // for(float phi = 0.0; phi < 2.0 * M_PI; phi += sampleDeltaPhi)
-                // {
-                //     for(float theta = 0.0; theta < 0.5 * M_PI; theta += sampleDeltaTheta)
-                //     {
-                //         // spherical to cartesian (in tangent space)
-                //         vec3 dir = vec3(sin(theta) * cos(phi),  sin(theta) * sin(phi), cos(theta));
-                //         vec3 world_dir = dir[0] * TX + dir[1] * TY + dir[2] * N;
-                //         float cos_theta = std::max(0.0f, dot(world_dir, N));
-                //         float sin_theta;
-                //         if(cos_theta*cos_theta >= 1.0f){
-                //             sin_theta = 0.0f;
-                //         } else {
-                //             sin_theta = sqrt(1.0f - cos_theta*cos_theta);
-                //         }
-                //         // float sin_theta = std::min(1.0f, sqrt(1.0f - cos_theta*cos_theta));
-                //         // tangent space to world
-                //         acc += lookup(world_dir) * cos_theta * sin_theta;
-                //     }
-                // }
-                // acc *= M_PI* 1.0f / float(samples) ; 
-
-                // Random sampling
-                // for (uint32_t i = 0; i < uint32_t(samples); ++i) {
-                //     vec3 dir = make_sample(); // sample direction in tangent space
-                //     vec3 world_dir = (dir[0] * TX + dir[1] * TY + dir[2] * N).normalized();
-                //     float cos_theta = std::max(0.0f, dot(world_dir, N));
-                //     // float sin_theta = sqrt(1.0f - cos_theta*cos_theta);
-                //     acc += lookup(world_dir) * cos_theta;
-                // }
+/* ----------------------- Memory budget ----------------------- */
 
-                
-                // std::cout<<acc<<"\n";
-                out_data.emplace_back(acc);
-            }
-        }
-    }
-    std::cout<<"Finished sampling\n";
+size_t megabytes(size_t bytes) {
+    return (bytes + (1 << 20) - 1) >> 20;
+}
 
-    // Convert rgb back to rgbe
-    std::vector<u8vec4> out_data_rgbe;
-    out_data_rgbe.reserve(out_size * 6 * out_size);
-    for (auto const &pix : out_data) {
-        out_data_rgbe.emplace_back( float_to_rgbe( pix ) );
+// Throws if bytes do not fit in --mem-budget
+void checkMemBudget(size_t mem_budget, size_t bytes, const std::string& what) {
+    if(bytes > mem_budget) {
+        throw std::runtime_error(what+" needs "+std::to_string(megabytes(bytes))+" MB, more than --mem-budget "
+            +std::to_string(megabytes(mem_budget))+" MB");
     }
-
-    // for(int i=0; i<10; i++){
-    //     std::cout<<out_data_rgbe[i];
-    // }
-
-    std::cout<<"Save to file: "<<out_file_path<<"\n";
-    stbi_write_png(out_file_path.c_str(), out_size, out_size*6, 4, out_data_rgbe.data(), out_size * 4);
 }
 
-/* --------------------------- PBR --------------------------- */
+// An RGBE output cube, which stbi_write_png filters and compresses into about two more copies,
+// and a sample table of that many samples
+size_t outputBytes(uint32_t out_size, uint32_t samples) {
+    return static_cast<size_t>(out_size) * out_size * 6 * 4 * 3 + static_cast<size_t>(samples + IBL_LANES) * 5 * sizeof(float);
+}
 
-vec3 ImportanceSampleGGX(vec2 Xi, vec3 N, float roughness)
-{
-    float a = roughness*roughness;
-	
-    float phi = 2.0 * M_PI * Xi[0];
-    float cosTheta = sqrt((1.0 - Xi[1]) / (1.0 + (a*a - 1.0) * Xi[1]));
-    float sinTheta = sqrt(1.0 - cosTheta*cosTheta);
-	
-    // from spherical coordinates to cartesian coordinates
-    vec3 H;
-    H[0] = cos(phi) * sinTheta;
-    H[1] = sin(phi) * sinTheta;
-    H[2] = cosTheta;
-	
-    // from tangent-space vector to world-space sample vector
-    vec3 up        = abs(N[2]) < 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(1.0, 0.0, 0.0);
-    vec3 tangent   = cross(up, N).normalized();
-    vec3 bitangent = cross(N, tangent);
-	
-    vec3 sampleVec = tangent * H[0] + bitangent * H[1] + N * H[2];
-    return sampleVec.normalized();
-}  
-
-void prefilterEnvironmentMapPbr(std::string in_file_path, std::string out_file_path, uint32_t samples, uint32_t mip_width = 128, uint32_t max_mip_levels = 5) {
+// Converts the input to its float16 scratch unless an up to date one exists and returns its path.
+// The decoded PNG is the largest buffer of the conversion, the bands of rows get what it leaves of the budget
+std::string prepareCubeScratch(const std::string& in_file_path, size_t mem_budget) {
+    std::string scratch_path = cubeScratchPath(in_file_path);
+    if(cubeScratchIsCurrent(scratch_path, in_file_path)) {
+        std::cout<<"Using scratch "<<scratch_path<<"\n";
+        return scratch_path;
+    }
     int texWidth, texHeight, texChannels;
-    // load Rgbe Cubemap
+    if(!stbi_info(in_file_path.c_str(), &texWidth, &texHeight, &texChannels)) {
+        throw std::runtime_error("failed to load texture image at: "+in_file_path);
+    }
+    size_t decoded = static_cast<size_t>(texWidth) * texHeight * 4;
+    checkMemBudget(mem_budget, decoded, "Decoding "+in_file_path);
+
+    auto start = std::chrono::steady_clock::now();
     unsigned char* buffer = stbi_load(in_file_path.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
     if (!buffer) {
-        throw std::runtime_error("failed to load texture image at: "+std::string(in_file_path));
+        throw std::runtime_error("failed to load texture image at: "+in_file_path);
     }
+    writeCubeScratch(scratch_path, in_file_path, {buffer, stbi_image_free}, texWidth, texHeight, mem_budget - decoded);
+    std::cout<<"Converted to scratch "<<scratch_path<<" in "<<std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()<<"s\n";
+    return scratch_path;
+}
 
-    // convert to float
-    int total_pixels = texWidth*texHeight;
-    uint8_t * in_data_rgbe = static_cast<uint8_t*>(buffer);
-    std::vector<vec3> in_data;
-    for(int i=0; i<total_pixels*4; i+=4) {
-        u8vec4 rgbe = u8vec4(in_data_rgbe[i], in_data_rgbe[i+1], in_data_rgbe[i+2], in_data_rgbe[i+3]);
-        vec3 rgb = rgbe_to_float(rgbe);
-        
-        in_data.push_back(rgb);
+// Calls sample once with the input decoded into a CubePyramid or, with a mem_budget (0 for none),
+// with its mapped float16 scratch. output_bytes is what sample allocates, checked against the budget
+template<typename Sample>
+void withEnvironment(const std::string& in_file_path, size_t mem_budget, size_t output_bytes, const Sample& sample) {
+    if(mem_budget > 0) {
+        checkMemBudget(mem_budget, output_bytes, "The output of "+in_file_path);
+        CubeScratch scratch(prepareCubeScratch(in_file_path, mem_budget), mem_budget);
+        sample(scratch.pyramid);
+    } else {
+        sample(CubePyramid(loadRgbeCube(in_file_path)));
     }
+}
 
-    // Referenced https://github.com/ixchow/15-466-ibl/blob/master/cubes/blur_cube.cpp for cube look up
-    std::string faces[6] = {"PositiveX", "NegativeX", "PositiveY", "NegativeY", "PositiveZ", "NegativeZ"};
-
-    auto lookup = [&in_data,&texWidth , &faces](vec3 const &dir) -> vec3 {
-		float sc, tc, ma;
-		uint32_t f;
-        if (std::abs(dir[0]) >= std::abs(dir[1]) && std::abs(dir[0]) >= std::abs(dir[2])) {
-            if (dir[0] >= 0) { sc = -dir[2]; tc = -dir[1]; ma = dir[0]; f = PositiveX; }
-			else            { sc =  dir[2]; tc = -dir[1]; ma =-dir[0]; f = NegativeX; }
-            
-        } else if (std::abs(dir[1]) >= std::abs(dir[2])) {
-            if (dir[1] >= 0) { sc =  dir[0]; tc =  dir[2]; ma = dir[1]; f = PositiveY; }
-			else            { sc =  dir[0]; tc = -dir[2]; ma =-dir[1]; f = NegativeY; }
-        } else {
-            if (dir[2] >= 0) { sc =  dir[0]; tc = -dir[1]; ma = dir[2]; f = PositiveZ; }
-			else            { sc = -dir[0]; tc = -dir[1]; ma =-dir[2]; f = NegativeZ; }
+void printProgress(const std::string& label, size_t done, size_t count, std::chrono::steady_clock::time_point start) {
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout<<"\r"<<label<<": "<<done<<"/"<<count<<" rows ("<<(100 * done / count)<<"%)";
+    if(done > 0 && done < count) {
+        int eta = static_cast<int>(elapsed * (count - done) / done);
+        std::cout<<", ETA "<<eta / 3600<<"h "<<eta / 60 % 60<<"m "<<eta % 60<<"s   ";
+    } else if(done == count) {
+        std::cout<<", took "<<static_cast<int>(elapsed)<<"s            \n";
+    }
+    std::cout<<std::flush;
+}
+
+// What prefilterCube calls after each row: CubeScratch::trim for the mapped scratch
+inline std::function<void()> rowDone(const CubePyramid&) { return nullptr; }
+inline std::function<void()> rowDone(const HalfCubePyramid& pyramid) { return pyramid.rowDone; }
+
+// Computes every texel of an out_size cube from its direction, one task per face row, stored as RGBE.
+// Each texel only depends on its direction, so the result is the same for any number of threads.
+// row_done, if set, is called after each row
+void prefilterCube(ThreadPool& pool, const std::string& label, uint32_t out_size, std::vector<u8vec4>& out_data, const std::function<vec3(const vec3&)>& texel,
+                   const std::function<void()>& row_done = nullptr) {
+    out_data.assign(static_cast<size_t>(out_size) * out_size * 6, u8vec4(0, 0, 0, 0));
+    auto start = std::chrono::steady_clock::now();
+    pool.run(6 * out_size, [&](size_t row) {
+        uint32_t f = static_cast<uint32_t>(row / out_size);
+        uint32_t t = static_cast<uint32_t>(row % out_size);
+        vec3 sc, tc, ma;
+        faceBasis(f, sc, tc, ma);
+        for (uint32_t s = 0; s < out_size; ++s) {
+            vec3 N = (ma
+                        + (2.0f * (s + 0.5f) / out_size - 1.0f) * sc
+                        + (2.0f * (t + 0.5f) / out_size - 1.0f) * tc).normalized();
+            out_data[row * out_size + s] = float_to_rgbe(texel(N));
         }
+        if(row_done) {
+            row_done();
+        }
+    }, [&](size_t done, size_t count) {
+        printProgress(label, done, count, start);
+    });
+}
 
-		int32_t s = std::floor(0.5f * (sc / ma + 1.0f) * texWidth);
-		s = std::max(0, std::min(int32_t(texWidth)-1, s));
-		int32_t t = std::floor(0.5f * (tc / ma + 1.0f) * texWidth);
-		t = std::max(0, std::min(int32_t(texWidth)-1, t));
-        if(false)
-            std::cout<<faces[f]<<"\n";
-		return in_data[(f*texWidth+t)*texWidth+s];
-	};
+/* --------------------------- PBR --------------------------- */
 
-    
-    std::string file_name = out_file_path.substr(0, out_file_path.find_last_of('.'));
-    for (uint32_t mip = 0; mip < max_mip_levels; ++mip){
-        std::cout<<"Generate mip map "<<mip<<"\n";
-        uint32_t out_size  = mip_width * std::pow(0.5, mip);
+template<typename Pyramid>
+void prefilterLambertian(ThreadPool& pool, const Pyramid& pyramid, std::string out_file_path, uint32_t out_size, uint32_t samples) {
+    // The cosine weighted directions are the same around every N, only the frame changes
+    SampleTable table = SampleTable::cosine(samples);
 
-        float roughness = (float)mip / (float)(max_mip_levels - 1);
+    std::vector<u8vec4> out_data;
+    prefilterCube(pool, "Sampling lambertian", out_size, out_data, [&](const vec3& N) {
+        vec3 temp = (abs(N[2]) < 0.99f ? vec3(0.0f, 0.0f, 1.0f) : vec3(1.0f, 0.0f, 0.0f));
+        vec3 TX = cross(N, temp).normalized();
+        vec3 TY = cross(N, TX);
+        return integrateCube(pyramid, table, TX, TY, N);
+    }, rowDone(pyramid));
+    std::cout<<"Finished sampling\n";
 
-        std::vector<vec3> out_data;
-        out_data.reserve(out_size * out_size * 6);
-
-            // sample each face
-        for(uint32_t f = 0; f < 6; ++f) {
-            vec3 sc; //maps to rightward axis on face
-            vec3 tc; //maps to upward axis on face
-            vec3 ma; //direction to face, normal direction
-            //See OpenGL 4.4 Core Profile specification, Table 8.18:
-            if      (f == PositiveX) { sc = vec3( 0.0f, 0.0f,-1.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3( 1.0f, 0.0f, 0.0f); }
-            else if (f == NegativeX) { sc = vec3( 0.0f, 0.0f, 1.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3(-1.0f, 0.0f, 0.0f); }
-            else if (f == PositiveY) { sc = vec3( 1.0f, 0.0f, 0.0f); tc = vec3( 0.0f, 0.0f, 1.0f); ma = vec3( 0.0f, 1.0f, 0.0f); }
-            else if (f == NegativeY) { sc = vec3( 1.0f, 0.0f, 0.0f); tc = vec3( 0.0f, 0.0f,-1.0f); ma = vec3( 0.0f,-1.0f, 0.0f); }
-            else if (f == PositiveZ) { sc = vec3( 1.0f, 0.0f, 0.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3( 0.0f, 0.0f, 1.0f); }
-            else if (f == NegativeZ) { sc = vec3(-1.0f, 0.0f, 0.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3( 0.0f, 0.0f,-1.0f); }
-
-            for (uint32_t t = 0; t < out_size; ++t) {
-                for (uint32_t s = 0; s < out_size; ++s) {
-                    vec3 N = (ma
-                                + (2.0f * (s + 0.5f) / out_size - 1.0f) * sc
-                                + (2.0f * (t + 0.5f) / out_size - 1.0f) * tc).normalized(); // normal direction
-                    vec3 R = N; // specular reflection direction
-                    vec3 V = R; // view direction
-
-                    // Reference https://learnopengl.com/PBR/IBL/Specular-IBL for ggx sampling
-                    float total_weight = 0.0;
-                    vec3 acc = vec3(0.0f);
-                    for(uint32_t i=0; i<samples; i++) {
-                        vec2 Xi = Hammersley(i, samples);   
-                        vec3 H = ImportanceSampleGGX(Xi, N, roughness);
-                        vec3 L  = (2.0 * dot(V, H) * H - V).normalized();
-
-                        float NdotL = std::max(dot(N, L), 0.0f);
-                        NdotL = std::min(NdotL, 1.0f);
-                        if(NdotL > 0.0)
-                        {
-                            acc += lookup(L) * NdotL;
-                            total_weight += NdotL;
-                        }
-                    }
-                    acc = acc / total_weight;
+    saveRgbeCube(out_file_path, out_data, out_size);
+}
+
+void prefilterEnvironmentMapLambertian(ThreadPool& pool, std::string in_file_path, std::string out_file_path, uint32_t out_size, uint32_t samples, size_t mem_budget) {
+    withEnvironment(in_file_path, mem_budget, outputBytes(out_size, samples), [&](const auto& pyramid) {
+        prefilterLambertian(pool, pyramid, out_file_path, out_size, samples);
+    });
+}
+
+/* ------------------- Spherical harmonics ------------------- */
+
+// Real SH basis up to L2 in the order (0,0), (1,-1), (1,0), (1,1), (2,-2), (2,-1), (2,0), (2,1), (2,2).
+// The same constants are in irradianceSH in src/shaders/common.glsl
+void shBasis(const vec3& d, float Y[9]) {
+    Y[0] = 0.282095f;
+    Y[1] = 0.488603f * d[1];
+    Y[2] = 0.488603f * d[2];
+    Y[3] = 0.488603f * d[0];
+    Y[4] = 1.092548f * d[0] * d[1];
+    Y[5] = 1.092548f * d[1] * d[2];
+    Y[6] = 0.315392f * (3.0f * d[2] * d[2] - 1.0f);
+    Y[7] = 1.092548f * d[0] * d[2];
+    Y[8] = 0.546274f * (d[0] * d[0] - d[1] * d[1]);
+}
 
-                    out_data.emplace_back(acc);
+// Projects the radiance onto L2 SH in one pass over the input texels, each weighted by its solid angle,
+// and convolves the result with the clamped cosine lobe divided by pi (Ramamoorthi and Hanrahan,
+// "An Efficient Representation for Irradiance Environment Maps"). The result evaluates to the same
+// value the lambertian prefilter stores per texel
+// radiance(i) is texel i of the faces stacked +X to -Z
+template<typename Radiance>
+std::array<vec3, 9> projectIrradianceSH(int32_t size, const Radiance& radiance) {
+    double acc[9][3] = {};
+    const float texel = 2.0f / size;
+    for(uint32_t f = 0; f < 6; ++f) {
+        vec3 sc, tc, ma;
+        faceBasis(f, sc, tc, ma);
+        for (int32_t t = 0; t < size; ++t) {
+            for (int32_t s = 0; s < size; ++s) {
+                float u = (s + 0.5f) * texel - 1.0f;
+                float v = (t + 0.5f) * texel - 1.0f;
+                // solid angle of the texel, d omega = dA / (1 + u^2 + v^2)^(3/2)
+                float r2 = 1.0f + u * u + v * v;
+                double weight = texel * texel / (r2 * std::sqrt(r2));
+                vec3 dir = (ma + u * sc + v * tc).normalized();
+                float Y[9];
+                shBasis(dir, Y);
+                vec3 L = radiance((static_cast<size_t>(f)*size+t)*size+s);
+                for(int i = 0; i < 9; ++i) {
+                    for(int c = 0; c < 3; ++c) {
+                        acc[i][c] += weight * Y[i] * L[c];
+                    }
                 }
             }
         }
-        std::cout<<"Finished sampling\n";
-
-        // Convert rgb back to rgbe
-        std::vector<u8vec4> out_data_rgbe;
-        out_data_rgbe.reserve(out_size * 6 * out_size);
-        for (auto const &pix : out_data) {
-            out_data_rgbe.emplace_back( float_to_rgbe( pix ) );
-        }
-        
-        std::string mip_file_name = file_name+"."+std::to_string(mip)+".png";
-        std::cout<<"Save to file: "<<mip_file_name<<"\n";
-
-        
-        stbi_write_png(mip_file_name.c_str(), out_size, out_size*6, 4, out_data_rgbe.data(), out_size * 4);
     }
-    
+    // cosine lobe A_l / pi for bands 0, 1, 2
+    const double band[9] = {1.0, 2.0/3.0, 2.0/3.0, 2.0/3.0, 0.25, 0.25, 0.25, 0.25, 0.25};
+    std::array<vec3, 9> coefficients;
+    for(int i = 0; i < 9; ++i) {
+        coefficients[i] = vec3(acc[i][0] * band[i], acc[i][1] * band[i], acc[i][2] * band[i]);
+    }
+    return coefficients;
 }
 
-float GeometrySchlickGGX(float NdotV, float roughness)
-{
-    float a = roughness;
-    float k = (a * a) / 2.0;
-
-    float nom   = NdotV;
-    float denom = NdotV * (1.0 - k) + k;
-    return nom / denom;
+vec3 evaluateIrradianceSH(const std::array<vec3, 9>& coefficients, const vec3& N) {
+    float Y[9];
+    shBasis(N, Y);
+    vec3 irradiance = vec3(0.0f);
+    for(int i = 0; i < 9; ++i) {
+        irradiance += coefficients[i] * Y[i];
+    }
+    // L2 ringing can go slightly negative opposite very bright lights
+    return vec3(std::max(irradiance[0], 0.0f), std::max(irradiance[1], 0.0f), std::max(irradiance[2], 0.0f));
 }
 
-float GeometrySmith(vec3 N, vec3 V, vec3 L, float roughness)
-{
-    float NdotV = std::max(dot(N, V), 0.0f);
-    float NdotL = std::max(dot(N, L), 0.0f);
-    float ggx2 = GeometrySchlickGGX(NdotV, roughness);
-    float ggx1 = GeometrySchlickGGX(NdotL, roughness);
+// Writes the lambertian cube evaluated from SH and the coefficients next to it ([name].sh9, one rgb line
+// per coefficient), which the viewer uses in place of the cube. With a mem_budget the projection
+// streams over level 0 of the mapped scratch
+void prefilterEnvironmentMapSH(ThreadPool& pool, std::string in_file_path, std::string out_file_path, uint32_t out_size, size_t mem_budget) {
+    std::array<vec3, 9> coefficients;
+    auto start = std::chrono::steady_clock::now();
+    if(mem_budget > 0) {
+        checkMemBudget(mem_budget, outputBytes(out_size, 0), "The output of "+in_file_path);
+        CubeScratch scratch(prepareCubeScratch(in_file_path, mem_budget), mem_budget);
+        start = std::chrono::steady_clock::now();
+        const HalfCubePyramid& pyramid = scratch.pyramid;
+        int32_t size = pyramid.levelSizes[0];
+        coefficients = projectIrradianceSH(size, [&](size_t i) {
+            if(i % size == 0 && pyramid.rowDone) {
+                pyramid.rowDone();
+            }
+            return vec3(halfToFloat(pyramid.planes[0][i]), halfToFloat(pyramid.planes[1][i]), halfToFloat(pyramid.planes[2][i]));
+        });
+    } else {
+        CubeMap in_cube = loadRgbeCube(in_file_path);
+        start = std::chrono::steady_clock::now();
+        coefficients = projectIrradianceSH(in_cube.size, [&](size_t i) {
+            return in_cube.texels[i];
+        });
+    }
+    std::cout<<"Projected onto SH in "<<std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()<<"ms\n";
 
-    return ggx1 * ggx2;
-}  
+    std::string sh_file_path = out_file_path.substr(0, out_file_path.find_last_of('.'))+".sh9";
+    std::ofstream sh_file(sh_file_path);
+    if(!sh_file.is_open()) {
+        throw std::runtime_error("failed to open file "+sh_file_path);
+    }
+    sh_file.precision(9);
+    for(const vec3& c: coefficients) {
+        sh_file<<c[0]<<" "<<c[1]<<" "<<c[2]<<"\n";
+    }
+    std::cout<<"Save to file: "<<sh_file_path<<"\n";
 
-vec2 IntegrateBRDF(float NdotV, float roughness, uint32_t samples){
-    vec3 V;
-    V[0] = sqrt(1.0 - NdotV*NdotV);
-    V[1] = 0.0;
-    V[2] = NdotV;
+    std::vector<u8vec4> out_data;
+    prefilterCube(pool, "Evaluating SH", out_size, out_data, [&](const vec3& N) {
+        return evaluateIrradianceSH(coefficients, N);
+    });
+    saveRgbeCube(out_file_path, out_data, out_size);
+}
 
-    float A = 0.0;
-    float B = 0.0;
+/* --------------------------- PBR --------------------------- */
 
-    vec3 N = vec3(0.0, 0.0, 1.0);
+// From a HalfCubePyramid (--mem-budget) the reference runs on the batch kernels too, from the
+// nearest texel of level 0 like prefilterGGX
+template<typename Pyramid>
+void prefilterGgxMips(ThreadPool& pool, const Pyramid& pyramid, std::string out_file_path, uint32_t samples, bool filtered, uint32_t mip_width, uint32_t max_mip_levels) {
+    std::string file_name = out_file_path.substr(0, out_file_path.find_last_of('.'));
+    for (uint32_t mip = 0; mip < max_mip_levels; ++mip){
+        std::cout<<"Generate mip map "<<mip<<"\n";
+        uint32_t out_size  = mip_width * std::pow(0.5, mip);
 
-    for(uint i = 0u; i < samples; ++i)
-    {
-        vec2 Xi = Hammersley(i, samples);
-        vec3 H  = ImportanceSampleGGX(Xi, N, roughness);
-        vec3 L  = (2.0 * dot(V, H) * H - V).normalized();
+        float roughness = (float)mip / (float)(max_mip_levels - 1);
+        std::string label = "Sampling mip "+std::to_string(mip);
+
+        std::vector<u8vec4> out_data;
+        bool sampled = false;
+        if constexpr (std::is_same_v<Pyramid, CubePyramid>) {
+            // The reference stays on the scalar path when the input is in memory
+            if(!filtered) {
+                prefilterCube(pool, label, out_size, out_data, [&](const vec3& N) {
+                    return prefilterGGX(pyramid, N, roughness, samples, false);
+                });
+                sampled = true;
+            }
+        }
+        if(!sampled) {
+            SampleTable table = SampleTable::ggx(samples, roughness, filtered, pyramid.levelSizes[0]);
+            prefilterCube(pool, label, out_size, out_data, [&](const vec3& N) {
+                vec3 T, B;
+                tangentFrameGGX(N, T, B);
+                return integrateCube(pyramid, table, T, B, N);
+            }, rowDone(pyramid));
+        }
+        std::cout<<"Finished sampling\n";
 
-        float NdotL = std::max(L[2], 0.0f);
-        float NdotH = std::max(H[2], 0.0f);
-        float VdotH = std::max(dot(V, H), 0.0f);
+        saveRgbeCube(file_name+"."+std::to_string(mip)+".png", out_data, out_size);
+    }
+}
 
-        if(NdotL > 0.0)
-        {
-            float G = GeometrySmith(N, V, L, roughness);
-            float G_Vis = (G * VdotH) / (NdotH * NdotV);
+void prefilterEnvironmentMapPbr(ThreadPool& pool, std::string in_file_path, std::string out_file_path, uint32_t samples, bool filtered, size_t mem_budget, uint32_t mip_width = 128, uint32_t max_mip_levels = 5) {
+    withEnvironment(in_file_path, mem_budget, outputBytes(mip_width, samples), [&](const auto& pyramid) {
+        prefilterGgxMips(pool, pyramid, out_file_path, samples, filtered, mip_width, max_mip_levels);
+    });
+}
 
-            float Fc = pow(1.0 - VdotH, 5.0);
+// Filtered importance sampling against the brute force reference, on every stride-th texel of
+// every row and column of each mip. Prints the RMSE relative to the reference RMS and the speedup
+void compareEnvironmentMapPbr(ThreadPool& pool, std::string in_file_path, uint32_t samples, uint32_t reference_samples, uint32_t stride, uint32_t mip_width = 128, uint32_t max_mip_levels = 5) {
+    CubePyramid pyramid(loadRgbeCube(in_file_path));
 
-            A += (1.0 - Fc) * G_Vis;
-            B += Fc * G_Vis;
+    for (uint32_t mip = 0; mip < max_mip_levels; ++mip){
+        uint32_t out_size  = mip_width * std::pow(0.5, mip);
+        float roughness = (float)mip / (float)(max_mip_levels - 1);
+        uint32_t step = std::min(stride, out_size);
+        uint32_t rows = (out_size + step - 1) / step;
+
+        std::vector<vec3> filtered(static_cast<size_t>(rows) * rows * 6);
+        std::vector<vec3> reference(filtered.size());
+        SampleTable table = SampleTable::ggx(samples, roughness, true, pyramid.levels[0].size);
+        auto forEachTexel = [&](std::vector<vec3>& out, uint32_t n, bool filter) {
+            auto start = std::chrono::steady_clock::now();
+            pool.run(6 * rows, [&](size_t row) {
+                uint32_t f = static_cast<uint32_t>(row / rows);
+                uint32_t t = static_cast<uint32_t>(row % rows) * step;
+                vec3 sc, tc, ma;
+                faceBasis(f, sc, tc, ma);
+                for (uint32_t s = 0; s < out_size; s += step) {
+                    vec3 N = (ma
+                                + (2.0f * (s + 0.5f) / out_size - 1.0f) * sc
+                                + (2.0f * (t + 0.5f) / out_size - 1.0f) * tc).normalized();
+                    if(filter) {
+                        vec3 T, B;
+                        tangentFrameGGX(N, T, B);
+                        out[row * rows + s / step] = integrateCube(pyramid, table, T, B, N);
+                    } else {
+                        out[row * rows + s / step] = prefilterGGX(pyramid, N, roughness, n, false);
+                    }
+                }
+            });
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        };
+        double filtered_time = forEachTexel(filtered, samples, true);
+        double reference_time = forEachTexel(reference, reference_samples, false);
+
+        double error = 0.0, norm = 0.0;
+        for(size_t i = 0; i < filtered.size(); ++i) {
+            for(int c = 0; c < 3; ++c) {
+                error += double(filtered[i][c] - reference[i][c]) * (filtered[i][c] - reference[i][c]);
+                norm += double(reference[i][c]) * reference[i][c];
+            }
         }
+        std::cout<<"Mip "<<mip<<" (roughness "<<roughness<<", "<<filtered.size()<<" texels): relative RMSE "
+            <<std::sqrt(error / std::max(norm, 1e-30))<<", "<<samples<<" filtered samples "<<filtered_time<<"s, "
+            <<reference_samples<<" reference samples "<<reference_time<<"s ("<<reference_time / std::max(filtered_time, 1e-9)<<"x)\n";
     }
-    A /= float(samples);
-    B /= float(samples);
-    return vec2(A, B);
-};
+}
 
-void precomputeBrdfLUT(std::string out_file_path, uint32_t samples, uint32_t out_size=512) {
-    std::vector<u8vec4> out_data;
-    out_data.reserve(out_size*out_size);
-    for (int32_t t = out_size-1; t >=0; --t) {
+// One task per row, as RG16F (see brdf_lut.h)
+BrdfLut integrateBrdfLut(ThreadPool& pool, uint32_t samples, uint32_t out_size) {
+    BrdfSampleTable table(samples);
+    BrdfLut lut;
+    lut.width = out_size;
+    lut.height = out_size;
+    lut.samples = samples;
+    lut.texels.resize(static_cast<size_t>(out_size) * out_size * 2);
+    auto start = std::chrono::steady_clock::now();
+    pool.run(out_size, [&](size_t t) {
         float roughness  = (t+0.5f) / out_size;
-        for (int32_t s = 0; s < out_size; ++s) {
+        for (uint32_t s = 0; s < out_size; ++s) {
             float NdotV = (s+0.5f) / out_size;
-            vec2 v = IntegrateBRDF(NdotV, roughness, samples);
-            std::cout<<v;
-            v *= 255;
-            out_data.emplace_back(u8vec4(static_cast<uint8_t>(v[0]),static_cast<uint8_t>(v[1]), 0,128));
+            vec2 v = integrateBRDF(table, NdotV, roughness);
+            lut.texels[(t*out_size+s)*2] = floatToHalf(v[0]);
+            lut.texels[(t*out_size+s)*2+1] = floatToHalf(v[1]);
         }
-    }
-    
+    }, [&](size_t done, size_t count) {
+        printProgress("Integrating BRDF", done, count, start);
+    });
+    return lut;
+}
+
+void precomputeBrdfLutToBinary(ThreadPool& pool, std::string out_file_path, uint32_t samples, uint32_t out_size=512){
+    writeBrdfLut(out_file_path, integrateBrdfLut(pool, samples, out_size));
     std::cout<<"Save to file: "<<out_file_path<<"\n";
+}
 
-    
-    stbi_write_png(out_file_path.c_str(), out_size, out_size, 4, out_data.data(), out_size * 4);
 
-    
-}
 
-void precomputeBrdfLutToBinary(std::string out_file_path, uint32_t samples, uint32_t out_size=512){
-    float *out_data = new float[out_size*out_size*2];
-    int i = 0;
-    for (int32_t t = 0; t < out_size; t++) {
-        float roughness  = (t+0.5f) / out_size;
-        for (int32_t s = 0; s < out_size; ++s) {
-            float NdotV = (s+0.5f) / out_size;
-            vec2 v = IntegrateBRDF(NdotV, roughness, samples)*255;
-            out_data[i++] = v[0];
-            out_data[i++] = v[1];
+/* --------------------------- Batch --------------------------- */
+
+struct BakeProduct {
+    std::string name;
+    uint64_t inputs; // hash of the source and the parameters the product is computed with
+    std::vector<std::string> outputs;
+};
+
+// Bakes [name].lambertian.png, [name].ggx.N.png and [name].lut.bin for every environment. Each
+// input is decoded once for both cubes and the LUT integrated once for the whole batch. Products
+// whose inputs and outputs still hash as recorded in [name].bake are skipped
+void bakeEnvironments(ThreadPool& pool, const std::vector<std::string>& in_file_paths, size_t mem_budget) {
+    std::unique_ptr<BrdfLut> lut; // integrated when the first environment needs it
+    uint32_t baked = 0, skipped = 0;
+    for(const std::string& in_file_path: in_file_paths) {
+        std::cout<<"Environment "<<in_file_path<<"\n";
+        std::string name = in_file_path.substr(0, in_file_path.find_last_of('.'));
+        uint64_t source;
+        if(!hashFiles({in_file_path}, source)) {
+            throw std::runtime_error("failed to load texture image at: "+in_file_path);
+        }
+        // the scratch holds halves, so its cubes differ slightly from those of the decoded input
+        std::string precision = mem_budget > 0 ? " f16" : " f32";
+
+        BakeProduct lambertian{"lambertian", hashString("lambertian "+std::to_string(LAMBERTIAN_SIZE)+" "
+            +std::to_string(LAMBERTIAN_SAMPLES)+precision, source), {name+".lambertian.png"}};
+        BakeProduct ggx{"ggx", hashString("ggx "+std::to_string(GGX_SIZE)+" "+std::to_string(GGX_FILTERED_SAMPLES)+" "
+            +std::to_string(ENVIRONMENT_MIP_LEVEL)+precision, source), {}};
+        for(int mip = 0; mip < ENVIRONMENT_MIP_LEVEL; ++mip) {
+            ggx.outputs.push_back(name+".ggx."+std::to_string(mip)+".png");
+        }
+        BakeProduct brdf{"lut", hashString("lut "+std::to_string(BRDF_LUT_VERSION)+" "+std::to_string(BRDF_LUT_SIZE)+" "
+            +std::to_string(BRDF_LUT_SAMPLES)), {brdfLutPath(in_file_path)}};
+
+        std::string manifest_path = bakeManifestPath(in_file_path);
+        BakeManifest manifest = readBakeManifest(manifest_path);
+        auto pending = [&](const BakeProduct& product) {
+            auto record = manifest.find(product.name);
+            uint64_t outputs;
+            if(record != manifest.end() && record->second.inputs == product.inputs
+                && hashFiles(product.outputs, outputs) && outputs == record->second.outputs) {
+                std::cout<<"Skipping "<<product.name<<", unchanged\n";
+                skipped++;
+                return false;
+            }
+            return true;
+        };
+        auto finish = [&](const BakeProduct& product) {
+            BakeRecord record{product.inputs, 0};
+            if(!hashFiles(product.outputs, record.outputs)) {
+                throw std::runtime_error("failed to read back the "+product.name+" output of "+in_file_path);
+            }
+            manifest[product.name] = record;
+            // after every product, so an interrupted batch keeps what it finished
+            writeBakeManifest(manifest_path, manifest);
+            baked++;
+        };
+
+        bool bake_lambertian = pending(lambertian);
+        bool bake_ggx = pending(ggx);
+        if(bake_lambertian || bake_ggx) {
+            size_t output_bytes = std::max(outputBytes(LAMBERTIAN_SIZE, LAMBERTIAN_SAMPLES), outputBytes(GGX_SIZE, GGX_FILTERED_SAMPLES));
+            withEnvironment(in_file_path, mem_budget, output_bytes, [&](const auto& pyramid) {
+                if(bake_lambertian) {
+                    prefilterLambertian(pool, pyramid, lambertian.outputs[0], LAMBERTIAN_SIZE, LAMBERTIAN_SAMPLES);
+                    finish(lambertian);
+                }
+                if(bake_ggx) {
+                    prefilterGgxMips(pool, pyramid, name+".ggx.png", GGX_FILTERED_SAMPLES, true, GGX_SIZE, ENVIRONMENT_MIP_LEVEL);
+                    finish(ggx);
+                }
+            });
+        }
+        if(pending(brdf)) {
+            if(!lut) {
+                lut = std::make_unique<BrdfLut>(integrateBrdfLut(pool, BRDF_LUT_SAMPLES, BRDF_LUT_SIZE));
+            }
+            writeBrdfLut(brdf.outputs[0], *lut);
+            std::cout<<"Save to file: "<<brdf.outputs[0]<<"\n";
+            finish(brdf);
         }
     }
-    std::ofstream zOut(out_file_path, std::ios::out | std::ios::binary);
-    zOut.write(reinterpret_cast<char*>(out_data), out_size*out_size*2);
-    zOut.close();
+    std::cout<<"Baked "<<baked<<" products, skipped "<<skipped<<" unchanged\n";
 }
 
-
-
 int main(int argc, char ** argv) {
-    if(argc == 4) {
-        std::string input = argv[1];
-        std::string flag = argv[2];
-        std::string output = argv[3];
+    std::vector<std::string> args(argv + 1, argv + argc);
+    // --threads N may go anywhere, 0 or leaving it out uses every hardware thread
+    uint32_t threads = 0;
+    auto threads_arg = std::find(args.begin(), args.end(), THREADS);
+    if(threads_arg != args.end()) {
+        if(threads_arg + 1 == args.end()) {
+            throw std::runtime_error("Missing arguments");
+        }
+        threads = static_cast<uint32_t>(std::stoul(*(threads_arg + 1)));
+        args.erase(threads_arg, threads_arg + 2);
+    }
+    // --mem-budget MB samples the input from a float16 scratch file instead of memory (see cube_scratch.h)
+    size_t mem_budget = 0;
+    auto budget_arg = std::find(args.begin(), args.end(), MEM_BUDGET);
+    if(budget_arg != args.end()) {
+        if(budget_arg + 1 == args.end()) {
+            throw std::runtime_error("Missing arguments");
+        }
+        mem_budget = static_cast<size_t>(std::stoull(*(budget_arg + 1))) << 20;
+        args.erase(budget_arg, budget_arg + 2);
+    }
 
+    auto all_arg = std::find(args.begin(), args.end(), ALL);
+    if(all_arg != args.end()) {
+        args.erase(all_arg);
+        if(args.empty()) {
+            throw std::runtime_error("Missing arguments");
+        }
+        ThreadPool pool(threads);
+        std::cout<<"Using "<<pool.size()<<" threads, "<<IBL_KERNEL_ISA<<" kernels ("<<IBL_LANES<<" lanes)\n";
+        bakeEnvironments(pool, args, mem_budget);
+    } else if(args.size() == 3) {
+        std::string input = args[0];
+        std::string flag = args[1];
+        std::string output = args[2];
+
+        ThreadPool pool(threads);
+        std::cout<<"Using "<<pool.size()<<" threads, "<<IBL_KERNEL_ISA<<" kernels ("<<IBL_LANES<<" lanes)\n";
         if(flag == LAMBERTIAN) {
+            prefilterEnvironmentMapLambertian(pool, input, output, LAMBERTIAN_SIZE, LAMBERTIAN_SAMPLES, mem_budget);
+        } else if (flag == SH) {
             const uint32_t OUT_SIZE = 256;
-            const uint32_t SAMPLES = 1048576;
-            prefilterEnvironmentMapLambertian(input, output, OUT_SIZE, SAMPLES);
+            prefilterEnvironmentMapSH(pool, input, output, OUT_SIZE, mem_budget);
         } else if (flag == GGX) {
-            const uint32_t SAMPLES = 1048576/4;
-            const uint32_t OUT_SIZE = 512;
-            prefilterEnvironmentMapPbr(input, output, SAMPLES, OUT_SIZE, 5);
+            prefilterEnvironmentMapPbr(pool, input, output, GGX_FILTERED_SAMPLES, true, mem_budget, GGX_SIZE, ENVIRONMENT_MIP_LEVEL);
+        } else if (flag == GGX_REFERENCE) {
+            prefilterEnvironmentMapPbr(pool, input, output, GGX_REFERENCE_SAMPLES, false, mem_budget, GGX_SIZE, ENVIRONMENT_MIP_LEVEL);
         } else {
             throw std::runtime_error("Invalid flag");
         }
-    } else if (argc == 3) {
-        std::string flag = argv[2];
-        std::string output = argv[1];
-
-        const uint32_t SAMPLES = 4000;
-        const uint32_t OUT_SIZE = 512;
+    } else if (args.size() == 2) {
+        std::string flag = args[1];
+        std::string output = args[0];
+        if(mem_budget > 0) {
+            throw std::runtime_error(MEM_BUDGET+" only applies to --lambertian, --sh, --ggx and --ggx-reference");
+        }
 
         if (flag == LUT) {
-            precomputeBrdfLutToBinary(output, SAMPLES, OUT_SIZE);
+            ThreadPool pool(threads);
+            std::cout<<"Using "<<pool.size()<<" threads, "<<IBL_KERNEL_ISA<<" kernels ("<<IBL_LANES<<" lanes)\n";
+            precomputeBrdfLutToBinary(pool, output, BRDF_LUT_SAMPLES, BRDF_LUT_SIZE);
+        } else if (flag == GGX_COMPARE) {
+            // args[0] is the input environment here, the reference on every 8th texel of each axis
+            ThreadPool pool(threads);
+            std::cout<<"Using "<<pool.size()<<" threads, "<<IBL_KERNEL_ISA<<" kernels ("<<IBL_LANES<<" lanes)\n";
+            compareEnvironmentMapPbr(pool, args[0], GGX_FILTERED_SAMPLES, GGX_REFERENCE_SAMPLES, 8, 512, ENVIRONMENT_MIP_LEVEL);
         } else {
             throw std::runtime_error("Invalid flag");
         }
     }
     else {
-        throw std::runtime_error("Require 4 arguments: ./cube <input> --<flag> <output>");
+        throw std::runtime_error("Require 4 arguments: ./cube <input> --<flag> <output> [--threads N] [--mem-budget MB], or ./cube <input>... --all");
     }
 
 
@@ -2,6 +2,7 @@
 #include <memory>
 #include <chrono>
 #include <string>
+#include <thread>
 
 bool WindowController::shouldClose() { 
     return glfwWindowShouldClose(window); 
@@ -30,6 +31,11 @@ void WindowController::initWindow(float width, float height){
     window = glfwCreateWindow(width,height,"Vulkan", nullptr, nullptr);
     glfwSetWindowUserPointer(window, this);
     glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+
+    int w, h;
+    glfwGetFramebufferSize(window, &w, &h);
+    this->width = w;
+    this->height = h;
 }
 
 void WindowController::createSurface(VkInstance& instance, VkSurfaceKHR* surface){
@@ -43,12 +49,14 @@ void WindowController::destroy() {
     glfwDestroyWindow(window);
 }
 
-void WindowController::getFramebufferSize(int* width, int* height){
-    glfwGetFramebufferSize(window, width, height);
-    while (width == 0 || height == 0) {
-        glfwGetFramebufferSize(window, width, height);
-        glfwWaitEvents();
+void WindowController::getFramebufferSize(int* width_, int* height_){
+    // Called from the render thread, so use the size recorded by the resize callback 
+    // rather than querying GLFW. Wait while the window is minimized.
+    while ((width == 0 || height == 0) && !glfwWindowShouldClose(window)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
+    *width_ = width;
+    *height_ = height;
 }
 
 void WindowController::framebufferResizeCallback(GLFWwindow* window, int width, int height)  {
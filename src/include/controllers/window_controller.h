@@ -2,13 +2,15 @@
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
+#include <atomic>
 
 class WindowController {
     friend class ViewerApplication;
 private:
     GLFWwindow* window;
-    bool framebuffer_resized = false;
-    int width, height;
+    // Written by the GLFW callbacks on the main thread, read by the render thread
+    std::atomic<bool> framebuffer_resized{false};
+    std::atomic<int> width{0}, height{0};
 
 public:
     WindowController() = default;
@@ -0,0 +1,710 @@
+#include "ibl_sampling.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define IBL_AVX512
+#elif defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define IBL_AVX2
+#endif
+
+/* ----------------- SIMD -----------------*/
+// Just the operations the kernels need, on LANES floats / int32s at a time
+
+namespace {
+
+#if defined(IBL_AVX512)
+
+// GCC 12 reports the undefined passthrough registers of the unmasked intrinsics as uninitialized
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+const int LANES = 16;
+struct FloatN { __m512 v; };
+struct IntN { __m512i v; };
+struct MaskN { __mmask16 m; };
+
+inline FloatN load(const float* p) { return {_mm512_loadu_ps(p)}; }
+inline void store(float* p, FloatN a) { _mm512_storeu_ps(p, a.v); }
+inline FloatN set1(float s) { return {_mm512_set1_ps(s)}; }
+inline IntN set1i(int32_t s) { return {_mm512_set1_epi32(s)}; }
+inline FloatN operator+(FloatN a, FloatN b) { return {_mm512_add_ps(a.v, b.v)}; }
+inline FloatN operator-(FloatN a, FloatN b) { return {_mm512_sub_ps(a.v, b.v)}; }
+inline FloatN operator*(FloatN a, FloatN b) { return {_mm512_mul_ps(a.v, b.v)}; }
+inline FloatN operator/(FloatN a, FloatN b) { return {_mm512_div_ps(a.v, b.v)}; }
+inline FloatN fmadd(FloatN a, FloatN b, FloatN c) { return {_mm512_fmadd_ps(a.v, b.v, c.v)}; }
+inline FloatN sqrt(FloatN a) { return {_mm512_sqrt_ps(a.v)}; }
+inline FloatN min(FloatN a, FloatN b) { return {_mm512_min_ps(a.v, b.v)}; }
+inline FloatN max(FloatN a, FloatN b) { return {_mm512_max_ps(a.v, b.v)}; }
+inline FloatN abs(FloatN a) { return {_mm512_abs_ps(a.v)}; }
+inline FloatN floor(FloatN a) { return {_mm512_roundscale_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)}; }
+inline MaskN operator>=(FloatN a, FloatN b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)}; }
+inline MaskN operator>(FloatN a, FloatN b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ)}; }
+inline MaskN operator&(MaskN a, MaskN b) { return {static_cast<__mmask16>(a.m & b.m)}; }
+inline MaskN operator!(MaskN a) { return {static_cast<__mmask16>(~a.m)}; }
+inline FloatN select(MaskN m, FloatN a, FloatN b) { return {_mm512_mask_blend_ps(m.m, b.v, a.v)}; }
+inline IntN select(MaskN m, IntN a, IntN b) { return {_mm512_mask_blend_epi32(m.m, b.v, a.v)}; }
+inline IntN toInt(FloatN a) { return {_mm512_cvttps_epi32(a.v)}; }
+inline FloatN toFloat(IntN a) { return {_mm512_cvtepi32_ps(a.v)}; }
+inline IntN operator+(IntN a, IntN b) { return {_mm512_add_epi32(a.v, b.v)}; }
+inline IntN operator*(IntN a, IntN b) { return {_mm512_mullo_epi32(a.v, b.v)}; }
+inline IntN min(IntN a, IntN b) { return {_mm512_min_epi32(a.v, b.v)}; }
+inline FloatN gather(const float* base, IntN index) { return {_mm512_i32gather_ps(index.v, base, 4)}; }
+inline IntN gather(const int32_t* base, IntN index) { return {_mm512_i32gather_epi32(index.v, base, 4)}; }
+// 32 bit loads two bytes apart, truncated to the indexed half (see HalfCubePyramid on the padding)
+inline FloatN gather(const uint16_t* base, IntN index) {
+    return {_mm512_cvtph_ps(_mm512_cvtepi32_epi16(_mm512_i32gather_epi32(index.v, base, 2)))};
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#elif defined(IBL_AVX2)
+
+const int LANES = 8;
+struct FloatN { __m256 v; };
+struct IntN { __m256i v; };
+struct MaskN { __m256 m; };
+
+inline FloatN load(const float* p) { return {_mm256_loadu_ps(p)}; }
+inline void store(float* p, FloatN a) { _mm256_storeu_ps(p, a.v); }
+inline FloatN set1(float s) { return {_mm256_set1_ps(s)}; }
+inline IntN set1i(int32_t s) { return {_mm256_set1_epi32(s)}; }
+inline FloatN operator+(FloatN a, FloatN b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline FloatN operator-(FloatN a, FloatN b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline FloatN operator*(FloatN a, FloatN b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline FloatN operator/(FloatN a, FloatN b) { return {_mm256_div_ps(a.v, b.v)}; }
+inline FloatN fmadd(FloatN a, FloatN b, FloatN c) { return {_mm256_fmadd_ps(a.v, b.v, c.v)}; }
+inline FloatN sqrt(FloatN a) { return {_mm256_sqrt_ps(a.v)}; }
+inline FloatN min(FloatN a, FloatN b) { return {_mm256_min_ps(a.v, b.v)}; }
+inline FloatN max(FloatN a, FloatN b) { return {_mm256_max_ps(a.v, b.v)}; }
+inline FloatN abs(FloatN a) { return {_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)}; }
+inline FloatN floor(FloatN a) { return {_mm256_floor_ps(a.v)}; }
+inline MaskN operator>=(FloatN a, FloatN b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+inline MaskN operator>(FloatN a, FloatN b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)}; }
+inline MaskN operator&(MaskN a, MaskN b) { return {_mm256_and_ps(a.m, b.m)}; }
+inline MaskN operator!(MaskN a) { return {_mm256_xor_ps(a.m, _mm256_castsi256_ps(_mm256_set1_epi32(-1)))}; }
+inline FloatN select(MaskN m, FloatN a, FloatN b) { return {_mm256_blendv_ps(b.v, a.v, m.m)}; }
+inline IntN select(MaskN m, IntN a, IntN b) {
+    return {_mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b.v), _mm256_castsi256_ps(a.v), m.m))};
+}
+inline IntN toInt(FloatN a) { return {_mm256_cvttps_epi32(a.v)}; }
+inline FloatN toFloat(IntN a) { return {_mm256_cvtepi32_ps(a.v)}; }
+inline IntN operator+(IntN a, IntN b) { return {_mm256_add_epi32(a.v, b.v)}; }
+inline IntN operator*(IntN a, IntN b) { return {_mm256_mullo_epi32(a.v, b.v)}; }
+inline IntN min(IntN a, IntN b) { return {_mm256_min_epi32(a.v, b.v)}; }
+inline FloatN gather(const float* base, IntN index) { return {_mm256_i32gather_ps(base, index.v, 4)}; }
+inline IntN gather(const int32_t* base, IntN index) { return {_mm256_i32gather_epi32(reinterpret_cast<const int*>(base), index.v, 4)}; }
+#if defined(__F16C__)
+// 32 bit loads two bytes apart, the low halves packed into 8 x 16 bits (see HalfCubePyramid on the padding)
+inline FloatN gather(const uint16_t* base, IntN index) {
+    __m256i bits = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(base), index.v, 2), _mm256_set1_epi32(0xFFFF));
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(bits, bits), 0x08);
+    return {_mm256_cvtph_ps(_mm256_castsi256_si128(packed))};
+}
+#else
+inline FloatN gather(const uint16_t* base, IntN index) {
+    alignas(32) int32_t lanes[LANES];
+    alignas(32) float values[LANES];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), index.v);
+    for(int i=0; i<LANES; i++) {
+        values[i] = halfToFloat(base[lanes[i]]);
+    }
+    return {_mm256_load_ps(values)};
+}
+#endif
+
+#else
+
+// Fixed width loops; the compiler turns them into SSE / NEON code
+const int LANES = 8;
+struct FloatN { float v[LANES]; };
+struct IntN { int32_t v[LANES]; };
+struct MaskN { bool m[LANES]; };
+
+#define IBL_LANEWISE(Type, expr) Type r; for(int i=0; i<LANES; i++) { r.v[i] = (expr); } return r;
+#define IBL_MASKWISE(expr) MaskN r; for(int i=0; i<LANES; i++) { r.m[i] = (expr); } return r;
+
+inline FloatN load(const float* p) { IBL_LANEWISE(FloatN, p[i]) }
+inline void store(float* p, FloatN a) { for(int i=0; i<LANES; i++) { p[i] = a.v[i]; } }
+inline FloatN set1(float s) { IBL_LANEWISE(FloatN, s) }
+inline IntN set1i(int32_t s) { IBL_LANEWISE(IntN, s) }
+inline FloatN operator+(FloatN a, FloatN b) { IBL_LANEWISE(FloatN, a.v[i] + b.v[i]) }
+inline FloatN operator-(FloatN a, FloatN b) { IBL_LANEWISE(FloatN, a.v[i] - b.v[i]) }
+inline FloatN operator*(FloatN a, FloatN b) { IBL_LANEWISE(FloatN, a.v[i] * b.v[i]) }
+inline FloatN operator/(FloatN a, FloatN b) { IBL_LANEWISE(FloatN, a.v[i] / b.v[i]) }
+// Rounds the product and the sum separately, so results differ from the fused SIMD kernels in the last bits
+inline FloatN fmadd(FloatN a, FloatN b, FloatN c) { IBL_LANEWISE(FloatN, a.v[i] * b.v[i] + c.v[i]) }
+inline FloatN sqrt(FloatN a) { IBL_LANEWISE(FloatN, std::sqrt(a.v[i])) }
+inline FloatN min(FloatN a, FloatN b) { IBL_LANEWISE(FloatN, std::min(a.v[i], b.v[i])) }
+inline FloatN max(FloatN a, FloatN b) { IBL_LANEWISE(FloatN, std::max(a.v[i], b.v[i])) }
+inline FloatN abs(FloatN a) { IBL_LANEWISE(FloatN, std::abs(a.v[i])) }
+inline FloatN floor(FloatN a) { IBL_LANEWISE(FloatN, std::floor(a.v[i])) }
+inline MaskN operator>=(FloatN a, FloatN b) { IBL_MASKWISE(a.v[i] >= b.v[i]) }
+inline MaskN operator>(FloatN a, FloatN b) { IBL_MASKWISE(a.v[i] > b.v[i]) }
+inline MaskN operator&(MaskN a, MaskN b) { IBL_MASKWISE(a.m[i] && b.m[i]) }
+inline MaskN operator!(MaskN a) { IBL_MASKWISE(!a.m[i]) }
+inline FloatN select(MaskN m, FloatN a, FloatN b) { IBL_LANEWISE(FloatN, m.m[i] ? a.v[i] : b.v[i]) }
+inline IntN select(MaskN m, IntN a, IntN b) { IBL_LANEWISE(IntN, m.m[i] ? a.v[i] : b.v[i]) }
+inline IntN toInt(FloatN a) { IBL_LANEWISE(IntN, static_cast<int32_t>(a.v[i])) }
+inline FloatN toFloat(IntN a) { IBL_LANEWISE(FloatN, static_cast<float>(a.v[i])) }
+inline IntN operator+(IntN a, IntN b) { IBL_LANEWISE(IntN, a.v[i] + b.v[i]) }
+inline IntN operator*(IntN a, IntN b) { IBL_LANEWISE(IntN, a.v[i] * b.v[i]) }
+inline IntN min(IntN a, IntN b) { IBL_LANEWISE(IntN, std::min(a.v[i], b.v[i])) }
+inline FloatN gather(const float* base, IntN index) { IBL_LANEWISE(FloatN, base[index.v[i]]) }
+inline IntN gather(const int32_t* base, IntN index) { IBL_LANEWISE(IntN, base[index.v[i]]) }
+inline FloatN gather(const uint16_t* base, IntN index) { IBL_LANEWISE(FloatN, halfToFloat(base[index.v[i]])) }
+
+#undef IBL_LANEWISE
+#undef IBL_MASKWISE
+
+#endif
+
+inline FloatN operator-(FloatN a) { return set1(0.0f) - a; }
+
+// Lanes summed in index order, so the result does not depend on the instruction set's reduction order
+inline float sum(FloatN a) {
+    float lanes[LANES];
+    store(lanes, a);
+    float total = 0.0f;
+    for(int i=0; i<LANES; i++) {
+        total += lanes[i];
+    }
+    return total;
+}
+
+// Same face selection as CubeMap::faceCoords
+inline void faceCoords(FloatN x, FloatN y, FloatN z, IntN& f, FloatN& u, FloatN& v) {
+    const FloatN zero = set1(0.0f);
+    FloatN ax = abs(x), ay = abs(y), az = abs(z);
+    MaskN majorX = (ax >= ay) & (ax >= az);
+    MaskN majorY = (!majorX) & (ay >= az);
+    MaskN majorZ = (!majorX) & (!majorY);
+    MaskN posX = x >= zero, posY = y >= zero, posZ = z >= zero;
+
+    FloatN ma = select(majorX, ax, select(majorY, ay, az));
+    FloatN sc = select(majorX, select(posX, -z, z), select(majorY, x, select(posZ, x, -x)));
+    FloatN tc = select(majorY, select(posY, z, -z), -y);
+    f = select(majorX, select(posX, set1i(PositiveX), set1i(NegativeX)),
+        select(majorY, select(posY, set1i(PositiveY), set1i(NegativeY)), select(majorZ & posZ, set1i(PositiveZ), set1i(NegativeZ))));
+
+    const FloatN half = set1(0.5f), one = set1(1.0f);
+    u = half * (sc / ma + one);
+    v = half * (tc / ma + one);
+}
+
+inline const float* plane(const CubePyramid& pyramid, int c) { return pyramid.planes[c].data(); }
+inline const uint16_t* plane(const HalfCubePyramid& pyramid, int c) { return pyramid.planes[c]; }
+
+// Nearest texel of level 0
+template<typename Pyramid>
+inline void lookupNearest(const Pyramid& pyramid, FloatN x, FloatN y, FloatN z, FloatN& r, FloatN& g, FloatN& b) {
+    IntN f;
+    FloatN u, v;
+    faceCoords(x, y, z, f, u, v);
+    const int32_t size = pyramid.levelSizes[0];
+    const FloatN sizeN = set1(static_cast<float>(size));
+    const FloatN last = set1(static_cast<float>(size - 1));
+    // clamping in float before the conversion keeps the truncation a floor
+    IntN s = toInt(min(max(floor(u * sizeN), set1(0.0f)), last));
+    IntN t = toInt(min(max(floor(v * sizeN), set1(0.0f)), last));
+    IntN sizeI = set1i(size);
+    IntN index = (f * sizeI + t) * sizeI + s;
+    r = gather(plane(pyramid, 0), index);
+    g = gather(plane(pyramid, 1), index);
+    b = gather(plane(pyramid, 2), index);
+}
+
+// Bilinear on level l (a different one per lane), clamped at face edges
+template<typename Pyramid>
+inline void lookupBilinear(const Pyramid& pyramid, IntN f, FloatN u, FloatN v, IntN l, FloatN& r, FloatN& g, FloatN& b) {
+    IntN sizeI = gather(pyramid.levelSizes.data(), l);
+    IntN offset = gather(pyramid.levelOffsets.data(), l);
+    FloatN size = toFloat(sizeI);
+    FloatN last = size - set1(1.0f);
+    FloatN px = min(max(u * size - set1(0.5f), set1(0.0f)), last);
+    FloatN py = min(max(v * size - set1(0.5f), set1(0.0f)), last);
+    IntN s0 = toInt(px), t0 = toInt(py);
+    IntN lastI = sizeI + set1i(-1);
+    IntN s1 = min(s0 + set1i(1), lastI), t1 = min(t0 + set1i(1), lastI);
+    FloatN fx = px - toFloat(s0), fy = py - toFloat(t0);
+
+    IntN face = offset + f * sizeI * sizeI;
+    IntN i00 = face + t0 * sizeI + s0, i01 = face + t0 * sizeI + s1;
+    IntN i10 = face + t1 * sizeI + s0, i11 = face + t1 * sizeI + s1;
+    FloatN* out[3] = {&r, &g, &b};
+    for(int c=0; c<3; c++) {
+        const auto* channel = plane(pyramid, c);
+        FloatN t00 = gather(channel, i00), t01 = gather(channel, i01);
+        FloatN t10 = gather(channel, i10), t11 = gather(channel, i11);
+        FloatN top = fmadd(t01 - t00, fx, t00);
+        FloatN bottom = fmadd(t11 - t10, fx, t10);
+        *out[c] = fmadd(bottom - top, fy, top);
+    }
+}
+
+template<typename Pyramid>
+inline void lookupTrilinear(const Pyramid& pyramid, FloatN x, FloatN y, FloatN z, FloatN lod, FloatN& r, FloatN& g, FloatN& b) {
+    IntN f;
+    FloatN u, v;
+    faceCoords(x, y, z, f, u, v);
+    const int32_t levels = static_cast<int32_t>(pyramid.levelSizes.size());
+    lod = min(max(lod, set1(0.0f)), set1(static_cast<float>(levels - 1)));
+    IntN l0 = toInt(lod);
+    IntN l1 = min(l0 + set1i(1), set1i(levels - 1));
+    FloatN fl = lod - toFloat(l0);
+    FloatN r0, g0, b0, r1, g1, b1;
+    lookupBilinear(pyramid, f, u, v, l0, r0, g0, b0);
+    lookupBilinear(pyramid, f, u, v, l1, r1, g1, b1);
+    r = fmadd(r1 - r0, fl, r0);
+    g = fmadd(g1 - g0, fl, g0);
+    b = fmadd(b1 - b0, fl, b0);
+}
+
+}
+
+const uint32_t IBL_LANES = LANES;
+#if defined(IBL_AVX512)
+const char* const IBL_KERNEL_ISA = "AVX-512";
+#elif defined(IBL_AVX2)
+const char* const IBL_KERNEL_ISA = "AVX2";
+#else
+const char* const IBL_KERNEL_ISA = "portable";
+#endif
+
+/* ----------------- Cube -----------------*/
+
+float RadicalInverse_VdC(uint32_t bits)
+{
+    bits = (bits << 16u) | (bits >> 16u);
+    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+    return float(bits) * 2.3283064365386963e-10; // / 0x100000000
+}
+
+vec2 Hammersley(uint32_t i, uint32_t N)
+{
+    return vec2(float(i)/float(N), RadicalInverse_VdC(i));
+}
+
+void faceBasis(uint32_t f, vec3& sc, vec3& tc, vec3& ma) {
+    //See OpenGL 4.4 Core Profile specification, Table 8.18:
+    if      (f == PositiveX) { sc = vec3( 0.0f, 0.0f,-1.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3( 1.0f, 0.0f, 0.0f); }
+    else if (f == NegativeX) { sc = vec3( 0.0f, 0.0f, 1.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3(-1.0f, 0.0f, 0.0f); }
+    else if (f == PositiveY) { sc = vec3( 1.0f, 0.0f, 0.0f); tc = vec3( 0.0f, 0.0f, 1.0f); ma = vec3( 0.0f, 1.0f, 0.0f); }
+    else if (f == NegativeY) { sc = vec3( 1.0f, 0.0f, 0.0f); tc = vec3( 0.0f, 0.0f,-1.0f); ma = vec3( 0.0f,-1.0f, 0.0f); }
+    else if (f == PositiveZ) { sc = vec3( 1.0f, 0.0f, 0.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3( 0.0f, 0.0f, 1.0f); }
+    else                     { sc = vec3(-1.0f, 0.0f, 0.0f); tc = vec3( 0.0f,-1.0f, 0.0f); ma = vec3( 0.0f, 0.0f,-1.0f); }
+}
+
+// Referenced https://github.com/ixchow/15-466-ibl/blob/master/cubes/blur_cube.cpp for cube look up
+void CubeMap::faceCoords(vec3 const &dir, uint32_t& f, float& x, float& y) {
+	float sc, tc, ma;
+    if (std::abs(dir[0]) >= std::abs(dir[1]) && std::abs(dir[0]) >= std::abs(dir[2])) {
+        if (dir[0] >= 0) { sc = -dir[2]; tc = -dir[1]; ma = dir[0]; f = PositiveX; }
+		else            { sc =  dir[2]; tc = -dir[1]; ma =-dir[0]; f = NegativeX; }
+
+    } else if (std::abs(dir[1]) >= std::abs(dir[2])) {
+        if (dir[1] >= 0) { sc =  dir[0]; tc =  dir[2]; ma = dir[1]; f = PositiveY; }
+		else            { sc =  dir[0]; tc = -dir[2]; ma =-dir[1]; f = NegativeY; }
+    } else {
+        if (dir[2] >= 0) { sc =  dir[0]; tc = -dir[1]; ma = dir[2]; f = PositiveZ; }
+		else            { sc = -dir[0]; tc = -dir[1]; ma =-dir[2]; f = NegativeZ; }
+    }
+	x = 0.5f * (sc / ma + 1.0f);
+	y = 0.5f * (tc / ma + 1.0f);
+}
+
+vec3 CubeMap::lookup(vec3 const &dir) const {
+	uint32_t f;
+	float x, y;
+	faceCoords(dir, f, x, y);
+	int32_t s = std::floor(x * size);
+	s = std::max(0, std::min(int32_t(size)-1, s));
+	int32_t t = std::floor(y * size);
+	t = std::max(0, std::min(int32_t(size)-1, t));
+	return texels[(f*size+t)*size+s];
+}
+
+vec3 CubeMap::lookupBilinear(uint32_t f, float x, float y) const {
+    float px = std::max(0.0f, std::min(float(size) - 1.0f, x * size - 0.5f));
+    float py = std::max(0.0f, std::min(float(size) - 1.0f, y * size - 0.5f));
+    int32_t s0 = int32_t(px), t0 = int32_t(py);
+    int32_t s1 = std::min(s0 + 1, size - 1), t1 = std::min(t0 + 1, size - 1);
+    float fx = px - s0, fy = py - t0;
+    const vec3* face = texels.data() + f * size * size;
+    vec3 top = face[t0*size+s0] * (1.0f - fx) + face[t0*size+s1] * fx;
+    vec3 bottom = face[t1*size+s0] * (1.0f - fx) + face[t1*size+s1] * fx;
+    return top * (1.0f - fy) + bottom * fy;
+}
+
+CubePyramid::CubePyramid(const CubeMap& cube) {
+    levels.push_back(cube);
+    while(levels.back().size > 1) {
+        const CubeMap& src = levels.back();
+        CubeMap dst;
+        dst.size = src.size / 2;
+        dst.texels.resize(6 * dst.size * dst.size);
+        for(int32_t f = 0; f < 6; ++f) {
+            for(int32_t t = 0; t < dst.size; ++t) {
+                for(int32_t s = 0; s < dst.size; ++s) {
+                    // odd sizes drop their last row and column
+                    const vec3* face = src.texels.data() + f * src.size * src.size;
+                    dst.texels[(f*dst.size+t)*dst.size+s] = (face[(2*t)*src.size+2*s] + face[(2*t)*src.size+2*s+1]
+                        + face[(2*t+1)*src.size+2*s] + face[(2*t+1)*src.size+2*s+1]) * 0.25f;
+                }
+            }
+        }
+        levels.push_back(std::move(dst));
+    }
+
+    for(const CubeMap& level: levels) {
+        levelOffsets.push_back(static_cast<int32_t>(planes[0].size()));
+        levelSizes.push_back(level.size);
+        for(const vec3& texel: level.texels) {
+            for(int c=0; c<3; c++) {
+                planes[c].push_back(texel[c]);
+            }
+        }
+    }
+}
+
+vec3 CubePyramid::lookup(vec3 const &dir, float lod) const {
+    uint32_t f;
+    float x, y;
+    CubeMap::faceCoords(dir, f, x, y);
+    lod = std::max(0.0f, std::min(float(levels.size() - 1), lod));
+    uint32_t l0 = uint32_t(lod);
+    uint32_t l1 = std::min(l0 + 1, uint32_t(levels.size() - 1));
+    float fl = lod - l0;
+    vec3 a = levels[l0].lookupBilinear(f, x, y);
+    if(fl == 0.0f) {
+        return a;
+    }
+    return a * (1.0f - fl) + levels[l1].lookupBilinear(f, x, y) * fl;
+}
+
+/* ----------------- Scalar -----------------*/
+
+void tangentFrameGGX(const vec3& N, vec3& T, vec3& B) {
+    vec3 up = abs(N[2]) < 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(1.0, 0.0, 0.0);
+    T = cross(up, N).normalized();
+    B = cross(N, T);
+}
+
+vec3 ImportanceSampleGGX(vec2 Xi, vec3 N, float roughness)
+{
+    float a = roughness*roughness;
+
+    float phi = 2.0 * M_PI * Xi[0];
+    float cosTheta = sqrt((1.0 - Xi[1]) / (1.0 + (a*a - 1.0) * Xi[1]));
+    float sinTheta = sqrt(1.0 - cosTheta*cosTheta);
+
+    // from spherical coordinates to cartesian coordinates
+    vec3 H;
+    H[0] = cos(phi) * sinTheta;
+    H[1] = sin(phi) * sinTheta;
+    H[2] = cosTheta;
+
+    // from tangent-space vector to world-space sample vector
+    vec3 tangent, bitangent;
+    tangentFrameGGX(N, tangent, bitangent);
+
+    vec3 sampleVec = tangent * H[0] + bitangent * H[1] + N * H[2];
+    return sampleVec.normalized();
+}
+
+float DistributionGGX(float NdotH, float roughness) {
+    float a = roughness*roughness;
+    float a2 = a*a;
+    float d = NdotH * NdotH * (a2 - 1.0f) + 1.0f;
+    return a2 / (M_PI * d * d);
+}
+
+// Source lod of a GGX sample for filtered importance sampling (Colbert and Krivanek, GPU Gems 3
+// chapter 20): the level whose texels cover about the solid angle the sample stands for, 1 / (samples * pdf)
+static float ggxSampleLod(float NdotH, float roughness, uint32_t samples, float texelSolidAngle) {
+    if(roughness <= 0.0f) {
+        return 0.0f;
+    }
+    // pdf of L is D * NdotH / (4 * VdotH), which is D / 4 with V = N
+    float pdf = DistributionGGX(NdotH, roughness) * 0.25f;
+    float sampleSolidAngle = 1.0f / (float(samples) * pdf + 1e-6f);
+    return 0.5f * std::log2(sampleSolidAngle / texelSolidAngle);
+}
+
+// The reference takes the nearest texel of the source for every sample and needs a huge number
+// of samples to hide aliasing; filtered importance sampling reads each from a mip of the source
+vec3 prefilterGGX(const CubePyramid& pyramid, const vec3& N, float roughness, uint32_t samples, bool filtered) {
+    vec3 R = N; // specular reflection direction
+    vec3 V = R; // view direction
+    const float texelSolidAngle = 4.0f * M_PI / (6.0f * pyramid.levels[0].size * pyramid.levels[0].size);
+    if(filtered && roughness == 0.0f) {
+        // every sample is N
+        samples = 1;
+    }
+
+    // Reference https://learnopengl.com/PBR/IBL/Specular-IBL for ggx sampling
+    float total_weight = 0.0;
+    vec3 acc = vec3(0.0f);
+    for(uint32_t i=0; i<samples; i++) {
+        vec2 Xi = Hammersley(i, samples);
+        vec3 H = ImportanceSampleGGX(Xi, N, roughness);
+        vec3 L  = (2.0 * dot(V, H) * H - V).normalized();
+
+        float NdotL = std::max(dot(N, L), 0.0f);
+        NdotL = std::min(NdotL, 1.0f);
+        if(NdotL > 0.0)
+        {
+            if(filtered) {
+                float lod = ggxSampleLod(std::max(dot(N, H), 0.0f), roughness, samples, texelSolidAngle);
+                acc += pyramid.lookup(L, lod) * NdotL;
+            } else {
+                acc += pyramid.levels[0].lookup(L) * NdotL;
+            }
+            total_weight += NdotL;
+        }
+    }
+    return acc / total_weight;
+}
+
+float GeometrySchlickGGX(float NdotV, float roughness)
+{
+    float a = roughness;
+    float k = (a * a) / 2.0;
+
+    float nom   = NdotV;
+    float denom = NdotV * (1.0 - k) + k;
+    return nom / denom;
+}
+
+float GeometrySmith(vec3 N, vec3 V, vec3 L, float roughness)
+{
+    float NdotV = std::max(dot(N, V), 0.0f);
+    float NdotL = std::max(dot(N, L), 0.0f);
+    float ggx2 = GeometrySchlickGGX(NdotV, roughness);
+    float ggx1 = GeometrySchlickGGX(NdotL, roughness);
+
+    return ggx1 * ggx2;
+}
+
+vec2 IntegrateBRDF(float NdotV, float roughness, uint32_t samples){
+    vec3 V;
+    V[0] = sqrt(1.0 - NdotV*NdotV);
+    V[1] = 0.0;
+    V[2] = NdotV;
+
+    float A = 0.0;
+    float B = 0.0;
+
+    vec3 N = vec3(0.0, 0.0, 1.0);
+
+    for(uint32_t i = 0u; i < samples; ++i)
+    {
+        vec2 Xi = Hammersley(i, samples);
+        vec3 H  = ImportanceSampleGGX(Xi, N, roughness);
+        vec3 L  = (2.0 * dot(V, H) * H - V).normalized();
+
+        float NdotL = std::max(L[2], 0.0f);
+        float NdotH = std::max(H[2], 0.0f);
+        float VdotH = std::max(dot(V, H), 0.0f);
+
+        if(NdotL > 0.0)
+        {
+            float G = GeometrySmith(N, V, L, roughness);
+            float G_Vis = (G * VdotH) / (NdotH * NdotV);
+
+            float Fc = pow(1.0 - VdotH, 5.0);
+
+            A += (1.0 - Fc) * G_Vis;
+            B += Fc * G_Vis;
+        }
+    }
+    A /= float(samples);
+    B /= float(samples);
+    return vec2(A, B);
+}
+
+/* ----------------- Batch -----------------*/
+
+void SampleTable::push(float x_, float y_, float z_, float weight_, float lod_) {
+    x.push_back(x_);
+    y.push_back(y_);
+    z.push_back(z_);
+    weight.push_back(weight_);
+    lod.push_back(lod_);
+}
+
+void SampleTable::finish() {
+    double total = 0.0;
+    for(float w: weight) {
+        total += w;
+    }
+    invTotalWeight = total > 0.0 ? static_cast<float>(1.0 / total) : 0.0f;
+    // padding samples point along N with no weight
+    while(x.size() % LANES != 0) {
+        push(0.0f, 0.0f, 1.0f, 0.0f, 0.0f);
+    }
+}
+
+SampleTable SampleTable::cosine(uint32_t samples) {
+    SampleTable table;
+    for(uint32_t i=0; i<samples; i++) {
+        vec2 u = Hammersley(i, samples);
+        float cosTheta = sqrt(1.0 - u[1]);
+        float sinTheta = sqrt(u[1]);
+        float phi = 2 * M_PI * u[0];
+        table.push(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta, 1.0f, 0.0f);
+    }
+    table.finish();
+    return table;
+}
+
+SampleTable SampleTable::ggx(uint32_t samples, float roughness, bool filtered, int sourceSize) {
+    SampleTable table;
+    table.filtered = filtered;
+    if(filtered && roughness == 0.0f) {
+        // every sample is N
+        samples = 1;
+    }
+    const float texelSolidAngle = 4.0f * M_PI / (6.0f * sourceSize * sourceSize);
+    const vec3 N = vec3(0.0f, 0.0f, 1.0f);
+    for(uint32_t i=0; i<samples; i++) {
+        // ImportanceSampleGGX in the tangent frame, where N = V = z
+        vec2 Xi = Hammersley(i, samples);
+        float a = roughness*roughness;
+        float phi = 2.0 * M_PI * Xi[0];
+        float cosTheta = sqrt((1.0 - Xi[1]) / (1.0 + (a*a - 1.0) * Xi[1]));
+        float sinTheta = sqrt(1.0 - cosTheta*cosTheta);
+        vec3 H = vec3(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
+        vec3 L = (2.0 * dot(N, H) * H - N).normalized();
+
+        float NdotL = std::min(std::max(L[2], 0.0f), 1.0f);
+        if(NdotL > 0.0f) {
+            float lod = filtered ? ggxSampleLod(cosTheta, roughness, samples, texelSolidAngle) : 0.0f;
+            table.push(L[0], L[1], L[2], NdotL, lod);
+        }
+    }
+    table.finish();
+    return table;
+}
+
+template<typename Pyramid>
+static vec3 integrate(const Pyramid& pyramid, const SampleTable& table, const vec3& T, const vec3& B, const vec3& N) {
+    const FloatN Tx = set1(T[0]), Ty = set1(T[1]), Tz = set1(T[2]);
+    const FloatN Bx = set1(B[0]), By = set1(B[1]), Bz = set1(B[2]);
+    const FloatN Nx = set1(N[0]), Ny = set1(N[1]), Nz = set1(N[2]);
+    FloatN accR = set1(0.0f), accG = set1(0.0f), accB = set1(0.0f);
+    for(size_t i=0; i<table.x.size(); i+=LANES) {
+        FloatN lx = load(&table.x[i]), ly = load(&table.y[i]), lz = load(&table.z[i]);
+        // tangent frame to world
+        FloatN x = fmadd(lx, Tx, fmadd(ly, Bx, lz * Nx));
+        FloatN y = fmadd(lx, Ty, fmadd(ly, By, lz * Ny));
+        FloatN z = fmadd(lx, Tz, fmadd(ly, Bz, lz * Nz));
+        FloatN r, g, b;
+        if(table.filtered) {
+            lookupTrilinear(pyramid, x, y, z, load(&table.lod[i]), r, g, b);
+        } else {
+            lookupNearest(pyramid, x, y, z, r, g, b);
+        }
+        FloatN w = load(&table.weight[i]);
+        accR = fmadd(w, r, accR);
+        accG = fmadd(w, g, accG);
+        accB = fmadd(w, b, accB);
+    }
+    return vec3(sum(accR), sum(accG), sum(accB)) * table.invTotalWeight;
+}
+
+vec3 integrateCube(const CubePyramid& pyramid, const SampleTable& table, const vec3& T, const vec3& B, const vec3& N) {
+    return integrate(pyramid, table, T, B, N);
+}
+
+vec3 integrateCube(const HalfCubePyramid& pyramid, const SampleTable& table, const vec3& T, const vec3& B, const vec3& N) {
+    return integrate(pyramid, table, T, B, N);
+}
+
+void lookupCube(const CubePyramid& pyramid, size_t count, const float* x, const float* y, const float* z, const float* lod,
+                float* r, float* g, float* b) {
+    size_t i = 0;
+    for(; i + LANES <= count; i += LANES) {
+        FloatN cr, cg, cb;
+        if(lod) {
+            lookupTrilinear(pyramid, load(x + i), load(y + i), load(z + i), load(lod + i), cr, cg, cb);
+        } else {
+            lookupNearest(pyramid, load(x + i), load(y + i), load(z + i), cr, cg, cb);
+        }
+        store(r + i, cr);
+        store(g + i, cg);
+        store(b + i, cb);
+    }
+    for(; i < count; i++) {
+        vec3 dir = vec3(x[i], y[i], z[i]);
+        vec3 c = lod ? pyramid.lookup(dir, lod[i]) : pyramid.levels[0].lookup(dir);
+        r[i] = c[0];
+        g[i] = c[1];
+        b[i] = c[2];
+    }
+}
+
+BrdfSampleTable::BrdfSampleTable(uint32_t samples_) : samples(samples_) {
+    size_t padded = (samples + LANES - 1) / LANES * LANES;
+    sinPhi.assign(padded, 0.0f);
+    xi.assign(padded, 0.0f);
+    valid.assign(padded, 0.0f);
+    for(uint32_t i=0; i<samples; i++) {
+        vec2 Xi = Hammersley(i, samples);
+        float phi = 2.0 * M_PI * Xi[0];
+        sinPhi[i] = sin(phi);
+        xi[i] = Xi[1];
+        valid[i] = 1.0f;
+    }
+}
+
+// IntegrateBRDF with N = z; ImportanceSampleGGX's frame for that N is T = -y, B = x, so
+// H = (sinPhi sinTheta, -cosPhi sinTheta, cosTheta). V has no y and only L's z is used
+vec2 integrateBRDF(const BrdfSampleTable& table, float NdotV, float roughness) {
+    const float a = roughness*roughness;
+    const FloatN a2m1 = set1(a*a - 1.0f);
+    const float k_ = (roughness * roughness) / 2.0f;
+    const FloatN k = set1(k_), oneMinusK = set1(1.0f - k_);
+    const FloatN Vx = set1(std::sqrt(1.0f - NdotV*NdotV)), Vz = set1(NdotV);
+    const FloatN NdotVN = set1(NdotV);
+    const FloatN G1V = set1(NdotV / (NdotV * (1.0f - k_) + k_));
+    const FloatN zero = set1(0.0f), one = set1(1.0f), two = set1(2.0f);
+    FloatN accA = zero, accB = zero;
+    for(size_t i=0; i<table.xi.size(); i+=LANES) {
+        FloatN xi = load(&table.xi[i]);
+        FloatN cosTheta = sqrt((one - xi) / fmadd(a2m1, xi, one));
+        FloatN sinTheta = sqrt(max(one - cosTheta * cosTheta, zero));
+        FloatN Hx = load(&table.sinPhi[i]) * sinTheta;
+        FloatN Hz = cosTheta;
+
+        FloatN VdotH = fmadd(Vx, Hx, Vz * Hz);
+        FloatN Lz = fmadd(two * VdotH, Hz, -Vz);
+        FloatN NdotL = max(Lz, zero);
+        FloatN NdotH = max(Hz, zero);
+        VdotH = max(VdotH, zero);
+
+        FloatN G = G1V * (NdotL / fmadd(NdotL, oneMinusK, k));
+        FloatN G_Vis = G * VdotH / (NdotH * NdotVN);
+        FloatN c = one - VdotH;
+        FloatN c2 = c * c;
+        FloatN Fc = c2 * c2 * c;
+
+        // samples below the horizon and padding contribute nothing
+        FloatN w = select(NdotL > zero, load(&table.valid[i]), zero);
+        G_Vis = select(NdotL > zero, G_Vis, zero) * w;
+        accA = fmadd(one - Fc, G_Vis, accA);
+        accB = fmadd(Fc, G_Vis, accB);
+    }
+    return vec2(sum(accA) / float(table.samples), sum(accB) / float(table.samples));
+}
@@ -0,0 +1,123 @@
+//
+//  ibl_sampling.h
+//
+//  Cube maps and the sampling kernels bin/cube prefilters environments with.
+//  The scalar functions are the reference; the batch kernels evaluate IBL_LANES samples per
+//  iteration from structure of arrays tables (16 with AVX-512, 8 with AVX2 + FMA, otherwise
+//  8-wide loops the compiler vectorizes for the target). bin/bench_cube times one against the other.
+//
+
+#pragma once
+
+#include "mathlib.h"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+enum Face {
+	PositiveX = 0, NegativeX = 1,
+	PositiveY = 2, NegativeY = 3,
+	PositiveZ = 4, NegativeZ = 5,
+};
+
+// Samples the batch kernels take per iteration, tables are padded to a multiple of it
+extern const uint32_t IBL_LANES;
+// "AVX-512", "AVX2" or "portable"
+extern const char* const IBL_KERNEL_ISA;
+
+float RadicalInverse_VdC(uint32_t bits);
+vec2 Hammersley(uint32_t i, uint32_t N);
+
+// sc maps to rightward axis on face f, tc to upward axis on face, ma is the direction to face
+void faceBasis(uint32_t f, vec3& sc, vec3& tc, vec3& ma);
+
+struct CubeMap {
+    int size; // width of a face
+    std::vector<vec3> texels; // faces stacked +X, -X, +Y, -Y, +Z, -Z
+
+    // Face of dir and where it hits it, x and y in [0, 1]
+    static void faceCoords(vec3 const &dir, uint32_t& f, float& x, float& y);
+    // Nearest texel
+    vec3 lookup(vec3 const &dir) const;
+    // Bilinear within the face, clamped at its edges
+    vec3 lookupBilinear(uint32_t f, float x, float y) const;
+};
+
+// Box filtered mip chain of a cube, level 0 is the cube itself
+struct CubePyramid {
+    std::vector<CubeMap> levels;
+
+    // Every level one channel after the other, for the batch kernels
+    std::vector<float> planes[3];
+    std::vector<int32_t> levelOffsets; // first texel of each level in planes
+    std::vector<int32_t> levelSizes;
+
+    explicit CubePyramid(const CubeMap& cube);
+
+    // Trilinear, lod 0 is the original resolution
+    vec3 lookup(vec3 const &dir, float lod) const;
+};
+
+// The same planes as float16 in memory owned by someone else, the mapped scratch file of
+// bin/cube --mem-budget. The kernels read halves with 32 bit gathers, so the storage must
+// stay readable for at least 2 bytes past the last texel of each plane
+struct HalfCubePyramid {
+    const uint16_t* planes[3] = {};
+    std::vector<int32_t> levelOffsets;
+    std::vector<int32_t> levelSizes;
+    std::function<void()> rowDone; // called by the prefilters after each row they sample, if set
+};
+
+/* ------------------------- Scalar ------------------------- */
+
+// Tangent and bitangent ImportanceSampleGGX places half vectors with
+void tangentFrameGGX(const vec3& N, vec3& T, vec3& B);
+vec3 ImportanceSampleGGX(vec2 Xi, vec3 N, float roughness);
+float DistributionGGX(float NdotH, float roughness);
+float GeometrySchlickGGX(float NdotV, float roughness);
+float GeometrySmith(vec3 N, vec3 V, vec3 L, float roughness);
+
+// GGX prefiltered radiance around N, from the nearest texel of level 0 or with filtered importance sampling
+vec3 prefilterGGX(const CubePyramid& pyramid, const vec3& N, float roughness, uint32_t samples, bool filtered);
+// Scale and bias to F0 of the split sum BRDF
+vec2 IntegrateBRDF(float NdotV, float roughness, uint32_t samples);
+
+/* ------------------------- Batch ------------------------- */
+
+// Sample directions in the tangent frame of the texel (z along N), with a weight and a source lod each.
+// They only depend on the mip, so one table serves every texel of it
+struct SampleTable {
+    std::vector<float> x, y, z, weight, lod;
+    float invTotalWeight = 0.0f;
+    bool filtered = false; // lod holds the source level, otherwise level 0 nearest
+
+    // Cosine weighted hemisphere, for the lambertian prefilter
+    static SampleTable cosine(uint32_t samples);
+    // Reflections of GGX half vectors with V = N, weighted by NdotL; filtered picks each lod from
+    // the pdf and the texel solid angle of a source of sourceSize
+    static SampleTable ggx(uint32_t samples, float roughness, bool filtered, int sourceSize);
+
+private:
+    void push(float x_, float y_, float z_, float weight_, float lod_);
+    void finish();
+};
+
+// sum(weight * radiance(x T + y B + z N)) / sum(weight) over the table
+vec3 integrateCube(const CubePyramid& pyramid, const SampleTable& table, const vec3& T, const vec3& B, const vec3& N);
+vec3 integrateCube(const HalfCubePyramid& pyramid, const SampleTable& table, const vec3& T, const vec3& B, const vec3& N);
+
+// Looks up count directions at once, nearest on level 0 if lod is null, otherwise trilinear
+void lookupCube(const CubePyramid& pyramid, size_t count, const float* x, const float* y, const float* z, const float* lod,
+                float* r, float* g, float* b);
+
+// Hammersley points of the BRDF integral, shared by every texel of the LUT. The y of the half
+// vectors is never needed, so only sin(phi) is kept
+struct BrdfSampleTable {
+    std::vector<float> sinPhi, xi, valid;
+    uint32_t samples = 0;
+
+    explicit BrdfSampleTable(uint32_t samples);
+};
+
+vec2 integrateBRDF(const BrdfSampleTable& table, float NdotV, float roughness);
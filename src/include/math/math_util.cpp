@@ -3,8 +3,17 @@
 #include <algorithm>
 #include <cfloat>
 #include <iostream>
+#include <cstring>
 #include "math_util.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RGBE_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RGBE_NEON
+#endif
+
 float lerp(const float start, const float end, float t /* a fraction of 1*/){
     return start + (end - start) * t;
 }
@@ -325,4 +334,127 @@ u8vec4 float_to_rgbe(vec3 col) {
 		std::max(0, int32_t(col[2] * fac)),
 		e + 128
 	);
-}
\ No newline at end of file
+}
+
+// RGBE (value (m + 0.5) / 256 * 2^(e - 128)) and E5B9G9R9 (value m9 / 512 * 2^(E - 15)) both
+// share one exponent, so m9 = 2m + 1 and E = e - 113 convert exactly. Below e = 113 the
+// mantissas are shifted right instead and above e = 144 the value saturates.
+// (0, 0, 0, 0) has e = 0 and becomes 0 like in rgbe_to_float
+static uint32_t rgbe_texel_to_e5b9g9r9(uint32_t rgbe) {
+	uint32_t e = rgbe >> 24;
+	if (e > 144) {
+		return 0xffffffff;
+	}
+	uint32_t shift = e < 113 ? 113 - e : 0;
+	uint32_t r = shift < 32 ? ((rgbe & 0xff) * 2 + 1) >> shift : 0;
+	uint32_t g = shift < 32 ? (((rgbe >> 8) & 0xff) * 2 + 1) >> shift : 0;
+	uint32_t b = shift < 32 ? (((rgbe >> 16) & 0xff) * 2 + 1) >> shift : 0;
+	uint32_t exponent = e < 113 ? 0 : e - 113;
+	return r | g << 9 | b << 18 | exponent << 27;
+}
+
+void rgbe_to_e5b9g9r9(const uint8_t* rgbe, uint32_t* out, size_t count) {
+	size_t i = 0;
+#if defined(RGBE_SSE2)
+	const __m128i byte = _mm_set1_epi32(0xff);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i bias = _mm_set1_epi32(113);
+	for (; i + 4 <= count; i += 4) {
+		__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgbe + i * 4));
+		__m128i e = _mm_srli_epi32(p, 24);
+		// SSE2 has no per lane shift: scale by 2^-shift as a float, the truncating conversion back shifts
+		__m128i shift = _mm_sub_epi32(bias, e);
+		shift = _mm_and_si128(shift, _mm_cmpgt_epi32(shift, _mm_setzero_si128()));
+		__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(127), shift), 23));
+		__m128i r = _mm_and_si128(p, byte);
+		__m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), byte);
+		__m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), byte);
+		r = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(r, r), one)), scale));
+		g = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(g, g), one)), scale));
+		b = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(b, b), one)), scale));
+		__m128i exponent = _mm_sub_epi32(e, bias);
+		exponent = _mm_and_si128(exponent, _mm_cmpgt_epi32(exponent, _mm_setzero_si128()));
+		__m128i packed = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 9)), _mm_or_si128(_mm_slli_epi32(b, 18), _mm_slli_epi32(exponent, 27)));
+		packed = _mm_or_si128(packed, _mm_cmpgt_epi32(e, _mm_set1_epi32(144)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packed);
+	}
+#elif defined(RGBE_NEON)
+	const uint32x4_t byte = vdupq_n_u32(0xff);
+	const uint32x4_t one = vdupq_n_u32(1);
+	for (; i + 4 <= count; i += 4) {
+		uint32x4_t p = vreinterpretq_u32_u8(vld1q_u8(rgbe + i * 4));
+		uint32x4_t e = vshrq_n_u32(p, 24);
+		// Negative shifts shift right, by 32 or more they give 0
+		int32x4_t right = vnegq_s32(vreinterpretq_s32_u32(vqsubq_u32(vdupq_n_u32(113), e)));
+		uint32x4_t r = vshlq_u32(vaddq_u32(vshlq_n_u32(vandq_u32(p, byte), 1), one), right);
+		uint32x4_t g = vshlq_u32(vaddq_u32(vshlq_n_u32(vandq_u32(vshrq_n_u32(p, 8), byte), 1), one), right);
+		uint32x4_t b = vshlq_u32(vaddq_u32(vshlq_n_u32(vandq_u32(vshrq_n_u32(p, 16), byte), 1), one), right);
+		uint32x4_t exponent = vqsubq_u32(e, vdupq_n_u32(113));
+		uint32x4_t packed = vorrq_u32(vorrq_u32(r, vshlq_n_u32(g, 9)), vorrq_u32(vshlq_n_u32(b, 18), vshlq_n_u32(exponent, 27)));
+		packed = vorrq_u32(packed, vcgtq_u32(e, vdupq_n_u32(144)));
+		vst1q_u32(out + i, packed);
+	}
+#endif
+	for (; i < count; ++i) {
+		uint32_t p;
+		std::memcpy(&p, rgbe + i * 4, sizeof(p));
+		out[i] = rgbe_texel_to_e5b9g9r9(p);
+	}
+}
+
+uint16_t floatToHalf(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mantissa = x & 0x7FFFFF;
+    if(((x >> 23) & 0xFF) == 0xFF) {
+        return static_cast<uint16_t>(sign | 0x7C00 | (mantissa != 0 ? 0x200 : 0));
+    }
+    int32_t exponent = static_cast<int32_t>((x >> 23) & 0xFF) - 127 + 15;
+    if(exponent >= 31) {
+        return static_cast<uint16_t>(sign | 0x7C00);
+    }
+    if(exponent <= 0) {
+        // subnormal half
+        if(exponent < -10) {
+            return static_cast<uint16_t>(sign);
+        }
+        mantissa |= 0x800000;
+        uint32_t shift = static_cast<uint32_t>(14 - exponent);
+        uint32_t half = mantissa >> shift;
+        if((mantissa >> (shift - 1)) & 1) {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = sign | (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+    if(mantissa & 0x1000) {
+        half++; // a carry into the exponent is still the correctly rounded value
+    }
+    return static_cast<uint16_t>(half);
+}
+
+float halfToFloat(uint16_t h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1F;
+    uint32_t mantissa = h & 0x3FF;
+    uint32_t x;
+    if(exponent == 0x1F) {
+        x = sign | 0x7F800000 | (mantissa << 13);
+    } else if(exponent != 0) {
+        x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if(mantissa != 0) {
+        // subnormal half, normalized for the float
+        exponent = 127 - 15 + 1;
+        while(!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        x = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    } else {
+        x = sign;
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
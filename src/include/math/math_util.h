@@ -80,3 +80,8 @@ qua angleAxis(const float& angle, const vec3& dir);
 /* ------------------- Cubemap ------------------- */
 vec3 rgbe_to_float(u8vec4 col);
 u8vec4 float_to_rgbe(vec3 col);
+// Converts count RGBE texels to VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 (SSE2 / NEON); out may alias rgbe
+void rgbe_to_e5b9g9r9(const uint8_t* rgbe, uint32_t* out, size_t count);
+// IEEE half, rounded to nearest; out of range values become infinity
+uint16_t floatToHalf(float f);
+float halfToFloat(uint16_t h);
@@ -10,6 +10,9 @@
 #include "bbox.h"
 #include "vertex.hpp"
 #include "material.h"
+#include "mesh_simplify.h"
+#include "meshlet.h"
+#include "mesh_optimize.h"
 
 struct LoadInfo{
     std::string src;
@@ -27,7 +30,9 @@ struct Mesh {
     LoadInfo tex_info;
     LoadInfo tangent_info;
     std::vector<Vertex> vertices;
-    std::vector<uint32_t> indices;
+    std::vector<uint32_t> indices; // every LOD, each a range of indices into the same vertices
+    std::vector<MeshLod> lods; // lods[0] is the full resolution mesh
+    std::vector<Meshlet> meshlets; // clusters of lods[0], empty unless built
     Bbox bbox;
     std::shared_ptr<Material> material;
     bool simple; //if "simple" material, then only load position, normal and color
@@ -37,18 +42,22 @@ struct Mesh {
 
     void loadMesh(){
         if(simple){
-            loadMeshSimple();
+            loadVertices<attribute::Position, attribute::Normal, attribute::Color>();
         } else {
-            loadMeshNonSimple();
+            loadVertices<attribute::Position, attribute::Normal, attribute::Tangent, attribute::TexCoord, attribute::Color>();
         }
         calculateIndices();
+        lods = {{0, static_cast<uint32_t>(indices.size()), 0.0f}};
         // std::cout<<"Mesh: \n";
         // for(int i=0; i<vertices.size() && i<10; i++){
         //     std::cout<<"pos: "<<vertices[i].pos<<"normal: "<<vertices[i].normal<<", tangent: "<<vertices[i].tangent<<", texCoord: "<<vertices[i].texCoord<<"\n";
         // }
     }
 
-    void loadMeshSimple(){
+    // Reads the attributes interleaved in the position accessor's file, in the listed order.
+    // Attributes not listed keep the Vertex defaults
+    template<typename... Attributes>
+    void loadVertices(){
         std::ifstream infile(SCENE_PATH+pos_info.src, std::ifstream::binary);
         if(infile.fail()){
             throw std::runtime_error("failed to open file "+SCENE_PATH+pos_info.src);
@@ -59,98 +68,48 @@ struct Mesh {
         infile.seekg(pos_info.offset);
         
         vertices.resize(num_elements);
-        for(size_t i=0; i<num_elements; i++) {
-            Vertex& v = vertices[i];
-            float f;
-
-            // position
-            infile.read((char*)&f, sizeof(float));
-            v.pos[0] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.pos[1] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.pos[2] = f;
+        for(Vertex& v: vertices) {
+            (Attributes::read(infile, v), ...);
             bbox.enclose(v.pos);
-            //normal
-            infile.read((char*)&f, sizeof(float));
-            v.normal[0] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.normal[1] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.normal[2] = f;
-            
-            //color
-            uint8_t color;
-            infile.read((char*)&color, sizeof(uint8_t));
-            v.color[0] = static_cast<float>(color) / 255.0f;
-            infile.read((char*)&color, sizeof(uint8_t));
-            v.color[1] = static_cast<float>(color) / 255.0f;
-            infile.read((char*)&color, sizeof(uint8_t));
-            v.color[2] = static_cast<float>(color) / 255.0f;
-            infile.read((char*)&color, sizeof(uint8_t));
-            // v.color[3] = static_cast<float>(color);
-
-            v.tangent = vec4(1,0,0,1);
-            v.texCoord = vec2(0);
         }
 
         infile.close();
     }
 
-    void loadMeshNonSimple(){
-        std::ifstream infile(SCENE_PATH+pos_info.src, std::ifstream::binary);
-
-        infile.seekg(0, infile.end);
-        const size_t num_elements = infile.tellg() / pos_info.stride;
-        infile.seekg(pos_info.offset);
-        
-        vertices.resize(num_elements);
-        for(size_t i=0; i<num_elements; i++) {
-            Vertex& v = vertices[i];
-            float f;
+    // Replaces the single level with a quadric simplified LOD chain
+    void buildLods() {
+        indices.resize(lods[0].indexCount);
+        lods = buildMeshLods(vertices, indices);
+    }
 
-            // position
-            infile.read((char*)&f, sizeof(float));
-            v.pos[0] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.pos[1] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.pos[2] = f;
-            bbox.enclose(v.pos);
-            //normal
-            infile.read((char*)&f, sizeof(float));
-            v.normal[0] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.normal[1] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.normal[2] = f;
-            //tangent
-            infile.read((char*)&f, sizeof(float));
-            v.tangent[0] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.tangent[1] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.tangent[2] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.tangent[3] = f;
-            //texcoord
-            infile.read((char*)&f, sizeof(float));
-            v.texCoord[0] = f;
-            infile.read((char*)&f, sizeof(float));
-            v.texCoord[1] = f;
-            //color
-            uint8_t color;
-            infile.read((char*)&color, sizeof(uint8_t));
-            v.color[0] = static_cast<float>(color) / 255.0f;
-            infile.read((char*)&color, sizeof(uint8_t));
-            v.color[1] = static_cast<float>(color) / 255.0f;
-            infile.read((char*)&color, sizeof(uint8_t));
-            v.color[2] = static_cast<float>(color) / 255.0f;
-            infile.read((char*)&color, sizeof(uint8_t));
-            // v.color[3] = static_cast<float>(color);        
+    // Reorders the triangles of every LOD for the vertex cache, and in clusters for overdraw if asked,
+    // then renumbers the vertices in first use order. With clustered, lods[0] is split into meshlets
+    // first and each meshlet is optimized as its own range, since the meshlets are culled and drawn
+    // independently (they take the place of the overdraw clusters). before / after are measured on lods[0]
+    void optimize(bool overdraw, bool clustered, VertexCacheStats& before, VertexCacheStats& after) {
+        before = analyzeVertexCache(indices, lods[0].firstIndex, lods[0].indexCount, vertices.size());
+        if(clustered) {
+            buildMeshlets();
+        }
+        for(size_t l=0; l<lods.size(); l++) {
+            if(l == 0 && !meshlets.empty()) {
+                for(const Meshlet& meshlet: meshlets) {
+                    optimizeVertexCache(indices, meshlet.firstIndex, meshlet.indexCount, vertices.size());
+                }
+                continue;
+            }
+            optimizeVertexCache(indices, lods[l].firstIndex, lods[l].indexCount, vertices.size());
+            if(overdraw) {
+                optimizeOverdraw(vertices, indices, lods[l].firstIndex, lods[l].indexCount);
+            }
         }
+        optimizeVertexFetch(vertices, indices);
+        after = analyzeVertexCache(indices, lods[0].firstIndex, lods[0].indexCount, vertices.size());
+    }
 
-        infile.close();
+    // Reorders the triangles of lods[0] into meshlets, the other LODs are separate ranges and stay as they are
+    void buildMeshlets() {
+        meshlets = ::buildMeshlets(vertices, indices, lods[0].firstIndex, lods[0].indexCount);
     }
 
     typedef std::pair<Vertex, uint32_t> VPair;
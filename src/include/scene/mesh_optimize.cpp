@@ -0,0 +1,234 @@
+#include "mesh_optimize.h"
+#include "constants.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+// FIFO cache of vertex indices, a vertex is in the cache when it was pushed less than size pushes ago
+struct FifoCache {
+    std::vector<uint32_t> timestamps; // push count when each vertex entered, 0 for never
+    uint32_t time;
+    uint32_t size;
+
+    FifoCache(size_t vertexCount, uint32_t size_) : timestamps(vertexCount, 0), time(size_ + 1), size(size_) {}
+
+    // Returns whether v missed
+    bool access(uint32_t v) {
+        if(time - timestamps[v] > size) {
+            timestamps[v] = time++;
+            return true;
+        }
+        return false;
+    }
+
+    void clear() {
+        time += size + 1;
+    }
+};
+
+VertexCacheStats analyzeVertexCache(const std::vector<uint32_t>& indices, uint32_t firstIndex, uint32_t indexCount, size_t vertexCount, uint32_t cacheSize) {
+    VertexCacheStats stats;
+    if(indexCount < 3) {
+        return stats;
+    }
+    FifoCache cache(vertexCount, cacheSize);
+    std::vector<uint8_t> referenced(vertexCount, 0);
+    uint32_t misses = 0;
+    uint32_t unique = 0;
+    for(uint32_t i=firstIndex; i<firstIndex + indexCount; i++) {
+        uint32_t v = indices[i];
+        misses += cache.access(v);
+        if(!referenced[v]) {
+            referenced[v] = 1;
+            unique++;
+        }
+    }
+    stats.acmr = static_cast<float>(misses) / static_cast<float>(indexCount / 3);
+    stats.atvr = static_cast<float>(misses) / static_cast<float>(unique);
+    return stats;
+}
+
+void optimizeVertexCache(std::vector<uint32_t>& indices, uint32_t firstIndex, uint32_t indexCount, size_t vertexCount, uint32_t cacheSize) {
+    uint32_t triangleCount = indexCount / 3;
+    if(triangleCount == 0) {
+        return;
+    }
+    const std::vector<uint32_t> source(indices.begin() + firstIndex, indices.begin() + firstIndex + triangleCount * 3);
+
+    // Triangles around every vertex, flattened; live counts the ones not yet emitted
+    std::vector<uint32_t> vertexTriOffsets(vertexCount + 1, 0);
+    for(uint32_t index: source) {
+        vertexTriOffsets[index + 1]++;
+    }
+    for(size_t v=0; v<vertexCount; v++) {
+        vertexTriOffsets[v + 1] += vertexTriOffsets[v];
+    }
+    std::vector<uint32_t> vertexTris(source.size());
+    std::vector<uint32_t> live(vertexCount, 0);
+    for(uint32_t i=0; i<source.size(); i++) {
+        uint32_t v = source[i];
+        vertexTris[vertexTriOffsets[v] + live[v]++] = i / 3;
+    }
+
+    std::vector<uint8_t> emitted(triangleCount, 0);
+    std::vector<uint32_t> deadEnds; // recently used vertices, to resume from when a fan ends
+    std::vector<uint32_t> candidates;
+    FifoCache cache(vertexCount, cacheSize);
+    uint32_t cursor = 0; // vertices before the cursor have no live triangles
+    uint32_t output = firstIndex;
+
+    auto nextLiveVertex = [&]() -> int64_t {
+        while(!deadEnds.empty()) {
+            uint32_t v = deadEnds.back();
+            deadEnds.pop_back();
+            if(live[v] > 0) {
+                return v;
+            }
+        }
+        while(cursor < vertexCount) {
+            if(live[cursor] > 0) {
+                return cursor;
+            }
+            cursor++;
+        }
+        return -1;
+    };
+
+    int64_t fan = nextLiveVertex();
+    while(fan >= 0) {
+        candidates.clear();
+        uint32_t f = static_cast<uint32_t>(fan);
+        for(uint32_t i=vertexTriOffsets[f]; i<vertexTriOffsets[f + 1]; i++) {
+            uint32_t t = vertexTris[i];
+            if(emitted[t]) {
+                continue;
+            }
+            emitted[t] = 1;
+            for(int k=0; k<3; k++) {
+                uint32_t v = source[t * 3 + k];
+                indices[output++] = v;
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                cache.access(v);
+            }
+        }
+
+        // Next fan: the candidate that stays in the cache the longest while its remaining
+        // triangles are emitted, otherwise a dead end
+        fan = -1;
+        int64_t bestPriority = -1;
+        for(uint32_t v: candidates) {
+            if(live[v] == 0) {
+                continue;
+            }
+            int64_t priority = 0;
+            int64_t age = cache.time - cache.timestamps[v];
+            if(age + 2 * live[v] <= cacheSize) {
+                priority = age;
+            }
+            if(priority > bestPriority) {
+                bestPriority = priority;
+                fan = v;
+            }
+        }
+        if(fan < 0) {
+            fan = nextLiveVertex();
+        }
+    }
+}
+
+void optimizeOverdraw(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, uint32_t firstIndex, uint32_t indexCount, float threshold, uint32_t cacheSize) {
+    uint32_t triangleCount = indexCount / 3;
+    if(triangleCount < 2) {
+        return;
+    }
+    float targetAcmr = analyzeVertexCache(indices, firstIndex, triangleCount * 3, vertices.size(), cacheSize).acmr * threshold;
+
+    // A cluster ends once it is at least a cache's worth of triangles and, from a cold cache,
+    // no worse than the target, so drawing clusters in any order keeps the ACMR bounded
+    std::vector<uint32_t> clusterStarts;
+    FifoCache cache(vertices.size(), cacheSize);
+    uint32_t clusterTris = 0;
+    uint32_t clusterMisses = 0;
+    for(uint32_t t=0; t<triangleCount; t++) {
+        if(clusterTris == 0) {
+            clusterStarts.push_back(t);
+            cache.clear();
+        }
+        for(int k=0; k<3; k++) {
+            clusterMisses += cache.access(indices[firstIndex + t * 3 + k]);
+        }
+        clusterTris++;
+        if(clusterTris >= cacheSize && static_cast<float>(clusterMisses) <= targetAcmr * static_cast<float>(clusterTris)) {
+            clusterTris = 0;
+            clusterMisses = 0;
+        }
+    }
+    uint32_t clusterCount = static_cast<uint32_t>(clusterStarts.size());
+    clusterStarts.push_back(triangleCount);
+    if(clusterCount < 2) {
+        return;
+    }
+
+    // Area weighted centroid and normal per cluster
+    std::vector<vec3> centroids(clusterCount);
+    std::vector<vec3> normals(clusterCount);
+    std::vector<float> areas(clusterCount, 0.0f);
+    vec3 meshCentroid(0.0f, 0.0f, 0.0f);
+    float meshArea = 0.0f;
+    for(uint32_t c=0; c<clusterCount; c++) {
+        for(uint32_t t=clusterStarts[c]; t<clusterStarts[c + 1]; t++) {
+            const Vertex& a = vertices[indices[firstIndex + t * 3]];
+            const Vertex& b = vertices[indices[firstIndex + t * 3 + 1]];
+            const Vertex& d = vertices[indices[firstIndex + t * 3 + 2]];
+            vec3 n = faceNormal(a, b, d);
+            float area = std::sqrt(dot(n, n));
+            centroids[c] += (a.pos + b.pos + d.pos) * (area / 3.0f);
+            normals[c] += n;
+            areas[c] += area;
+        }
+        meshCentroid += centroids[c];
+        meshArea += areas[c];
+        if(areas[c] > 0.0f) {
+            centroids[c] = centroids[c] / areas[c];
+        }
+    }
+    if(meshArea > 0.0f) {
+        meshCentroid = meshCentroid / meshArea;
+    }
+
+    std::vector<float> keys(clusterCount);
+    for(uint32_t c=0; c<clusterCount; c++) {
+        float len = std::sqrt(dot(normals[c], normals[c]));
+        keys[c] = len > 0.0f ? dot(centroids[c] - meshCentroid, normals[c]) / len : 0.0f;
+    }
+    std::vector<uint32_t> order(clusterCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return keys[a] > keys[b];
+    });
+
+    const std::vector<uint32_t> source(indices.begin() + firstIndex, indices.begin() + firstIndex + triangleCount * 3);
+    uint32_t output = firstIndex;
+    for(uint32_t c: order) {
+        for(uint32_t i=clusterStarts[c] * 3; i<clusterStarts[c + 1] * 3; i++) {
+            indices[output++] = source[i];
+        }
+    }
+}
+
+void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+    std::vector<Vertex> reordered;
+    reordered.reserve(vertices.size());
+    for(uint32_t& index: indices) {
+        if(remap[index] == UINT32_MAX) {
+            remap[index] = static_cast<uint32_t>(reordered.size());
+            reordered.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+    vertices.swap(reordered);
+}
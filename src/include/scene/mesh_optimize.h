@@ -0,0 +1,33 @@
+//
+//  mesh_optimize.h
+//
+//  Index and vertex order optimizations: triangles are reordered for the post-transform
+//  vertex cache (Tipsify, Sander et al. 2007) and optionally in clusters for overdraw,
+//  then vertices are renumbered in the order the index buffer first uses them.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "vertex.hpp"
+
+struct VertexCacheStats {
+    float acmr = 0.0f; // cache misses per triangle, 0.5 is ideal for large regular meshes
+    float atvr = 0.0f; // cache misses per referenced vertex, 1 is ideal
+};
+
+// Simulates a FIFO vertex cache of cacheSize entries over indices[firstIndex, firstIndex + indexCount)
+VertexCacheStats analyzeVertexCache(const std::vector<uint32_t>& indices, uint32_t firstIndex, uint32_t indexCount, size_t vertexCount, uint32_t cacheSize = VERTEX_CACHE_SIZE);
+
+// Reorders the triangles of the range in fans around vertices still in a cache of cacheSize entries
+void optimizeVertexCache(std::vector<uint32_t>& indices, uint32_t firstIndex, uint32_t indexCount, size_t vertexCount, uint32_t cacheSize = VERTEX_CACHE_SIZE);
+
+// Splits the (cache optimized) range into clusters that keep their ACMR within threshold times
+// the range's, even starting from a cold cache, and draws the clusters facing away from the mesh
+// center first, as they are the likeliest to occlude the rest
+void optimizeOverdraw(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, uint32_t firstIndex, uint32_t indexCount, float threshold = OVERDRAW_ACMR_THRESHOLD, uint32_t cacheSize = VERTEX_CACHE_SIZE);
+
+// Renumbers the vertices in order of first use by indices and drops the unreferenced ones
+void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
@@ -0,0 +1,225 @@
+#include "mesh_simplify.h"
+#include "constants.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <queue>
+
+// Symmetric 4x4 matrix of the summed squared distances to a set of planes
+struct Quadric {
+    double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+    double a11 = 0, a12 = 0, a13 = 0;
+    double a22 = 0, a23 = 0;
+    double a33 = 0;
+
+    // Plane nx*x + ny*y + nz*z + d = 0 with a unit normal
+    static Quadric plane(double nx, double ny, double nz, double d, double weight) {
+        Quadric q;
+        q.a00 = weight * nx * nx; q.a01 = weight * nx * ny; q.a02 = weight * nx * nz; q.a03 = weight * nx * d;
+        q.a11 = weight * ny * ny; q.a12 = weight * ny * nz; q.a13 = weight * ny * d;
+        q.a22 = weight * nz * nz; q.a23 = weight * nz * d;
+        q.a33 = weight * d * d;
+        return q;
+    }
+
+    void add(const Quadric& q) {
+        a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+        a11 += q.a11; a12 += q.a12; a13 += q.a13;
+        a22 += q.a22; a23 += q.a23;
+        a33 += q.a33;
+    }
+
+    double eval(const vec3& p) const {
+        double x = p[0], y = p[1], z = p[2];
+        double result = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x
+                      + a11 * y * y + 2 * a12 * y * z + 2 * a13 * y
+                      + a22 * z * z + 2 * a23 * z
+                      + a33;
+        return std::max(result, 0.0);
+    }
+};
+
+struct Collapse {
+    double cost;
+    uint32_t from;
+    uint32_t to;
+    uint32_t fromVersion;
+    uint32_t toVersion;
+
+    bool operator>(const Collapse& other) const {
+        return cost > other.cost;
+    }
+};
+
+// Boundary edges get a plane perpendicular to their face with this weight, so open
+// borders only collapse along themselves
+const double BOUNDARY_WEIGHT = 4.0;
+
+static vec3 triangleNormal(const vec3& a, const vec3& b, const vec3& c) {
+    vec3 e0 = b - a;
+    vec3 e1 = c - a;
+    return vec3(e0[1] * e1[2] - e0[2] * e1[1], e0[2] * e1[0] - e0[0] * e1[2], e0[0] * e1[1] - e0[1] * e1[0]);
+}
+
+static double length(const vec3& v) {
+    return std::sqrt(double(v[0]) * v[0] + double(v[1]) * v[1] + double(v[2]) * v[2]);
+}
+
+std::vector<uint32_t> simplifyMesh(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, size_t targetIndexCount, float& error) {
+    error = 0.0f;
+    std::vector<uint32_t> tris = indices;
+    size_t triangleCount = tris.size() / 3;
+    std::vector<uint8_t> alive(triangleCount, 1);
+    std::vector<std::vector<uint32_t>> vertexTris(vertices.size());
+    std::vector<Quadric> quadrics(vertices.size());
+
+    // Face quadrics, and edge use counts to find the boundary
+    std::map<std::pair<uint32_t, uint32_t>, std::pair<uint32_t, uint32_t>> edges; // edge -> (uses, triangle)
+    for(uint32_t t=0; t<triangleCount; t++) {
+        const uint32_t* tri = &tris[t * 3];
+        vec3 n = triangleNormal(vertices[tri[0]].pos, vertices[tri[1]].pos, vertices[tri[2]].pos);
+        double len = length(n);
+        if(len > 0.0) {
+            double nx = n[0] / len, ny = n[1] / len, nz = n[2] / len;
+            const vec3& p = vertices[tri[0]].pos;
+            Quadric q = Quadric::plane(nx, ny, nz, -(nx * p[0] + ny * p[1] + nz * p[2]), 1.0);
+            for(int k=0; k<3; k++) {
+                quadrics[tri[k]].add(q);
+            }
+        }
+        for(int k=0; k<3; k++) {
+            vertexTris[tri[k]].push_back(t);
+            auto key = std::minmax(tri[k], tri[(k + 1) % 3]);
+            auto& use = edges[{key.first, key.second}];
+            use.first++;
+            use.second = t;
+        }
+    }
+    for(auto& [edge, use]: edges) {
+        if(use.first != 1) {
+            continue;
+        }
+        const uint32_t* tri = &tris[use.second * 3];
+        const vec3& a = vertices[edge.first].pos;
+        const vec3& b = vertices[edge.second].pos;
+        vec3 faceNormal = triangleNormal(vertices[tri[0]].pos, vertices[tri[1]].pos, vertices[tri[2]].pos);
+        vec3 n = triangleNormal(a, b, a + faceNormal);
+        double len = length(n);
+        if(len > 0.0) {
+            double nx = n[0] / len, ny = n[1] / len, nz = n[2] / len;
+            Quadric q = Quadric::plane(nx, ny, nz, -(nx * a[0] + ny * a[1] + nz * a[2]), BOUNDARY_WEIGHT);
+            quadrics[edge.first].add(q);
+            quadrics[edge.second].add(q);
+        }
+    }
+
+    std::vector<uint32_t> versions(vertices.size(), 0);
+    std::vector<uint8_t> removed(vertices.size(), 0);
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+    auto pushCollapse = [&](uint32_t from, uint32_t to) {
+        Quadric q = quadrics[from];
+        q.add(quadrics[to]);
+        heap.push({q.eval(vertices[to].pos), from, to, versions[from], versions[to]});
+    };
+    for(auto& [edge, use]: edges) {
+        pushCollapse(edge.first, edge.second);
+        pushCollapse(edge.second, edge.first);
+    }
+
+    while(triangleCount * 3 > targetIndexCount && !heap.empty()) {
+        Collapse collapse = heap.top();
+        heap.pop();
+        uint32_t from = collapse.from;
+        uint32_t to = collapse.to;
+        if(removed[from] || removed[to] || versions[from] != collapse.fromVersion || versions[to] != collapse.toVersion) {
+            continue;
+        }
+
+        // Moving from onto to must not flip any triangle that survives the collapse
+        bool flips = false;
+        for(uint32_t t: vertexTris[from]) {
+            uint32_t* tri = &tris[t * 3];
+            if(!alive[t] || tri[0] == to || tri[1] == to || tri[2] == to) {
+                continue;
+            }
+            vec3 before = triangleNormal(vertices[tri[0]].pos, vertices[tri[1]].pos, vertices[tri[2]].pos);
+            vec3 p[3];
+            for(int k=0; k<3; k++) {
+                p[k] = vertices[tri[k] == from ? to : tri[k]].pos;
+            }
+            vec3 after = triangleNormal(p[0], p[1], p[2]);
+            if(double(before[0]) * after[0] + double(before[1]) * after[1] + double(before[2]) * after[2] <= 0.0) {
+                flips = true;
+                break;
+            }
+        }
+        if(flips) {
+            continue;
+        }
+
+        for(uint32_t t: vertexTris[from]) {
+            uint32_t* tri = &tris[t * 3];
+            if(!alive[t]) {
+                continue;
+            }
+            if(tri[0] == to || tri[1] == to || tri[2] == to) {
+                alive[t] = 0;
+                triangleCount--;
+                continue;
+            }
+            for(int k=0; k<3; k++) {
+                if(tri[k] == from) {
+                    tri[k] = to;
+                }
+            }
+            vertexTris[to].push_back(t);
+        }
+        vertexTris[from].clear();
+        removed[from] = 1;
+        quadrics[to].add(quadrics[from]);
+        versions[to]++;
+        error = std::max(error, static_cast<float>(std::sqrt(collapse.cost)));
+
+        // Drop dead triangles and requeue the edges around to with its new quadric
+        auto& toTris = vertexTris[to];
+        toTris.erase(std::remove_if(toTris.begin(), toTris.end(), [&alive](uint32_t t) { return !alive[t]; }), toTris.end());
+        for(uint32_t t: toTris) {
+            for(int k=0; k<3; k++) {
+                uint32_t other = tris[t * 3 + k];
+                if(other != to) {
+                    pushCollapse(other, to);
+                    pushCollapse(to, other);
+                }
+            }
+        }
+    }
+
+    std::vector<uint32_t> result;
+    result.reserve(triangleCount * 3);
+    for(size_t t=0; t<alive.size(); t++) {
+        if(alive[t]) {
+            result.insert(result.end(), tris.begin() + t * 3, tris.begin() + t * 3 + 3);
+        }
+    }
+    return result;
+}
+
+std::vector<MeshLod> buildMeshLods(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+    std::vector<MeshLod> lods = {{0, static_cast<uint32_t>(indices.size()), 0.0f}};
+    while(lods.size() < MAX_MESH_LODS && lods.back().indexCount / 3 >= MIN_LOD_TRIANGLES * 2) {
+        const MeshLod& previous = lods.back();
+        std::vector<uint32_t> source(indices.begin() + previous.firstIndex, indices.begin() + previous.firstIndex + previous.indexCount);
+        float error;
+        std::vector<uint32_t> simplified = simplifyMesh(vertices, source, previous.indexCount / 6 * 3, error);
+        // Stop once the collapses left are the ones that would flip triangles
+        if(simplified.empty() || simplified.size() > previous.indexCount * 3 / 4) {
+            break;
+        }
+        // Each level is simplified from the previous one, so the errors add up
+        MeshLod lod = {static_cast<uint32_t>(indices.size()), static_cast<uint32_t>(simplified.size()), previous.error + error};
+        indices.insert(indices.end(), simplified.begin(), simplified.end());
+        lods.push_back(lod);
+    }
+    return lods;
+}
@@ -0,0 +1,29 @@
+//
+//  mesh_simplify.h
+//
+//  Quadric error metric simplification (Garland & Heckbert) used to build mesh LOD chains.
+//  Vertices collapse onto one of their neighbours, so every LOD keeps indexing the
+//  original vertex buffer and only adds indices.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "vertex.hpp"
+
+struct MeshLod {
+    uint32_t firstIndex = 0;
+    uint32_t indexCount = 0;
+    float error = 0.0f; // object space distance to the full resolution surface, 0 for LOD 0
+};
+
+// Collapses edges in order of quadric error until at most targetIndexCount indices are left,
+// or no collapse is possible without flipping a triangle. Returns the new index list and
+// sets error to the largest collapse error (as a distance)
+std::vector<uint32_t> simplifyMesh(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, size_t targetIndexCount, float& error);
+
+// Appends LODs to indices, each with about half the triangles of the previous one,
+// until MAX_MESH_LODS or MIN_LOD_TRIANGLES is reached. The first entry is the input mesh
+std::vector<MeshLod> buildMeshLods(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
@@ -0,0 +1,174 @@
+#include "meshlet.h"
+#include "constants.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// Normal cones whose face normals spread further than this (cosine) are never culled
+const float MESHLET_CONE_MIN_COS = 0.1f;
+
+// Bounding sphere around the AABB center and normal cone of the triangles tris[0, count)
+static void computeBounds(const std::vector<Vertex>& vertices, const uint32_t* tris, uint32_t count, Meshlet& meshlet) {
+    vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+    vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for(uint32_t i=0; i<count * 3; i++) {
+        const vec3& p = vertices[tris[i]].pos;
+        for(int k=0; k<3; k++) {
+            min[k] = std::min(min[k], p[k]);
+            max[k] = std::max(max[k], p[k]);
+        }
+    }
+    vec3 center = (min + max) * 0.5f;
+    float radius = 0.0f;
+    for(uint32_t i=0; i<count * 3; i++) {
+        vec3 d = vertices[tris[i]].pos - center;
+        radius = std::max(radius, dot(d, d));
+    }
+    meshlet.sphere = vec4(center[0], center[1], center[2], std::sqrt(radius));
+
+    std::vector<vec3> normals;
+    vec3 axis(0.0f, 0.0f, 0.0f);
+    for(uint32_t t=0; t<count; t++) {
+        vec3 n = faceNormal(vertices[tris[t * 3]], vertices[tris[t * 3 + 1]], vertices[tris[t * 3 + 2]]);
+        float len = std::sqrt(dot(n, n));
+        if(len <= 0.0f) {
+            continue; // degenerate, faces nowhere
+        }
+        n = n / len;
+        normals.push_back(n);
+        axis += n;
+    }
+    float axisLen = std::sqrt(dot(axis, axis));
+    if(normals.empty() || axisLen <= 0.0f) {
+        meshlet.cone = vec4(0.0f, 0.0f, 1.0f, 1.0f);
+        return;
+    }
+    axis = axis / axisLen;
+    float minCos = 1.0f;
+    for(const vec3& n: normals) {
+        minCos = std::min(minCos, dot(n, axis));
+    }
+    float cutoff = minCos <= MESHLET_CONE_MIN_COS ? 1.0f : std::sqrt(1.0f - minCos * minCos);
+    meshlet.cone = vec4(axis[0], axis[1], axis[2], cutoff);
+}
+
+std::vector<Meshlet> buildMeshlets(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, uint32_t firstIndex, uint32_t indexCount) {
+    uint32_t triangleCount = indexCount / 3;
+    const std::vector<uint32_t> source(indices.begin() + firstIndex, indices.begin() + firstIndex + triangleCount * 3);
+
+    // Triangles around every vertex, flattened
+    std::vector<uint32_t> vertexTriOffsets(vertices.size() + 1, 0);
+    for(uint32_t index: source) {
+        vertexTriOffsets[index + 1]++;
+    }
+    for(size_t v=0; v<vertices.size(); v++) {
+        vertexTriOffsets[v + 1] += vertexTriOffsets[v];
+    }
+    std::vector<uint32_t> vertexTris(source.size());
+    std::vector<uint32_t> fill(vertexTriOffsets.begin(), vertexTriOffsets.end() - 1);
+    for(uint32_t i=0; i<source.size(); i++) {
+        vertexTris[fill[source[i]]++] = i / 3;
+    }
+
+    std::vector<Meshlet> meshlets;
+    std::vector<uint8_t> emitted(triangleCount, 0);
+    // Meshlet that last used a vertex / considered a triangle, to test membership without clearing
+    std::vector<uint32_t> vertexMeshlet(vertices.size(), UINT32_MAX);
+    std::vector<uint32_t> candidateMeshlet(triangleCount, UINT32_MAX);
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> meshletTris;
+    uint32_t vertexCount = 0;
+    uint32_t seed = 0; // triangles before seed are all emitted
+    uint32_t output = firstIndex;
+
+    auto finish = [&]() {
+        Meshlet meshlet = {};
+        meshlet.firstIndex = output;
+        meshlet.indexCount = static_cast<uint32_t>(meshletTris.size() * 3);
+        meshlet.vertexCount = vertexCount;
+        // Keep the input order inside the meshlet, which may already be cache optimized
+        std::sort(meshletTris.begin(), meshletTris.end());
+        for(uint32_t t: meshletTris) {
+            indices[output++] = source[t * 3];
+            indices[output++] = source[t * 3 + 1];
+            indices[output++] = source[t * 3 + 2];
+        }
+        computeBounds(vertices, &indices[meshlet.firstIndex], static_cast<uint32_t>(meshletTris.size()), meshlet);
+        meshlets.push_back(meshlet);
+        meshletTris.clear();
+        candidates.clear();
+        vertexCount = 0;
+    };
+
+    auto add = [&](uint32_t t) {
+        uint32_t id = static_cast<uint32_t>(meshlets.size());
+        emitted[t] = 1;
+        meshletTris.push_back(t);
+        for(int k=0; k<3; k++) {
+            uint32_t v = source[t * 3 + k];
+            if(vertexMeshlet[v] != id) {
+                vertexMeshlet[v] = id;
+                vertexCount++;
+            }
+            for(uint32_t i=vertexTriOffsets[v]; i<vertexTriOffsets[v + 1]; i++) {
+                uint32_t neighbour = vertexTris[i];
+                if(!emitted[neighbour] && candidateMeshlet[neighbour] != id) {
+                    candidateMeshlet[neighbour] = id;
+                    candidates.push_back(neighbour);
+                }
+            }
+        }
+    };
+
+    uint32_t remaining = triangleCount;
+    while(remaining > 0) {
+        uint32_t id = static_cast<uint32_t>(meshlets.size());
+        if(meshletTris.empty()) {
+            while(emitted[seed]) {
+                seed++;
+            }
+            add(seed);
+            remaining--;
+            continue;
+        }
+
+        // Neighbour adding the fewest new vertices, ties go to the earliest one found
+        uint32_t best = UINT32_MAX;
+        uint32_t bestNew = 4;
+        for(size_t c=0; c<candidates.size();) {
+            uint32_t t = candidates[c];
+            if(emitted[t]) {
+                candidates[c] = candidates.back();
+                candidates.pop_back();
+                continue;
+            }
+            uint32_t newVertices = 0;
+            for(int k=0; k<3; k++) {
+                newVertices += vertexMeshlet[source[t * 3 + k]] != id;
+            }
+            if(newVertices < bestNew) {
+                best = t;
+                bestNew = newVertices;
+                if(newVertices == 0) {
+                    break;
+                }
+            }
+            c++;
+        }
+
+        if(best == UINT32_MAX || vertexCount + bestNew > MESHLET_MAX_VERTICES) {
+            finish();
+            continue;
+        }
+        add(best);
+        remaining--;
+        if(meshletTris.size() == MESHLET_MAX_TRIANGLES) {
+            finish();
+        }
+    }
+    if(!meshletTris.empty()) {
+        finish();
+    }
+    return meshlets;
+}
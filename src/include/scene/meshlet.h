@@ -0,0 +1,34 @@
+//
+//  meshlet.h
+//
+//  Splits a mesh into small clusters of triangles (meshlets) with a bounding sphere and
+//  a normal cone each, so that off-screen and back-facing parts of a mesh can be culled
+//  on the GPU. Meshlets are contiguous ranges of the mesh's index buffer.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "mathlib.h"
+#include "vertex.hpp"
+
+// Same layout as Meshlet in cluster_cull.shader.comp (std430)
+struct Meshlet {
+    alignas(16) vec4 sphere; // object space center (xyz) and radius (w)
+    // Average face normal (xyz) and the sine of the largest angle between it and a face normal (w).
+    // The meshlet is back-facing from every eye with dot(center - eye, axis) >= w * |center - eye| + radius,
+    // w is 1 when the normals spread too far for the test to ever pass
+    alignas(16) vec4 cone;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    uint32_t vertexCount; // distinct vertices referenced
+    uint32_t pad = 0;
+};
+
+// Greedily grows meshlets of at most MESHLET_MAX_VERTICES vertices and MESHLET_MAX_TRIANGLES
+// triangles, preferring triangles that share the most vertices with the current meshlet.
+// Reorders the triangles of indices[firstIndex, firstIndex + indexCount) so each meshlet is one range,
+// triangles keep their input order within a meshlet
+std::vector<Meshlet> buildMeshlets(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, uint32_t firstIndex, uint32_t indexCount);
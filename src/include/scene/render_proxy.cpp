@@ -0,0 +1,144 @@
+#include "render_proxy.h"
+#include "math_util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+uint32_t RenderProxyTable::addMesh(const Bbox& bounds, const std::vector<float>& lodErrors_, const mat4& dequantization) {
+    meshBounds.push_back(bounds);
+    meshDequantization.push_back(dequantization);
+    meshFirstLod.push_back(static_cast<uint32_t>(lodErrors.size()));
+    meshLodCount.push_back(static_cast<uint8_t>(lodErrors_.size()));
+    lodErrors.insert(lodErrors.end(), lodErrors_.begin(), lodErrors_.end());
+    return static_cast<uint32_t>(meshBounds.size() - 1);
+}
+
+uint32_t RenderProxyTable::addTransform(const Transform* node) {
+    transforms.push_back(node);
+    transformModels.emplace_back();
+    return static_cast<uint32_t>(transforms.size() - 1);
+}
+
+uint32_t RenderProxyTable::add(uint32_t mesh_, uint32_t material_, uint32_t transform_, uint8_t flags_, uint32_t bindlessMaterial) {
+    uint32_t index = static_cast<uint32_t>(size());
+    mesh.push_back(mesh_);
+    material.push_back(material_);
+    transform.push_back(transform_);
+    flags.push_back(flags_);
+
+    worldBounds.emplace_back();
+    scales.push_back(1.0f);
+    instances.emplace_back();
+    instances.back().material = bindlessMaterial;
+    versions.push_back(0);
+    models.emplace_back();
+    return index;
+}
+
+void RenderProxyTable::finalize() {
+    gbuffer.clear();
+    std::vector<DrawItem> shadowItems;
+    for(uint32_t i=0; i<size(); i++) {
+        if(flags[i] & GBUFFER) {
+            gbuffer.push_back(i);
+        }
+        if(flags[i] & CASTS_SHADOW) {
+            shadowItems.push_back({RenderKey::depthOnly(mesh[i]), i});
+        }
+    }
+    // Shadow maps draw every caster with one pipeline and no material, so only the mesh is
+    // in the key and the order never changes
+    radixSort(shadowItems, scratch);
+    shadowCasters.clear();
+    for(const DrawItem& item: shadowItems) {
+        shadowCasters.push_back(item.index);
+    }
+}
+
+// Bounds of the transformed box, from the box center and the absolute matrix applied to its extent
+static Bbox transformBounds(const mat4& m, const Bbox& bounds) {
+    Bbox result;
+    for(int r=0; r<3; r++) {
+        float center = m[3][r];
+        float extent = 0.0f;
+        for(int c=0; c<3; c++) {
+            center += m[c][r] * (bounds.min[c] + bounds.max[c]) * 0.5f;
+            extent += std::abs(m[c][r]) * (bounds.max[c] - bounds.min[c]) * 0.5f;
+        }
+        result.min[r] = center - extent;
+        result.max[r] = center + extent;
+    }
+    return result;
+}
+
+void RenderProxyTable::update() {
+    for(size_t t=0; t<transforms.size(); t++) {
+        transformModels[t] = transforms[t]->model();
+    }
+    changed.clear();
+    for(size_t i=0; i<size(); i++) {
+        const mat4& model = transformModels[transform[i]];
+        if(versions[i] != 0 && memcmp(&model, &models[i], sizeof(mat4)) == 0) {
+            continue;
+        }
+        models[i] = model;
+        // Bounds and scale stay in object space, only the shaders see vertex positions
+        mat4 instanceModel = model * meshDequantization[mesh[i]];
+        instances[i].setModel(instanceModel);
+        instances[i].setNormal(mat4::transpose(inverse(instanceModel)));
+        worldBounds[i] = transformBounds(model, meshBounds[mesh[i]]);
+        float scale = 0.0f;
+        for(int c=0; c<3; c++) {
+            scale = std::max(scale, std::sqrt(model[c][0] * model[c][0] + model[c][1] * model[c][1] + model[c][2] * model[c][2]));
+        }
+        scales[i] = scale;
+        versions[i]++;
+        changed.push_back(static_cast<uint32_t>(i));
+    }
+}
+
+void RenderProxyTable::buildGBufferQueue(const mat4& VP, const mat4& view, bool frustumCulling, std::vector<uint32_t>& queue) {
+    items.clear();
+    for(uint32_t i: gbuffer) {
+        const Bbox& bounds = worldBounds[i];
+        if(frustumCulling && !frustum_cull_test(VP, bounds)) {
+            continue;
+        }
+        // Front to back by the view depth of the bounds center
+        vec4 center = vec4((bounds.min[0] + bounds.max[0]) * 0.5f, (bounds.min[1] + bounds.max[1]) * 0.5f, (bounds.min[2] + bounds.max[2]) * 0.5f, 1.0f);
+        float depth = -(view * center)[2];
+        items.push_back({RenderKey::opaque((flags[i] & DISPLACEMENT) ? 0 : 1,
+                                           RenderKey::quantizeDepth(depth),
+                                           (flags[i] & BINDLESS) ? 0 : material[i] + 1,
+                                           mesh[i]),
+                         i});
+    }
+    radixSort(items, scratch);
+    queue.clear();
+    for(const DrawItem& item: items) {
+        queue.push_back(item.index);
+    }
+}
+
+void RenderProxyTable::selectLods(const std::vector<uint32_t>& queue, const vec3& eye, float pixelsPerUnit, float maxPixelError, std::vector<uint8_t>& lods) const {
+    lods.resize(queue.size());
+    for(size_t q=0; q<queue.size(); q++) {
+        uint32_t i = queue[q];
+        // Distance to the closest point of the world bounds, so the error is never underestimated
+        const Bbox& bounds = worldBounds[i];
+        float distance2 = 0.0f;
+        for(int k=0; k<3; k++) {
+            float d = std::max(std::max(bounds.min[k] - eye[k], eye[k] - bounds.max[k]), 0.0f);
+            distance2 += d * d;
+        }
+        // Largest error that still projects to maxPixelError pixels at this distance
+        float maxError = maxPixelError * std::sqrt(distance2) / (pixelsPerUnit * scales[i]);
+        uint32_t m = mesh[i];
+        uint8_t lod = 0;
+        while(lod + 1 < meshLodCount[m] && lodErrors[meshFirstLod[m] + lod + 1] <= maxError) {
+            lod++;
+        }
+        lods[q] = lod;
+    }
+}
@@ -0,0 +1,86 @@
+//
+//  render_proxy.h
+//
+//  Flat table of everything the viewer draws, one row per scene node instancing a mesh.
+//  Rows are stored as parallel arrays and iterated by index; the row is also the
+//  proxy's index into the instance buffer. Passes draw from index lists (views).
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "mathlib.h"
+#include "bbox.h"
+#include "transform.h"
+#include "vertex.hpp"
+#include "render_queue.h"
+
+struct RenderProxyTable {
+    enum Flags : uint8_t {
+        CASTS_SHADOW = 1 << 0,
+        GBUFFER = 1 << 1, // pbr and lambertian, drawn in the gbuffer pass
+        DISPLACEMENT = 1 << 2, // needs the gbuffer variant with parallax occlusion mapping
+        BINDLESS = 1 << 3, // material is read from the bindless material buffer
+    };
+
+    // Per proxy, written at load
+    std::vector<uint32_t> mesh; // into the viewer's mesh table and meshBounds
+    std::vector<uint32_t> material; // into the viewer's material table
+    std::vector<uint32_t> transform; // into transforms
+    std::vector<uint8_t> flags;
+
+    // Shared by proxies: scene graph nodes (owned by the scene), object space mesh bounds,
+    // the matrix from the mesh's vertex positions to object space (quantized vertices)
+    // and the object space error of each mesh LOD (lodErrors[meshFirstLod[m] + l])
+    std::vector<const Transform*> transforms;
+    std::vector<Bbox> meshBounds;
+    std::vector<mat4> meshDequantization;
+    std::vector<uint32_t> meshFirstLod;
+    std::vector<uint8_t> meshLodCount;
+    std::vector<float> lodErrors;
+
+    // Per proxy, written by update(). Versions start at 0, so every row is written by the
+    // first update(), and are bumped whenever the model matrix changes
+    std::vector<Bbox> worldBounds;
+    std::vector<float> scales; // largest axis scale of the model matrix, turns LOD errors into world space
+    std::vector<InstanceData> instances;
+    std::vector<uint32_t> versions;
+    std::vector<uint32_t> changed; // rows whose instance data the last update() rewrote
+
+    // Pass views
+    std::vector<uint32_t> gbuffer; // rows with GBUFFER set
+    std::vector<uint32_t> shadowCasters; // rows with CASTS_SHADOW set, sorted by mesh
+
+    size_t size() const {
+        return mesh.size();
+    }
+
+    uint32_t addMesh(const Bbox& bounds, const std::vector<float>& lodErrors_ = {0.0f}, const mat4& dequantization = mat4::I);
+    uint32_t addTransform(const Transform* node);
+    // bindlessMaterial is written to the instance data, the shader's index into the material buffer
+    uint32_t add(uint32_t mesh_, uint32_t material_, uint32_t transform_, uint8_t flags_, uint32_t bindlessMaterial = 0);
+
+    // Sorts the static views once all proxies are added
+    void finalize();
+
+    // Simulation thread, every frame: evaluate the transforms, then refresh the instance
+    // data and world bounds of the proxies whose model matrix changed and list them in changed
+    void update();
+
+    // Simulation thread, every frame: frustum cull the gbuffer view against VP and write
+    // the visible rows to queue in render key order (pipeline variant, depth bucket, material, mesh, depth)
+    void buildGBufferQueue(const mat4& VP, const mat4& view, bool frustumCulling, std::vector<uint32_t>& queue);
+
+    // Simulation thread, per pass: for every row in queue, the coarsest LOD whose error seen
+    // from eye stays within maxPixelError. pixelsPerUnit is the size in pixels of one unit
+    // at distance one (proj[1][1] * viewport height / 2)
+    void selectLods(const std::vector<uint32_t>& queue, const vec3& eye, float pixelsPerUnit, float maxPixelError, std::vector<uint8_t>& lods) const;
+
+private:
+    std::vector<mat4> transformModels; // per transform, evaluated by update()
+    std::vector<mat4> models; // per proxy, last model matrix written to instances
+    std::vector<DrawItem> items;
+    std::vector<DrawItem> scratch;
+};
@@ -0,0 +1,80 @@
+#include "bake_manifest.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+static const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for(size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t hashString(const std::string& text, uint64_t hash) {
+    return hashBytes(text.data(), text.size(), hash);
+}
+
+bool hashFiles(const std::vector<std::string>& paths, uint64_t& hash) {
+    hash = FNV_OFFSET_BASIS;
+    std::vector<char> chunk(1 << 16);
+    for(const std::string& path: paths) {
+        std::ifstream file(path, std::ios::binary);
+        if(!file.is_open()) {
+            return false;
+        }
+        uint64_t length = 0;
+        while(file) {
+            file.read(chunk.data(), chunk.size());
+            hash = hashBytes(chunk.data(), static_cast<size_t>(file.gcount()), hash);
+            length += static_cast<uint64_t>(file.gcount());
+        }
+        // Each file ends with its length, so moving bytes between files changes the hash but
+        // the same contents under another path (a moved environment) do not
+        hash = hashBytes(&length, sizeof(length), hash);
+    }
+    return true;
+}
+
+std::string bakeManifestPath(const std::string& environment_path) {
+    return environment_path.substr(0, environment_path.find_last_of('.'))+".bake";
+}
+
+BakeManifest readBakeManifest(const std::string& path) {
+    BakeManifest manifest;
+    std::ifstream file(path);
+    if(!file.is_open()) {
+        return manifest;
+    }
+    std::string line;
+    while(std::getline(file, line)) {
+        if(line.empty()) {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string product;
+        BakeRecord record;
+        if(!(fields>>product>>std::hex>>record.inputs>>record.outputs)) {
+            throw std::runtime_error("malformed bake manifest "+path+": "+line);
+        }
+        manifest[product] = record;
+    }
+    return manifest;
+}
+
+void writeBakeManifest(const std::string& path, const BakeManifest& manifest) {
+    std::ofstream file(path);
+    if(!file.is_open()) {
+        throw std::runtime_error("failed to open "+path+" for writing");
+    }
+    file<<std::hex;
+    for(const auto& [product, record]: manifest) {
+        file<<product<<" "<<record.inputs<<" "<<record.outputs<<"\n";
+    }
+    if(!file) {
+        throw std::runtime_error("failed to write "+path);
+    }
+}
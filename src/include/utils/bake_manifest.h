@@ -0,0 +1,36 @@
+//
+//  bake_manifest.h
+//
+//  Record of what bin/cube --all baked for an environment ([name].bake, one text line per
+//  product: its name, a hash of everything the product is computed from and a hash of the
+//  files it wrote). A product whose inputs hash the same and whose outputs are still the
+//  files it wrote is skipped on the next run. Hashes are 64 bit FNV-1a.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+
+struct BakeRecord {
+    uint64_t inputs = 0;
+    uint64_t outputs = 0;
+};
+
+using BakeManifest = std::map<std::string, BakeRecord>;
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS);
+uint64_t hashString(const std::string& text, uint64_t hash = FNV_OFFSET_BASIS);
+// Hashes the contents of the files one after the other, each followed by its length (paths are
+// not hashed), false if one of them cannot be read
+bool hashFiles(const std::vector<std::string>& paths, uint64_t& hash);
+
+// [name].bake next to [name].png
+std::string bakeManifestPath(const std::string& environment_path);
+// Empty if the file does not exist; throws std::runtime_error on a malformed one
+BakeManifest readBakeManifest(const std::string& path);
+void writeBakeManifest(const std::string& path, const BakeManifest& manifest);
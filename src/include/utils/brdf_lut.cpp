@@ -0,0 +1,62 @@
+#include "brdf_lut.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+static const char BRDF_LUT_MAGIC[4] = {'B', 'L', 'U', 'T'};
+// Magic, then version, width, height, vkFormat and samples as little endian uint32
+static const size_t BRDF_LUT_HEADER_SIZE = 24;
+
+BrdfLut readBrdfLut(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if(!file.is_open()) {
+        throw std::runtime_error("failed to open BRDF LUT: "+path);
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if(data.size() < BRDF_LUT_HEADER_SIZE || std::memcmp(data.data(), BRDF_LUT_MAGIC, sizeof(BRDF_LUT_MAGIC)) != 0) {
+        throw std::runtime_error("not a BRDF LUT: "+path);
+    }
+    uint32_t header[5];
+    std::memcpy(header, data.data() + sizeof(BRDF_LUT_MAGIC), sizeof(header));
+    if(header[0] != BRDF_LUT_VERSION) {
+        throw std::runtime_error("BRDF LUT version "+std::to_string(header[0])+" is not supported, regenerate "+path+" with bin/cube --lut");
+    }
+    BrdfLut lut;
+    lut.width = header[1];
+    lut.height = header[2];
+    lut.vkFormat = header[3];
+    lut.samples = header[4];
+    if(lut.vkFormat != BRDF_LUT_FORMAT_RG16F) {
+        throw std::runtime_error("BRDF LUT format "+std::to_string(lut.vkFormat)+" is not supported: "+path);
+    }
+    size_t count = static_cast<size_t>(lut.width) * lut.height * 2;
+    if(lut.width == 0 || lut.height == 0 || data.size() != BRDF_LUT_HEADER_SIZE + count * sizeof(uint16_t)) {
+        throw std::runtime_error("BRDF LUT is truncated: "+path);
+    }
+    lut.texels.resize(count);
+    std::memcpy(lut.texels.data(), data.data() + BRDF_LUT_HEADER_SIZE, count * sizeof(uint16_t));
+    return lut;
+}
+
+void writeBrdfLut(const std::string& path, const BrdfLut& lut) {
+    if(lut.texels.size() != static_cast<size_t>(lut.width) * lut.height * 2) {
+        throw std::runtime_error("BRDF LUT texel count does not match its size");
+    }
+    std::ofstream file(path, std::ios::binary);
+    if(!file.is_open()) {
+        throw std::runtime_error("failed to open "+path+" for writing");
+    }
+    uint32_t header[5] = {BRDF_LUT_VERSION, lut.width, lut.height, lut.vkFormat, lut.samples};
+    file.write(BRDF_LUT_MAGIC, sizeof(BRDF_LUT_MAGIC));
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(lut.texels.data()), lut.texels.size() * sizeof(uint16_t));
+    if(!file) {
+        throw std::runtime_error("failed to write "+path);
+    }
+}
+
+std::string brdfLutPath(const std::string& environment_path) {
+    return environment_path.substr(0, environment_path.find_last_of('.'))+".lut.bin";
+}
@@ -0,0 +1,32 @@
+//
+//  brdf_lut.h
+//
+//  Binary split sum BRDF table: a header (magic, version, size, VkFormat and the sample count
+//  it was integrated with) followed by width * height RG16F texels. Row t holds roughness
+//  (t + 0.5) / height and column s NdotV (s + 0.5) / width, red is the scale and green the
+//  bias to F0. Written by bin/cube --lut, read by the viewer.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+const uint32_t BRDF_LUT_VERSION = 1;
+const uint32_t BRDF_LUT_FORMAT_RG16F = 83; // VK_FORMAT_R16G16_SFLOAT
+
+struct BrdfLut {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t vkFormat = BRDF_LUT_FORMAT_RG16F;
+    uint32_t samples = 0;
+    std::vector<uint16_t> texels; // two halves per texel, rows from roughness 0 up
+};
+
+// Both throw std::runtime_error on failure, including a file of another version or format
+BrdfLut readBrdfLut(const std::string& path);
+void writeBrdfLut(const std::string& path, const BrdfLut& lut);
+
+// The table the viewer looks for next to an environment map ([name].lut.bin)
+std::string brdfLutPath(const std::string& environment_path);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 // Define arguments
@@ -13,11 +14,25 @@ const std::string HEADLESS = "--headless";
 // const std::string ANIMATION_LOOP = "--animation-loop";
 const std::string ANIMATION_NO_LOOP = "--animation-no-loop";
 const std::string MEASURE = "--measure";
+const std::string SSAO_TEMPORAL = "--ssao-temporal";
+const std::string NO_SSAO = "--no-ssao";
+const std::string FRAMES_IN_FLIGHT = "--frames-in-flight";
+const std::string STARTUP_REPORT = "--startup-report";
+const std::string BINDLESS = "--bindless";
+const std::string LOD = "--lod";
+const std::string CLUSTER_CULLING = "--cluster-culling";
+const std::string PACKED_VERTICES = "--packed-vertices";
+const std::string OPTIMIZE_MESHES = "--optimize-meshes";
+const std::string CACHE_ENVIRONMENT = "--cache-environment";
 
 // culling mode
 const std::string CULLING_NONE = "None";
 const std::string CULLING_FRUSTUM = "Frustum";
 
+// mesh optimization mode
+const std::string MESH_OPTIMIZE_CACHE = "cache";
+const std::string MESH_OPTIMIZE_OVERDRAW = "overdraw";
+
 // animation chanels
 const std::string CHANEL_TRANSLATION = "translation"; //3d
 const std::string CHANEL_ROTATION = "rotation"; //4d
@@ -40,6 +55,8 @@ const int MAX_FRAME_COUNT = 800;
 
 // Shader paths
 const std::string SHADER_PATH = "./src/shaders/bin/";
+// Pipeline cache, reused across runs on the same device and driver
+const std::string PIPELINE_CACHE_PATH = "./pipeline_cache.bin";
 
 const std::string SIMPLE_VSHADER = SHADER_PATH+"simple.vert.spv";
 const std::string SIMPLE_FSHADER = SHADER_PATH+"simple.frag.spv";
@@ -72,6 +89,7 @@ const std::string DEFERRED_FSHADER = SHADER_PATH+"deferred.frag.spv";
 
 const std::string GBUFFER_VSHADER = SHADER_PATH+"gbuffer.vert.spv";
 const std::string GBUFFER_FSHADER = SHADER_PATH+"gbuffer.frag.spv";
+const std::string GBUFFER_BINDLESS_FSHADER = SHADER_PATH+"gbuffer.bindless.frag.spv";
 
 const std::string SSAO_VSHADER = SHADER_PATH+"ssao.vert.spv";
 const std::string SSAO_FSHADER = SHADER_PATH+"ssao.frag.spv";
@@ -79,18 +97,87 @@ const std::string SSAO_FSHADER = SHADER_PATH+"ssao.frag.spv";
 const std::string SSAO_BLUR_VSHADER = SHADER_PATH+"ssao.blur.vert.spv";
 const std::string SSAO_BLUR_FSHADER = SHADER_PATH+"ssao.blur.frag.spv";
 
+const std::string CLUSTER_CULL_CSHADER = SHADER_PATH+"cluster_cull.comp.spv";
+const std::string BRDF_LUT_CSHADER = SHADER_PATH+"brdf_lut.comp.spv";
+const std::string ENV_PREFILTER_CSHADER = SHADER_PATH+"env_prefilter.comp.spv";
+
 const int MAX_DESCRIPTOR_COUNT = 6; //maximum number of texture sampler descriptor
 
 // Cube arguments
 const std::string LAMBERTIAN = "--lambertian";
+const std::string SH = "--sh";
 const std::string GGX = "--ggx";
+const std::string GGX_REFERENCE = "--ggx-reference";
+const std::string GGX_COMPARE = "--ggx-compare";
 const std::string LUT = "--lut";
+const std::string THREADS = "--threads";
+const std::string MEM_BUDGET = "--mem-budget";
+const std::string ALL = "--all";
+
+// Compress arguments (GGX is shared with cube)
+const std::string ALBEDO = "--albedo";
+const std::string NORMAL = "--normal";
+const std::string ROUGHNESS = "--roughness";
+const std::string METALNESS = "--metalness";
+const std::string DISPLACEMENT = "--displacement";
+const std::string CUBE = "--cube";
 
 const int ENVIRONMENT_MIP_LEVEL = 5;
+// Face size of the lambertian cube and its samples per texel, face size of GGX mip 0
+const uint32_t LAMBERTIAN_SIZE = 256;
+const uint32_t LAMBERTIAN_SAMPLES = 1048576;
+const uint32_t GGX_SIZE = 512;
+// GGX samples per texel with filtered importance sampling (--ggx) and for the brute force reference
+const uint32_t GGX_FILTERED_SAMPLES = 512;
+const uint32_t GGX_REFERENCE_SAMPLES = 1048576/4;
+// Split sum BRDF table, written by cube --lut or generated by the viewer when the file is missing
+const uint32_t BRDF_LUT_SIZE = 512;
+const uint32_t BRDF_LUT_SAMPLES = 1024;
+// Workgroup size of brdf_lut.shader.comp in each dimension (specialization constants)
+const uint32_t BRDF_LUT_GROUP_SIZE = 8;
+// Cubes the viewer prefilters with env_prefilter.shader.comp when their files are missing: face size
+// and samples per texel of the lambertian cube (GGX uses GGX_SIZE, at most the environment's face size,
+// and GGX_FILTERED_SAMPLES), the largest face size of the float copy of the environment they sample,
+// and the workgroup size in each dimension (specialization constants)
+const uint32_t PREFILTER_LAMBERTIAN_SIZE = 64;
+const uint32_t PREFILTER_LAMBERTIAN_SAMPLES = 1024;
+const uint32_t PREFILTER_SOURCE_MAX_SIZE = 2 * GGX_SIZE;
+const uint32_t ENV_PREFILTER_GROUP_SIZE = 8;
 
 // Light
 const int MAX_LIGHT_COUNT = 10;
 
+// Bindless materials
+// Upper bound on the bindless texture array, further limited by the device
+const uint32_t MAX_BINDLESS_TEXTURES = 65536;
+// Descriptors the scene and material sets take from the same per-stage limits
+const uint32_t BINDLESS_RESERVED_DESCRIPTORS = 64;
+const uint32_t BINDLESS_NO_TEXTURE = 0xFFFFFFFF;
+
+// Mesh LOD
+// Levels per mesh including the full resolution one
+const uint32_t MAX_MESH_LODS = 5;
+// No further level is built below this many triangles
+const uint32_t MIN_LOD_TRIANGLES = 64;
+
+// Meshlets (cluster culling)
+// Limits per meshlet, the triangle limit keeps the index range of a meshlet under 384 indices
+const uint32_t MESHLET_MAX_VERTICES = 64;
+const uint32_t MESHLET_MAX_TRIANGLES = 124;
+// Workgroup size of cluster_cull.shader.comp (specialization constant), the invocations
+// of one clustered draw share its meshlets
+const uint32_t CLUSTER_CULL_GROUP_SIZE = 64;
+
+// Textures
+// Upper bound on sampler anisotropy, further limited by the device
+const float MAX_SAMPLER_ANISOTROPY = 16.0f;
+
+// Mesh optimization
+// Entries of the FIFO post-transform vertex cache that triangle reordering targets and the statistics simulate
+const uint32_t VERTEX_CACHE_SIZE = 16;
+// How much worse than the cache optimized order (as a factor of ACMR) the overdraw clusters may be
+const float OVERDRAW_ACMR_THRESHOLD = 1.05f;
+
 // Shader map constants
 const float SHADOW_ZNEAR = 0.1f;
 const float SHADOW_ZFAR = 20.0f;
@@ -108,4 +195,8 @@ const bool DISPLAY_SHADOW_MAP_SPOT = false;
 const int DISPLAY_SHADOW_MAP_IDX = 1;
 
 //SSAO
-const int SSAO_SAMPLE_SIZE = 64;
\ No newline at end of file
+const int SSAO_SAMPLE_SIZE = 64;
+// Temporal SSAO: samples evaluated per frame, rotated through the full kernel
+const int SSAO_TEMPORAL_SAMPLE_SIZE = 8;
+// Relative view depth difference above which the history is treated as disoccluded
+const float SSAO_TEMPORAL_DEPTH_THRESHOLD = 0.05f;
\ No newline at end of file
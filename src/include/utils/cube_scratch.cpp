@@ -0,0 +1,200 @@
+#include "cube_scratch.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+static const char CUBE_SCRATCH_MAGIC[4] = {'C', 'F', '1', '6'};
+// Magic, version, size and level count as uint32, then the input's byte size and write time as 64 bit
+static const size_t CUBE_SCRATCH_HEADER_SIZE = 32;
+// The 32 bit gathers of the batch kernels read 2 bytes past the last texel of the blue plane
+static const size_t CUBE_SCRATCH_PADDING = 16;
+
+struct ScratchHeader {
+    uint32_t version = 0;
+    uint32_t size = 0;
+    uint32_t levels = 0;
+    uint64_t sourceBytes = 0;
+    int64_t sourceTime = 0;
+};
+
+static void sourceStamp(const std::string& input_path, uint64_t& bytes, int64_t& time) {
+    bytes = static_cast<uint64_t>(std::filesystem::file_size(input_path));
+    time = static_cast<int64_t>(std::filesystem::last_write_time(input_path).time_since_epoch().count());
+}
+
+static void levelLayout(int size, std::vector<int32_t>& offsets, std::vector<int32_t>& sizes, size_t& texels) {
+    texels = 0;
+    for(int s = size;; s /= 2) {
+        offsets.push_back(static_cast<int32_t>(texels));
+        sizes.push_back(s);
+        texels += static_cast<size_t>(6) * s * s;
+        if(s <= 1) {
+            break;
+        }
+    }
+}
+
+static bool readHeader(const uint8_t* data, size_t size, ScratchHeader& header) {
+    if(size < CUBE_SCRATCH_HEADER_SIZE || std::memcmp(data, CUBE_SCRATCH_MAGIC, sizeof(CUBE_SCRATCH_MAGIC)) != 0) {
+        return false;
+    }
+    std::memcpy(&header.version, data + 4, 4);
+    std::memcpy(&header.size, data + 8, 4);
+    std::memcpy(&header.levels, data + 12, 4);
+    std::memcpy(&header.sourceBytes, data + 16, 8);
+    std::memcpy(&header.sourceTime, data + 24, 8);
+    return true;
+}
+
+std::string cubeScratchPath(const std::string& input_path) {
+    return input_path.substr(0, input_path.find_last_of('.'))+".f16cube";
+}
+
+bool cubeScratchIsCurrent(const std::string& scratch_path, const std::string& input_path) {
+    std::ifstream file(scratch_path, std::ios::binary);
+    uint8_t data[CUBE_SCRATCH_HEADER_SIZE];
+    ScratchHeader header;
+    if(!file.read(reinterpret_cast<char*>(data), sizeof(data)) || !readHeader(data, sizeof(data), header)) {
+        return false;
+    }
+    uint64_t bytes;
+    int64_t time;
+    sourceStamp(input_path, bytes, time);
+    return header.version == CUBE_SCRATCH_VERSION && header.sourceBytes == bytes && header.sourceTime == time;
+}
+
+void writeCubeScratch(const std::string& scratch_path, const std::string& input_path,
+                      std::unique_ptr<uint8_t, void(*)(void*)> rgbe, int width, int height, size_t band_bytes) {
+    if(width <= 0 || height != 6 * width) {
+        throw std::runtime_error("a cube needs its 6 faces stacked vertically, got "+std::to_string(width)+"x"+std::to_string(height));
+    }
+    const int size = width;
+    std::vector<int32_t> offsets, sizes;
+    size_t texels;
+    levelLayout(size, offsets, sizes, texels);
+    const size_t plane_bytes = texels * sizeof(uint16_t);
+    auto texelOffset = [&](int c, size_t texel) {
+        return static_cast<std::streamoff>(CUBE_SCRATCH_HEADER_SIZE + c * plane_bytes + texel * sizeof(uint16_t));
+    };
+
+    // The header is written last, so an interrupted conversion is never taken for a current one
+    std::fstream file(scratch_path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!file.is_open()) {
+        throw std::runtime_error("failed to open "+scratch_path+" for writing");
+    }
+    std::vector<char> zeros(CUBE_SCRATCH_HEADER_SIZE + CUBE_SCRATCH_PADDING, 0);
+    file.write(zeros.data(), CUBE_SCRATCH_HEADER_SIZE);
+    file.seekp(texelOffset(3, 0));
+    file.write(zeros.data(), CUBE_SCRATCH_PADDING);
+
+    // Level 0, converted from RGBE in bands of rows
+    {
+        size_t rows = std::max<size_t>(1, band_bytes / (3 * sizeof(uint16_t) * size));
+        std::vector<uint16_t> band[3];
+        for(int f = 0; f < 6; ++f) {
+            for(int t0 = 0; t0 < size; t0 += static_cast<int>(rows)) {
+                int count = std::min(static_cast<int>(rows), size - t0);
+                size_t first = (static_cast<size_t>(f) * size + t0) * size;
+                size_t n = static_cast<size_t>(count) * size;
+                for(int c = 0; c < 3; ++c) {
+                    band[c].resize(n);
+                }
+                for(size_t i = 0; i < n; ++i) {
+                    const uint8_t* p = rgbe.get() + (first + i) * 4;
+                    vec3 radiance = rgbe_to_float(u8vec4(p[0], p[1], p[2], p[3]));
+                    for(int c = 0; c < 3; ++c) {
+                        band[c][i] = floatToHalf(radiance[c]);
+                    }
+                }
+                for(int c = 0; c < 3; ++c) {
+                    file.seekp(texelOffset(c, first));
+                    file.write(reinterpret_cast<const char*>(band[c].data()), n * sizeof(uint16_t));
+                }
+            }
+        }
+    }
+    rgbe.reset();
+
+    // Each following level from the one before, odd sizes drop their last row and column
+    for(size_t l = 1; l < sizes.size(); ++l) {
+        const int src = sizes[l - 1], dst = sizes[l];
+        size_t rows = std::max<size_t>(1, band_bytes / (3 * sizeof(uint16_t) * (2 * static_cast<size_t>(src) + dst)));
+        std::vector<uint16_t> in(2 * rows * src), out[3];
+        for(int f = 0; f < 6; ++f) {
+            for(int t0 = 0; t0 < dst; t0 += static_cast<int>(rows)) {
+                int count = std::min(static_cast<int>(rows), dst - t0);
+                size_t src_first = offsets[l - 1] + (static_cast<size_t>(f) * src + 2 * t0) * src;
+                size_t dst_first = offsets[l] + (static_cast<size_t>(f) * dst + t0) * dst;
+                for(int c = 0; c < 3; ++c) {
+                    file.seekg(texelOffset(c, src_first));
+                    file.read(reinterpret_cast<char*>(in.data()), 2 * count * src * sizeof(uint16_t));
+                    out[c].resize(static_cast<size_t>(count) * dst);
+                    for(int t = 0; t < count; ++t) {
+                        const uint16_t* row0 = in.data() + (2 * t) * src;
+                        const uint16_t* row1 = row0 + src;
+                        for(int s = 0; s < dst; ++s) {
+                            out[c][t * dst + s] = floatToHalf((halfToFloat(row0[2*s]) + halfToFloat(row0[2*s+1])
+                                + halfToFloat(row1[2*s]) + halfToFloat(row1[2*s+1])) * 0.25f);
+                        }
+                    }
+                    file.seekp(texelOffset(c, dst_first));
+                    file.write(reinterpret_cast<const char*>(out[c].data()), out[c].size() * sizeof(uint16_t));
+                }
+            }
+        }
+    }
+
+    uint32_t fields[3] = {CUBE_SCRATCH_VERSION, static_cast<uint32_t>(size), static_cast<uint32_t>(sizes.size())};
+    uint64_t bytes;
+    int64_t time;
+    sourceStamp(input_path, bytes, time);
+    file.seekp(0);
+    file.write(CUBE_SCRATCH_MAGIC, sizeof(CUBE_SCRATCH_MAGIC));
+    file.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+    file.write(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+    file.write(reinterpret_cast<const char*>(&time), sizeof(time));
+    file.flush();
+    if(!file) {
+        throw std::runtime_error("failed to write "+scratch_path);
+    }
+}
+
+CubeScratch::CubeScratch(const std::string& path, size_t resident_budget) : file(path) {
+    ScratchHeader header;
+    if(!readHeader(file.data(), file.size(), header)) {
+        throw std::runtime_error("not a cube scratch file: "+path);
+    }
+    if(header.version != CUBE_SCRATCH_VERSION) {
+        throw std::runtime_error("cube scratch version "+std::to_string(header.version)+" is not supported, delete "+path);
+    }
+    size_t texels;
+    levelLayout(static_cast<int>(header.size), pyramid.levelOffsets, pyramid.levelSizes, texels);
+    if(header.size == 0 || header.levels != pyramid.levelSizes.size()
+        || file.size() != CUBE_SCRATCH_HEADER_SIZE + 3 * texels * sizeof(uint16_t) + CUBE_SCRATCH_PADDING) {
+        throw std::runtime_error("cube scratch is truncated: "+path);
+    }
+    for(int c = 0; c < 3; ++c) {
+        pyramid.planes[c] = reinterpret_cast<const uint16_t*>(file.data() + CUBE_SCRATCH_HEADER_SIZE + c * texels * sizeof(uint16_t));
+    }
+    if(resident_budget > 0) {
+        threshold = resident_budget - resident_budget / 8;
+        pyramid.rowDone = [this]() { trim(); };
+    }
+}
+
+void CubeScratch::trim() {
+    // a thread already checking releases the pages this row read too
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if(!lock.owns_lock() || threshold == 0) {
+        return;
+    }
+    if(residentBytes() > threshold && !file.release()) {
+        threshold = 0;
+        std::cerr<<"Failed to release the mapped scratch, --mem-budget no longer bounds what is read of it\n";
+    }
+}
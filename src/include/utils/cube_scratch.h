@@ -0,0 +1,52 @@
+//
+//  cube_scratch.h
+//
+//  Scratch copy of an environment cube for bin/cube --mem-budget: the box filtered mip chain
+//  of CubePyramid as float16 planes (red, green then blue, each with every level from the
+//  input resolution down to 1), mapped read only while the prefilters sample it. It is written
+//  next to the input and records the size and modification time of the PNG it came from, so
+//  it is converted once and again only when the input changes.
+//
+
+#pragma once
+
+#include "ibl_sampling.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+const uint32_t CUBE_SCRATCH_VERSION = 1;
+
+// [name].f16cube next to [name].png
+std::string cubeScratchPath(const std::string& input_path);
+
+// True if scratch_path is a complete scratch of this version for input_path as it is now
+bool cubeScratchIsCurrent(const std::string& scratch_path, const std::string& input_path);
+
+// Writes the scratch of a decoded RGBE cube (faces stacked, width texels wide). rgbe is freed
+// as soon as level 0 is converted, every following level is built from the previous one read
+// back from the file, in bands of rows that fit in band_bytes (at least one row)
+void writeCubeScratch(const std::string& scratch_path, const std::string& input_path,
+                      std::unique_ptr<uint8_t, void(*)(void*)> rgbe, int width, int height, size_t band_bytes);
+
+struct CubeScratch {
+    MappedFile file;
+    HalfCubePyramid pyramid; // points into file
+
+    // Throws std::runtime_error if path is not a complete scratch of this version. With a
+    // resident_budget in bytes (0 for none), pyramid.rowDone calls trim
+    explicit CubeScratch(const std::string& path, size_t resident_budget = 0);
+
+    // Releases the mapped pages if the resident set of the process is over 7/8 of the budget.
+    // The prefilters call it after every row of work, so the budget holds at row boundaries;
+    // between two checks it can be overshot by what the rows in flight read, which the last
+    // 1/8 is left for. Stops checking, with a warning, if the pages cannot be released
+    void trim();
+
+private:
+    size_t threshold = 0;
+    std::mutex mutex; // one thread checks at a time
+};
@@ -0,0 +1,32 @@
+//
+//  embedded_shaders.h
+//
+//  SPIR-V linked into the viewer at build time.
+//  The table itself is generated by the EMBED_SPIRV rule in Maekfile.js.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+struct EmbeddedShader {
+    const char* name; // file name of the compiled shader, e.g. "pbr.frag.spv"
+    const uint32_t* code;
+    size_t size; // in bytes
+};
+
+extern const EmbeddedShader EMBEDDED_SHADERS[];
+extern const size_t EMBEDDED_SHADER_COUNT;
+
+// Returns nullptr if no shader with this file name was embedded
+inline const EmbeddedShader* findEmbeddedShader(const std::string& name) {
+    for(size_t i=0; i<EMBEDDED_SHADER_COUNT; i++) {
+        if(strcmp(EMBEDDED_SHADERS[i].name, name.c_str()) == 0) {
+            return &EMBEDDED_SHADERS[i];
+        }
+    }
+    return nullptr;
+}
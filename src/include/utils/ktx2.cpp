@@ -0,0 +1,208 @@
+#include "ktx2.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+static const uint8_t KTX2_IDENTIFIER[12] = {0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+// Identifier, header and index
+static const size_t KTX2_HEADER_SIZE = 80;
+// byteOffset, byteLength, uncompressedByteLength
+static const size_t KTX2_LEVEL_INDEX_SIZE = 24;
+
+uint32_t Ktx2Image::blockSize(uint32_t vkFormat) {
+    switch(vkFormat) {
+        case KTX2_FORMAT_BC4_UNORM:
+            return 8;
+        case KTX2_FORMAT_BC5_UNORM:
+        case KTX2_FORMAT_BC6H_UFLOAT:
+        case KTX2_FORMAT_BC7_UNORM:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+size_t Ktx2Image::faceSize(uint32_t level) const {
+    size_t blocksX = (levelWidth(level) + 3) / 4;
+    size_t blocksY = (levelHeight(level) + 3) / 4;
+    return blocksX * blocksY * blockSize(vkFormat);
+}
+
+template<typename T>
+static void put(std::vector<uint8_t>& out, size_t offset, T value) {
+    std::memcpy(out.data() + offset, &value, sizeof(T));
+}
+
+template<typename T>
+static T get(const std::vector<uint8_t>& in, size_t offset) {
+    if(offset + sizeof(T) > in.size()) {
+        throw std::runtime_error("KTX2 file is truncated");
+    }
+    T value;
+    std::memcpy(&value, in.data() + offset, sizeof(T));
+    return value;
+}
+
+// Basic data format descriptor of a block compressed format, one sample per 64 bit channel block
+static std::vector<uint8_t> describeFormat(uint32_t vkFormat) {
+    struct Sample {
+        uint16_t bitOffset;
+        uint8_t channel;
+    };
+    uint8_t colorModel = 0;
+    uint8_t channelFlags = 0;
+    uint32_t lower = 0;
+    uint32_t upper = 0xFFFFFFFF;
+    std::vector<Sample> samples;
+    switch(vkFormat) {
+        case KTX2_FORMAT_BC4_UNORM:
+            colorModel = 131; // KHR_DF_MODEL_BC4
+            samples = {{0, 0}};
+            break;
+        case KTX2_FORMAT_BC5_UNORM:
+            colorModel = 132; // KHR_DF_MODEL_BC5, red then green block
+            samples = {{0, 0}, {64, 1}};
+            break;
+        case KTX2_FORMAT_BC6H_UFLOAT:
+            colorModel = 133; // KHR_DF_MODEL_BC6H
+            channelFlags = 0x80; // KHR_DF_SAMPLE_DATATYPE_FLOAT
+            lower = 0; // 0.0f
+            upper = 0x3F800000; // 1.0f
+            samples = {{0, 0}};
+            break;
+        case KTX2_FORMAT_BC7_UNORM:
+            colorModel = 134; // KHR_DF_MODEL_BC7
+            samples = {{0, 0}};
+            break;
+        default:
+            throw std::runtime_error("KTX2: unsupported format "+std::to_string(vkFormat));
+    }
+    uint32_t blockBits = Ktx2Image::blockSize(vkFormat) * 8;
+    uint32_t sampleBits = blockBits / static_cast<uint32_t>(samples.size());
+
+    const size_t descriptorSize = 24 + 16 * samples.size();
+    std::vector<uint8_t> dfd(4 + descriptorSize, 0);
+    put<uint32_t>(dfd, 0, static_cast<uint32_t>(dfd.size()));
+    put<uint32_t>(dfd, 4, 0); // vendor Khronos, basic descriptor
+    put<uint32_t>(dfd, 8, 2u | static_cast<uint32_t>(descriptorSize) << 16); // version 2
+    dfd[12] = colorModel;
+    dfd[13] = 1; // BT.709 primaries
+    dfd[14] = 1; // linear transfer, textures are sampled as UNORM
+    dfd[15] = 0; // straight alpha
+    dfd[16] = 3; // 4x4 texel blocks, stored minus one
+    dfd[17] = 3;
+    dfd[20] = static_cast<uint8_t>(Ktx2Image::blockSize(vkFormat));
+    for(size_t s=0; s<samples.size(); s++) {
+        size_t offset = 28 + 16 * s;
+        put<uint16_t>(dfd, offset, samples[s].bitOffset);
+        dfd[offset + 2] = static_cast<uint8_t>(sampleBits - 1);
+        dfd[offset + 3] = samples[s].channel | channelFlags;
+        put<uint32_t>(dfd, offset + 8, lower);
+        put<uint32_t>(dfd, offset + 12, upper);
+    }
+    return dfd;
+}
+
+Ktx2Image readKtx2(const std::string& path) {
+    std::ifstream file(path, std::ios::ate | std::ios::binary);
+    if(!file.is_open()) {
+        throw std::runtime_error("failed to open file "+path);
+    }
+    std::vector<uint8_t> bytes(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+
+    if(bytes.size() < KTX2_HEADER_SIZE || std::memcmp(bytes.data(), KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0) {
+        throw std::runtime_error("not a KTX2 file: "+path);
+    }
+    Ktx2Image image;
+    image.vkFormat = get<uint32_t>(bytes, 12);
+    image.width = get<uint32_t>(bytes, 20);
+    image.height = get<uint32_t>(bytes, 24);
+    uint32_t depth = get<uint32_t>(bytes, 28);
+    uint32_t layerCount = get<uint32_t>(bytes, 32);
+    image.faceCount = get<uint32_t>(bytes, 36);
+    uint32_t levelCount = std::max(get<uint32_t>(bytes, 40), 1u);
+    uint32_t supercompression = get<uint32_t>(bytes, 44);
+
+    if(Ktx2Image::blockSize(image.vkFormat) == 0) {
+        throw std::runtime_error("KTX2 format "+std::to_string(image.vkFormat)+" not supported: "+path);
+    }
+    if(depth > 1 || layerCount > 1 || supercompression != 0 || (image.faceCount != 1 && image.faceCount != 6)) {
+        throw std::runtime_error("KTX2 file is not a plain 2D texture or cube map: "+path);
+    }
+    if(image.width == 0 || image.height == 0 || levelCount > 32) {
+        throw std::runtime_error("KTX2 file has invalid dimensions: "+path);
+    }
+
+    image.levels.resize(levelCount);
+    for(uint32_t level=0; level<levelCount; level++) {
+        size_t index = KTX2_HEADER_SIZE + KTX2_LEVEL_INDEX_SIZE * level;
+        uint64_t offset = get<uint64_t>(bytes, index);
+        uint64_t length = get<uint64_t>(bytes, index + 8);
+        if(length != image.faceSize(level) * image.faceCount || offset + length > bytes.size()) {
+            throw std::runtime_error("KTX2 level "+std::to_string(level)+" has an invalid size: "+path);
+        }
+        image.levels[level].assign(bytes.begin() + offset, bytes.begin() + offset + length);
+    }
+    return image;
+}
+
+void writeKtx2(const std::string& path, const Ktx2Image& image) {
+    const uint32_t levelCount = static_cast<uint32_t>(image.levels.size());
+    const uint32_t blockSize = Ktx2Image::blockSize(image.vkFormat);
+    std::vector<uint8_t> dfd = describeFormat(image.vkFormat);
+
+    // Header, level index and format descriptor, then the levels smallest first as the
+    // specification requires, each aligned to the block size
+    size_t dfdOffset = KTX2_HEADER_SIZE + KTX2_LEVEL_INDEX_SIZE * levelCount;
+    size_t size = dfdOffset + dfd.size();
+    std::vector<uint64_t> offsets(levelCount);
+    for(uint32_t level=levelCount; level-- > 0;) {
+        if(image.levels[level].size() != image.faceSize(level) * image.faceCount) {
+            throw std::runtime_error("KTX2 level "+std::to_string(level)+" has an invalid size");
+        }
+        size = (size + blockSize - 1) / blockSize * blockSize;
+        offsets[level] = size;
+        size += image.levels[level].size();
+    }
+
+    std::vector<uint8_t> bytes(size, 0);
+    std::memcpy(bytes.data(), KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+    put<uint32_t>(bytes, 12, image.vkFormat);
+    put<uint32_t>(bytes, 16, 1); // typeSize
+    put<uint32_t>(bytes, 20, image.width);
+    put<uint32_t>(bytes, 24, image.height);
+    put<uint32_t>(bytes, 28, 0); // depth
+    put<uint32_t>(bytes, 32, 0); // layerCount, not an array
+    put<uint32_t>(bytes, 36, image.faceCount);
+    put<uint32_t>(bytes, 40, levelCount);
+    put<uint32_t>(bytes, 44, 0); // no supercompression
+    put<uint32_t>(bytes, 48, static_cast<uint32_t>(dfdOffset));
+    put<uint32_t>(bytes, 52, static_cast<uint32_t>(dfd.size()));
+    // Key/value and supercompression global data are empty, their offsets and lengths stay 0
+    for(uint32_t level=0; level<levelCount; level++) {
+        size_t index = KTX2_HEADER_SIZE + KTX2_LEVEL_INDEX_SIZE * level;
+        put<uint64_t>(bytes, index, offsets[level]);
+        put<uint64_t>(bytes, index + 8, image.levels[level].size());
+        put<uint64_t>(bytes, index + 16, image.levels[level].size());
+        std::memcpy(bytes.data() + offsets[level], image.levels[level].data(), image.levels[level].size());
+    }
+    std::memcpy(bytes.data() + dfdOffset, dfd.data(), dfd.size());
+
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    if(!file.is_open()) {
+        throw std::runtime_error("failed to open file "+path);
+    }
+    file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+std::string ktx2Path(const std::string& path) {
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if(dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return path + ".ktx2";
+    }
+    return path.substr(0, dot) + ".ktx2";
+}
@@ -0,0 +1,44 @@
+//
+//  ktx2.h
+//
+//  Minimal KTX2 container (https://registry.khronos.org/KTX/specs/2.0/ktxspec.v2.html) for
+//  block compressed 2D textures and cube maps: no supercompression, no arrays, no key/value data.
+//  Written by bin/compress, read by the viewer.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// VkFormat values of the formats bin/compress writes, so the tool does not depend on Vulkan
+const uint32_t KTX2_FORMAT_BC4_UNORM = 139; // VK_FORMAT_BC4_UNORM_BLOCK
+const uint32_t KTX2_FORMAT_BC5_UNORM = 141; // VK_FORMAT_BC5_UNORM_BLOCK
+const uint32_t KTX2_FORMAT_BC6H_UFLOAT = 143; // VK_FORMAT_BC6H_UFLOAT_BLOCK
+const uint32_t KTX2_FORMAT_BC7_UNORM = 145; // VK_FORMAT_BC7_UNORM_BLOCK
+
+struct Ktx2Image {
+    uint32_t vkFormat = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t faceCount = 1; // 6 for cube maps, faces in +X, -X, +Y, -Y, +Z, -Z order
+    // levels[l] holds every face of level l one after the other, level 0 is the largest
+    std::vector<std::vector<uint8_t>> levels;
+
+    // Bytes per 4x4 block of vkFormat, 0 if it is not one of the formats above
+    static uint32_t blockSize(uint32_t vkFormat);
+
+    uint32_t levelWidth(uint32_t level) const { return std::max(width >> level, 1u); }
+    uint32_t levelHeight(uint32_t level) const { return std::max(height >> level, 1u); }
+    // Bytes of one face of a level
+    size_t faceSize(uint32_t level) const;
+};
+
+// Both throw std::runtime_error on failure
+Ktx2Image readKtx2(const std::string& path);
+void writeKtx2(const std::string& path, const Ktx2Image& image);
+
+// Path of the KTX2 file the viewer prefers over path (same name, .ktx2 extension)
+std::string ktx2Path(const std::string& path);
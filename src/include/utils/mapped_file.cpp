@@ -0,0 +1,157 @@
+#include "mapped_file.h"
+
+#include <stdexcept>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
+#endif
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(const std::string& path) {
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("failed to open "+path);
+    }
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        throw std::runtime_error("failed to map "+path);
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if(!view) {
+        if(mapping) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        throw std::runtime_error("failed to map "+path);
+    }
+    file_ = file;
+    mapping_ = mapping;
+    data_ = static_cast<const uint8_t*>(view);
+    size_ = static_cast<size_t>(size.QuadPart);
+}
+
+MappedFile::~MappedFile() {
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+    CloseHandle(file_);
+}
+
+bool MappedFile::release() const {
+    // Unlocking pages that are not locked removes them from the working set and fails with ERROR_NOT_LOCKED
+    return VirtualUnlock(const_cast<uint8_t*>(data_), size_) || GetLastError() == ERROR_NOT_LOCKED;
+}
+
+size_t residentBytes() {
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.WorkingSetSize;
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw std::runtime_error("failed to open "+path);
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("failed to map "+path);
+    }
+    void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if(view == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("failed to map "+path);
+    }
+#if defined(__APPLE__)
+    fd_ = fd;
+#else
+    close(fd);
+#endif
+    data_ = static_cast<const uint8_t*>(view);
+    size_ = static_cast<size_t>(info.st_size);
+}
+
+MappedFile::~MappedFile() {
+    munmap(const_cast<uint8_t*>(data_), size_);
+#if defined(__APPLE__)
+    close(fd_);
+#endif
+}
+
+#if defined(__APPLE__)
+
+bool MappedFile::release() const {
+    // madvise(MADV_DONTNEED) is only a hint for file mappings here, mapping the file again over
+    // itself replaces the old pages in one step
+    void* view = mmap(const_cast<uint8_t*>(data_), size_, PROT_READ, MAP_SHARED | MAP_FIXED, fd_, 0);
+    if(view != MAP_FAILED) {
+        return true;
+    }
+    // Arguments rejected up front leave the old mapping alone. Otherwise POSIX allows part of the
+    // range to be unmapped already, and the threads reading it would fault
+    if(errno != EBADF && errno != EINVAL && errno != ENOTSUP) {
+        std::fprintf(stderr, "failed to map the scratch file again, its old mapping may be gone\n");
+        std::abort();
+    }
+    return false;
+}
+
+#else
+
+bool MappedFile::release() const {
+    // Drops the clean file backed pages from the resident set, the next access reads them
+    // again from the page cache or the file
+    return madvise(const_cast<uint8_t*>(data_), size_, MADV_DONTNEED) == 0;
+}
+
+#endif
+
+#if defined(__APPLE__)
+
+size_t residentBytes() {
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if(task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.resident_size;
+}
+
+#else
+
+size_t residentBytes() {
+    // The second field of statm is the resident set in pages
+    FILE* statm = std::fopen("/proc/self/statm", "r");
+    if(!statm) {
+        return 0;
+    }
+    unsigned long size = 0, resident = 0;
+    int read = std::fscanf(statm, "%lu %lu", &size, &resident);
+    std::fclose(statm);
+    return read == 2 ? static_cast<size_t>(resident) * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+}
+
+#endif
+
+#endif
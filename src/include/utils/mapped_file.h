@@ -0,0 +1,45 @@
+//
+//  mapped_file.h
+//
+//  Read only memory mapping of a whole file (mmap, MapViewOfFile on Windows). The pages are
+//  backed by the file, so the OS can drop them under memory pressure and read them again,
+//  and release() drops them from the process explicitly.
+//  Used by bin/cube for the scratch files of --mem-budget.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class MappedFile {
+public:
+    // Throws std::runtime_error if the file cannot be opened or mapped
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // Removes the mapped pages from the resident set of the process, they are read again from
+    // the file on the next access. The mapping stays at the same address, so other threads may
+    // keep reading it. Returns false, with the mapping intact, if the pages could not be released
+    bool release() const;
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+#if defined(_WIN32)
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#elif defined(__APPLE__)
+    int fd_ = -1; // release() maps the file again
+#endif
+};
+
+// Resident set of this process in bytes, 0 where it cannot be read
+size_t residentBytes();
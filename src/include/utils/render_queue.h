@@ -0,0 +1,91 @@
+//
+//  render_queue.h
+//
+//  64-bit draw sort keys and a radix sort to order them.
+//  Keys are built and sorted on the simulation thread; the render thread emits
+//  the draws in key order and skips binds that repeat the previous draw's state.
+//
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+struct DrawItem {
+    uint64_t key;
+    uint32_t index; // render proxy
+};
+
+namespace RenderKey {
+    const uint32_t MATERIAL_BITS = 20;
+    const uint32_t MESH_BITS = 20;
+    const uint32_t FINE_DEPTH_BITS = 14;
+
+    // Opaque gbuffer draws: pipeline (4) | depth bucket (6) | material (20) | mesh (20) | fine depth (14)
+    // The coarse bucket keeps the pass roughly front to back for early-z while draws in one
+    // bucket still group by material and mesh; the fine depth only orders draws of equal state.
+    // depth is quantizeDepth's bucket and fine depth
+    inline uint64_t opaque(uint32_t pipeline, uint32_t depth, uint32_t material, uint32_t mesh) {
+        assert(material < (1u << MATERIAL_BITS) && mesh < (1u << MESH_BITS));
+        return (uint64_t(pipeline & 0xF) << 60) |
+               (uint64_t(depth >> FINE_DEPTH_BITS & 0x3F) << 54) |
+               (uint64_t(material) << 34) |
+               (uint64_t(mesh) << 14) |
+               uint64_t(depth & ((1u << FINE_DEPTH_BITS) - 1));
+    }
+
+    // Depth only draws (shadow maps) only bind geometry: mesh (32)
+    inline uint64_t depthOnly(uint32_t mesh) {
+        return uint64_t(mesh);
+    }
+
+    // The bit pattern of a non-negative float increases with its value. The top bits of the
+    // exponent and mantissa give half octave buckets, clamped to 2^-8..2^24, and the next
+    // 14 mantissa bits the depth inside the bucket: bucket (6) | fine depth (14)
+    inline uint32_t quantizeDepth(float depth) {
+        if(!(depth > 0.0f)) {
+            return 0;
+        }
+        uint32_t bits;
+        std::memcpy(&bits, &depth, sizeof(bits));
+        const int32_t firstBucket = (127 - 8) << 1;
+        int32_t bucket = static_cast<int32_t>(bits >> 22) - firstBucket;
+        if(bucket < 0) {
+            return 0;
+        }
+        if(bucket > 0x3F) {
+            return (1u << (6 + FINE_DEPTH_BITS)) - 1;
+        }
+        return (uint32_t(bucket) << FINE_DEPTH_BITS) | (bits >> 8 & ((1u << FINE_DEPTH_BITS) - 1));
+    }
+}
+
+// LSD radix sort on the key, one byte per pass. Bytes that are equal for every key
+// (unused key fields) are skipped. Stable, so equal keys keep their input order
+inline void radixSort(std::vector<DrawItem>& items, std::vector<DrawItem>& scratch) {
+    if(items.size() < 2) {
+        return;
+    }
+    scratch.resize(items.size());
+    for(uint32_t shift = 0; shift < 64; shift += 8) {
+        size_t offsets[256] = {};
+        for(const DrawItem& item: items) {
+            offsets[(item.key >> shift) & 0xFF]++;
+        }
+        if(offsets[(items[0].key >> shift) & 0xFF] == items.size()) {
+            continue;
+        }
+        size_t sum = 0;
+        for(size_t& offset: offsets) {
+            size_t count = offset;
+            offset = sum;
+            sum += count;
+        }
+        for(const DrawItem& item: items) {
+            scratch[offsets[(item.key >> shift) & 0xFF]++] = item;
+        }
+        items.swap(scratch);
+    }
+}
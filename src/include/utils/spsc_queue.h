@@ -0,0 +1,116 @@
+//
+//  spsc_queue.h
+//
+//  Single-producer single-consumer lock-free ring buffer.
+//  Used to hand frame packets from the simulation thread to the render thread.
+//  pushWait and popWait sleep on a condition variable instead of spinning; the mutex only
+//  guards the sleep, items go through the ring.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+template<typename T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(size_t capacity = 1) : buffer(capacity + 1) {}
+
+    // Only call while neither the producer nor the consumer is running
+    void reset(size_t capacity) {
+        buffer = std::vector<T>(capacity + 1);
+        head.store(0);
+        tail.store(0);
+        closed = false;
+    }
+
+    // Producer side. Returns false (and leaves item untouched) if the queue is full
+    bool push(T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % buffer.size();
+        if(next == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        buffer[t] = std::move(item);
+        tail.store(next, std::memory_order_release);
+        wake(notEmpty);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(buffer[h]);
+        head.store((h + 1) % buffer.size(), std::memory_order_release);
+        wake(notFull);
+        return true;
+    }
+
+    // Producer side. Sleeps while the queue is full. Returns false once the queue is closed
+    bool pushWait(T& item) {
+        while(!push(item)) {
+            std::unique_lock<std::mutex> lock(mutex);
+            notFull.wait(lock, [this](){ return closed || !full(); });
+            if(closed) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Consumer side. Sleeps while the queue is empty. Returns false once the queue is closed
+    bool popWait(T& item) {
+        while(!pop(item)) {
+            std::unique_lock<std::mutex> lock(mutex);
+            notEmpty.wait(lock, [this](){ return closed || !empty(); });
+            if(closed) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Wakes both sides; pushWait and popWait fail from now on until reset
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    bool full() const {
+        return (tail.load(std::memory_order_acquire) + 1) % buffer.size() == head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    // Taking the mutex orders the index store before a waiter's check, so the wakeup can't be lost
+    void wake(std::condition_variable& cv) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        cv.notify_one();
+    }
+
+    std::vector<T> buffer;
+    // keep the indices on separate cache lines so the two threads don't false share
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    bool closed = false; // guarded by mutex
+};
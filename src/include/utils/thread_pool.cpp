@@ -0,0 +1,142 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(uint32_t threadCount) {
+    if(threadCount == 0) {
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    shares = std::make_unique<Share[]>(threadCount);
+    idleWorkers = threadCount;
+    for(uint32_t w=0; w<threadCount; w++) {
+        workers.emplace_back(&ThreadPool::work, this, w);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for(auto& worker: workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::run(size_t count, const std::function<void(size_t)>& task_,
+                     const std::function<void(size_t, size_t)>& progress, std::chrono::milliseconds interval) {
+    if(count == 0) {
+        return;
+    }
+    const uint32_t workerCount = size();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Every worker is idle here, nothing else touches the shares
+        for(uint32_t w=0; w<workerCount; w++) {
+            shares[w].begin = count * w / workerCount;
+            shares[w].end = count * (w + 1) / workerCount;
+        }
+        task = &task_;
+        done = 0;
+        failed = false;
+        error = nullptr;
+        idleWorkers = 0;
+        batch++;
+    }
+    wake.notify_all();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!idle.wait_for(lock, interval, [&]{ return idleWorkers == workerCount; })) {
+        if(progress) {
+            lock.unlock();
+            progress(done.load(), count);
+            lock.lock();
+        }
+    }
+    task = nullptr;
+    if(error) {
+        std::rethrow_exception(error);
+    }
+    lock.unlock();
+    if(progress) {
+        progress(count, count);
+    }
+}
+
+bool ThreadPool::take(uint32_t worker, size_t& index) {
+    if(failed.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    Share& own = shares[worker];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(own.begin < own.end) {
+            index = own.begin++;
+            return true;
+        }
+    }
+    // Never holds two share locks at once
+    for(;;) {
+        uint32_t victim = worker;
+        size_t most = 0;
+        for(uint32_t w=0; w<size(); w++) {
+            std::lock_guard<std::mutex> lock(shares[w].mutex);
+            if(shares[w].end - shares[w].begin > most) {
+                most = shares[w].end - shares[w].begin;
+                victim = w;
+            }
+        }
+        if(most == 0) {
+            return false;
+        }
+        size_t first, last;
+        {
+            std::lock_guard<std::mutex> lock(shares[victim].mutex);
+            size_t remaining = shares[victim].end - shares[victim].begin;
+            if(remaining == 0) {
+                continue;
+            }
+            last = shares[victim].end;
+            first = last - (remaining + 1) / 2;
+            shares[victim].end = first;
+        }
+        index = first;
+        std::lock_guard<std::mutex> lock(own.mutex);
+        own.begin = first + 1;
+        own.end = last;
+        return true;
+    }
+}
+
+void ThreadPool::work(uint32_t worker) {
+    uint64_t seen = 0;
+    for(;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]{ return stopping || batch != seen; });
+            if(stopping) {
+                return;
+            }
+            seen = batch;
+        }
+        size_t index;
+        while(take(worker, index)) {
+            try {
+                (*task)(index);
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(!error) {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+            done.fetch_add(1, std::memory_order_relaxed);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idleWorkers++;
+        }
+        idle.notify_all();
+    }
+}
@@ -0,0 +1,67 @@
+//
+//  thread_pool.h
+//
+//  Fixed set of worker threads running batches of independent tasks.
+//  Each worker starts on its own contiguous share of a batch and, once that runs out, steals
+//  the back half of the largest remaining share, so uneven tasks still keep every core busy.
+//  Used by bin/cube for the environment prefilters.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    // 0 threads: one per hardware thread
+    explicit ThreadPool(uint32_t threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    uint32_t size() const { return static_cast<uint32_t>(workers.size()); }
+
+    // Calls task(i) for every i in [0, count) and returns once all are done. Tasks must not
+    // depend on the order they run in. progress(done, count) is called on the calling thread
+    // every interval and once at the end. The first exception a task throws stops the batch
+    // and is rethrown here
+    void run(size_t count, const std::function<void(size_t)>& task,
+             const std::function<void(size_t, size_t)>& progress = nullptr,
+             std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+
+private:
+    // Task indices [begin, end) a worker has left
+    struct alignas(64) Share {
+        std::mutex mutex;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    bool take(uint32_t worker, size_t& index);
+    void work(uint32_t worker);
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Share[]> shares;
+
+    std::mutex mutex;
+    std::condition_variable wake; // a batch started or the pool is stopping
+    std::condition_variable idle; // a worker ran out of tasks
+    const std::function<void(size_t)>* task = nullptr;
+    uint64_t batch = 0;
+    uint32_t idleWorkers = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    std::atomic<size_t> done{0};
+    std::atomic<bool> failed{false};
+};
@@ -9,60 +9,269 @@
 
 // #include <glm/glm.hpp>
 #include <vulkan/vulkan.h>
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstring>
+#include <istream>
+#include <vector>
 
 #include "mathlib.h"
 #include "light.h"
 #include "constants.h"
 
+// Every attribute of a loaded vertex, the meshes keep these on the CPU for LODs and meshlets.
+// What reaches the GPU is split into streams, see VertexFormat below
 struct Vertex {
     vec3 pos;
     vec3 normal;
     vec3 color;
-    vec4 tangent;
+    vec4 tangent = vec4(1.0f, 0.0f, 0.0f, 1.0f);
     vec2 texCoord;
-    
-    static VkVertexInputBindingDescription getBindingDescription() {
-        VkVertexInputBindingDescription bindingDescription{};
-        bindingDescription.binding = 0;
-        bindingDescription.stride = sizeof(Vertex);
-        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+};
+
+// Normal of the triangle abc with twice its area as length, from the winding but flipped to agree
+// with the vertex normals the shading uses, so it does not depend on the scene's winding convention
+inline vec3 faceNormal(const Vertex& a, const Vertex& b, const Vertex& c) {
+    vec3 n = cross(b.pos - a.pos, c.pos - a.pos);
+    if(dot(n, a.normal + b.normal + c.normal) < 0.0f) {
+        n = -n;
+    }
+    return n;
+}
+
+// Maps positions into the cube [0, 1] for quantized attributes
+struct VertexQuantization {
+    vec3 offset = vec3(0.0f, 0.0f, 0.0f);
+    float scale = 1.0f;
+};
+
+// Streams of vertex attributes, each uploaded to its own buffer and bound at binding = stream index.
+// Depth passes read only the positions, simple materials never see tangents or texture coordinates
+enum VertexStream : uint32_t {
+    POSITION_STREAM = 0,
+    NORMAL_STREAM,
+    COLOR_STREAM,
+    SURFACE_STREAM, // tangent and texture coordinates
+    VERTEX_STREAM_COUNT
+};
+
+// Streams read by each kind of pipeline, a mesh uploads those of the pipelines that draw it
+const uint32_t DEPTH_STREAMS = 1u << POSITION_STREAM;
+const uint32_t SIMPLE_STREAMS = DEPTH_STREAMS | 1u << NORMAL_STREAM | 1u << COLOR_STREAM;
+const uint32_t MATERIAL_STREAMS = DEPTH_STREAMS | 1u << NORMAL_STREAM | 1u << SURFACE_STREAM;
+
+// One vertex attribute: its shader location, vertex format and the Type stored in the stream,
+// encoded from a Vertex. The full precision ones also read themselves from a scene's binary file
+namespace attribute {
+
+inline void readFloats(std::istream& in, float* out, int count) {
+    for(int i=0; i<count; i++) {
+        in.read((char*)&out[i], sizeof(float));
+    }
+}
+
+template<uint32_t size>
+inline void readVec(std::istream& in, vec<float, size>& v) {
+    float f[size];
+    readFloats(in, f, size);
+    for(uint32_t i=0; i<size; i++) {
+        v[i] = f[i];
+    }
+}
+
+struct Position {
+    using Type = vec3;
+    static constexpr uint32_t location = 0;
+    static constexpr VkFormat format = VK_FORMAT_R32G32B32_SFLOAT;
+    static Type encode(const Vertex& v, const VertexQuantization&) { return v.pos; }
+    static void read(std::istream& in, Vertex& v) { readVec(in, v.pos); }
+};
+
+struct Normal {
+    using Type = vec3;
+    static constexpr uint32_t location = 1;
+    static constexpr VkFormat format = VK_FORMAT_R32G32B32_SFLOAT;
+    static Type encode(const Vertex& v, const VertexQuantization&) { return v.normal; }
+    static void read(std::istream& in, Vertex& v) { readVec(in, v.normal); }
+};
 
-        return bindingDescription;
+struct Color {
+    using Type = vec3;
+    static constexpr uint32_t location = 2;
+    static constexpr VkFormat format = VK_FORMAT_R32G32B32_SFLOAT;
+    static Type encode(const Vertex& v, const VertexQuantization&) { return v.color; }
+    // rgba8 in the file, alpha is unused
+    static void read(std::istream& in, Vertex& v) {
+        uint8_t color[4];
+        in.read((char*)color, sizeof(color));
+        for(int i=0; i<3; i++) {
+            v.color[i] = static_cast<float>(color[i]) / 255.0f;
+        }
     }
-    
-    static std::array<VkVertexInputAttributeDescription, 5> getAttributeDescriptions() {
-        std::array<VkVertexInputAttributeDescription, 5> attributeDescriptions{};
+};
 
-        attributeDescriptions[0].binding = 0;
-        attributeDescriptions[0].location = 0;
-        attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-        attributeDescriptions[0].offset = offsetof(Vertex, pos);
+struct Tangent {
+    using Type = vec4;
+    static constexpr uint32_t location = 3;
+    static constexpr VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    static Type encode(const Vertex& v, const VertexQuantization&) { return v.tangent; }
+    static void read(std::istream& in, Vertex& v) { readVec(in, v.tangent); }
+};
+
+struct TexCoord {
+    using Type = vec2;
+    static constexpr uint32_t location = 4;
+    static constexpr VkFormat format = VK_FORMAT_R32G32_SFLOAT;
+    static Type encode(const Vertex& v, const VertexQuantization&) { return v.texCoord; }
+    static void read(std::istream& in, Vertex& v) { readVec(in, v.texCoord); }
+};
 
-        attributeDescriptions[1].binding = 0;
-        attributeDescriptions[1].location = 1;
-        attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-        attributeDescriptions[1].offset = offsetof(Vertex, normal);
+// Projects the unit vector onto the octahedron |x| + |y| + |z| = 1 and folds the lower half over
+inline std::array<int16_t, 2> octEncode(const vec3& n) {
+    float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+    if(l1 <= 0.0f) {
+        return {0, 0};
+    }
+    float x = n[0] / l1;
+    float y = n[1] / l1;
+    if(n[2] < 0.0f) {
+        float foldedX = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float foldedY = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = foldedX;
+        y = foldedY;
+    }
+    return {static_cast<int16_t>(std::lround(std::clamp(x, -1.0f, 1.0f) * 32767.0f)),
+            static_cast<int16_t>(std::lround(std::clamp(y, -1.0f, 1.0f) * 32767.0f))};
+}
 
-        attributeDescriptions[2].binding = 0;
-        attributeDescriptions[2].location = 2;
-        attributeDescriptions[2].format = VK_FORMAT_R32G32B32_SFLOAT;
-        attributeDescriptions[2].offset = offsetof(Vertex, color);
+// Compact versions at the same locations, decoded in common.glsl. The shaders declare every
+// attribute as vec4 and read either encoding
 
-        attributeDescriptions[3].binding = 0;
-        attributeDescriptions[3].location = 3;
-        attributeDescriptions[3].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-        attributeDescriptions[3].offset = offsetof(Vertex, tangent);
+// unorm over the quantization cube, which the instance's model matrix scales back (see
+// VkMesh::dequantization); w is the tangent sign, 0 for -1, so the position stream every pass binds carries it
+struct QuantizedPosition {
+    using Type = std::array<uint16_t, 4>;
+    static constexpr uint32_t location = 0;
+    static constexpr VkFormat format = VK_FORMAT_R16G16B16A16_UNORM;
+    static Type encode(const Vertex& v, const VertexQuantization& q) {
+        Type p;
+        for(int i=0; i<3; i++) {
+            float x = std::clamp((v.pos[i] - q.offset[i]) / q.scale, 0.0f, 1.0f);
+            p[i] = static_cast<uint16_t>(std::lround(x * 65535.0f));
+        }
+        p[3] = v.tangent[3] < 0.0f ? 0 : 65535;
+        return p;
+    }
+};
 
-        attributeDescriptions[4].binding = 0;
-        attributeDescriptions[4].location = 4;
-        attributeDescriptions[4].format = VK_FORMAT_R32G32_SFLOAT;
-        attributeDescriptions[4].offset = offsetof(Vertex, texCoord);
+struct OctNormal {
+    using Type = std::array<int16_t, 2>;
+    static constexpr uint32_t location = 1;
+    static constexpr VkFormat format = VK_FORMAT_R16G16_SNORM;
+    static Type encode(const Vertex& v, const VertexQuantization&) { return octEncode(v.normal); }
+};
 
-        return attributeDescriptions;
+struct Color8 {
+    using Type = std::array<uint8_t, 4>;
+    static constexpr uint32_t location = 2;
+    static constexpr VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+    static Type encode(const Vertex& v, const VertexQuantization&) {
+        Type c;
+        for(int i=0; i<3; i++) {
+            c[i] = static_cast<uint8_t>(std::lround(std::clamp(v.color[i], 0.0f, 1.0f) * 255.0f));
+        }
+        c[3] = 255;
+        return c;
     }
 };
 
+struct OctTangent {
+    using Type = std::array<int16_t, 2>;
+    static constexpr uint32_t location = 3;
+    static constexpr VkFormat format = VK_FORMAT_R16G16_SNORM;
+    static Type encode(const Vertex& v, const VertexQuantization&) { return octEncode(vec3(v.tangent[0], v.tangent[1], v.tangent[2])); }
+};
+
+struct HalfTexCoord {
+    using Type = std::array<uint16_t, 2>;
+    static constexpr uint32_t location = 4;
+    static constexpr VkFormat format = VK_FORMAT_R16G16_SFLOAT;
+    static Type encode(const Vertex& v, const VertexQuantization&) { return {floatToHalf(v.texCoord[0]), floatToHalf(v.texCoord[1])}; }
+};
+
+} // namespace attribute
+
+// One stream: the listed attributes interleaved, tightly packed in order
+template<typename... Attributes>
+struct VertexLayout {
+    static constexpr uint32_t stride = (0 + ... + static_cast<uint32_t>(sizeof(typename Attributes::Type)));
+
+    static void describe(uint32_t binding, std::vector<VkVertexInputBindingDescription>& bindings, std::vector<VkVertexInputAttributeDescription>& attributes) {
+        bindings.push_back({binding, stride, VK_VERTEX_INPUT_RATE_VERTEX});
+        uint32_t offset = 0;
+        ((attributes.push_back({Attributes::location, binding, Attributes::format, offset}), offset += sizeof(typename Attributes::Type)), ...);
+    }
+
+    static std::vector<uint8_t> encode(const std::vector<Vertex>& vertices, const VertexQuantization& quantization) {
+        std::vector<uint8_t> data(static_cast<size_t>(stride) * vertices.size());
+        uint8_t* out = data.data();
+        for(const Vertex& v: vertices) {
+            (write<Attributes>(out, v, quantization), ...);
+        }
+        return data;
+    }
+
+private:
+    template<typename Attribute>
+    static void write(uint8_t*& out, const Vertex& v, const VertexQuantization& quantization) {
+        typename Attribute::Type value = Attribute::encode(v, quantization);
+        memcpy(out, &value, sizeof(value));
+        out += sizeof(value);
+    }
+};
+
+// Layouts of the VertexStreams, in stream order
+template<typename... Streams>
+struct VertexFormat {
+    static_assert(sizeof...(Streams) == VERTEX_STREAM_COUNT, "one layout per vertex stream");
+
+    // Binding and attribute descriptions of the streams in the mask
+    static void describe(uint32_t streams, std::vector<VkVertexInputBindingDescription>& bindings, std::vector<VkVertexInputAttributeDescription>& attributes) {
+        uint32_t binding = 0;
+        ((streams & (1u << binding) ? Streams::describe(binding, bindings, attributes) : void(), binding++), ...);
+    }
+
+    // Bytes per vertex over the streams in the mask
+    static uint32_t stride(uint32_t streams) {
+        uint32_t binding = 0;
+        uint32_t bytes = 0;
+        ((bytes += streams & (1u << binding) ? Streams::stride : 0, binding++), ...);
+        return bytes;
+    }
+
+    // Contents of the streams in the mask, the others are left empty
+    static std::array<std::vector<uint8_t>, VERTEX_STREAM_COUNT> encode(uint32_t streams, const std::vector<Vertex>& vertices, const VertexQuantization& quantization) {
+        std::array<std::vector<uint8_t>, VERTEX_STREAM_COUNT> data;
+        uint32_t binding = 0;
+        ((streams & (1u << binding) ? void(data[binding] = Streams::encode(vertices, quantization)) : void(), binding++), ...);
+        return data;
+    }
+};
+
+using FullVertexFormat = VertexFormat<
+    VertexLayout<attribute::Position>,
+    VertexLayout<attribute::Normal>,
+    VertexLayout<attribute::Color>,
+    VertexLayout<attribute::Tangent, attribute::TexCoord>>;
+
+// --packed-vertices: 8 bytes per vertex in the depth passes, 20 in the material passes
+using PackedVertexFormat = VertexFormat<
+    VertexLayout<attribute::QuantizedPosition>,
+    VertexLayout<attribute::OctNormal>,
+    VertexLayout<attribute::Color8>,
+    VertexLayout<attribute::OctTangent, attribute::HalfTexCoord>>;
+
 struct UniformBufferObjectScene {
     alignas(16) mat4 view;
     alignas(16) mat4 proj;
@@ -70,9 +279,39 @@ struct UniformBufferObjectScene {
     alignas(16) vec4 eye; // camera position
 };
 
-struct PushConstantModel {
-    alignas(16) mat4 model;
-    alignas(16) mat4 invModel;
+// One entry per model in the instance storage buffer (scene binding 15),
+// indexed by gl_InstanceIndex in every geometry pass.
+// Holds the top three rows of the affine model matrix and of its inverse transpose
+struct InstanceData {
+    alignas(16) vec4 model[3];
+    alignas(16) vec4 normal[3];
+    alignas(16) uint32_t material = 0; // index into the bindless material buffer
+
+    void setModel(const mat4& m) {
+        for(int r=0; r<3; r++) {
+            model[r] = vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+        }
+    }
+
+    void setNormal(const mat4& m) {
+        for(int r=0; r<3; r++) {
+            normal[r] = vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+        }
+    }
+};
+
+// One entry per bindless material in the material storage buffer (see src/shaders/gbuffer.shader.frag).
+// Texture indices point into the bindless texture array, BINDLESS_NO_TEXTURE selects the constant instead
+struct MaterialData {
+    alignas(16) vec4 albedo;
+    alignas(4) float roughness;
+    alignas(4) float metalness;
+    alignas(4) uint32_t normalTexture = BINDLESS_NO_TEXTURE;
+    alignas(4) uint32_t displacementTexture = BINDLESS_NO_TEXTURE;
+    alignas(4) uint32_t albedoTexture = BINDLESS_NO_TEXTURE;
+    alignas(4) uint32_t roughnessTexture = BINDLESS_NO_TEXTURE;
+    alignas(4) uint32_t metalnessTexture = BINDLESS_NO_TEXTURE;
+    alignas(4) uint32_t pad = 0;
 };
 
 struct UniformBufferObjectShadow {
@@ -84,16 +323,16 @@ struct UniformBufferObjectShadow {
 
 // used in src/shaders/depth.shader.vert
 // to compute shadow map for spot light
+// pushed once per shadow map, the model matrix comes from InstanceData
 struct PushConstantShadow {
-    alignas(16) mat4 model;
     alignas(16) mat4 lightVP;
 };
 
 // used in src/shaders/depth.cube.shader.vert
 // to compute shadow map for sphere light
+// pushed once per cube face, the model matrix comes from InstanceData
 struct PushConstantCubeShadow {
-    alignas(16) mat4 model;
-    alignas(16) vec4 lightData; //face idx, light idx, *, *
+    alignas(16) vec4 lightData; //light idx, face idx, *, *
 };
 
 struct UniformBufferObjectLight {
@@ -104,6 +343,8 @@ struct UniformBufferObjectLight {
     alignas(16) SphereLight sphereLights[MAX_LIGHT_COUNT];
     alignas(16) SpotLight spotLights[MAX_LIGHT_COUNT];
     alignas(16) DirectionalLight directionalLights[MAX_LIGHT_COUNT];
+    // L2 SH of the environment convolved with the cosine lobe (see ./cube --sh), rgb per coefficient
+    alignas(16) vec4 irradianceSH[9];
 };
 
 struct UniformBufferObjectSphereLight {
@@ -113,6 +354,8 @@ struct UniformBufferObjectSphereLight {
 
 struct UniformBufferObjectSSAO {
     alignas(16) vec4 samples[SSAO_SAMPLE_SIZE];
+    alignas(16) mat4 prevViewProj; // last frame's proj * view, for reprojecting the history
+    alignas(16) vec4 temporal; // frame index, samples per frame, history weight, depth rejection threshold
 };
 
 
@@ -3,14 +3,20 @@
 #include "scene/material.h"
 #include "vk/vk_debug.h"
 #include "file.hpp"
+#include "embedded_shaders.h"
 
 #include <cfloat>
+#include <cstddef>
 #include <memory>
 #include <stdexcept>
 #include <fstream>
+#include <cstring>
+#include <filesystem>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "utils/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "utils/stb_image_write.h"
 
 struct QueueFamilyIndices {
     std::optional<uint32_t> graphicsFamily;
@@ -39,6 +45,7 @@ void ViewerApplication::setUpScene(const std::string& file_name){
     uboLight.sphereLightCount = light_info_list.sphere_lights.size();
     uboLight.spotLightCount = light_info_list.spot_lights.size();
     uboLight.directionalLightCount = light_info_list.directional_lights.size();
+    loadIrradianceSH();
 }
 
 void ViewerApplication::setCamera(const std::string& camera_name) {
@@ -69,7 +76,55 @@ void ViewerApplication::enableMeasure(){
     does_measure = true;
 }
 
+void ViewerApplication::enableTemporalSSAO(){
+    ssaoPassList.temporal = true;
+}
+
+void ViewerApplication::disableSSAO(){
+    ssaoPassList.enabled = false;
+}
+
+void ViewerApplication::enableStartupReport(){
+    startup_report = true;
+}
+
+void ViewerApplication::enableBindless(){
+    bindless = true;
+}
+
+void ViewerApplication::setLodError(float pixels){
+    if(pixels <= 0.0f) {
+        throw std::runtime_error("Invalid LOD error "+std::to_string(pixels)+". Must be greater than 0 pixels");
+    }
+    lod_pixel_error = pixels;
+}
+
+void ViewerApplication::enableClusterCulling(){
+    clusterCullPass.enabled = true;
+}
+
+void ViewerApplication::enablePackedVertices(){
+    packed_vertices = true;
+}
+
+void ViewerApplication::setMeshOptimization(const std::string& mode){
+    optimize_meshes = true;
+    optimize_overdraw = mode == MESH_OPTIMIZE_OVERDRAW;
+}
+
+void ViewerApplication::enableEnvironmentCache(){
+    environment_cache = true;
+}
+
+void ViewerApplication::setFramesInFlight(int n){
+    if(n < 1) {
+        throw std::runtime_error("Invalid frames in flight "+std::to_string(n)+". Must be at least 1");
+    }
+    framesInFlight = n;
+}
+
 void ViewerApplication::run(){
+    startup_time = std::chrono::high_resolution_clock::now();
     if(!headless) {
         window_controller = std::make_shared<WindowController>();
         window_controller->initWindow(width, height);
@@ -104,21 +159,94 @@ void ViewerApplication::listPhysicalDevice(){
 
 /* ---------------- Load models ---------------- */
 void ViewerApplication::createModels(){
-    auto loadModelInfo = [&](std::vector<std::shared_ptr<ModelInfo>>& model_infos, std::vector<std::shared_ptr<VkModel>>& model_list){
+    // Meshes and materials are loaded once and shared by every node that uses them;
+    // each node becomes one row of the proxy table
+    std::map<Mesh*, uint32_t> mesh_indices;
+    std::map<Material*, uint32_t> material_indices;
+    std::map<Transform*, uint32_t> transform_indices;
+    uint32_t bindlessCount = 0;
+    VkDeviceSize vertex_bytes = 0;
+    VkDeviceSize index_bytes = 0;
+    auto loadModelInfo = [&](std::vector<std::shared_ptr<ModelInfo>>& model_infos, bool gbuffer){
         for(auto info: model_infos){
-            model_list.push_back(std::make_shared<VkModel>(info));
             std::cout<<"load "<<info->mesh->name<<"\n";
-            model_list.back()->load();
-            vertices_count += model_list.back()->mesh->vertices.size();
+            auto mesh = mesh_indices.find(info->mesh.get());
+            if(mesh == mesh_indices.end()) {
+                if(lod_pixel_error > 0.0f) {
+                    info->mesh->buildLods();
+                    std::cout<<"  "<<info->mesh->lods.size()<<" LODs, triangles";
+                    for(auto& lod: info->mesh->lods) {
+                        std::cout<<" "<<lod.indexCount / 3;
+                    }
+                    std::cout<<"\n";
+                }
+                // Only gbuffer draws are cluster culled, and a mesh of one meshlet gains nothing
+                bool clustered = clusterCullPass.enabled && gbuffer && info->mesh->lods[0].indexCount / 3 > MESHLET_MAX_TRIANGLES;
+                if(optimize_meshes) {
+                    // Meshlets are built first so the optimized order is the one drawn
+                    VertexCacheStats before, after;
+                    info->mesh->optimize(optimize_overdraw, clustered, before, after);
+                    std::cout<<"  ACMR "<<before.acmr<<" -> "<<after.acmr<<", ATVR "<<before.atvr<<" -> "<<after.atvr<<"\n";
+                } else if(clustered) {
+                    info->mesh->buildMeshlets();
+                }
+                if(clustered) {
+                    std::cout<<"  "<<info->mesh->meshlets.size()<<" meshlets\n";
+                }
+                std::vector<float> lodErrors;
+                for(auto& lod: info->mesh->lods) {
+                    lodErrors.push_back(lod.error);
+                }
+                meshes.emplace_back(info->mesh);
+                // Simple materials only need positions, normals and colors, the rest also read tangents and texture coordinates
+                uint32_t streams = info->mesh->material->type == Material::Type::SIMPLE ? SIMPLE_STREAMS : MATERIAL_STREAMS;
+                meshes.back().load(packed_vertices, streams);
+                vertex_bytes += meshes.back().vertexBufferSize;
+                index_bytes += meshes.back().indexBufferSize;
+                mesh = mesh_indices.emplace(info->mesh.get(), proxies.addMesh(info->mesh->bbox, lodErrors, meshes.back().dequantization())).first;
+            }
+            auto material = material_indices.find(info->mesh->material.get());
+            if(material == material_indices.end()) {
+                // Only the gbuffer materials go through the bindless path, the forward materials keep their descriptor sets
+                materials.emplace_back();
+                materials.back().load(info->mesh->material, gbuffer && bindless);
+                if(materials.back().bindless) {
+                    materials.back().bindlessIndex = bindlessCount++;
+                }
+                material = material_indices.emplace(info->mesh->material.get(), static_cast<uint32_t>(materials.size() - 1)).first;
+            }
+            auto transform = transform_indices.find(info->transform.get());
+            if(transform == transform_indices.end()) {
+                transform = transform_indices.emplace(info->transform.get(), proxies.addTransform(info->transform.get())).first;
+            }
+
+            const VkMaterial& vkMaterial = materials[material->second];
+            uint8_t flags = 0;
+            if(gbuffer) {
+                flags |= RenderProxyTable::GBUFFER | RenderProxyTable::CASTS_SHADOW;
+            }
+            if(vkMaterial.hasDisplacement) {
+                flags |= RenderProxyTable::DISPLACEMENT;
+            }
+            if(vkMaterial.bindless) {
+                flags |= RenderProxyTable::BINDLESS;
+            }
+            proxies.add(mesh->second, material->second, transform->second, flags, vkMaterial.bindlessIndex);
+            vertices_count += info->mesh->vertices.size();
         }
     };
-    loadModelInfo(model_info_list.simple_models, model_list.simple_models);
-    loadModelInfo(model_info_list.env_models, model_list.env_models);
-    loadModelInfo(model_info_list.mirror_models, model_list.mirror_models);
-    loadModelInfo(model_info_list.pbr_models, model_list.pbr_models);
-    loadModelInfo(model_info_list.lamber_models, model_list.lamber_models);
+    loadModelInfo(model_info_list.simple_models, false);
+    loadModelInfo(model_info_list.env_models, false);
+    loadModelInfo(model_info_list.mirror_models, false);
+    loadModelInfo(model_info_list.pbr_models, true);
+    loadModelInfo(model_info_list.lamber_models, true);
+    proxies.finalize();
 
     std::cout<<"Total vertices count: "<<vertices_count<<"\n";
+    uint32_t depth_stride = packed_vertices ? PackedVertexFormat::stride(DEPTH_STREAMS) : FullVertexFormat::stride(DEPTH_STREAMS);
+    uint32_t material_stride = packed_vertices ? PackedVertexFormat::stride(MATERIAL_STREAMS) : FullVertexFormat::stride(MATERIAL_STREAMS);
+    std::cout<<"Vertex buffers: "<<vertex_bytes / 1024<<" KB ("<<depth_stride<<" bytes per vertex in depth passes, "<<material_stride<<" in material passes)\n";
+    std::cout<<"Index buffers: "<<index_bytes / 1024<<" KB\n";
 }
 
 /** ---------------- main steps ---------------- */
@@ -155,6 +283,9 @@ void ViewerApplication::initVulkan(){
     createSSAOPassList();
     
     createDescriptorSets();
+    if(clusterCullPass.enabled) {
+        createClusterCullPass();
+    }
     
     createCommandBuffers();
     createSyncObjects();
@@ -162,8 +293,23 @@ void ViewerApplication::initVulkan(){
 
 void ViewerApplication::mainLoop(){
     if(!headless) {
+        // The calling (main) thread owns GLFW and runs the simulation: it polls input, 
+        // drives animation and produces frame packets. The render thread consumes them.
+        frame_queue.reset(1);
+        running = true;
+        std::exception_ptr render_exception = nullptr;
+        std::thread render_thread([this, &render_exception](){
+            try {
+                renderLoop();
+            } catch (...) {
+                render_exception = std::current_exception();
+                running = false;
+                frame_queue.close();
+            }
+        });
+
         auto currentTime = std::chrono::high_resolution_clock::now();
-        while(!window_controller->shouldClose()){
+        while(running && !window_controller->shouldClose()){
             glfwPollEvents();
 
             auto newTime = std::chrono::high_resolution_clock::now();
@@ -181,7 +327,24 @@ void ViewerApplication::mainLoop(){
             camera_controller->moveCamera(deltaTime);
             animation_controller->driveAnimation(deltaTime);
 
-            drawFrame();
+            FramePacket packet;
+            buildFramePacket(packet);
+            packet.inputTime = newTime;
+            // Back pressure: sleep until the render thread takes a packet instead of simulating further ahead
+            if(!frame_queue.pushWait(packet)) {
+                break;
+            }
+        }
+
+        running = false;
+        // wakes the render thread if it is waiting for a packet
+        frame_queue.close();
+        render_thread.join();
+        if(render_exception) {
+            std::rethrow_exception(render_exception);
+        }
+        if(does_measure && latency_count > 0){
+            std::cout<<"Average input-to-present latency: "<<total_latency / latency_count<<"\n";
         }
     } else {
         // Execute event
@@ -191,35 +354,151 @@ void ViewerApplication::mainLoop(){
     vkDeviceWaitIdle(device);
 }
 
+void ViewerApplication::renderLoop(){
+    FramePacket packet;
+    // popWait sleeps until a packet arrives and fails once mainLoop closes the queue
+    while(running && frame_queue.popWait(packet)) {
+        drawFrame(packet);
+
+        // Time from polling the input of this frame until its present was queued
+        float latency = std::chrono::duration<float, std::chrono::seconds::period>(std::chrono::high_resolution_clock::now() - packet.inputTime).count();
+        total_latency += latency;
+        ++latency_count;
+        if(does_measure) {
+            std::cout<<"MEASURE latency "<<latency<<"\n";
+        }
+    }
+}
+
+// Runs on the simulation thread: evaluate transforms, lights and culling into a packet
+void ViewerApplication::buildFramePacket(FramePacket& packet){
+    packet.frameId = frame_id++;
+
+    // Scene
+    if(present_width > 0 && present_height > 0) {
+        camera_controller->setHeightWdith(present_height, present_width);
+    }
+    packet.uboScene.proj = camera_controller->getPerspective();
+    packet.uboScene.proj[1][1] *= -1;
+    packet.uboScene.view = camera_controller->getView();
+    packet.uboScene.light = environment_lighting_info.transform->worldToLocal(); // transform from world space to environment space
+    packet.uboScene.eye = camera_controller->getEyePos();
+
+    // Light
+    light_info_list.update();
+    packet.uboLight = uboLight;
+    for(size_t i=0; i<packet.uboLight.sphereLightCount; i++){
+        packet.uboLight.sphereLights[i] = light_info_list.sphere_lights[i];
+    }
+    for(size_t i=0; i<packet.uboLight.spotLightCount; i++){
+        packet.uboLight.spotLights[i] = light_info_list.spot_lights[i];
+    }
+    for(size_t i=0; i<packet.uboLight.directionalLightCount; i++){
+        packet.uboLight.directionalLights[i] = light_info_list.directional_lights[i];
+    }
+
+    // Shadow
+    packet.spotLightVPs.resize(shadowMapPassList.shadowMapPassesSpot.size());
+    for(size_t i=0; i<shadowMapPassList.shadowMapPassesSpot.size(); i++)  {
+        auto& shadowMapPass = shadowMapPassList.shadowMapPassesSpot[i];
+        packet.spotLightVPs[i] = shadowMapPass.uboShadow.proj * shadowMapPass.transform->worldToLocal();
+        packet.uboLight.spotLights[shadowMapPass.light_idx].lightVP = packet.spotLightVPs[i];
+    }
+
+    // UniformBufferObjectSphereLight for sphere light shadow map rendering
+    // Only the packet is written here, the render thread owns shadowMapPassList
+    packet.sphereLightPositions.resize(shadowMapPassList.shadowMapPassesSphere.size());
+    if(shadowMapPassList.shadowMapPassesSphere.size()>0) {
+        for(size_t i=0; i<shadowMapPassList.shadowMapPassesSphere.size(); i++)  {
+            packet.sphereLightPositions[i] = shadowMapPassList.shadowMapPassesSphere[i].updateSphereShadowData(packet.uboSphere);
+        }
+        for(size_t i=0; i<uboLight.sphereLightCount; i++){
+            packet.uboSphere.sphereLights[i] = light_info_list.sphere_lights[i];
+        } 
+    }
+
+    // Models
+    mat4 VP;
+    if(camera_controller->isDebug()) {
+        VP = camera_controller->getPrevPerspective() * camera_controller->getPrevView();
+    } else {
+        VP = packet.uboScene.proj * packet.uboScene.view;
+    }
+    proxies.update();
+    proxies.buildGBufferQueue(VP, packet.uboScene.view, culling != CULLING_NONE, packet.gbufferQueue);
+
+    // LODs per pass from the projected error seen by its camera; the six faces of a cube
+    // shadow map share the light position and projection, so they share one selection.
+    // Without --lod the lists stay empty and every mesh is drawn at full resolution
+    packet.spotShadowLods.resize(shadowMapPassList.shadowMapPassesSpot.size());
+    packet.sphereShadowLods.resize(shadowMapPassList.shadowMapPassesSphere.size());
+    packet.gbufferLods.clear();
+    if(lod_pixel_error > 0.0f) {
+        float viewportHeight = static_cast<float>(present_height > 0 ? present_height.load() : height);
+        proxies.selectLods(packet.gbufferQueue, packet.uboScene.eye, std::abs(packet.uboScene.proj[1][1]) * viewportHeight * 0.5f, lod_pixel_error, packet.gbufferLods);
+
+        for(size_t i=0; i<shadowMapPassList.shadowMapPassesSpot.size(); i++)  {
+            auto& shadowMapPass = shadowMapPassList.shadowMapPassesSpot[i];
+            vec3 lightPos = shadowMapPass.transform->localToWorld() * vec4(0,0,0,1);
+            proxies.selectLods(proxies.shadowCasters, lightPos, std::abs(shadowMapPass.uboShadow.proj[1][1]) * shadowMapPass.shadow_res * 0.5f, lod_pixel_error, packet.spotShadowLods[i]);
+        }
+        for(size_t i=0; i<shadowMapPassList.shadowMapPassesSphere.size(); i++)  {
+            auto& shadowMapPass = shadowMapPassList.shadowMapPassesSphere[i];
+            // 90 degree faces, proj[1][1] is 1
+            proxies.selectLods(proxies.shadowCasters, packet.sphereLightPositions[i], shadowMapPass.shadow_res * 0.5f, lod_pixel_error, packet.sphereShadowLods[i]);
+        }
+    }
+    // Packets are never dropped, so the render thread only needs what changed since the previous one
+    packet.instanceUpdates.clear();
+    for(uint32_t i: proxies.changed) {
+        packet.instanceUpdates.emplace_back(i, proxies.instances[i]);
+    }
+}
+
 void ViewerApplication::cleanUp(){
     cleanupSwapChain();
     
     // destroy materials and textures
-    model_list.destroyMaterial();
+    for(auto& material: materials) {
+        material.destroy();
+    }
     destroyEnvironment();
     
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < framesInFlight; i++) {
         uniformBuffers[i].destroy();
         lightUniformBuffers[i].destroy();
+        instanceBuffers[i].destroy();
     }
     
     shadowMapPassList.destroy();
     gBufferPass.destroy();
     ssaoPassList.destroy();
+    clusterCullPass.destroy();
 
     vkDestroyDescriptorPool(device, descriptorPool, nullptr);
     vkDestroyDescriptorSetLayout(device, descriptorSetLayoutScene, nullptr);
     vkDestroyDescriptorSetLayout(device, descriptorSetLayoutMaterial, nullptr);
+    if(bindless) {
+        vkDestroyDescriptorPool(device, bindlessDescriptorPool, nullptr);
+        vkDestroyDescriptorSetLayout(device, descriptorSetLayoutBindless, nullptr);
+        materialBuffer.destroy();
+    }
     
-    model_list.destroy();
+    for(auto& mesh: meshes) {
+        mesh.destroy();
+    }
     
     pipelines.destroy();
+    for(auto& [key, pipeline]: pipelineVariants) {
+        vkDestroyPipeline(device, pipeline, nullptr);
+    }
     vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+    savePipelineCache();
     vkDestroyPipelineCache(device, pipelineCache, nullptr);
 
     vkDestroyRenderPass(device, renderPass, nullptr);
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < framesInFlight; i++) {
         vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
         vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
         vkDestroyFence(device, inFlightFences[i], nullptr);
@@ -414,6 +693,87 @@ void ViewerApplication::pickPysicalDevice(){
     if(physicalDevice==VK_NULL_HANDLE){
         throw std::runtime_error("failed to find a suitable GPU!");
     }
+
+    if(bindless && !checkBindlessSupport(physicalDevice)) {
+        std::cout<<"Bindless materials are not supported by "<<physicalDeviceProperties.deviceName<<", using per-model descriptor sets\n";
+        bindless = false;
+    }
+    if(clusterCullPass.enabled && !checkClusterCullingSupport(physicalDevice)) {
+        std::cout<<"Cluster culling is not supported by "<<physicalDeviceProperties.deviceName<<", drawing whole meshes\n";
+        clusterCullPass.enabled = false;
+    }
+}
+
+bool ViewerApplication::checkBindlessSupport(VkPhysicalDevice device) {
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+    
+    std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
+
+    std::set<std::string> requiredExtensions = {VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME, VK_KHR_MAINTENANCE3_EXTENSION_NAME};
+    for(const auto& extension: availableExtensions){
+        requiredExtensions.erase(extension.extensionName);
+    }
+    if(!requiredExtensions.empty()) {
+        return false;
+    }
+
+    // The instance is created for Vulkan 1.0, so go through VK_KHR_get_physical_device_properties2
+    auto getFeatures2 = reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2KHR>(vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR"));
+    auto getProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2KHR>(vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties2KHR"));
+    if(getFeatures2 == nullptr || getProperties2 == nullptr) {
+        return false;
+    }
+
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+    indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    VkPhysicalDeviceFeatures2KHR features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+    features.pNext = &indexingFeatures;
+    getFeatures2(device, &features);
+    if(!indexingFeatures.runtimeDescriptorArray ||
+       !indexingFeatures.shaderSampledImageArrayNonUniformIndexing ||
+       !indexingFeatures.descriptorBindingPartiallyBound ||
+       !indexingFeatures.descriptorBindingVariableDescriptorCount ||
+       !indexingFeatures.descriptorBindingSampledImageUpdateAfterBind) {
+        return false;
+    }
+
+    VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexingProperties{};
+    indexingProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+    VkPhysicalDeviceProperties2KHR properties{};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+    properties.pNext = &indexingProperties;
+    getProperties2(device, &properties);
+
+    // Combined image samplers count towards both the sampler and the sampled image limits
+    uint32_t limit = std::min({indexingProperties.maxPerStageDescriptorUpdateAfterBindSamplers,
+                               indexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                               indexingProperties.maxDescriptorSetUpdateAfterBindSamplers,
+                               indexingProperties.maxDescriptorSetUpdateAfterBindSampledImages});
+    if(limit <= BINDLESS_RESERVED_DESCRIPTORS) {
+        return false;
+    }
+    bindlessTextureCapacity = std::min(limit - BINDLESS_RESERVED_DESCRIPTORS, MAX_BINDLESS_TEXTURES);
+    return true;
+}
+
+bool ViewerApplication::checkClusterCullingSupport(VkPhysicalDevice device) {
+    // Every clustered draw is one vkCmdDrawIndexedIndirect over its meshlets
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
+    if(!supportedFeatures.multiDrawIndirect) {
+        return false;
+    }
+
+    // The culling dispatch is recorded into the command buffer of the gbuffer pass
+    QueueFamilyIndices indices = findQueueFamilies(device);
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
+    return (queueFamilies[indices.graphicsFamily.value()].queueFlags & VK_QUEUE_COMPUTE_BIT) != 0;
 }
 
 
@@ -434,18 +794,39 @@ void ViewerApplication::createLogicalDevice(){
         queueCreateInfos.push_back(queueCreateInfo);
     }
     
+    // Block compressed textures are optional, without them the PNGs are loaded
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+    bcTextures = supportedFeatures.textureCompressionBC;
+
     VkPhysicalDeviceFeatures deviceFeatures{};
     deviceFeatures.samplerAnisotropy = VK_TRUE;
+    deviceFeatures.multiDrawIndirect = clusterCullPass.enabled;
+    deviceFeatures.textureCompressionBC = bcTextures;
+
+    std::vector<const char*> enabledExtensions = deviceExtensions;
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+    indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    if(bindless) {
+        enabledExtensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+        enabledExtensions.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+        indexingFeatures.runtimeDescriptorArray = VK_TRUE;
+        indexingFeatures.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+        indexingFeatures.descriptorBindingPartiallyBound = VK_TRUE;
+        indexingFeatures.descriptorBindingVariableDescriptorCount = VK_TRUE;
+        indexingFeatures.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    }
     
     VkDeviceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    createInfo.pNext = bindless ? &indexingFeatures : nullptr;
     createInfo.pQueueCreateInfos = queueCreateInfos.data();
     createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
     
     createInfo.pEnabledFeatures = &deviceFeatures;
     
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+    createInfo.ppEnabledExtensionNames = enabledExtensions.data();
     if(enableValidationLayers){
         createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
         createInfo.ppEnabledLayerNames = validationLayers.data();
@@ -674,6 +1055,10 @@ void ViewerApplication::createSwapChain() {
     
     swapChainImageFormat = surfaceFormat.format;
     swapChainExtent = extent;
+
+    // Picked up by the simulation thread to update the projection matrix
+    present_width = extent.width;
+    present_height = extent.height;
 }
 
 /* ------------ Image View ------------ */
@@ -687,35 +1072,194 @@ void ViewerApplication::createImageViews(){
 
 /* ------------- Graphics Pipeline ------------- */
 void ViewerApplication::createGraphicsPipeline() {
-    // Create Pipeline cache
-    VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
-	pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-	VK_CHECK_RESULT(vkCreatePipelineCache(device, &pipelineCacheCreateInfo, nullptr, &pipelineCache), "fail to create pipeline cache");
+    auto pipelineStartTime = std::chrono::high_resolution_clock::now();
 
+    // Create Pipeline cache, seeded from disk if a cache from the same device and driver exists
+    loadPipelineCache();
 
-    // Programmable shader stages
-    std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages;
+    //setup push constants
+    VkPushConstantRange pushConstantRange;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = static_cast<uint32_t>(std::max(sizeof(PushConstantShadow), sizeof(PushConstantCubeShadow)));
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    std::vector<VkDescriptorSetLayout> descriptorSetLayouts = {descriptorSetLayoutScene, descriptorSetLayoutMaterial};
+    if(bindless) {
+        descriptorSetLayouts.push_back(descriptorSetLayoutBindless);
+    }
+    
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(descriptorSetLayouts.size()); // Optional
+    pipelineLayoutInfo.pSetLayouts = descriptorSetLayouts.data(); // Optional
+    pipelineLayoutInfo.pushConstantRangeCount = 1; // Optional
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange; // Optional
+
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline layout!");
+    }
     
+    bool hasSpotShadow = false;
+    for(auto& info: light_info_list.spot_light_infos) {
+        hasSpotShadow |= info->shadow_res > 0;
+    }
+    bool hasSphereShadow = false;
+    for(auto& info: light_info_list.sphere_light_infos) {
+        hasSphereShadow |= info->shadow_res > 0;
+    }
+    for(auto& models: {model_info_list.pbr_models, model_info_list.lamber_models}) {
+        for(auto& info: models) {
+            bool displacement = info->mesh->material->displacement_map.has_value();
+            hasDisplacedMaterials |= displacement;
+            hasFlatMaterials |= !displacement;
+        }
+    }
+
+    sceneVariant.sphereLightCount = static_cast<int32_t>(light_info_list.sphere_lights.size());
+    sceneVariant.spotLightCount = static_cast<int32_t>(light_info_list.spot_lights.size());
+    sceneVariant.directionalLightCount = static_cast<int32_t>(light_info_list.directional_lights.size());
+    sceneVariant.spotShadows = hasSpotShadow;
+    sceneVariant.sphereShadows = hasSphereShadow;
+    sceneVariant.ssao = ssaoPassList.enabled;
+    // Only pbr and lambertian models reach the gbuffer, without them the lighting pass shades no pixel.
+    // Scenes without an environment keep IBL, they shaded with it before specialization
+    sceneVariant.ibl = !model_info_list.pbr_models.empty() || !model_info_list.lamber_models.empty();
+    sceneVariant.displacement = VK_TRUE;
+    sceneVariant.packedVertices = packed_vertices;
+    sceneVariant.irradianceSH = irradiance_sh;
+
+    // The deferred path always needs the gbuffer, ssao and the final lighting pass.
+    // Everything else is only built up front if the scene uses it, and otherwise on first use (see getPipeline)
+    pipelineDescs = {
+        {"Simple", &pipelines.simple, SIMPLE_VSHADER, SIMPLE_FSHADER, renderPass, SIMPLE_STREAMS, VK_CULL_MODE_BACK_BIT, 1, false, false},
+        {"Env", &pipelines.env, ENV_VSHADER, ENV_FSHADER, renderPass, MATERIAL_STREAMS, VK_CULL_MODE_BACK_BIT, 1, false, false},
+        {"Mirror", &pipelines.mirror, MIRROR_VSHADER, MIRROR_FSHADER, renderPass, MATERIAL_STREAMS, VK_CULL_MODE_BACK_BIT, 1, false, false},
+        {"Lambertian", &pipelines.lamber, LAMBER_VSHADER, LAMBER_FSHADER, renderPass, 0, VK_CULL_MODE_FRONT_BIT, 1, false, false},
+        {"Pbr", &pipelines.pbr, PBR_VSHADER, PBR_FSHADER, renderPass, 0, VK_CULL_MODE_FRONT_BIT, 1, false, true},
+        {"SSAO", &pipelines.ssao, SSAO_VSHADER, SSAO_FSHADER, ssaoPassList.ssaoRenderPass(), 0, VK_CULL_MODE_FRONT_BIT, 1, false, ssaoPassList.enabled},
+        {"SSAO Blur", &pipelines.ssaoBlur, SSAO_BLUR_VSHADER, SSAO_BLUR_FSHADER, ssaoPassList.renderPass, 0, VK_CULL_MODE_FRONT_BIT, 1, false, ssaoPassList.enabled},
+        {"GBuffer", &pipelines.gbuffer, GBUFFER_VSHADER, bindless ? GBUFFER_BINDLESS_FSHADER : GBUFFER_FSHADER, gBufferPass.renderPass, MATERIAL_STREAMS, VK_CULL_MODE_BACK_BIT, 5, false, hasDisplacedMaterials},
+        {"Debug shadow", &pipelines.debug, DEBUG_SHADOW_VSHADER, DEBUG_SHADOW_FSHADER, renderPass, 0, VK_CULL_MODE_NONE, 1, false, DISPLAY_SHADOW_MAP_SPOT},
+        {"Debug shadow cube", &pipelines.debugCube, DEBUG_SHADOW_VSHADER, DEBUG_SHADOW_CUBE_FSHADER, renderPass, 0, VK_CULL_MODE_NONE, 1, false, DISPLAY_SHADOW_MAP_SPHERE},
+        {"Shadow cube", &pipelines.shadowCube, SHADOW_CUBE_VSHADER, SHADOW_CUBE_FSHADER, shadowMapPassList.renderPassSphere, DEPTH_STREAMS, VK_CULL_MODE_NONE, 1, false, hasSphereShadow},
+        // No color attachments; front face culling and depth bias (set dynamically) avoid shadow acne
+        {"Shadow", &pipelines.shadow, SHADOW_VSHADER, "", shadowMapPassList.renderPassSpot, DEPTH_STREAMS, VK_CULL_MODE_FRONT_BIT, 0, true, hasSpotShadow},
+    };
+    struct PipelineJob {
+        const PipelineDesc* desc;
+        ShaderVariant variant;
+        VkPipeline* pipeline;
+    };
+    std::vector<PipelineJob> required;
+    for(auto& desc: pipelineDescs) {
+        if(desc.required) {
+            required.push_back({&desc, sceneVariant, desc.pipeline});
+        }
+    }
+    if(hasFlatMaterials) {
+        // Materials without displacement map skip parallax occlusion mapping
+        ShaderVariant variant = sceneVariant;
+        variant.displacement = VK_FALSE;
+        const PipelineDesc& desc = findPipelineDesc(pipelines.gbuffer);
+        // Insert before the workers start so they only write to existing entries
+        VkPipeline& pipeline = pipelineVariants[{desc.name, variant.key()}];
+        required.push_back({&desc, variant, &pipeline});
+    }
+    std::vector<float> pipelineTimes(required.size());
+
+    // Create the pipelines on worker threads
+    size_t workerCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, required.size());
+    std::atomic<size_t> nextPipeline{0};
+    std::vector<std::exception_ptr> workerExceptions(workerCount);
+    std::vector<std::thread> workers;
+    for(size_t w=0; w<workerCount; w++) {
+        workers.emplace_back([&, w](){
+            try {
+                for(size_t idx = nextPipeline++; idx < required.size(); idx = nextPipeline++) {
+                    pipelineTimes[idx] = createPipeline(*required[idx].desc, required[idx].variant, required[idx].pipeline);
+                }
+            } catch (...) {
+                workerExceptions[w] = std::current_exception();
+            }
+        });
+    }
+    for(auto& worker: workers) {
+        worker.join();
+    }
+    for(auto& workerException: workerExceptions) {
+        if(workerException) {
+            std::rethrow_exception(workerException);
+        }
+    }
+
+    float totalTime = std::chrono::duration<float, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - pipelineStartTime).count();
+    if(startup_report) {
+        std::cout<<"STARTUP pipeline cache "<<(pipelineCacheLoaded ? "loaded from " : "not found at ")<<PIPELINE_CACHE_PATH<<"\n";
+        for(size_t i=0; i<required.size(); i++) {
+            std::cout<<"STARTUP pipeline "<<required[i].desc->name<<" (variant "<<std::hex<<required[i].variant.key()<<std::dec<<") "<<pipelineTimes[i]<<" ms\n";
+        }
+        std::cout<<"STARTUP pipelines total "<<totalTime<<" ms on "<<workerCount<<" threads\n";
+    } else {
+        std::cout<<"Created "<<required.size()<<" pipelines in "<<totalTime<<" ms\n";
+    }
+}
+
+float ViewerApplication::createPipeline(const PipelineDesc& desc, const ShaderVariant& variant, VkPipeline* pipeline) {
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    // Every pipeline builds its own copy of the fixed function state so that they can be created concurrently
+
+    // Programmable shader stages
+    std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
+    shaderStages.push_back(loadShader(desc.vertShader, VK_SHADER_STAGE_VERTEX_BIT));
+    if(!desc.fragShader.empty()) {
+        shaderStages.push_back(loadShader(desc.fragShader, VK_SHADER_STAGE_FRAGMENT_BIT));
+    }
+
+    // Constants a shader does not declare are ignored, so every stage gets the whole variant
+    std::array<VkSpecializationMapEntry, 10> specializationEntries = {{
+        {0, offsetof(ShaderVariant, sphereLightCount), sizeof(int32_t)},
+        {1, offsetof(ShaderVariant, spotLightCount), sizeof(int32_t)},
+        {2, offsetof(ShaderVariant, directionalLightCount), sizeof(int32_t)},
+        {3, offsetof(ShaderVariant, spotShadows), sizeof(VkBool32)},
+        {4, offsetof(ShaderVariant, sphereShadows), sizeof(VkBool32)},
+        {5, offsetof(ShaderVariant, ssao), sizeof(VkBool32)},
+        {6, offsetof(ShaderVariant, ibl), sizeof(VkBool32)},
+        {7, offsetof(ShaderVariant, displacement), sizeof(VkBool32)},
+        {8, offsetof(ShaderVariant, packedVertices), sizeof(VkBool32)},
+        {9, offsetof(ShaderVariant, irradianceSH), sizeof(VkBool32)},
+    }};
+    VkSpecializationInfo specializationInfo{};
+    specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+    specializationInfo.pMapEntries = specializationEntries.data();
+    specializationInfo.dataSize = sizeof(ShaderVariant);
+    specializationInfo.pData = &variant;
+    for(auto& shaderStage: shaderStages) {
+        shaderStage.pSpecializationInfo = &specializationInfo;
+    }
+
     std::vector<VkDynamicState> dynamicStates = {
         VK_DYNAMIC_STATE_VIEWPORT,
         VK_DYNAMIC_STATE_SCISSOR
     };
-
-    VkPipelineDynamicStateCreateInfo dynamicStateInfo{};
-    dynamicStateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamicStateInfo.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
-    dynamicStateInfo.pDynamicStates = dynamicStates.data();
     
     // Fixed function stage
+    // Fullscreen passes generate their vertices in the vertex shader
+    std::vector<VkVertexInputBindingDescription> bindingDescriptions;
+    std::vector<VkVertexInputAttributeDescription> attributeDescriptions;
+    if(variant.packedVertices) {
+        PackedVertexFormat::describe(desc.vertexStreams, bindingDescriptions, attributeDescriptions);
+    } else {
+        FullVertexFormat::describe(desc.vertexStreams, bindingDescriptions, attributeDescriptions);
+    }
     VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    
-    auto bindingDescription = Vertex::getBindingDescription();
-    auto attributeDescriptions = Vertex::getAttributeDescriptions();
-    vertexInputInfo.vertexBindingDescriptionCount = 1;
-    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription; // Optional
-    vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
-    vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data(); // Optional
+    if(desc.vertexStreams != 0) {
+        vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescriptions.size());
+        vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data(); // Optional
+        vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
+        vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data(); // Optional
+    }
     
     VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
     inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
@@ -734,7 +1278,7 @@ void ViewerApplication::createGraphicsPipeline() {
     rasterizer.rasterizerDiscardEnable = VK_FALSE;
     rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
     rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizer.cullMode = desc.cullMode;
     rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
     rasterizer.depthBiasEnable = VK_FALSE;
     rasterizer.depthBiasConstantFactor = 0.0f; // Optional
@@ -767,39 +1311,25 @@ void ViewerApplication::createGraphicsPipeline() {
 //        colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
 //        colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
 //        colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+    // GBuffer writes 5 color attachments
+    std::array<VkPipelineColorBlendAttachmentState, 5> blendAttachmentStates;
+    blendAttachmentStates.fill(colorBlendAttachment);
     
     VkPipelineColorBlendStateCreateInfo colorBlending{};
     colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
     colorBlending.logicOpEnable = VK_FALSE;
     colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
-    colorBlending.attachmentCount = 1;
-    colorBlending.pAttachments = &colorBlendAttachment;
+    colorBlending.attachmentCount = desc.colorAttachmentCount;
+    colorBlending.pAttachments = blendAttachmentStates.data();
     colorBlending.blendConstants[0] = 0.0f; // Optional
     colorBlending.blendConstants[1] = 0.0f; // Optional
     colorBlending.blendConstants[2] = 0.0f; // Optional
     colorBlending.blendConstants[3] = 0.0f; // Optional
 
-    //setup push constants
-    VkPushConstantRange pushConstantRange;
-    pushConstantRange.offset = 0;
-    pushConstantRange.size = sizeof(PushConstantModel);
-    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-
-    std::array<VkDescriptorSetLayout, 2> descriptorSetLayouts = {descriptorSetLayoutScene, descriptorSetLayoutMaterial};
-    
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(descriptorSetLayouts.size()); // Optional
-    pipelineLayoutInfo.pSetLayouts = descriptorSetLayouts.data(); // Optional
-    pipelineLayoutInfo.pushConstantRangeCount = 1; // Optional
-    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange; // Optional
-
-    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create pipeline layout!");
-    }
-    
     VkPipelineDepthStencilStateCreateInfo depthStencil{};
     depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_TRUE;
+    depthStencil.depthWriteEnable = VK_TRUE;
     depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
     depthStencil.depthBoundsTestEnable = VK_FALSE;
     depthStencil.minDepthBounds = 0.0f; // Optional
@@ -807,6 +1337,18 @@ void ViewerApplication::createGraphicsPipeline() {
     depthStencil.stencilTestEnable = VK_FALSE;
     depthStencil.front = {}; // Optional
     depthStencil.back = {}; // Optional
+
+    if(desc.depthBias) {
+        depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+        rasterizer.depthBiasEnable = VK_TRUE;
+        // Add depth bias to dynamic state, so we can change it at runtime
+        dynamicStates.push_back(VK_DYNAMIC_STATE_DEPTH_BIAS);
+    }
+
+    VkPipelineDynamicStateCreateInfo dynamicStateInfo{};
+    dynamicStateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicStateInfo.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+    dynamicStateInfo.pDynamicStates = dynamicStates.data();
     
     VkGraphicsPipelineCreateInfo pipelineInfo{};
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -821,155 +1363,121 @@ void ViewerApplication::createGraphicsPipeline() {
     pipelineInfo.pColorBlendState = &colorBlending;
     pipelineInfo.pDynamicState = &dynamicStateInfo;
     pipelineInfo.layout = pipelineLayout;
-    pipelineInfo.renderPass = renderPass;
+    pipelineInfo.renderPass = desc.renderPass;
     pipelineInfo.subpass = 0;
     pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
     pipelineInfo.basePipelineIndex = -1; // Optional
 
-    VkPipelineVertexInputStateCreateInfo emptyInputState {}; // Empty vertex input state
-    emptyInputState.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    // The pipeline cache is internally synchronized
+    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, pipeline), "Failed to create "+desc.name+" pipeline!");
+    for(auto& shaderStage: shaderStages) {
+        vkDestroyShaderModule(device, shaderStage.module, nullptr);
+    }
 
-    // Simple pipeline
-    depthStencil.depthTestEnable = VK_TRUE;
-    depthStencil.depthWriteEnable = VK_TRUE;
-    shaderStages[0] = loadShader(SIMPLE_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(SIMPLE_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create Simple pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.simple), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-
-    // Environment pipeline
-    shaderStages[0] = loadShader(ENV_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(ENV_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create Env pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.env), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-
-    // Mirror pipeline
-    shaderStages[0] = loadShader(MIRROR_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(MIRROR_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create Mirror pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.mirror), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-    
-    // Lambertian pipeline
-    rasterizer.cullMode = VK_CULL_MODE_FRONT_BIT;
-    pipelineInfo.pVertexInputState = &emptyInputState;
-    shaderStages[0] = loadShader(LAMBER_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(LAMBER_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create Lambertian pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.lamber), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-
-    // Pbr pipeline
-    shaderStages[0] = loadShader(PBR_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(PBR_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create Pbr pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.pbr), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-
-    // SSAO pipeline
-    pipelineInfo.renderPass = ssaoPassList.renderPass;
-    shaderStages[0] = loadShader(SSAO_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(SSAO_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create SSAO pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.ssao), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-
-    // SSAO pipeline
-    shaderStages[0] = loadShader(SSAO_BLUR_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(SSAO_BLUR_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create SSAO Blur pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.ssaoBlur), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-
-    // Gbuffer pipeline
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-    pipelineInfo.pVertexInputState = &vertexInputInfo;
-    pipelineInfo.renderPass = gBufferPass.renderPass;
-    VkPipelineColorBlendAttachmentState colorBlendAttachmentState{};
-    colorBlendAttachmentState.colorWriteMask = 0xf;
-    colorBlendAttachmentState.blendEnable = VK_FALSE;
-    std::array<VkPipelineColorBlendAttachmentState, 5> blendAttachmentStates = {
-        colorBlendAttachmentState,
-        colorBlendAttachmentState,
-        colorBlendAttachmentState,
-        colorBlendAttachmentState,
-        colorBlendAttachmentState
-    };
-    colorBlending.attachmentCount = static_cast<uint32_t>(blendAttachmentStates.size());
-    colorBlending.pAttachments = blendAttachmentStates.data();
-    shaderStages[0] = loadShader(GBUFFER_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(GBUFFER_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create GBuffer pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.gbuffer), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-    colorBlending.attachmentCount = 1;
-    colorBlending.pAttachments = &colorBlendAttachment;
-    pipelineInfo.renderPass = renderPass;
-
-    // Debug shadow pipeline
-    rasterizer.cullMode = VK_CULL_MODE_NONE;
-    pipelineInfo.pVertexInputState = &emptyInputState;
-    shaderStages[0] = loadShader(DEBUG_SHADOW_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(DEBUG_SHADOW_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create Debug shadow pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.debug), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-
-    // Debug shadow cube pipeline
-    shaderStages[0] = loadShader(DEBUG_SHADOW_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(DEBUG_SHADOW_CUBE_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    std::cout<<"Create Debug shadow cube pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.debugCube), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-
-    // Shadow cube pipeline
-    shaderStages[0] = loadShader(SHADOW_CUBE_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    shaderStages[1] = loadShader(SHADOW_CUBE_FSHADER, VK_SHADER_STAGE_FRAGMENT_BIT);
-    pipelineInfo.pVertexInputState = &vertexInputInfo;
-    pipelineInfo.renderPass = shadowMapPassList.renderPassSphere;
-    std::cout<<"Create Shadow cube pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.shadowCube), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(device, shaderStages[1].module, nullptr);
-
-    // Shadow pipeline
-    shaderStages[0] = loadShader(SHADOW_VSHADER, VK_SHADER_STAGE_VERTEX_BIT); 
-    pipelineInfo.stageCount = 1;
-    // No blend attachment states (no color attachments used)
-    colorBlending.attachmentCount = 0;
-    // Disable culling, so all faces contribute to shadows
-    rasterizer.cullMode = VK_CULL_MODE_FRONT_BIT;//VK_CULL_MODE_NONE;//
-    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-    // Enable depth bias
-    rasterizer.depthBiasEnable = VK_TRUE;
-    // Add depth bias to dynamic state, so we can change it at runtime
-    dynamicStates.push_back(VK_DYNAMIC_STATE_DEPTH_BIAS);
-    dynamicStateInfo.pDynamicStates = dynamicStates.data();
-    dynamicStateInfo.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
-    pipelineInfo.renderPass = shadowMapPassList.renderPassSpot;
-    std::cout<<"Create Shadow pipeline\n";
-    VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipelines.shadow), "Failed to create pipeline!");
-    vkDestroyShaderModule(device, shaderStages[0].module, nullptr);
-    
+    return std::chrono::duration<float, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - startTime).count();
+}
+
+const ViewerApplication::PipelineDesc& ViewerApplication::findPipelineDesc(const VkPipeline& pipeline) {
+    for(auto& desc: pipelineDescs) {
+        if(desc.pipeline == &pipeline) {
+            return desc;
+        }
+    }
+    throw std::runtime_error("unknown pipeline requested!");
+}
+
+VkPipeline ViewerApplication::getPipeline(VkPipeline& pipeline) {
+    if(pipeline == VK_NULL_HANDLE) {
+        const PipelineDesc& desc = findPipelineDesc(pipeline);
+        float time = createPipeline(desc, sceneVariant, &pipeline);
+        if(startup_report) {
+            std::cout<<"STARTUP pipeline "<<desc.name<<" created on first use "<<time<<" ms\n";
+        }
+    }
+    return pipeline;
+}
+
+VkPipeline ViewerApplication::getPipeline(VkPipeline& pipeline, const ShaderVariant& variant) {
+    if(variant.key() == sceneVariant.key()) {
+        return getPipeline(pipeline);
+    }
+    const PipelineDesc& desc = findPipelineDesc(pipeline);
+    VkPipeline& variantPipeline = pipelineVariants[{desc.name, variant.key()}];
+    if(variantPipeline == VK_NULL_HANDLE) {
+        float time = createPipeline(desc, variant, &variantPipeline);
+        if(startup_report) {
+            std::cout<<"STARTUP pipeline "<<desc.name<<" (variant "<<std::hex<<variant.key()<<std::dec<<") created on first use "<<time<<" ms\n";
+        }
+    }
+    return variantPipeline;
+}
+
+void ViewerApplication::loadPipelineCache() {
+    std::vector<char> cacheData;
+    std::ifstream file(PIPELINE_CACHE_PATH, std::ios::binary);
+    if(file.is_open()) {
+        file.close();
+        cacheData = readFile(PIPELINE_CACHE_PATH);
+    }
+
+    // Only hand the data to the driver if it was written by the same device and driver
+    pipelineCacheLoaded = false;
+    if(cacheData.size() >= sizeof(VkPipelineCacheHeaderVersionOne)) {
+        VkPipelineCacheHeaderVersionOne header;
+        memcpy(&header, cacheData.data(), sizeof(header));
+        pipelineCacheLoaded = header.headerSize >= sizeof(header)
+            && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+            && header.vendorID == physicalDeviceProperties.vendorID
+            && header.deviceID == physicalDeviceProperties.deviceID
+            && memcmp(header.pipelineCacheUUID, physicalDeviceProperties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+        if(!pipelineCacheLoaded) {
+            std::cout<<"Ignoring pipeline cache "<<PIPELINE_CACHE_PATH<<" from a different device or driver\n";
+        }
+    }
+
+    VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
+	pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    if(pipelineCacheLoaded) {
+        pipelineCacheCreateInfo.initialDataSize = cacheData.size();
+        pipelineCacheCreateInfo.pInitialData = cacheData.data();
+    }
+	VK_CHECK_RESULT(vkCreatePipelineCache(device, &pipelineCacheCreateInfo, nullptr, &pipelineCache), "fail to create pipeline cache");
+}
+
+void ViewerApplication::savePipelineCache() {
+    size_t dataSize = 0;
+    VK_CHECK_RESULT(vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr), "fail to get pipeline cache size");
+    std::vector<char> cacheData(dataSize);
+    VK_CHECK_RESULT(vkGetPipelineCacheData(device, pipelineCache, &dataSize, cacheData.data()), "fail to get pipeline cache data");
+
+    // Write to a temporary file first so an interrupted write never leaves a truncated cache behind
+    std::string tmpPath = PIPELINE_CACHE_PATH + ".tmp";
+    std::error_code ec;
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if(!file.is_open()) {
+        std::cerr<<"failed to write pipeline cache "<<PIPELINE_CACHE_PATH<<"\n";
+        return;
+    }
+    file.write(cacheData.data(), dataSize);
+    file.close();
+    if(!file) {
+        std::cerr<<"failed to write pipeline cache "<<PIPELINE_CACHE_PATH<<"\n";
+        std::filesystem::remove(tmpPath, ec);
+        return;
+    }
+    // std::filesystem::rename replaces an existing cache, which std::rename does not on Windows
+    std::filesystem::rename(tmpPath, PIPELINE_CACHE_PATH, ec);
+    if(ec) {
+        std::cerr<<"failed to replace pipeline cache "<<PIPELINE_CACHE_PATH<<": "<<ec.message()<<"\n";
+        std::filesystem::remove(tmpPath, ec);
+    }
 }
 
-VkShaderModule ViewerApplication::createShaderModule(const std::vector<char>& code) {
+VkShaderModule ViewerApplication::createShaderModule(const uint32_t* code, size_t size) {
     VkShaderModuleCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    createInfo.codeSize = code.size();
-    createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+    createInfo.codeSize = size;
+    createInfo.pCode = code;
 
     VkShaderModule shaderModule;
     if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
@@ -980,8 +1488,15 @@ VkShaderModule ViewerApplication::createShaderModule(const std::vector<char>& co
 }
 
 VkPipelineShaderStageCreateInfo ViewerApplication::loadShader(const std::string shaderFileName, VkShaderStageFlagBits stageFlag) {
-    auto shaderCode = readFile(shaderFileName);
-    VkShaderModule shaderModule = createShaderModule(shaderCode);
+    // Prefer the SPIR-V embedded at build time, fall back to the file next to the binary
+    VkShaderModule shaderModule;
+    const EmbeddedShader* embedded = findEmbeddedShader(shaderFileName.substr(shaderFileName.find_last_of("/")+1));
+    if(embedded != nullptr) {
+        shaderModule = createShaderModule(embedded->code, embedded->size);
+    } else {
+        auto shaderCode = readFile(shaderFileName);
+        shaderModule = createShaderModule(reinterpret_cast<const uint32_t*>(shaderCode.data()), shaderCode.size());
+    }
     VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
     vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     vertShaderStageInfo.stage = stageFlag;
@@ -1097,7 +1612,7 @@ void ViewerApplication::createCommandPool() {
 }
 
 void ViewerApplication::createCommandBuffers() {
-    commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    commandBuffers.resize(framesInFlight);
     
     VkCommandBufferAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -1131,6 +1646,62 @@ VkRect2D ViewerApplication::createScissor(int32_t width, int32_t height, int32_t
     return rect2D;
 }
 
+// The queue is sorted so draws sharing a pipeline, material or mesh are adjacent;
+// state is only bound when it differs from the previous draw
+void ViewerApplication::drawQueue(VkCommandBuffer commandBuffer, const std::vector<uint32_t>& queue, const std::vector<uint8_t>& lods, const VkPipeline* gbufferPipelines, PassStats& stats) {
+    VkPipeline boundPipeline = VK_NULL_HANDLE;
+    uint32_t boundMaterial = UINT32_MAX;
+    uint32_t boundMesh = UINT32_MAX;
+    // Shadow passes only read positions
+    uint32_t streams = gbufferPipelines != nullptr ? MATERIAL_STREAMS : DEPTH_STREAMS;
+    for(size_t q=0; q<queue.size(); q++) {
+        uint32_t index = queue[q];
+        uint8_t flags = proxies.flags[index];
+        if(gbufferPipelines != nullptr) {
+            VkPipeline pipeline = gbufferPipelines[(flags & RenderProxyTable::DISPLACEMENT) ? 0 : 1];
+            if(pipeline != boundPipeline) {
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+                boundPipeline = pipeline;
+                stats.pipelineBinds++;
+            }
+            // bindless materials are selected through the instance data, the set is bound once per pass
+            uint32_t material = proxies.material[index];
+            if(!(flags & RenderProxyTable::BINDLESS) && material != boundMaterial) {
+                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 1, 1, &materials[material].descriptorSets[currentFrame], 0, nullptr);
+                boundMaterial = material;
+                stats.materialBinds++;
+            }
+        }
+        const VkMesh& mesh = meshes[proxies.mesh[index]];
+        if(proxies.mesh[index] != boundMesh) {
+            VkDeviceSize offset = 0;
+            for(uint32_t s=0; s<VERTEX_STREAM_COUNT; s++) {
+                if(streams & (1u << s)) {
+                    vkCmdBindVertexBuffers(commandBuffer, s, 1, &mesh.vertexBuffers[s], &offset);
+                    stats.vertexBinds++;
+                }
+            }
+            vkCmdBindIndexBuffer(commandBuffer, mesh.indexBuffer, 0, mesh.indexType);
+            boundMesh = proxies.mesh[index];
+            stats.indexBinds++;
+        }
+        // every LOD is a range of the same index buffer, the proxy index selects its InstanceData
+        const MeshLod& lod = mesh.lods[lods.empty() ? 0 : lods[q]];
+        uint32_t firstCommand = gbufferPipelines != nullptr && clusterCullPass.enabled ? clusterCullPass.queueCommands[q] : UINT32_MAX;
+        if(firstCommand != UINT32_MAX) {
+            // Meshlets that survived cluster culling, compacted to the front of the draw's range
+            vkCmdDrawIndexedIndirect(commandBuffer, clusterCullPass.commandBuffers[currentFrame].buffer, firstCommand * sizeof(VkDrawIndexedIndirectCommand),
+                                     mesh.meshletCount, sizeof(VkDrawIndexedIndirectCommand));
+            stats.indirectDraws++;
+            stats.meshlets += mesh.meshletCount;
+        } else {
+            vkCmdDrawIndexed(commandBuffer, lod.indexCount, 1, lod.firstIndex, 0, index);
+            stats.draws++;
+        }
+        stats.triangles += lod.indexCount / 3;
+    }
+}
+
 void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -1143,6 +1714,10 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
     VkViewport viewport{};
     VkRect2D scissor{};
 
+    /* Cluster culling for the gbuffer pass
+    */
+    recordClusterCullPass(commandBuffer);
+
     /* Deferred shading to generate GBuffer
     */
     {
@@ -1171,21 +1746,26 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
 
         vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.gbuffer);
         // Bind scene descriptor set
         vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSetsScene[currentFrame], 0, nullptr);
-        if(culling == CULLING_NONE) {
-            model_list.renderForGBuffer(commandBuffer, pipelineLayout);
-        } else if (culling == CULLING_FRUSTUM){
-            // frustum culling
-            mat4 VP;
-            if(camera_controller->isDebug()) {
-                VP = camera_controller->getPrevPerspective() * camera_controller->getPrevView();
-            } else {
-                VP = uboScene.proj * uboScene.view;
-            }
-            
-            model_list.renderForGBuffer(commandBuffer, pipelineLayout, culling, VP);
+        if(bindless) {
+            // Materials and their textures for the whole pass, no per-draw material set
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 2, 1, &bindlessDescriptorSet, 0, nullptr);
+        }
+        // frustum culling and sorting were already done on the simulation thread
+        VkPipeline gbufferPipelines[2] = {VK_NULL_HANDLE, VK_NULL_HANDLE};
+        if(hasDisplacedMaterials) {
+            gbufferPipelines[0] = getPipeline(pipelines.gbuffer);
+        }
+        if(hasFlatMaterials) {
+            ShaderVariant variant = sceneVariant;
+            variant.displacement = VK_FALSE;
+            gbufferPipelines[1] = getPipeline(pipelines.gbuffer, variant);
+        }
+        PassStats stats;
+        drawQueue(commandBuffer, gbuffer_queue, gbuffer_lods, gbufferPipelines, stats);
+        if(does_measure) {
+            stats.print("gbuffer");
         }
 
         vkCmdEndRenderPass(commandBuffer);
@@ -1193,17 +1773,17 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
 
     /* SSAO
     */
-    {
+    if(ssaoPassList.enabled) {
         VkRenderPassBeginInfo renderPassInfo{};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.renderPass = ssaoPassList.renderPass;
+        renderPassInfo.renderPass = ssaoPassList.ssaoRenderPass();
         renderPassInfo.renderArea.offset = {0, 0};
         renderPassInfo.clearValueCount = 2;
         
         clearValues[0].color = { { 0.0f, 0.0f, 0.0f, 1.0f } };
         clearValues[1].depthStencil = { 1.0f, 0 };
         renderPassInfo.pClearValues = clearValues.data();
-        renderPassInfo.framebuffer = ssaoPassList.ssaoPass.frameBuffer;
+        renderPassInfo.framebuffer = ssaoPassList.currentPass().frameBuffer;
         renderPassInfo.renderArea.extent.width = width;
         renderPassInfo.renderArea.extent.height = height;
 
@@ -1215,16 +1795,16 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
 
         vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.ssao);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(pipelines.ssao));
         // Bind scene descriptor set
-        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &(ssaoPassList.ssaoPass.descriptorSets[currentFrame]), 0, nullptr);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &(ssaoPassList.currentPass().descriptorSets[currentFrame]), 0, nullptr);
         vkCmdDraw(commandBuffer, 3, 1, 0, 0);
         vkCmdEndRenderPass(commandBuffer);
     }
 
     /* SSAO Blur
     */
-    {
+    if(ssaoPassList.enabled) {
         VkRenderPassBeginInfo renderPassInfo{};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
         renderPassInfo.renderPass = ssaoPassList.renderPass;
@@ -1246,11 +1826,13 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
 
         vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.ssaoBlur);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(pipelines.ssaoBlur));
         // Bind scene descriptor set
-        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &(ssaoPassList.ssaoBlurPass.descriptorSets[0]), 0, nullptr);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &(ssaoPassList.ssaoBlurPass.descriptorSets[ssaoPassList.frameIndex % ssaoPassList.passCount()]), 0, nullptr);
         vkCmdDraw(commandBuffer, 3, 1, 0, 0);
         vkCmdEndRenderPass(commandBuffer);
+
+        ssaoPassList.swapHistory();
     }
     
     /*
@@ -1274,7 +1856,9 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
             DEPTH_BIAS_CONSTANT,
             0.0f,
             DEPTH_BIAS_SLOPE);
-        for(auto& shadowMapPass: shadowMapPassList.shadowMapPassesSpot) {
+        PassStats stats;
+        for(size_t passIdx=0; passIdx<shadowMapPassList.shadowMapPassesSpot.size(); passIdx++) {
+            auto& shadowMapPass = shadowMapPassList.shadowMapPassesSpot[passIdx];
             renderPassInfo.framebuffer = shadowMapPass.frameBuffer;
             
             renderPassInfo.renderArea.extent.width = shadowMapPass.shadow_res;
@@ -1287,12 +1871,17 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
             vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
                 
             vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.shadow);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(pipelines.shadow));
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSetsScene[currentFrame], 0, nullptr);
+            vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstantShadow), &shadowMapPass.pcShadow);
 
-            model_list.renderForShadowMap(commandBuffer, pipelineLayout, shadowMapPass.pcShadow);
+            drawQueue(commandBuffer, proxies.shadowCasters, spot_shadow_lods[passIdx], nullptr, stats);
 
             vkCmdEndRenderPass(commandBuffer);
         }
+        if(does_measure) {
+            stats.print("shadow");
+        }
     }
 
     /* Generate shadow cubemap for sphere lights
@@ -1308,10 +1897,12 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
 		clearValues[1].depthStencil = { 1.0f, 0 };
         renderPassInfo.pClearValues = clearValues.data();
         
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.shadowCube);
-        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &shadowMapPassList.sphereDescriptorSet, 0, nullptr);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(pipelines.shadowCube));
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &shadowMapPassList.sphereDescriptorSets[currentFrame], 0, nullptr);
 
-        for(auto& shadowMapPass: shadowMapPassList.shadowMapPassesSphere) {
+        PassStats stats;
+        for(size_t passIdx=0; passIdx<shadowMapPassList.shadowMapPassesSphere.size(); passIdx++) {
+            auto& shadowMapPass = shadowMapPassList.shadowMapPassesSphere[passIdx];
             renderPassInfo.renderArea.extent.width = shadowMapPass.shadow_res;
             renderPassInfo.renderArea.extent.height = shadowMapPass.shadow_res;
 
@@ -1325,12 +1916,16 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
                 renderPassInfo.framebuffer = shadowMapPass.frameBuffers[i];
                 vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
                 
-                model_list.renderForShadowMap(commandBuffer, pipelineLayout, shadowMapPass.pcCubeShadow[i]);
+                vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstantCubeShadow), &shadowMapPass.pcCubeShadow[i]);
+                drawQueue(commandBuffer, proxies.shadowCasters, sphere_shadow_lods[passIdx], nullptr, stats);
 
                 vkCmdEndRenderPass(commandBuffer);
             }
             
         }
+        if(does_measure) {
+            stats.print("shadow cube");
+        }
     }
 
 
@@ -1367,17 +1962,17 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
         
 
         if(DISPLAY_SHADOW_MAP_SPOT) {
-            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.debug);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(pipelines.debug));
             vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &shadowMapPassList.debugDescriptorSet, 0, nullptr);
             vkCmdDraw(commandBuffer, 3, 1, 0, 0);
         } else if(DISPLAY_SHADOW_MAP_SPHERE) {
-            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.debugCube);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(pipelines.debugCube));
             vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &shadowMapPassList.debugCubeDescriptorSet, 0, nullptr);
             vkCmdDraw(commandBuffer, 3, 1, 0, 0);
         } else {
             // Bind scene descriptor set
             vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSetsScene[currentFrame], 0, nullptr);
-            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.pbr);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(pipelines.pbr));
             vkCmdDraw(commandBuffer, 3, 1, 0, 0);
         }
         
@@ -1390,7 +1985,15 @@ void ViewerApplication::recordCommandBuffer(VkCommandBuffer commandBuffer) {
 }
 
 
-void ViewerApplication::drawFrame() {
+void ViewerApplication::drawFrame(const FramePacket& packet) {
+    // Every instance buffer has to see these updates, even if this frame is skipped below
+    for(const auto& update: packet.instanceUpdates) {
+        instance_data[update.first] = update.second;
+        for(auto& pending: instanceBufferPending) {
+            pending.push_back(update.first);
+        }
+    }
+
     //1. Wait for the previous frame to finish
     vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE /*wait for all fences*/, UINT64_MAX /*disables the timeout*/);
     
@@ -1415,7 +2018,7 @@ void ViewerApplication::drawFrame() {
     //3. Record a command buffer which draws the scene onto that image
     vkResetCommandBuffer(commandBuffers[currentFrame], 0/*VkCommandBufferResetFlagBits*/);
     
-    updateUniformBuffer(currentFrame);
+    updateUniformBuffer(currentFrame, packet);
 
     recordCommandBuffer(commandBuffers[currentFrame]);
     
@@ -1465,16 +2068,21 @@ void ViewerApplication::drawFrame() {
         }
     } 
     
+    if(startup_report && !first_frame_reported) {
+        first_frame_reported = true;
+        float firstFrameTime = std::chrono::duration<float, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - startup_time).count();
+        std::cout<<"STARTUP time to first frame "<<firstFrameTime<<" ms\n";
+    }
 
-    currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+    currentFrame = (currentFrame + 1) % framesInFlight;
 }
 
 
 /* ------- Creating the synchronization objects -------*/
 void ViewerApplication::createSyncObjects() {
-    imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    imageAvailableSemaphores.resize(framesInFlight);
+    renderFinishedSemaphores.resize(framesInFlight);
+    inFlightFences.resize(framesInFlight);
     
     VkSemaphoreCreateInfo semaphoreInfo{};
     semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -1483,7 +2091,7 @@ void ViewerApplication::createSyncObjects() {
     fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
     fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
     
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < framesInFlight; i++) {
         if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
             vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
             vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
@@ -1521,9 +2129,6 @@ void ViewerApplication::recreateSwapChain() {
     createImageViews();
     createDepthResources();
     createFramebuffers();
-
-    // update projection matrix
-    camera_controller->setHeightWdith(swapChainExtent.height, swapChainExtent.width);
 }
 
 
@@ -1537,22 +2142,33 @@ void ViewerApplication::recreateSwapChain() {
 void ViewerApplication::createUniformBuffers() {
     //create uniform buffer scene
     VkDeviceSize bufferSize = sizeof(UniformBufferObjectScene);
-    uniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    uniformBuffers.resize(framesInFlight);
+    for (size_t i = 0; i < framesInFlight; i++) {
         vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i].buffer, uniformBuffers[i].bufferMemory);
 
         vkMapMemory(device, uniformBuffers[i].bufferMemory, 0, bufferSize, 0, &uniformBuffers[i].bufferMapped);
     }
 
     // Create uniform buffer light
-    lightUniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    lightUniformBuffers.resize(framesInFlight);
     VkDeviceSize lightBufferSize = sizeof(UniformBufferObjectLight);
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < framesInFlight; i++) {
         vkHelper.createBuffer(lightBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, lightUniformBuffers[i].buffer, lightUniformBuffers[i].bufferMemory);
 
         vkMapMemory(device, lightUniformBuffers[i].bufferMemory, 0, lightBufferSize, 0, &lightUniformBuffers[i].bufferMapped);
     }
 
+    // Create instance storage buffer
+    instanceBuffers.resize(framesInFlight);
+    instance_data.assign(proxies.size(), InstanceData{});
+    instanceBufferPending.assign(framesInFlight, std::vector<uint32_t>());
+    VkDeviceSize instanceBufferSize = sizeof(InstanceData) * std::max<size_t>(proxies.size(), 1);
+    for (size_t i = 0; i < framesInFlight; i++) {
+        vkHelper.createBuffer(instanceBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, instanceBuffers[i].buffer, instanceBuffers[i].bufferMemory);
+
+        vkMapMemory(device, instanceBuffers[i].bufferMemory, 0, instanceBufferSize, 0, &instanceBuffers[i].bufferMapped);
+    }
+
     // Create uniform buffer shadow
     shadowMapPassList.createShadowUniformBuffer();
     shadowMapPassList.createSphereUniformBuffer();
@@ -1561,48 +2177,39 @@ void ViewerApplication::createUniformBuffers() {
     ssaoPassList.createUniformBuffer();
 }
 
-void ViewerApplication::updateUniformBuffer(uint32_t currentImage) {
+// Runs on the render thread: upload the frame packet produced by buildFramePacket
+void ViewerApplication::updateUniformBuffer(uint32_t currentImage, const FramePacket& packet) {
     // Update scene
-    uboScene.proj = camera_controller->getPerspective();
-    uboScene.proj[1][1] *= -1;
-    uboScene.view = camera_controller->getView();
-    uboScene.light = environment_lighting_info.transform->worldToLocal(); // transform from world space to environment space
-    uboScene.eye = camera_controller->getEyePos();
-
+    uboScene = packet.uboScene;
     memcpy(uniformBuffers[currentImage].bufferMapped, &uboScene, sizeof(uboScene));
 
+    // Update SSAO
+    ssaoPassList.update(currentImage, uboScene.proj * uboScene.view);
+
     // Update light
-    light_info_list.update();
-    
-    for(size_t i=0; i<uboLight.sphereLightCount; i++){
-        uboLight.sphereLights[i] = light_info_list.sphere_lights[i];
-    }
-    for(size_t i=0; i<uboLight.spotLightCount; i++){
-        uboLight.spotLights[i] = light_info_list.spot_lights[i];
-    }
-    for(size_t i=0; i<uboLight.directionalLightCount; i++){
-        uboLight.directionalLights[i] = light_info_list.directional_lights[i];
-    }
+    memcpy(lightUniformBuffers[currentImage].bufferMapped, &packet.uboLight, sizeof(packet.uboLight));
 
     // update shadow
-    for(auto& shadowMapPass: shadowMapPassList.shadowMapPassesSpot)  {
-        shadowMapPass.updatePushConstant();
-        uboLight.spotLights[shadowMapPass.light_idx].lightVP = shadowMapPass.pcShadow.lightVP;
+    for(size_t i=0; i<shadowMapPassList.shadowMapPassesSpot.size(); i++)  {
+        shadowMapPassList.shadowMapPassesSpot[i].pcShadow.lightVP = packet.spotLightVPs[i];
     }
 
-    memcpy(lightUniformBuffers[currentImage].bufferMapped, &uboLight, sizeof(uboLight));
-
     // Update UniformBufferObjectSphereLight for sphere light shadow map rendering
     if(shadowMapPassList.shadowMapPassesSphere.size()>0) {
-        for(auto& shadowMapPass: shadowMapPassList.shadowMapPassesSphere)  {
-            shadowMapPass.updateSphereShadowData();
-        }
-        for(size_t i=0; i<uboLight.sphereLightCount; i++){
-            shadowMapPassList.uboSphere.sphereLights[i] = light_info_list.sphere_lights[i];
-        } 
-        shadowMapPassList.copySphereUniformBuffer();
+        shadowMapPassList.copySphereUniformBuffer(packet.uboSphere);
     }
-    
+
+    // Update models, only instances changed since this buffer was last written are copied
+    InstanceData* instances = static_cast<InstanceData*>(instanceBuffers[currentImage].bufferMapped);
+    for(uint32_t i: instanceBufferPending[currentImage]) {
+        instances[i] = instance_data[i];
+    }
+    instanceBufferPending[currentImage].clear();
+    gbuffer_queue = packet.gbufferQueue;
+    gbuffer_lods = packet.gbufferLods;
+    spot_shadow_lods = packet.spotShadowLods;
+    sphere_shadow_lods = packet.sphereShadowLods;
+    updateClusterCullPass(currentImage);
 }
 
 /* --------------------- Decriptor Sets --------------------- */
@@ -1636,6 +2243,7 @@ void ViewerApplication::createDescriptorSetLayout() {
         createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, /*binding=*/12, 1), // pbr prefiltered map
         createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, /*binding=*/13, 1), // brdf lut
         createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, /*binding=*/14, 1), //ssao blur
+        createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, /*binding=*/15, 1), //instance data
     };
 
     VkDescriptorSetLayoutCreateInfo layoutInfo{};
@@ -1657,24 +2265,63 @@ void ViewerApplication::createDescriptorSetLayout() {
     layoutInfo.pBindings = materialBindings.data();
 
     VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &descriptorSetLayoutMaterial), "failed to create descriptor set layout!");
+
+    if(bindless) {
+        // The texture array is last so the set can be allocated with only as many textures as the scene has
+        std::vector<VkDescriptorSetLayoutBinding> bindlessBindings = {
+            createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, /*binding=*/0, 1), //materials
+            createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, /*binding=*/1, bindlessTextureCapacity), //textures
+        };
+        std::vector<VkDescriptorBindingFlagsEXT> bindingFlags = {
+            0,
+            VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT,
+        };
+
+        VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsInfo{};
+        bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+        bindingFlagsInfo.bindingCount = static_cast<uint32_t>(bindingFlags.size());
+        bindingFlagsInfo.pBindingFlags = bindingFlags.data();
+
+        layoutInfo.pNext = &bindingFlagsInfo;
+        // update after bind lifts the texture count to the much larger update after bind limits
+        layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+        layoutInfo.bindingCount = static_cast<uint32_t>(bindlessBindings.size());
+        layoutInfo.pBindings = bindlessBindings.data();
+
+        VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &descriptorSetLayoutBindless), "failed to create bindless descriptor set layout!");
+    }
 }
 
 void ViewerApplication::createDescriptorPool() {
-    std::array<VkDescriptorPoolSize, 4> poolSizes{};
+    // Sized from the scene instead of a fixed cap. Sets with the scene layout:
+    // scene and sphere shadow (per frame), the ssao passes (per frame), ssao blur (one per ssao pass) and shadow debug (2)
+    uint32_t ssaoPasses = ssaoPassList.passCount();
+    uint32_t sceneSets = static_cast<uint32_t>(framesInFlight) * (2 + ssaoPasses) + ssaoPasses + 2;
+    // Material sets, per frame for every material that is not bindless
+    uint32_t materialSets = 0;
+    for(auto& material: materials) {
+        if(!material.bindless) {
+            materialSets += static_cast<uint32_t>(framesInFlight);
+        }
+    }
+
+    std::array<VkDescriptorPoolSize, 5> poolSizes{};
     poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT) * 1000;
+    poolSizes[0].descriptorCount = sceneSets * 2;
     poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT) * 1000; //?
+    poolSizes[1].descriptorCount = sceneSets * 9 + materialSets * 5;
     poolSizes[2].type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
-    poolSizes[2].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT) * 100; //?
+    poolSizes[2].descriptorCount = sceneSets * 2 * MAX_LIGHT_COUNT;
     poolSizes[3].type = VK_DESCRIPTOR_TYPE_SAMPLER;
-    poolSizes[3].descriptorCount = 100;
+    poolSizes[3].descriptorCount = sceneSets * 2;
+    poolSizes[4].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[4].descriptorCount = sceneSets;
 
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
     poolInfo.pPoolSizes = poolSizes.data();
-    poolInfo.maxSets = 1000;
+    poolInfo.maxSets = sceneSets + materialSets;
     
     if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS) {
         throw std::runtime_error("failed to create descriptor pool!");
@@ -1737,43 +2384,43 @@ void ViewerApplication::VkTexture::updateDescriptorImageInfo(){
     descriptorImageInfo.sampler = textureSampler;
 }
 
-void ViewerApplication::createModelDescriptorSets(std::shared_ptr<VkModel> model) {
-    allocateDescriptorSet(model->descriptorSets, MAX_FRAMES_IN_FLIGHT, descriptorSetLayoutMaterial);
+void ViewerApplication::createMaterialDescriptorSets(VkMaterial& material) {
+    allocateDescriptorSet(material.descriptorSets, framesInFlight, descriptorSetLayoutMaterial);
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < framesInFlight; i++) {
         // Add normal map and displacement map is common for all material
         std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
-            writeDescriptorSet(model->descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/0, &(model->material.normalMap->descriptorImageInfo), 1),
-            writeDescriptorSet(model->descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/1, &(model->material.displacementMap->descriptorImageInfo), 1)
+            writeDescriptorSet(material.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/0, &(material.normalMap->descriptorImageInfo), 1),
+            writeDescriptorSet(material.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/1, &(material.displacementMap->descriptorImageInfo), 1)
         };
         
-        if(model->material.type == Material::Type::ENVIRONMENT || 
-        model->material.type == Material::Type::MIRROR ||
-        model->material.type == Material::Type::SIMPLE) {
+        if(material.type == Material::Type::ENVIRONMENT || 
+        material.type == Material::Type::MIRROR ||
+        material.type == Material::Type::SIMPLE) {
             // No other texture to add
             
-        } else if(model->material.type == Material::Type::LAMBERTIAN) {
+        } else if(material.type == Material::Type::LAMBERTIAN) {
             // Add albedo
             
-            writeDescriptorSets.push_back(writeDescriptorSet(model->descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/2, &(model->material.albedo->descriptorImageInfo), 1)
+            writeDescriptorSets.push_back(writeDescriptorSet(material.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/2, &(material.albedo->descriptorImageInfo), 1)
             );
             // Fill in roughness and metalness descriptor but will not be used
-            writeDescriptorSets.push_back(writeDescriptorSet(model->descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/3, &(model->material.metalness->descriptorImageInfo), 1)
+            writeDescriptorSets.push_back(writeDescriptorSet(material.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/3, &(material.metalness->descriptorImageInfo), 1)
             );
 
-            writeDescriptorSets.push_back(writeDescriptorSet(model->descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/4, &(model->material.roughness->descriptorImageInfo), 1)
+            writeDescriptorSets.push_back(writeDescriptorSet(material.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/4, &(material.roughness->descriptorImageInfo), 1)
             );
             
-        } else if(model->material.type == Material::Type::PBR) {
+        } else if(material.type == Material::Type::PBR) {
             // Add albedo, metalness, roughness
 
-            writeDescriptorSets.push_back(writeDescriptorSet(model->descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/2, &(model->material.albedo->descriptorImageInfo), 1)
+            writeDescriptorSets.push_back(writeDescriptorSet(material.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/2, &(material.albedo->descriptorImageInfo), 1)
             );
 
-            writeDescriptorSets.push_back(writeDescriptorSet(model->descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/3, &(model->material.metalness->descriptorImageInfo), 1)
+            writeDescriptorSets.push_back(writeDescriptorSet(material.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/3, &(material.metalness->descriptorImageInfo), 1)
             );
 
-            writeDescriptorSets.push_back(writeDescriptorSet(model->descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/4, &(model->material.roughness->descriptorImageInfo), 1)
+            writeDescriptorSets.push_back(writeDescriptorSet(material.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/4, &(material.roughness->descriptorImageInfo), 1)
             );  
         }
 
@@ -1784,9 +2431,14 @@ void ViewerApplication::createModelDescriptorSets(std::shared_ptr<VkModel> model
 
 void ViewerApplication::createDescriptorSets() {
     // create scene descriptor set
-    allocateDescriptorSet(descriptorSetsScene, MAX_FRAMES_IN_FLIGHT, descriptorSetLayoutScene);
+    allocateDescriptorSet(descriptorSetsScene, framesInFlight, descriptorSetLayoutScene);
+
+    // Environment products the scene has no material for are not loaded; 
+    // bind the plain environment cube instead, it is never sampled through these bindings
+    VkDescriptorImageInfo* lambertianEnvironmentInfo = lambertianEnvironmentMap.textureImage != VK_NULL_HANDLE ? &lambertianEnvironmentMap.descriptorImageInfo : &environmentMap.descriptorImageInfo;
+    VkDescriptorImageInfo* pbrEnvironmentInfo = pbrEnvironmentMap.textureImage != VK_NULL_HANDLE ? &pbrEnvironmentMap.descriptorImageInfo : &environmentMap.descriptorImageInfo;
     
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < framesInFlight; i++) {
         VkDescriptorBufferInfo sceneBufferInfo{};
         sceneBufferInfo.buffer = uniformBuffers[i].buffer;
         sceneBufferInfo.offset = 0;
@@ -1797,6 +2449,11 @@ void ViewerApplication::createDescriptorSets() {
         lightBufferInfo.offset = 0;
         lightBufferInfo.range = sizeof(UniformBufferObjectLight);
 
+        VkDescriptorBufferInfo instanceBufferInfo{};
+        instanceBufferInfo.buffer = instanceBuffers[i].buffer;
+        instanceBufferInfo.offset = 0;
+        instanceBufferInfo.range = VK_WHOLE_SIZE;
+
         VkDescriptorImageInfo depthSamplerInfo = {};
         depthSamplerInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
         depthSamplerInfo.sampler = shadowMapPassList.defaultShadowMapPassSpot.shadowMapTexture.textureSampler;
@@ -1818,17 +2475,23 @@ void ViewerApplication::createDescriptorSets() {
             writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/8, &(gBufferPass.albedoAttachment.descriptorImageInfo), 1),
             writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/9, &(gBufferPass.roughnessAttachment.descriptorImageInfo), 1),
             writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/10, &(gBufferPass.metalnessAttachment.descriptorImageInfo), 1),
-            writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/11, &(lambertianEnvironmentMap.descriptorImageInfo), 1),
-            writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/12, &(pbrEnvironmentMap.descriptorImageInfo), 1),
+            writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/11, lambertianEnvironmentInfo, 1),
+            writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/12, pbrEnvironmentInfo, 1),
             writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/13, &(lut.descriptorImageInfo), 1),
-            writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/14, &(ssaoPassList.ssaoBlurPass.colorAttachment.descriptorImageInfo), 1) // SSAO Blur
+            writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/14, &(ssaoPassList.ssaoBlurPass.colorAttachment.descriptorImageInfo), 1), // SSAO Blur
+            writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /*binding=*/15, &instanceBufferInfo, 1) // instance data
         };
 
         vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
     }
 
-    for(auto model : model_list.getAllModels()) {
-        createModelDescriptorSets(model);
+    for(auto& material: materials) {
+        if(!material.bindless) {
+            createMaterialDescriptorSets(material);
+        }
+    }
+    if(bindless) {
+        createBindlessDescriptorSet();
     }
     createShadowMapSphereDescriptorSet();
     if(DISPLAY_SHADOW_MAP_SPOT) {
@@ -1842,6 +2505,286 @@ void ViewerApplication::createDescriptorSets() {
     createSSAOBlurPassDescriptorSet();
 }
 
+void ViewerApplication::createBindlessDescriptorSet() {
+    // Gather the textures of all bindless materials into one array, in bindlessIndex order
+    std::vector<MaterialData> materials;
+    std::vector<VkDescriptorImageInfo> textureInfos;
+    auto addTexture = [&textureInfos](std::shared_ptr<VkTexture2D>& texture, uint32_t& index) {
+        if(texture != nullptr) {
+            index = static_cast<uint32_t>(textureInfos.size());
+            textureInfos.push_back(texture->descriptorImageInfo);
+        }
+    };
+    for(auto& material: materials) {
+        if(!material.bindless) {
+            continue;
+        }
+        addTexture(material.normalMap, material.data.normalTexture);
+        addTexture(material.displacementMap, material.data.displacementTexture);
+        addTexture(material.albedo, material.data.albedoTexture);
+        addTexture(material.roughness, material.data.roughnessTexture);
+        addTexture(material.metalness, material.data.metalnessTexture);
+        materials.push_back(material.data);
+    }
+    if(textureInfos.size() > bindlessTextureCapacity) {
+        throw std::runtime_error("scene has "+std::to_string(textureInfos.size())+" material textures, the device supports "+std::to_string(bindlessTextureCapacity)+" bindless textures");
+    }
+    if(materials.empty()) {
+        materials.push_back({});
+    }
+
+    // Material buffer, written once
+    VkDeviceSize bufferSize = sizeof(MaterialData) * materials.size();
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+
+    void* data;
+    vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+    memcpy(data, materials.data(), (size_t) bufferSize);
+    vkUnmapMemory(device, stagingBufferMemory);
+
+    vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, materialBuffer.buffer, materialBuffer.bufferMemory);
+    vkHelper.copyBuffer(stagingBuffer, materialBuffer.buffer, bufferSize);
+
+    vkDestroyBuffer(device, stagingBuffer, nullptr);
+    vkFreeMemory(device, stagingBufferMemory, nullptr);
+
+    // One set for the whole scene, so its pool only has to hold the textures the scene actually uses
+    uint32_t textureCount = static_cast<uint32_t>(textureInfos.size());
+    std::array<VkDescriptorPoolSize, 2> poolSizes{};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[0].descriptorCount = 1;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[1].descriptorCount = std::max(textureCount, 1u);
+
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+    poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+    poolInfo.pPoolSizes = poolSizes.data();
+    poolInfo.maxSets = 1;
+    VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, nullptr, &bindlessDescriptorPool), "failed to create bindless descriptor pool!");
+
+    VkDescriptorSetVariableDescriptorCountAllocateInfoEXT variableCountInfo{};
+    variableCountInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO_EXT;
+    variableCountInfo.descriptorSetCount = 1;
+    variableCountInfo.pDescriptorCounts = &textureCount;
+
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.pNext = &variableCountInfo;
+    allocInfo.descriptorPool = bindlessDescriptorPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &descriptorSetLayoutBindless;
+    VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &bindlessDescriptorSet), "failed to allocate bindless descriptor set!");
+
+    VkDescriptorBufferInfo materialBufferInfo{};
+    materialBufferInfo.buffer = materialBuffer.buffer;
+    materialBufferInfo.offset = 0;
+    materialBufferInfo.range = VK_WHOLE_SIZE;
+
+    std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+        writeDescriptorSet(bindlessDescriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /*binding=*/0, &materialBufferInfo, 1)
+    };
+    if(textureCount > 0) {
+        writeDescriptorSets.push_back(writeDescriptorSet(bindlessDescriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/1, textureInfos.data(), textureCount));
+    }
+    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+
+    std::cout<<"Bindless materials: "<<materials.size()<<" materials, "<<textureCount<<" textures\n";
+}
+
+/* --------------------- Cluster culling --------------------- */
+void ViewerApplication::createClusterCullPass() {
+    // Meshlets of every mesh in one buffer. A draw is one indirect call, so meshes with more
+    // meshlets than the device can draw at once are drawn whole
+    std::vector<Meshlet> meshlets;
+    for(auto& mesh: meshes) {
+        const std::vector<Meshlet>& meshMeshlets = mesh.mesh->meshlets;
+        if(meshMeshlets.empty() || meshMeshlets.size() > physicalDeviceProperties.limits.maxDrawIndirectCount) {
+            continue;
+        }
+        mesh.firstMeshlet = static_cast<uint32_t>(meshlets.size());
+        mesh.meshletCount = static_cast<uint32_t>(meshMeshlets.size());
+        for(Meshlet meshlet: meshMeshlets) {
+            // The instance matrices map the quantized space of packed meshes, so the bounds move there too
+            if(mesh.packed) {
+                for(int i=0; i<3; i++) {
+                    meshlet.sphere[i] = (meshlet.sphere[i] - mesh.quantizationOffset[i]) / mesh.quantizationScale;
+                }
+                meshlet.sphere[3] /= mesh.quantizationScale;
+            }
+            meshlets.push_back(meshlet);
+        }
+    }
+    // Every gbuffer proxy is in the queue at most once per frame
+    for(uint32_t index: proxies.gbuffer) {
+        uint32_t meshletCount = meshes[proxies.mesh[index]].meshletCount;
+        if(meshletCount > 0) {
+            clusterCullPass.maxDraws++;
+            clusterCullPass.maxCommands += meshletCount;
+        }
+    }
+    if(clusterCullPass.maxDraws == 0) {
+        std::cout<<"No mesh has meshlets, cluster culling disabled\n";
+        clusterCullPass.enabled = false;
+        return;
+    }
+
+    // Meshlet buffer, written once
+    VkDeviceSize bufferSize = sizeof(Meshlet) * meshlets.size();
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+
+    void* data;
+    vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
+    memcpy(data, meshlets.data(), (size_t) bufferSize);
+    vkUnmapMemory(device, stagingBufferMemory);
+
+    vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, clusterCullPass.meshletBuffer.buffer, clusterCullPass.meshletBuffer.bufferMemory);
+    vkHelper.copyBuffer(stagingBuffer, clusterCullPass.meshletBuffer.buffer, bufferSize);
+
+    vkDestroyBuffer(device, stagingBuffer, nullptr);
+    vkFreeMemory(device, stagingBufferMemory, nullptr);
+
+    // Draw lists are written by the render thread, commands by the compute pass and read by the gbuffer pass
+    VkDeviceSize drawBufferSize = sizeof(ClusterDraw) * clusterCullPass.maxDraws;
+    VkDeviceSize commandBufferSize = sizeof(VkDrawIndexedIndirectCommand) * clusterCullPass.maxCommands;
+    clusterCullPass.drawBuffers.resize(framesInFlight);
+    clusterCullPass.commandBuffers.resize(framesInFlight);
+    for(size_t i=0; i<framesInFlight; i++) {
+        vkHelper.createBuffer(drawBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, clusterCullPass.drawBuffers[i].buffer, clusterCullPass.drawBuffers[i].bufferMemory);
+        vkMapMemory(device, clusterCullPass.drawBuffers[i].bufferMemory, 0, drawBufferSize, 0, &clusterCullPass.drawBuffers[i].bufferMapped);
+        vkHelper.createBuffer(commandBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, clusterCullPass.commandBuffers[i].buffer, clusterCullPass.commandBuffers[i].bufferMemory);
+    }
+
+    // Descriptor sets
+    std::vector<VkDescriptorSetLayoutBinding> bindings = {
+        createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, /*binding=*/0, 1), // meshlets
+        createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, /*binding=*/1, 1), // instance data
+        createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, /*binding=*/2, 1), // draws
+        createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, /*binding=*/3, 1), // indirect commands
+    };
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+    layoutInfo.pBindings = bindings.data();
+    VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &clusterCullPass.descriptorSetLayout), "failed to create cluster culling descriptor set layout!");
+
+    VkDescriptorPoolSize poolSize{};
+    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSize.descriptorCount = static_cast<uint32_t>(bindings.size() * framesInFlight);
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    poolInfo.maxSets = static_cast<uint32_t>(framesInFlight);
+    VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, nullptr, &clusterCullPass.descriptorPool), "failed to create cluster culling descriptor pool!");
+
+    std::vector<VkDescriptorSetLayout> layouts(framesInFlight, clusterCullPass.descriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = clusterCullPass.descriptorPool;
+    allocInfo.descriptorSetCount = static_cast<uint32_t>(framesInFlight);
+    allocInfo.pSetLayouts = layouts.data();
+    clusterCullPass.descriptorSets.resize(framesInFlight);
+    VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, clusterCullPass.descriptorSets.data()), "failed to allocate cluster culling descriptor sets!");
+
+    for(size_t i=0; i<framesInFlight; i++) {
+        VkDescriptorBufferInfo meshletBufferInfo = {clusterCullPass.meshletBuffer.buffer, 0, VK_WHOLE_SIZE};
+        VkDescriptorBufferInfo instanceBufferInfo = {instanceBuffers[i].buffer, 0, VK_WHOLE_SIZE};
+        VkDescriptorBufferInfo drawBufferInfo = {clusterCullPass.drawBuffers[i].buffer, 0, VK_WHOLE_SIZE};
+        VkDescriptorBufferInfo commandBufferInfo = {clusterCullPass.commandBuffers[i].buffer, 0, VK_WHOLE_SIZE};
+        std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+            writeDescriptorSet(clusterCullPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /*binding=*/0, &meshletBufferInfo, 1),
+            writeDescriptorSet(clusterCullPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /*binding=*/1, &instanceBufferInfo, 1),
+            writeDescriptorSet(clusterCullPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /*binding=*/2, &drawBufferInfo, 1),
+            writeDescriptorSet(clusterCullPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /*binding=*/3, &commandBufferInfo, 1),
+        };
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+    }
+
+    // Compute pipeline
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(PushConstantClusterCull);
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &clusterCullPass.descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &clusterCullPass.pipelineLayout), "failed to create cluster culling pipeline layout!");
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage = loadShader(CLUSTER_CULL_CSHADER, VK_SHADER_STAGE_COMPUTE_BIT);
+    // local_size_x_id = 0
+    VkSpecializationMapEntry groupSizeEntry = {0, 0, sizeof(uint32_t)};
+    VkSpecializationInfo specializationInfo = {1, &groupSizeEntry, sizeof(CLUSTER_CULL_GROUP_SIZE), &CLUSTER_CULL_GROUP_SIZE};
+    pipelineInfo.stage.pSpecializationInfo = &specializationInfo;
+    pipelineInfo.layout = clusterCullPass.pipelineLayout;
+    VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &clusterCullPass.pipeline), "Failed to create cluster culling pipeline!");
+    vkDestroyShaderModule(device, pipelineInfo.stage.module, nullptr);
+
+    std::cout<<"Cluster culling: "<<meshlets.size()<<" meshlets, up to "<<clusterCullPass.maxDraws<<" draws and "<<clusterCullPass.maxCommands<<" commands per frame\n";
+}
+
+void ViewerApplication::updateClusterCullPass(uint32_t currentImage) {
+    if(!clusterCullPass.enabled) {
+        return;
+    }
+    // Coarser LODs are not clustered and keep their direct draw
+    ClusterDraw* draws = static_cast<ClusterDraw*>(clusterCullPass.drawBuffers[currentImage].bufferMapped);
+    clusterCullPass.queueCommands.assign(gbuffer_queue.size(), UINT32_MAX);
+    uint32_t drawCount = 0;
+    uint32_t commandCount = 0;
+    for(size_t q=0; q<gbuffer_queue.size(); q++) {
+        uint32_t index = gbuffer_queue[q];
+        const VkMesh& mesh = meshes[proxies.mesh[index]];
+        if(mesh.meshletCount == 0 || (!gbuffer_lods.empty() && gbuffer_lods[q] != 0)) {
+            continue;
+        }
+        draws[drawCount++] = {index, mesh.firstMeshlet, mesh.meshletCount, commandCount};
+        clusterCullPass.queueCommands[q] = commandCount;
+        commandCount += mesh.meshletCount;
+    }
+    clusterCullPass.drawCount = drawCount;
+    clusterCullPass.commandCount = commandCount;
+    clusterCullPass.pushConstant.viewProj = uboScene.proj * uboScene.view;
+    clusterCullPass.pushConstant.eye = uboScene.eye;
+}
+
+void ViewerApplication::recordClusterCullPass(VkCommandBuffer commandBuffer) {
+    if(!clusterCullPass.enabled || clusterCullPass.drawCount == 0) {
+        return;
+    }
+    // The compute pass only writes the visible meshlets of a range, the rest must draw nothing
+    VkBuffer commands = clusterCullPass.commandBuffers[currentFrame].buffer;
+    vkCmdFillBuffer(commandBuffer, commands, 0, sizeof(VkDrawIndexedIndirectCommand) * clusterCullPass.commandCount, 0);
+
+    VkMemoryBarrier clearBarrier{};
+    clearBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    clearBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &clearBarrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, clusterCullPass.pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, clusterCullPass.pipelineLayout, 0, 1, &clusterCullPass.descriptorSets[currentFrame], 0, nullptr);
+    vkCmdPushConstants(commandBuffer, clusterCullPass.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstantClusterCull), &clusterCullPass.pushConstant);
+    vkCmdDispatch(commandBuffer, clusterCullPass.drawCount, 1, 1);
+
+    VkMemoryBarrier commandBarrier{};
+    commandBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    commandBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    commandBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &commandBarrier, 0, nullptr, 0, nullptr);
+}
+
 
 
 
@@ -1866,21 +2809,103 @@ ViewerApplication::TextureInfo ViewerApplication::VkTexture::loadFromFile(const
     return info;
 }
 
-void ViewerApplication::VkTexture::createTextureImage(TextureInfo info, VkFormat format, int pixelSize) {
+bool ViewerApplication::VkTexture::hasCompressed(const std::string& path) {
+    return bcTextures && std::ifstream(path).good();
+}
+
+void ViewerApplication::VkTexture::createCompressedImage(const Ktx2Image& ktx) {
+    VkFormat format = static_cast<VkFormat>(ktx.vkFormat);
+    mipLevels = static_cast<uint32_t>(ktx.levels.size());
+
+    VkDeviceSize bufferSize = 0;
+    for(auto& level: ktx.levels) {
+        bufferSize += level.size();
+    }
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingBufferMemory;
+    vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+
+    // Levels are packed one after the other, the faces of a level likewise; every face is a whole number of blocks
+    void* data;
+    VK_CHECK_RESULT(vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data), "failed to map memory");
+    std::vector<VkBufferImageCopy> regions;
+    VkDeviceSize offset = 0;
+    for(uint32_t level=0; level<mipLevels; level++) {
+        memcpy(static_cast<unsigned char*>(data) + offset, ktx.levels[level].data(), ktx.levels[level].size());
+        for(uint32_t face=0; face<ktx.faceCount; face++) {
+            VkBufferImageCopy region{};
+            region.bufferOffset = offset + face * ktx.faceSize(level);
+            region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level, face, 1};
+            region.imageExtent = {ktx.levelWidth(level), ktx.levelHeight(level), 1};
+            regions.push_back(region);
+        }
+        offset += ktx.levels[level].size();
+    }
+    vkUnmapMemory(device, stagingBufferMemory);
+
+    VkImageCreateFlags flags = ktx.faceCount == 6 ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0;
+    vkHelper.createImage(ktx.width, ktx.height, format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory, ktx.faceCount, flags, mipLevels);
+
+    vkHelper.transitionImageLayout(textureImage,
+        VK_IMAGE_LAYOUT_UNDEFINED,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        0,
+        VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        mipLevels, ktx.faceCount);
+    VkCommandBuffer commandBuffer = vkHelper.beginSingleTimeCommands();
+    vkCmdCopyBufferToImage(commandBuffer, stagingBuffer, textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(regions.size()), regions.data());
+    vkHelper.endSingleTimeCommands(commandBuffer);
+    vkHelper.transitionImageLayout(textureImage,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_ACCESS_SHADER_READ_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        mipLevels, ktx.faceCount);
+
+    vkDestroyBuffer(device, stagingBuffer, nullptr);
+    vkFreeMemory(device, stagingBufferMemory, nullptr);
+}
+
+void ViewerApplication::VkTexture::createTextureImage(TextureInfo info, VkFormat format, int pixelSize, uint32_t mipLevels_) {
+    mipLevels = mipLevels_;
+    // The chain is blitted on the GPU when the format supports linear blits, otherwise
+    // it is box filtered on the CPU and uploaded with the first level
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+    const VkFormatFeatureFlags blitFeatures = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    bool blit = mipLevels > 1 && (formatProperties.optimalTilingFeatures & blitFeatures) == blitFeatures;
+
+    std::vector<VkExtent2D> extents = {{static_cast<uint32_t>(info.texWidth), static_cast<uint32_t>(info.texHeight)}};
+    std::vector<unsigned char> cpuLevels;
+    if(mipLevels > 1 && !blit) {
+        cpuLevels = buildMipChain(info, mipLevels, extents);
+    }
+    
     VkDeviceSize imageSize = info.texWidth * info.texHeight * info.texChannels * pixelSize;
+    VkDeviceSize bufferSize = imageSize + cpuLevels.size();
     
     VkBuffer stagingBuffer;
     VkDeviceMemory stagingBufferMemory;
-    vkHelper.createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+    vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
     
     void* data;
-    VK_CHECK_RESULT(vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data), "failed to map memory");
+    VK_CHECK_RESULT(vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data), "failed to map memory");
     memcpy(data, info.pixels, static_cast<size_t>(imageSize));
+    if(!cpuLevels.empty()) {
+        memcpy(static_cast<unsigned char*>(data) + imageSize, cpuLevels.data(), cpuLevels.size());
+    }
     vkUnmapMemory(device, stagingBufferMemory);
     
     stbi_image_free(info.pixels);
     
-    vkHelper.createImage(info.texWidth, info.texHeight, format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    if(blit) {
+        usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    }
+    vkHelper.createImage(info.texWidth, info.texHeight, format, VK_IMAGE_TILING_OPTIMAL, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory, 1, 0, mipLevels);
     
     vkHelper.transitionImageLayout(textureImage, 
         VK_IMAGE_LAYOUT_UNDEFINED, 
@@ -1888,132 +2913,282 @@ void ViewerApplication::VkTexture::createTextureImage(TextureInfo info, VkFormat
         0,
         VK_ACCESS_TRANSFER_WRITE_BIT,
         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-        VK_PIPELINE_STAGE_TRANSFER_BIT);
-    copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(info.texWidth), static_cast<uint32_t>(info.texHeight));
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        mipLevels);
+    if(cpuLevels.empty()) {
+        copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(info.texWidth), static_cast<uint32_t>(info.texHeight));
+    } else {
+        std::vector<VkBufferImageCopy> regions(mipLevels);
+        VkDeviceSize offset = 0;
+        for(uint32_t level=0; level<mipLevels; level++) {
+            regions[level].bufferOffset = offset;
+            regions[level].imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1};
+            regions[level].imageExtent = {extents[level].width, extents[level].height, 1};
+            offset += static_cast<VkDeviceSize>(extents[level].width) * extents[level].height * info.texChannels;
+        }
+        VkCommandBuffer commandBuffer = vkHelper.beginSingleTimeCommands();
+        vkCmdCopyBufferToImage(commandBuffer, stagingBuffer, textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, regions.data());
+        vkHelper.endSingleTimeCommands(commandBuffer);
+    }
     
-    vkHelper.transitionImageLayout(textureImage,
-    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-    VK_ACCESS_TRANSFER_WRITE_BIT,
-    VK_ACCESS_SHADER_READ_BIT,
-    VK_PIPELINE_STAGE_TRANSFER_BIT,
-    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+    if(blit) {
+        generateMipmaps(info.texWidth, info.texHeight);
+    } else {
+        vkHelper.transitionImageLayout(textureImage,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_ACCESS_TRANSFER_WRITE_BIT,
+        VK_ACCESS_SHADER_READ_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        mipLevels);
+    }
     
     vkDestroyBuffer(device, stagingBuffer, nullptr);
     vkFreeMemory(device, stagingBufferMemory, nullptr);
 }
 
-ViewerApplication::TextureInfo ViewerApplication::VkTexture2D::loadLUTFromBinaryFile(const std::string texture_file_path) {
-    int file_size = 512*512;
-    std::ifstream zIn(texture_file_path, std::ios::in | std::ios::binary);
-    float *chBuffer = new float[file_size * 2];
-    zIn.read(reinterpret_cast<char*>(chBuffer), sizeof(float)*file_size *2);
-    zIn.close();
-    std::cout<<chBuffer[0]<<","<<chBuffer[1]<<"\n";
-    
+// Every level is blitted from the previous one, which then moves to shader read
+void ViewerApplication::VkTexture::generateMipmaps(int width, int height, uint32_t layerCount, VkPipelineStageFlags dstStage) {
+    VkCommandBuffer commandBuffer = vkHelper.beginSingleTimeCommands();
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = textureImage;
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, layerCount};
+
+    int32_t mipWidth = width;
+    int32_t mipHeight = height;
+    for(uint32_t level=1; level<mipLevels; level++) {
+        barrier.subresourceRange.baseMipLevel = level - 1;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        int32_t nextWidth = std::max(mipWidth / 2, 1);
+        int32_t nextHeight = std::max(mipHeight / 2, 1);
+        VkImageBlit region{};
+        region.srcOffsets[1] = {mipWidth, mipHeight, 1};
+        region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, layerCount};
+        region.dstOffsets[1] = {nextWidth, nextHeight, 1};
+        region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level, 0, layerCount};
+        vkCmdBlitImage(commandBuffer, textureImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region, VK_FILTER_LINEAR);
+
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        mipWidth = nextWidth;
+        mipHeight = nextHeight;
+    }
+
+    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    vkHelper.endSingleTimeCommands(commandBuffer);
+}
+
+// 2x2 box filter per level (the last row / column of an odd sized level is clamped),
+// rows of a level are split between hardware threads
+std::vector<unsigned char> ViewerApplication::VkTexture::buildMipChain(const TextureInfo& info, uint32_t mipLevels, std::vector<VkExtent2D>& extents) {
+    const int channels = info.texChannels;
+    // offsets[level] into the returned chain, which starts at level 1
+    std::vector<VkDeviceSize> offsets(mipLevels, 0);
+    VkDeviceSize size = 0;
+    for(uint32_t level=1; level<mipLevels; level++) {
+        VkExtent2D previous = extents.back();
+        extents.push_back({std::max(previous.width / 2, 1u), std::max(previous.height / 2, 1u)});
+        offsets[level] = size;
+        size += static_cast<VkDeviceSize>(extents.back().width) * extents.back().height * channels;
+    }
+    std::vector<unsigned char> levels(size);
+
+    size_t workerCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for(uint32_t level=1; level<mipLevels; level++) {
+        const unsigned char* src = level == 1 ? info.pixels : levels.data() + offsets[level - 1];
+        unsigned char* dst = levels.data() + offsets[level];
+        const uint32_t srcWidth = extents[level - 1].width;
+        const uint32_t srcHeight = extents[level - 1].height;
+        const uint32_t width = extents[level].width;
+        const uint32_t height = extents[level].height;
+        auto filterRows = [=](uint32_t firstRow, uint32_t lastRow) {
+            for(uint32_t y=firstRow; y<lastRow; y++) {
+                uint32_t y0 = std::min(y * 2, srcHeight - 1);
+                uint32_t y1 = std::min(y * 2 + 1, srcHeight - 1);
+                for(uint32_t x=0; x<width; x++) {
+                    uint32_t x0 = std::min(x * 2, srcWidth - 1);
+                    uint32_t x1 = std::min(x * 2 + 1, srcWidth - 1);
+                    for(int c=0; c<channels; c++) {
+                        uint32_t sum = src[(y0 * srcWidth + x0) * channels + c] + src[(y0 * srcWidth + x1) * channels + c]
+                                     + src[(y1 * srcWidth + x0) * channels + c] + src[(y1 * srcWidth + x1) * channels + c];
+                        dst[(y * width + x) * channels + c] = static_cast<unsigned char>((sum + 2) / 4);
+                    }
+                }
+            }
+        };
+        // Small levels are not worth a thread
+        size_t levelWorkers = std::clamp<size_t>(height / 64, 1, workerCount);
+        std::vector<std::thread> workers;
+        for(size_t w=1; w<levelWorkers; w++) {
+            workers.emplace_back(filterRows, static_cast<uint32_t>(height * w / levelWorkers), static_cast<uint32_t>(height * (w + 1) / levelWorkers));
+        }
+        filterRows(0, static_cast<uint32_t>(height / levelWorkers));
+        for(auto& worker: workers) {
+            worker.join();
+        }
+    }
+    return levels;
+}
+
+void ViewerApplication::VkTexture2D::load(const BrdfLut& lut) {
+    // createTextureImage frees the pixels with stbi_image_free
+    size_t size = lut.texels.size() * sizeof(uint16_t);
     TextureInfo info;
-    info.texHeight = 512;
-    info.texWidth = 512;
-    info.texChannels = 2*sizeof(float);
-    info.pixels = reinterpret_cast<unsigned char*>(chBuffer);
-    return info;
+    info.texWidth = static_cast<int>(lut.width);
+    info.texHeight = static_cast<int>(lut.height);
+    info.texChannels = 2 * sizeof(uint16_t); // bytes per texel
+    info.pixels = static_cast<unsigned char*>(std::malloc(size));
+    std::memcpy(info.pixels, lut.texels.data(), size);
+
+    createTextureImage(info, VK_FORMAT_R16G16_SFLOAT);
+    createTextureImageView(VK_FORMAT_R16G16_SFLOAT);
+    createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, 1, VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, 0.0f);
+    updateDescriptorImageInfo();
 }
 
 void ViewerApplication::VkTexture2D::load(const std::string texture_file_path, VkFormat format){
     TextureInfo info;
-    if (texture_file_path.find("txt") != std::string::npos) {
-        // lutBrdf in binary file ends with txt
-        info = loadLUTFromBinaryFile(texture_file_path);
-        
+    uint32_t levels = 1;
+    if (hasCompressed(ktx2Path(texture_file_path))) {
+        // Block compressed with its mip chain by bin/compress, format is the file's
+        Ktx2Image ktx = readKtx2(ktx2Path(texture_file_path));
+        createCompressedImage(ktx);
+        createTextureImageView(static_cast<VkFormat>(ktx.vkFormat));
+        createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, mipLevels, VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, static_cast<float>(mipLevels));
+        updateDescriptorImageInfo();
+        return;
     } else if (texture_file_path.find("png") != std::string::npos){
         stbi_set_flip_vertically_on_load(true);
         info = loadFromFile(texture_file_path.c_str(), STBI_rgb_alpha); //load 4 channels
+        // material textures get a full mip chain
+        levels = static_cast<uint32_t>(std::floor(std::log2(std::max(info.texWidth, info.texHeight)))) + 1;
     } else {
         throw std::runtime_error("texture file format not supported: "+texture_file_path);
     }
     
     
-    createTextureImage(info,format);
+    createTextureImage(info, format, 1, levels);
     createTextureImageView(format);
-    createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, 1, VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE);
+    createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, mipLevels, VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, static_cast<float>(mipLevels));
     updateDescriptorImageInfo();
 }
 
-// reference: old RGBE-handling from 15-466 https://github.com/ixchow/15-466-ibl/blob/master/rgbe.hpp
+// RGBE is converted in place to shared exponent floats (same 4 bytes per texel), which unlike
+// RGBE in RGBA8 can be filtered by the sampler
 void ViewerApplication::VkTextureCube::convertToRadianceValue(TextureInfo& info) {
-    int width = info.texWidth;
-    int height = info.texHeight;
-    int total_pixels = width*height;
-    uint8_t * buffer = static_cast<uint8_t*>(info.pixels);
-    float pixels[total_pixels*4];
-    for(int i=0; i<total_pixels*4; i+=4) {
-        vec3 rgb = vec3(static_cast<float>(buffer[i]), static_cast<float>(buffer[i+1]), static_cast<float>(buffer[i+2]));
-        // (0,0,0,0) should be mapped to (0,0,0)
-        if(rgb != vec3()) {
-            int exp = static_cast<int>(buffer[i+3]) - 128;
-
-            pixels[i] = std::ldexp((rgb[0]+0.5f) / 256.0f, exp);
-            pixels[i+1] = std::ldexp((rgb[1]+0.5f) / 256.0f, exp);
-            pixels[i+2] = std::ldexp((rgb[2]+0.5f) / 256.0f, exp);
-        }
-        // std::cout<<static_cast<int>(buffer[i])<<","<<static_cast<int>(buffer[i+1])<<static_cast<int>(buffer[i+2])<<"\n";
-        
-    }
-    std::cout<<static_cast<int>(buffer[0])<<"\n";
-    std::cout<<static_cast<int>(buffer[1])<<"\n";
-    std::cout<<static_cast<int>(buffer[2])<<"\n";
-    std::cout<<static_cast<int>(buffer[3])<<"\n";
+    size_t count = static_cast<size_t>(info.texWidth) * info.texHeight;
+    rgbe_to_e5b9g9r9(info.pixels, reinterpret_cast<uint32_t*>(info.pixels), count);
 }
 
 void ViewerApplication::VkTextureCube::load(std::string texture_file_path, VkFormat format, std::string type, bool isRgbe){
+    if(hasCompressed(compressedPath(texture_file_path, type))) {
+        loadCompressed(texture_file_path, type);
+        return;
+    }
     stbi_set_flip_vertically_on_load(false);
+    std::vector<TextureInfo> infos;
+    std::string common_file_path = texture_file_path.substr(0, texture_file_path.find_last_of("."));
     if (type == "") {
         // load original environment map
-        
-        std::vector<TextureInfo> infos = {loadFromFile(texture_file_path.c_str(), STBI_rgb_alpha)}; 
+        infos.push_back(loadFromFile(texture_file_path.c_str(), STBI_rgb_alpha));
         std::cout<<"Load original environment map "<<texture_file_path<<"\n";
-        createCubeTextureImage(infos, format);
-        createCubeTextureImageView(format);
-        if(isRgbe){
-            createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, 1, VK_BORDER_COLOR_INT_OPAQUE_BLACK, VK_FILTER_NEAREST, VK_SAMPLER_MIPMAP_MODE_NEAREST);
-        } else {
-            createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER);
-        }
-        
     } else if (type == "lambertian"){
         // load prefiltered environment map for lambertian diffuse
-        std::string common_file_path = texture_file_path.substr(0, texture_file_path.find_last_of("."));
-        std::vector<TextureInfo> infos = {loadFromFile((common_file_path+".lambertian.png").c_str(), STBI_rgb_alpha)};
+        infos.push_back(loadFromFile((common_file_path+".lambertian.png").c_str(), STBI_rgb_alpha));
         std::cout<<"Load prefiltered environment map for lambertian diffuse "<<(common_file_path+".lambertian.png")<<"\n"; 
-        createCubeTextureImage(infos, format);
-        createCubeTextureImageView(format);
-        if(isRgbe){
-            createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, 1, VK_BORDER_COLOR_INT_OPAQUE_BLACK, VK_FILTER_NEAREST, VK_SAMPLER_MIPMAP_MODE_NEAREST);
-        } else {
-            createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER);
-        }
     } else if (type == "pbr") {
         // load prefiltered environment maps for PBR
-        std::vector<TextureInfo> infos;
-        std::string common_file_path = texture_file_path.substr(0, texture_file_path.find_last_of("."));
         for(int i=0; i<ENVIRONMENT_MIP_LEVEL; ++i) {
             std::string mip_file_path = common_file_path+".ggx."+std::to_string(i)+".png";
             infos.push_back(loadFromFile(mip_file_path.c_str(), STBI_rgb_alpha)); 
             std::cout<<"Load mipmap "<<mip_file_path<<": "<<infos.back().texWidth<<","<<infos.back().texHeight<<"\n";
         }
-        
-        createCubeTextureImage(infos, format);
-        createCubeTextureImageView(format, ENVIRONMENT_MIP_LEVEL);
-        if(isRgbe){
-            createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, ENVIRONMENT_MIP_LEVEL, VK_BORDER_COLOR_INT_OPAQUE_BLACK, VK_FILTER_NEAREST, VK_SAMPLER_MIPMAP_MODE_NEAREST, 4.0);
-        } else {
-            createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, ENVIRONMENT_MIP_LEVEL, VK_BORDER_COLOR_INT_OPAQUE_BLACK, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, 4.0);
+    }
+    if(isRgbe) {
+        for(auto& info: infos) {
+            convertToRadianceValue(info);
+        }
+        format = VK_FORMAT_E5B9G9R9_UFLOAT_PACK32;
+    }
+
+    createCubeTextureImage(infos, format);
+    createCubeTextureImageView(format, mipLevels);
+    createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, mipLevels, VK_BORDER_COLOR_INT_OPAQUE_BLACK, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, static_cast<float>(mipLevels - 1));
+    updateDescriptorImageInfo();
+}
+
+std::string ViewerApplication::VkTextureCube::compressedPath(const std::string& texture_file_path, const std::string& type) {
+    std::string common_file_path = texture_file_path.substr(0, texture_file_path.find_last_of("."));
+    if(type == "lambertian") {
+        return common_file_path+".lambertian.ktx2";
+    } else if(type == "pbr") {
+        return common_file_path+".ggx.ktx2";
+    }
+    return ktx2Path(texture_file_path);
+}
+
+void ViewerApplication::VkTextureCube::loadCompressed(const std::string& texture_file_path, const std::string& type) {
+    std::string compressed_file_path = compressedPath(texture_file_path, type);
+    Ktx2Image ktx = readKtx2(compressed_file_path);
+    if(ktx.faceCount != 6) {
+        throw std::runtime_error("environment map is not a cube map: "+compressed_file_path);
+    }
+    std::cout<<"Load compressed environment map "<<compressed_file_path<<" ("<<ktx.levels.size()<<" levels)\n";
+    createCompressedImage(ktx);
+    size = ktx.width;
+    createCubeTextureImageView(static_cast<VkFormat>(ktx.vkFormat), mipLevels);
+    // Radiance is stored directly, so unlike RGBE it can be filtered
+    createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, mipLevels, VK_BORDER_COLOR_INT_OPAQUE_BLACK, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, static_cast<float>(mipLevels - 1));
+    updateDescriptorImageInfo();
+}
+
+bool ViewerApplication::VkTextureCube::hasPrefiltered(const std::string& texture_file_path, const std::string& type) {
+    if(hasCompressed(compressedPath(texture_file_path, type))) {
+        return true;
+    }
+    std::string common_file_path = texture_file_path.substr(0, texture_file_path.find_last_of("."));
+    if(type == "lambertian") {
+        return std::ifstream(common_file_path+".lambertian.png").good();
+    }
+    for(int i=0; i<ENVIRONMENT_MIP_LEVEL; ++i) {
+        if(!std::ifstream(common_file_path+".ggx."+std::to_string(i)+".png").good()) {
+            return false;
         }
     }
+    return true;
+}
+
+void ViewerApplication::VkTextureCube::createFloatCube(uint32_t size_, uint32_t mipLevels_, VkImageUsageFlags usage) {
+    size = size_;
+    mipLevels = mipLevels_;
+    vkHelper.createImage(size, size, VK_FORMAT_R16G16B16A16_SFLOAT, VK_IMAGE_TILING_OPTIMAL, usage | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory, 6, VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT, mipLevels);
+    createCubeTextureImageView(VK_FORMAT_R16G16B16A16_SFLOAT, mipLevels);
+    createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, mipLevels, VK_BORDER_COLOR_INT_OPAQUE_BLACK, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, static_cast<float>(mipLevels - 1));
     updateDescriptorImageInfo();
 }
 
 void ViewerApplication::VkTextureCube::createCubeTextureImage(std::vector<TextureInfo>& infos, VkFormat format) {
-    int mipLevels = infos.size();
+    mipLevels = static_cast<uint32_t>(infos.size());
+    size = static_cast<uint32_t>(infos[0].texWidth);
 
     VkDeviceSize imageSize{0};
     for(auto& info: infos) {
@@ -2045,7 +3220,7 @@ void ViewerApplication::VkTextureCube::createCubeTextureImage(std::vector<Textur
     currentOffset = 0;
     // Order of image: front, back, up, down, right, left
     
-    for(int level=0; level<mipLevels; ++level) {
+    for(uint32_t level=0; level<mipLevels; ++level) {
         for (uint32_t face = 0; face < 6; face++) {
             auto& info = infos[level];
             VkBufferImageCopy bufferCopyRegion = {};
@@ -2102,20 +3277,474 @@ void ViewerApplication::VkTextureCube::createCubeTextureImage(std::vector<Textur
     vkFreeMemory(device, stagingBufferMemory, nullptr);
 }
 
+void ViewerApplication::loadIrradianceSH() {
+    irradiance_sh = false;
+    if(!environment_lighting_info.exist) {
+        return;
+    }
+    const std::string& src = environment_lighting_info.texture.src;
+    std::ifstream file(src.substr(0, src.find_last_of("."))+".lambertian.sh9");
+    if(!file.is_open()) {
+        return;
+    }
+    for(int i=0; i<9; i++) {
+        float r, g, b;
+        if(!(file >> r >> g >> b)) {
+            throw std::runtime_error("invalid SH coefficients for "+src);
+        }
+        uboLight.irradianceSH[i] = vec4(r, g, b, 0.0f);
+    }
+    irradiance_sh = true;
+    std::cout<<"Load SH irradiance for "<<src<<"\n";
+}
+
 void ViewerApplication::loadEnvironment() {
     if(environment_lighting_info.exist) {
-        environmentMap.load(environment_lighting_info.texture.src, VK_FORMAT_R8G8B8A8_UNORM, "", true);
-        if(!model_info_list.lamber_models.empty() || !model_info_list.pbr_models.empty()) {
-            lambertianEnvironmentMap.load(environment_lighting_info.texture.src, VK_FORMAT_R8G8B8A8_UNORM, "lambertian", true);
+        std::string src = environment_lighting_info.texture.src;
+        environmentMap.load(src, VK_FORMAT_R8G8B8A8_UNORM, "", true);
+        bool lambertian = !irradiance_sh && (!model_info_list.lamber_models.empty() || !model_info_list.pbr_models.empty());
+        bool pbr = !model_info_list.pbr_models.empty();
+        // Cubes bin/cube has not baked are prefiltered from environmentMap on the GPU
+        bool prefilterLambertian = lambertian && !VkTextureCube::hasPrefiltered(src, "lambertian");
+        bool prefilterPbr = pbr && !VkTextureCube::hasPrefiltered(src, "pbr");
+        if(lambertian && !prefilterLambertian) {
+            lambertianEnvironmentMap.load(src, VK_FORMAT_R8G8B8A8_UNORM, "lambertian", true);
         }
-        // if(!model_info_list.pbr_models.empty()) {
-            std::string src = environment_lighting_info.texture.src;
+        if(pbr && !prefilterPbr) {
             pbrEnvironmentMap.load(src, VK_FORMAT_R8G8B8A8_UNORM, "pbr", true);
-            
-            std::string lut_file_path = src.substr(0, src.find_last_of("."))+".lut.png";
-            // lut.load(lut_file_path, VK_FORMAT_R16G16_SFLOAT);
-            lut.load(lut_file_path, VK_FORMAT_R8G8B8A8_UNORM);
-        // }
+        }
+        if(prefilterLambertian || prefilterPbr) {
+            prefilterEnvironment(prefilterLambertian, prefilterPbr);
+        }
+        if(pbr) {
+            std::string lut_file_path = brdfLutPath(src);
+            BrdfLut table;
+            bool loaded = false;
+            if(std::ifstream(lut_file_path).good()) {
+                // A table from another version of bin/cube, or cut short, is regenerated instead
+                try {
+                    table = readBrdfLut(lut_file_path);
+                    loaded = true;
+                } catch(const std::runtime_error& e) {
+                    std::cerr<<"Ignoring BRDF LUT "<<lut_file_path<<": "<<e.what()<<"\n";
+                }
+            }
+            if(loaded) {
+                lut.load(table);
+                std::cout<<"Load BRDF LUT "<<lut_file_path<<": "<<table.width<<"x"<<table.height<<", "<<table.samples<<" samples\n";
+            } else {
+                generateBrdfLut();
+            }
+        }
+    }
+    // The lighting pass binds the lut for every scene; it is only sampled for pbr materials
+    if(lut.textureImage == VK_NULL_HANDLE) {
+        lut.load(vec3(0.0f, 0.0f, 0.0f), VK_FORMAT_R8G8B8A8_UNORM);
+    }
+}
+
+void ViewerApplication::generateBrdfLut() {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    // The shader writes packed halves to a buffer, which is copied into the image
+    vkBuffer texels = {};
+    VkDeviceSize bufferSize = sizeof(uint32_t) * BRDF_LUT_SIZE * BRDF_LUT_SIZE;
+    // Read back by the host when the table is also written to [name].lut.bin
+    VkMemoryPropertyFlags bufferProperties = environment_cache ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, bufferProperties, texels.buffer, texels.bufferMemory);
+
+    VkDescriptorSetLayoutBinding binding = createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, /*binding=*/0, 1);
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = 1;
+    layoutInfo.pBindings = &binding;
+    VkDescriptorSetLayout descriptorSetLayout;
+    VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &descriptorSetLayout), "failed to create BRDF LUT descriptor set layout!");
+
+    VkDescriptorPoolSize poolSize{};
+    poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSize.descriptorCount = 1;
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = 1;
+    poolInfo.pPoolSizes = &poolSize;
+    poolInfo.maxSets = 1;
+    VkDescriptorPool lutDescriptorPool;
+    VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, nullptr, &lutDescriptorPool), "failed to create BRDF LUT descriptor pool!");
+
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = lutDescriptorPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &descriptorSetLayout;
+    VkDescriptorSet descriptorSet;
+    VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &descriptorSet), "failed to allocate BRDF LUT descriptor set!");
+    VkDescriptorBufferInfo bufferInfo = {texels.buffer, 0, VK_WHOLE_SIZE};
+    VkWriteDescriptorSet write = writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /*binding=*/0, &bufferInfo, 1);
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+
+    // size, samples
+    uint32_t pushConstant[2] = {BRDF_LUT_SIZE, BRDF_LUT_SAMPLES};
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(pushConstant);
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    VkPipelineLayout lutPipelineLayout;
+    VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &lutPipelineLayout), "failed to create BRDF LUT pipeline layout!");
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage = loadShader(BRDF_LUT_CSHADER, VK_SHADER_STAGE_COMPUTE_BIT);
+    // local_size_x_id = 0, local_size_y_id = 1
+    std::array<VkSpecializationMapEntry, 2> groupSizeEntries = {{{0, 0, sizeof(uint32_t)}, {1, 0, sizeof(uint32_t)}}};
+    VkSpecializationInfo specializationInfo = {static_cast<uint32_t>(groupSizeEntries.size()), groupSizeEntries.data(), sizeof(BRDF_LUT_GROUP_SIZE), &BRDF_LUT_GROUP_SIZE};
+    pipelineInfo.stage.pSpecializationInfo = &specializationInfo;
+    pipelineInfo.layout = lutPipelineLayout;
+    VkPipeline lutPipeline;
+    VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &lutPipeline), "Failed to create BRDF LUT pipeline!");
+    vkDestroyShaderModule(device, pipelineInfo.stage.module, nullptr);
+
+    lut.mipLevels = 1;
+    vkHelper.createImage(BRDF_LUT_SIZE, BRDF_LUT_SIZE, VK_FORMAT_R16G16_SFLOAT, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, lut.textureImage, lut.textureImageMemory);
+
+    VkCommandBuffer commandBuffer = vkHelper.beginSingleTimeCommands();
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lutPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lutPipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+    vkCmdPushConstants(commandBuffer, lutPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstant), pushConstant);
+    uint32_t groups = (BRDF_LUT_SIZE + BRDF_LUT_GROUP_SIZE - 1) / BRDF_LUT_GROUP_SIZE;
+    vkCmdDispatch(commandBuffer, groups, groups, 1);
+
+    VkBufferMemoryBarrier bufferBarrier{};
+    bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    bufferBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    bufferBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+    bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.buffer = texels.buffer;
+    bufferBarrier.offset = 0;
+    bufferBarrier.size = VK_WHOLE_SIZE;
+    VkImageMemoryBarrier imageBarrier{};
+    imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    imageBarrier.srcAccessMask = 0;
+    imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.image = lut.textureImage;
+    imageBarrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &bufferBarrier, 1, &imageBarrier);
+
+    VkBufferImageCopy region{};
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageExtent = {BRDF_LUT_SIZE, BRDF_LUT_SIZE, 1};
+    vkCmdCopyBufferToImage(commandBuffer, texels.buffer, lut.textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    imageBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+    vkHelper.endSingleTimeCommands(commandBuffer);
+
+    vkDestroyPipeline(device, lutPipeline, nullptr);
+    vkDestroyPipelineLayout(device, lutPipelineLayout, nullptr);
+    vkDestroyDescriptorPool(device, lutDescriptorPool, nullptr);
+    vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
+
+    if(environment_cache) {
+        BrdfLut table;
+        table.width = BRDF_LUT_SIZE;
+        table.height = BRDF_LUT_SIZE;
+        table.samples = BRDF_LUT_SAMPLES;
+        // packHalf2x16 puts the scale in the low half, which comes first in memory
+        table.texels.resize(2 * BRDF_LUT_SIZE * BRDF_LUT_SIZE);
+        void* data;
+        vkMapMemory(device, texels.bufferMemory, 0, bufferSize, 0, &data);
+        memcpy(table.texels.data(), data, static_cast<size_t>(bufferSize));
+        vkUnmapMemory(device, texels.bufferMemory);
+        std::string lut_file_path = brdfLutPath(environment_lighting_info.texture.src);
+        writeBrdfLut(lut_file_path, table);
+        std::cout<<"Save BRDF LUT "<<lut_file_path<<"\n";
+    }
+    texels.destroy();
+
+    lut.createTextureImageView(VK_FORMAT_R16G16_SFLOAT);
+    lut.createTextureSampler(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_COMPARE_OP_NEVER, 1, VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, 0.0f);
+    lut.updateDescriptorImageInfo();
+    float elapsed = std::chrono::duration<float, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - startTime).count();
+    std::cout<<"Generate BRDF LUT ("<<BRDF_LUT_SIZE<<"x"<<BRDF_LUT_SIZE<<", "<<BRDF_LUT_SAMPLES<<" samples) in "<<elapsed<<" ms\n";
+}
+
+// Whole levels of a cube for the barriers of prefilterEnvironment
+static VkImageMemoryBarrier cubeLevelsBarrier(VkImage image, uint32_t baseLevel, uint32_t levelCount, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask) {
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcAccessMask = srcAccessMask;
+    barrier.dstAccessMask = dstAccessMask;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, baseLevel, levelCount, 0, 6};
+    return barrier;
+}
+
+// RGBA16F texels of the 6 faces of a level, saved as the RGBE PNG bin/cube writes (faces stacked vertically)
+static void saveRgbeCube(const std::string& path, const uint16_t* texels, uint32_t size) {
+    std::vector<u8vec4> rgbe(static_cast<size_t>(size) * size * 6);
+    for(size_t i=0; i<rgbe.size(); i++) {
+        rgbe[i] = float_to_rgbe(vec3(halfToFloat(texels[i*4]), halfToFloat(texels[i*4+1]), halfToFloat(texels[i*4+2])));
+    }
+    if(!stbi_write_png(path.c_str(), size, size * 6, 4, rgbe.data(), size * 4)) {
+        throw std::runtime_error("failed to write "+path);
+    }
+    std::cout<<"Save prefiltered environment map "<<path<<"\n";
+}
+
+void ViewerApplication::prefilterEnvironment(bool lambertian, bool pbr) {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    const VkFormat format = VK_FORMAT_R16G16B16A16_SFLOAT;
+    const std::string& src = environment_lighting_info.texture.src;
+    const uint32_t sourceSize = environmentMap.size;
+    // The samples never need more detail than the GGX cube's level 0, so large environments are
+    // box filtered down when copied instead of keeping a float copy of every texel
+    const uint32_t radianceSize = std::min(sourceSize, PREFILTER_SOURCE_MAX_SIZE);
+
+    // Float copy of the environment with a box filtered mip chain, which the samples read from
+    VkTextureCube radiance;
+    radiance.createFloatCube(radianceSize, static_cast<uint32_t>(std::floor(std::log2(radianceSize))) + 1, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+    std::vector<VkTextureCube*> outputs;
+    if(lambertian) {
+        lambertianEnvironmentMap.createFloatCube(std::min(PREFILTER_LAMBERTIAN_SIZE, sourceSize), 1, VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+        outputs.push_back(&lambertianEnvironmentMap);
+    }
+    if(pbr) {
+        uint32_t ggxSize = std::min(GGX_SIZE, sourceSize);
+        uint32_t levels = std::min(static_cast<uint32_t>(ENVIRONMENT_MIP_LEVEL), static_cast<uint32_t>(std::floor(std::log2(ggxSize))) + 1);
+        pbrEnvironmentMap.createFloatCube(ggxSize, levels, VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+        outputs.push_back(&pbrEnvironmentMap);
+    }
+
+    // See PushConstantEnvPrefilter in env_prefilter.shader.comp
+    enum Mode : uint32_t { MODE_COPY = 0, MODE_LAMBERTIAN = 1, MODE_GGX = 2 };
+    struct PushConstant {
+        uint32_t size;
+        uint32_t samples;
+        uint32_t mode;
+        float roughness;
+        float sourceSize;
+    };
+    // One dispatch per level written
+    struct Pass {
+        VkDescriptorImageInfo source;
+        VkImageView target;
+        PushConstant pushConstant;
+    };
+    std::vector<Pass> passes;
+    passes.push_back({environmentMap.descriptorImageInfo, radiance.faceArrayView(format, 0), {radianceSize, 1, MODE_COPY, 0.0f, static_cast<float>(sourceSize)}});
+    if(lambertian) {
+        passes.push_back({radiance.descriptorImageInfo, lambertianEnvironmentMap.faceArrayView(format, 0),
+            {lambertianEnvironmentMap.size, PREFILTER_LAMBERTIAN_SAMPLES, MODE_LAMBERTIAN, 0.0f, static_cast<float>(radianceSize)}});
+    }
+    if(pbr) {
+        for(uint32_t level=0; level<pbrEnvironmentMap.mipLevels; ++level) {
+            float roughness = static_cast<float>(level) / static_cast<float>(ENVIRONMENT_MIP_LEVEL - 1);
+            // every sample of roughness 0 is N
+            uint32_t samples = level == 0 ? 1 : GGX_FILTERED_SAMPLES;
+            passes.push_back({radiance.descriptorImageInfo, pbrEnvironmentMap.faceArrayView(format, level),
+                {std::max(pbrEnvironmentMap.size >> level, 1u), samples, MODE_GGX, roughness, static_cast<float>(radianceSize)}});
+        }
+    }
+
+    std::array<VkDescriptorSetLayoutBinding, 2> bindings = {
+        createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, /*binding=*/0, 1),
+        createDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, /*binding=*/1, 1)
+    };
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+    layoutInfo.pBindings = bindings.data();
+    VkDescriptorSetLayout descriptorSetLayout;
+    VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &descriptorSetLayout), "failed to create environment prefilter descriptor set layout!");
+
+    const uint32_t setCount = static_cast<uint32_t>(passes.size());
+    std::array<VkDescriptorPoolSize, 2> poolSizes{};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[0].descriptorCount = setCount;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    poolSizes[1].descriptorCount = setCount;
+    VkDescriptorPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+    poolInfo.pPoolSizes = poolSizes.data();
+    poolInfo.maxSets = setCount;
+    VkDescriptorPool prefilterDescriptorPool;
+    VK_CHECK_RESULT(vkCreateDescriptorPool(device, &poolInfo, nullptr, &prefilterDescriptorPool), "failed to create environment prefilter descriptor pool!");
+
+    std::vector<VkDescriptorSetLayout> layouts(setCount, descriptorSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = prefilterDescriptorPool;
+    allocInfo.descriptorSetCount = setCount;
+    allocInfo.pSetLayouts = layouts.data();
+    std::vector<VkDescriptorSet> descriptorSets(setCount);
+    VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, descriptorSets.data()), "failed to allocate environment prefilter descriptor sets!");
+    for(uint32_t i=0; i<setCount; i++) {
+        VkDescriptorImageInfo targetInfo = {VK_NULL_HANDLE, passes[i].target, VK_IMAGE_LAYOUT_GENERAL};
+        std::array<VkWriteDescriptorSet, 2> writes = {
+            writeDescriptorSet(descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/0, &passes[i].source, 1),
+            writeDescriptorSet(descriptorSets[i], VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, /*binding=*/1, &targetInfo, 1)
+        };
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+    }
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(PushConstant);
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    VkPipelineLayout prefilterPipelineLayout;
+    VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &prefilterPipelineLayout), "failed to create environment prefilter pipeline layout!");
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage = loadShader(ENV_PREFILTER_CSHADER, VK_SHADER_STAGE_COMPUTE_BIT);
+    // local_size_x_id = 0, local_size_y_id = 1
+    std::array<VkSpecializationMapEntry, 2> groupSizeEntries = {{{0, 0, sizeof(uint32_t)}, {1, 0, sizeof(uint32_t)}}};
+    VkSpecializationInfo specializationInfo = {static_cast<uint32_t>(groupSizeEntries.size()), groupSizeEntries.data(), sizeof(ENV_PREFILTER_GROUP_SIZE), &ENV_PREFILTER_GROUP_SIZE};
+    pipelineInfo.stage.pSpecializationInfo = &specializationInfo;
+    pipelineInfo.layout = prefilterPipelineLayout;
+    VkPipeline prefilterPipeline;
+    VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &prefilterPipeline), "Failed to create environment prefilter pipeline!");
+    vkDestroyShaderModule(device, pipelineInfo.stage.module, nullptr);
+
+    auto dispatch = [&](VkCommandBuffer commandBuffer, uint32_t i) {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, prefilterPipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, prefilterPipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
+        vkCmdPushConstants(commandBuffer, prefilterPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstant), &passes[i].pushConstant);
+        uint32_t groups = (passes[i].pushConstant.size + ENV_PREFILTER_GROUP_SIZE - 1) / ENV_PREFILTER_GROUP_SIZE;
+        vkCmdDispatch(commandBuffer, groups, groups, 6);
+    };
+
+    // Level 0 of radiance and every output level are written by the shader, the rest of radiance by blits
+    VkCommandBuffer commandBuffer = vkHelper.beginSingleTimeCommands();
+    std::vector<VkImageMemoryBarrier> barriers;
+    barriers.push_back(cubeLevelsBarrier(radiance.textureImage, 0, 1, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT));
+    if(radiance.mipLevels > 1) {
+        barriers.push_back(cubeLevelsBarrier(radiance.textureImage, 1, radiance.mipLevels - 1, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT));
+    }
+    for(VkTextureCube* output: outputs) {
+        barriers.push_back(cubeLevelsBarrier(output->textureImage, 0, output->mipLevels, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, 0, VK_ACCESS_SHADER_WRITE_BIT));
+    }
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+    dispatch(commandBuffer, 0);
+    VkImageMemoryBarrier copied = cubeLevelsBarrier(radiance.textureImage, 0, 1, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &copied);
+    vkHelper.endSingleTimeCommands(commandBuffer);
+    radiance.generateMipmaps(radianceSize, radianceSize, 6, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+    // A submission per level keeps every one short, for drivers with a GPU timeout
+    for(uint32_t i=1; i<setCount; i++) {
+        commandBuffer = vkHelper.beginSingleTimeCommands();
+        dispatch(commandBuffer, i);
+        vkHelper.endSingleTimeCommands(commandBuffer);
+    }
+
+    // With environment_cache every output level is copied into texels, faces one after the other
+    vkBuffer texels = {};
+    std::vector<std::pair<VkTextureCube*, uint32_t>> levels;
+    std::vector<VkBufferImageCopy> regions;
+    VkDeviceSize bufferSize = 0;
+    if(environment_cache) {
+        for(VkTextureCube* output: outputs) {
+            for(uint32_t level=0; level<output->mipLevels; ++level) {
+                uint32_t levelSize = std::max(output->size >> level, 1u);
+                VkBufferImageCopy region{};
+                region.bufferOffset = bufferSize;
+                region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 6};
+                region.imageExtent = {levelSize, levelSize, 1};
+                regions.push_back(region);
+                levels.push_back({output, level});
+                bufferSize += sizeof(uint16_t) * 4 * levelSize * levelSize * 6;
+            }
+        }
+        vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, texels.buffer, texels.bufferMemory);
+    }
+
+    commandBuffer = vkHelper.beginSingleTimeCommands();
+    VkImageLayout written = environment_cache ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barriers.clear();
+    for(VkTextureCube* output: outputs) {
+        barriers.push_back(cubeLevelsBarrier(output->textureImage, 0, output->mipLevels, VK_IMAGE_LAYOUT_GENERAL, written, VK_ACCESS_SHADER_WRITE_BIT, environment_cache ? VK_ACCESS_TRANSFER_READ_BIT : VK_ACCESS_SHADER_READ_BIT));
+    }
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, environment_cache ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+    if(environment_cache) {
+        for(size_t i=0; i<regions.size(); i++) {
+            vkCmdCopyImageToBuffer(commandBuffer, levels[i].first->textureImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, texels.buffer, 1, &regions[i]);
+        }
+        VkBufferMemoryBarrier bufferBarrier{};
+        bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        bufferBarrier.buffer = texels.buffer;
+        bufferBarrier.offset = 0;
+        bufferBarrier.size = VK_WHOLE_SIZE;
+        for(VkImageMemoryBarrier& barrier: barriers) {
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        }
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &bufferBarrier, static_cast<uint32_t>(barriers.size()), barriers.data());
+    }
+    vkHelper.endSingleTimeCommands(commandBuffer);
+
+    vkDestroyPipeline(device, prefilterPipeline, nullptr);
+    vkDestroyPipelineLayout(device, prefilterPipelineLayout, nullptr);
+    vkDestroyDescriptorPool(device, prefilterDescriptorPool, nullptr);
+    vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
+    for(Pass& pass: passes) {
+        vkDestroyImageView(device, pass.target, nullptr);
+    }
+    radiance.destroy();
+
+    float elapsed = std::chrono::duration<float, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - startTime).count();
+    std::cout<<"Prefilter environment map "<<src<<" on the GPU";
+    if(lambertian) {
+        std::cout<<" (lambertian "<<lambertianEnvironmentMap.size<<", "<<PREFILTER_LAMBERTIAN_SAMPLES<<" samples)";
+    }
+    if(pbr) {
+        std::cout<<" (ggx "<<pbrEnvironmentMap.size<<", "<<pbrEnvironmentMap.mipLevels<<" levels, "<<GGX_FILTERED_SAMPLES<<" samples)";
+    }
+    std::cout<<" in "<<elapsed<<" ms\n";
+
+    if(environment_cache) {
+        std::string common_file_path = src.substr(0, src.find_last_of("."));
+        void* data;
+        vkMapMemory(device, texels.bufferMemory, 0, bufferSize, 0, &data);
+        for(size_t i=0; i<regions.size(); i++) {
+            const VkTextureCube* output = levels[i].first;
+            std::string path = output == &lambertianEnvironmentMap ? common_file_path+".lambertian.png" : common_file_path+".ggx."+std::to_string(levels[i].second)+".png";
+            saveRgbeCube(path, reinterpret_cast<const uint16_t*>(static_cast<const std::byte*>(data) + regions[i].bufferOffset), regions[i].imageExtent.width);
+        }
+        vkUnmapMemory(device, texels.bufferMemory);
+        texels.destroy();
     }
 }
 
@@ -2175,7 +3804,10 @@ void ViewerApplication::eventLoop() {
         if(e.type == EventType::AVAILABLE) {
             animation_controller->driveAnimation(time - currt_frame_time);
             currt_frame_time = time;
-            drawFrame();
+            FramePacket packet;
+            buildFramePacket(packet);
+            packet.inputTime = std::chrono::high_resolution_clock::now();
+            drawFrame(packet);
         } else if (e.type == EventType::PLAY) {
             animation_controller->setPlaybackTimeRate(time, e.rate);
             animation_controller->setPlaybackTimeRate(time, e.rate);
@@ -2383,17 +4015,25 @@ void ViewerApplication::screenshotSwapChain(const std::string& filename) {
 
 void ViewerApplication::createShadowMapSphereDescriptorSet() {
     // for sphere shadow map rendering pipeline
-    allocateSingleDescriptorSet(shadowMapPassList.sphereDescriptorSet, descriptorSetLayoutScene);
+    allocateDescriptorSet(shadowMapPassList.sphereDescriptorSets, framesInFlight, descriptorSetLayoutScene);
 
     VkDescriptorBufferInfo bufferInfo{};
     bufferInfo.buffer = shadowMapPassList.sphereUniformBuffer.buffer;
     bufferInfo.offset = 0;
     bufferInfo.range = sizeof(UniformBufferObjectShadow);
     
-    std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
-        writeDescriptorSet(shadowMapPassList.sphereDescriptorSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, /*binding=*/0, &bufferInfo, 1)};
+    for (size_t i = 0; i < framesInFlight; i++) {
+        VkDescriptorBufferInfo instanceBufferInfo{};
+        instanceBufferInfo.buffer = instanceBuffers[i].buffer;
+        instanceBufferInfo.offset = 0;
+        instanceBufferInfo.range = VK_WHOLE_SIZE;
 
-    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+        std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+            writeDescriptorSet(shadowMapPassList.sphereDescriptorSets[i], VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, /*binding=*/0, &bufferInfo, 1),
+            writeDescriptorSet(shadowMapPassList.sphereDescriptorSets[i], VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /*binding=*/15, &instanceBufferInfo, 1)};
+
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+    }
 
 }
 
@@ -2497,12 +4137,12 @@ void ViewerApplication::createShadowMapPassesSphere() {
             light_info_list.sphere_lights[i].shadow[1] = count++;
             float radius = light_info_list.sphere_lights[i].others[0];
             float limit = light_info_list.sphere_lights[i].others[1];
-            shadowMapPass.initCube(&(shadowMapPassList.uboSphere), shadow_res, radius, limit, light_info_list.sphere_light_infos[i]->transform, shadowMapPassList.renderPassSphere, depthFormat); 
+            shadowMapPass.initCube(shadow_res, radius, limit, light_info_list.sphere_light_infos[i]->transform, shadowMapPassList.renderPassSphere, depthFormat); 
             shadowMapPassList.shadowMapPassesSphere.push_back(shadowMapPass);
             shadowMapPassList.descriptorImageInfosSphere.push_back(shadowMapPass.shadowMapTexture.descriptorImageInfo);
         }
     }
-    shadowMapPassList.defaultShadowMapPassSphere.initCube(nullptr, 1, 1, 10, nullptr, shadowMapPassList.renderPassSphere, depthFormat);
+    shadowMapPassList.defaultShadowMapPassSphere.initCube(1, 1, 10, nullptr, shadowMapPassList.renderPassSphere, depthFormat);
     if(count == 0) {
         // If no light needs a shadow map, fill the descriptorImageInfosSpot with default info
         shadowMapPassList.descriptorImageInfosSphere.push_back(shadowMapPassList.defaultShadowMapPassSphere.shadowMapTexture.descriptorImageInfo);
@@ -2660,7 +4300,7 @@ void ViewerApplication::GBufferPass::createFrameBuffer(){
 
 void ViewerApplication::resizeGBufferAttachment() {
     gBufferPass.recreateAttachments();
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < framesInFlight; i++) {
         std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
         writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/6, &(gBufferPass.positionAttachment.descriptorImageInfo), 1),
         writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/7, &(gBufferPass.normalAttachment.descriptorImageInfo), 1),
@@ -2691,18 +4331,20 @@ void ViewerApplication::GBufferPass::recreateAttachments() {
 }
 
 /* -------------------- SSAO --------------------- */
-void ViewerApplication::SSAOBasePass::init(VkRenderPass renderPass){
+void ViewerApplication::SSAOBasePass::init(VkRenderPass renderPass, VkFormat format_){
+    format = format_;
     createAttachment(
-    VK_FORMAT_R8_UNORM,
+    format,
     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
     colorAttachment, width, height);
 
     createFrameBuffer(renderPass);
 }
 
-void ViewerApplication::SSAOPassList::createRenderPass(){
+// Color only render pass with a single attachment of the given format, left shader readable
+VkRenderPass ViewerApplication::SSAOPassList::createColorRenderPass(VkFormat format){
     VkAttachmentDescription attachmentDescription{};
-    attachmentDescription.format = VK_FORMAT_R8_UNORM;
+    attachmentDescription.format = format;
     attachmentDescription.samples = VK_SAMPLE_COUNT_1_BIT;
     attachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
     attachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
@@ -2745,10 +4387,24 @@ void ViewerApplication::SSAOPassList::createRenderPass(){
     renderPassInfo.dependencyCount = 2;
     renderPassInfo.pDependencies = dependencies.data();
 
+    VkRenderPass renderPass;
     VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass), "failed to create render pass for SSAOPass");
+    return renderPass;
+}
 
-    ssaoPass.init(renderPass);//create attachment and frame buffer
-    ssaoBlurPass.init(renderPass);
+void ViewerApplication::SSAOPassList::createRenderPass(){
+    renderPass = createColorRenderPass(format);
+    if(temporal) {
+        temporalRenderPass = createColorRenderPass(temporalFormat);
+    }
+
+    for(uint32_t p=0; p<passCount(); p++) {
+        ssaoPasses[p].init(ssaoRenderPass(), temporal ? temporalFormat : format);//create attachment and frame buffer
+    }
+    ssaoBlurPass.init(renderPass, format);
+    if(temporal) {
+        makeHistoryReadable();
+    }
 }
 
 void ViewerApplication::SSAOBasePass::createFrameBuffer(VkRenderPass renderPass){
@@ -2772,7 +4428,7 @@ void ViewerApplication::SSAOBasePass::recreateAttachment(VkRenderPass renderPass
     colorAttachment.destroy();
 
     createAttachment(
-    VK_FORMAT_R8_UNORM,
+    format,
     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
     colorAttachment, width, height);
 
@@ -2784,23 +4440,25 @@ void ViewerApplication::createSSAOPassList(){
 }
 
 void ViewerApplication::resizeSSAOPassListAttachment() {
-    ssaoPassList.ssaoPass.recreateAttachment(ssaoPassList.renderPass);
-    ssaoPassList.ssaoBlurPass.recreateAttachment(ssaoPassList.renderPass);
+    ssaoPassList.recreateAttachments();
+
+    for(uint32_t p=0; p<ssaoPassList.passCount(); p++) {
+        for(uint32_t i=0; i<framesInFlight; i++){
+            std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+            writeDescriptorSet(ssaoPassList.ssaoPasses[p].descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/6, &(gBufferPass.positionAttachment.descriptorImageInfo), 1),
+            writeDescriptorSet(ssaoPassList.ssaoPasses[p].descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/7, &(gBufferPass.normalAttachment.descriptorImageInfo), 1),
+            writeDescriptorSet(ssaoPassList.ssaoPasses[p].descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/9, ssaoHistoryImageInfo(p), 1)
+            };
+            vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+        }
 
-    for(uint32_t i=0; i<MAX_FRAMES_IN_FLIGHT; i++){
         std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
-        writeDescriptorSet(ssaoPassList.ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/6, &(gBufferPass.positionAttachment.descriptorImageInfo), 1),
-        writeDescriptorSet(ssaoPassList.ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/7, &(gBufferPass.normalAttachment.descriptorImageInfo), 1)
+            writeDescriptorSet(ssaoPassList.ssaoBlurPass.descriptorSets[p], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/6, &(ssaoPassList.ssaoPasses[p].colorAttachment.descriptorImageInfo), 1)
         };
         vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
     }
 
-    std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
-        writeDescriptorSet(ssaoPassList.ssaoBlurPass.descriptorSets[0], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/6, &(ssaoPassList.ssaoPass.colorAttachment.descriptorImageInfo), 1)
-    };
-    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
-
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < framesInFlight; i++) {
         std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
         writeDescriptorSet(descriptorSetsScene[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/14, &(ssaoPassList.ssaoBlurPass.colorAttachment.descriptorImageInfo), 1)
         };
@@ -2809,38 +4467,54 @@ void ViewerApplication::resizeSSAOPassListAttachment() {
     }
 }
 
-void ViewerApplication::createSSAOPassDescriptorSet(){
-    // for cube shadow map debug pipeline
-    allocateDescriptorSet(ssaoPassList.ssaoPass.descriptorSets, MAX_FRAMES_IN_FLIGHT, descriptorSetLayoutScene);
-
-    for(uint32_t i=0; i<MAX_FRAMES_IN_FLIGHT; i++){
-        VkDescriptorBufferInfo bufferInfo{};
-        bufferInfo.buffer = uniformBuffers[i].buffer;
-        bufferInfo.offset = 0;
-        bufferInfo.range = sizeof(UniformBufferObjectScene);
-
-        VkDescriptorBufferInfo ssaoBufferInfo{};
-        ssaoBufferInfo.buffer = ssaoPassList.ssaoUniformBuffer.buffer;
-        ssaoBufferInfo.offset = 0;
-        ssaoBufferInfo.range = sizeof(UniformBufferObjectSSAO);
-
-        std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
-        writeDescriptorSet(ssaoPassList.ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, /*binding=*/0, &bufferInfo, 1),
-        writeDescriptorSet(ssaoPassList.ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, /*binding=*/1, &ssaoBufferInfo, 1),
-        writeDescriptorSet(ssaoPassList.ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/6, &(gBufferPass.positionAttachment.descriptorImageInfo), 1),
-        writeDescriptorSet(ssaoPassList.ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/7, &(gBufferPass.normalAttachment.descriptorImageInfo), 1),
-        writeDescriptorSet(ssaoPassList.ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/8, &(ssaoPassList.ssaoNoise.descriptorImageInfo), 1)};
+// In temporal mode each ping-pong pass reads the other one's output as history (binding 9).
+// Otherwise the history is never blended in, but the shader still declares it, so the binding
+// gets an image that is always shader readable
+const VkDescriptorImageInfo* ViewerApplication::ssaoHistoryImageInfo(uint32_t pass){
+    if(ssaoPassList.temporal) {
+        return &(ssaoPassList.ssaoPasses[1-pass].colorAttachment.descriptorImageInfo);
+    }
+    return &(ssaoPassList.ssaoNoise.descriptorImageInfo);
+}
 
-        vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+void ViewerApplication::createSSAOPassDescriptorSet(){
+    for(uint32_t p=0; p<ssaoPassList.passCount(); p++) {
+        auto& ssaoPass = ssaoPassList.ssaoPasses[p];
+        allocateDescriptorSet(ssaoPass.descriptorSets, framesInFlight, descriptorSetLayoutScene);
+
+        for(uint32_t i=0; i<framesInFlight; i++){
+            VkDescriptorBufferInfo bufferInfo{};
+            bufferInfo.buffer = uniformBuffers[i].buffer;
+            bufferInfo.offset = 0;
+            bufferInfo.range = sizeof(UniformBufferObjectScene);
+
+            VkDescriptorBufferInfo ssaoBufferInfo{};
+            ssaoBufferInfo.buffer = ssaoPassList.ssaoUniformBuffers[i].buffer;
+            ssaoBufferInfo.offset = 0;
+            ssaoBufferInfo.range = sizeof(UniformBufferObjectSSAO);
+
+            std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+            writeDescriptorSet(ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, /*binding=*/0, &bufferInfo, 1),
+            writeDescriptorSet(ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, /*binding=*/1, &ssaoBufferInfo, 1),
+            writeDescriptorSet(ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/6, &(gBufferPass.positionAttachment.descriptorImageInfo), 1),
+            writeDescriptorSet(ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/7, &(gBufferPass.normalAttachment.descriptorImageInfo), 1),
+            writeDescriptorSet(ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/8, &(ssaoPassList.ssaoNoise.descriptorImageInfo), 1),
+            writeDescriptorSet(ssaoPass.descriptorSets[i], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/9, ssaoHistoryImageInfo(p), 1)};
+
+            vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+        }
     }
 }
 
 void ViewerApplication::createSSAOBlurPassDescriptorSet(){
-    allocateDescriptorSet(ssaoPassList.ssaoBlurPass.descriptorSets, 1, descriptorSetLayoutScene);
+    // One set per SSAO pass
+    allocateDescriptorSet(ssaoPassList.ssaoBlurPass.descriptorSets, ssaoPassList.passCount(), descriptorSetLayoutScene);
 
-    std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
-        writeDescriptorSet(ssaoPassList.ssaoBlurPass.descriptorSets[0], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/6, &(ssaoPassList.ssaoPass.colorAttachment.descriptorImageInfo), 1)
-    };
+    for(uint32_t p=0; p<ssaoPassList.passCount(); p++) {
+        std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+            writeDescriptorSet(ssaoPassList.ssaoBlurPass.descriptorSets[p], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, /*binding=*/6, &(ssaoPassList.ssaoPasses[p].colorAttachment.descriptorImageInfo), 1)
+        };
 
-    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+    }
 }
\ No newline at end of file
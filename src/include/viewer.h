@@ -35,6 +35,8 @@
 #include <algorithm> // Necessary for std::clamp
 #include <string>
 #include <random>
+#include <thread>
+#include <atomic>
 
 #include "vertex.hpp"
 #include "scene.h"
@@ -47,13 +49,18 @@
 #include "controllers/animation_controller.h"
 #include "controllers/events_controller.h"
 #include "vk/vk_helper.h"
+#include "utils/spsc_queue.h"
+#include "utils/render_queue.h"
+#include "utils/ktx2.h"
+#include "utils/brdf_lut.h"
+#include "scene/render_proxy.h"
 
 
 
 const uint32_t WIDTH = 1000;
 const uint32_t HEIGHT = 600;
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
 
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation"
@@ -97,6 +104,26 @@ public:
 
     void enableMeasure();
 
+    void enableTemporalSSAO();
+
+    void disableSSAO();
+
+    void setFramesInFlight(int n);
+
+    void enableStartupReport();
+
+    void enableBindless();
+
+    void setLodError(float pixels);
+
+    void enableClusterCulling();
+
+    void enablePackedVertices();
+
+    void setMeshOptimization(const std::string& mode);
+
+    void enableEnvironmentCache();
+
     void run();
 
     void listPhysicalDevice();
@@ -121,6 +148,10 @@ private:
     int frame_count = 0;
     float total_time = 0.0f;
     int vertices_count = 0;
+    // For startup time reporting
+    bool startup_report = false;
+    bool first_frame_reported = false;
+    std::chrono::time_point<std::chrono::high_resolution_clock> startup_time;
 
     UniformBufferObjectScene uboScene = {};
     UniformBufferObjectLight uboLight = {};
@@ -131,6 +162,8 @@ private:
     
     static inline VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
     static inline VkDevice device = NULL; //logical device
+    // textureCompressionBC is enabled, textures with a KTX2 file next to them are loaded from it
+    static inline bool bcTextures = false;
     VkPhysicalDeviceProperties physicalDeviceProperties;
     
     static inline VkQueue graphicsQueue = NULL;
@@ -150,10 +183,19 @@ private:
     // Per object/material
     VkDescriptorSetLayout descriptorSetLayoutMaterial;
     std::vector<VkDescriptorSet> descriptorSetsScene;
+
+    // Bindless materials (set 2): material buffer and one texture array shared by every pbr and lambertian model,
+    // bound once per frame instead of a material descriptor set per draw
+    bool bindless = false;
+    uint32_t bindlessTextureCapacity = 0; // size of the texture array in the layout, the set only allocates what is used
+    VkDescriptorSetLayout descriptorSetLayoutBindless = VK_NULL_HANDLE;
+    VkDescriptorPool bindlessDescriptorPool = VK_NULL_HANDLE; // update after bind pool, separate from descriptorPool
+    VkDescriptorSet bindlessDescriptorSet = VK_NULL_HANDLE;
     
     VkPipelineLayout pipelineLayout;
 
     VkPipelineCache pipelineCache;
+    bool pipelineCacheLoaded = false;
     //Multiple pipelines
     struct Pipelines {
         VkPipeline simple = VK_NULL_HANDLE;
@@ -214,6 +256,8 @@ private:
     
     bool framebufferResized = false;
     static inline uint32_t currentFrame = 0;
+    // Number of frames the CPU may record ahead of the GPU, set with --frames-in-flight
+    static inline uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
 
     struct vkBuffer {
         VkBuffer buffer;
@@ -228,6 +272,14 @@ private:
 
     std::vector<vkBuffer> uniformBuffers;
     std::vector<vkBuffer> lightUniformBuffers;
+    // Persistently mapped per-frame instance storage buffers (scene binding 15), one InstanceData per render proxy
+    std::vector<vkBuffer> instanceBuffers;
+    // Render thread copy of every instance, kept current from the packets' instance updates
+    std::vector<InstanceData> instance_data;
+    // Per instance buffer, instances changed since that buffer was last written
+    std::vector<std::vector<uint32_t>> instanceBufferPending;
+    // MaterialData of the bindless materials (bindless set binding 0)
+    vkBuffer materialBuffer = {};
     
     static inline VkDescriptorPool descriptorPool = NULL;
     
@@ -417,14 +469,15 @@ private:
             int levelCount = 1, 
             VkImageViewType viewType = VK_IMAGE_VIEW_TYPE_2D, 
             int baseArrayLayer = 0, 
-            VkComponentMapping components = {VK_COMPONENT_SWIZZLE_IDENTITY}) {
+            VkComponentMapping components = {VK_COMPONENT_SWIZZLE_IDENTITY},
+            int baseMipLevel = 0) {
             VkImageViewCreateInfo viewInfo{};
             viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
             viewInfo.image = image;
             viewInfo.viewType = viewType;
             viewInfo.format = format;
             viewInfo.subresourceRange.aspectMask = aspectFlags;
-            viewInfo.subresourceRange.baseMipLevel = 0;
+            viewInfo.subresourceRange.baseMipLevel = baseMipLevel;
             viewInfo.subresourceRange.levelCount = levelCount;
             viewInfo.subresourceRange.baseArrayLayer = baseArrayLayer;
             viewInfo.subresourceRange.layerCount = layerCount;
@@ -450,11 +503,12 @@ private:
     };
 
     struct VkTexture {
-        VkImage textureImage;
-        VkDeviceMemory textureImageMemory;
-        VkImageView textureImageView;
-        VkSampler textureSampler;
+        VkImage textureImage = VK_NULL_HANDLE;
+        VkDeviceMemory textureImageMemory = VK_NULL_HANDLE;
+        VkImageView textureImageView = VK_NULL_HANDLE;
+        VkSampler textureSampler = VK_NULL_HANDLE;
         VkDescriptorImageInfo descriptorImageInfo = {};
+        uint32_t mipLevels = 1;
 
         VkTexture() = default;
         
@@ -467,6 +521,12 @@ private:
 
         TextureInfo loadFromFile(const char* texture_file_path, int desired_channels);
 
+        // Whether path is a block compressed KTX2 file (see bin/compress) the device can sample
+        static bool hasCompressed(const std::string& path);
+
+        // Uploads every level and face of ktx as stored, a cube map for 6 faces
+        void createCompressedImage(const Ktx2Image& ktx);
+
         void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, int layerCount = 1, int mipLevel = 0) {
             VkCommandBuffer commandBuffer = vkHelper.beginSingleTimeCommands();
             
@@ -499,10 +559,19 @@ private:
         }
 
         
-        void createTextureImage(TextureInfo info, VkFormat format, int pixelSize = 1);
+        // With more than one mip level the rest of the chain is generated from info
+        void createTextureImage(TextureInfo info, VkFormat format, int pixelSize = 1, uint32_t mipLevels_ = 1);
+
+        // Blits mip levels 1.. from level 0, which is in TRANSFER_DST_OPTIMAL; leaves every level in SHADER_READ_ONLY_OPTIMAL
+        // for reads in dstStage. Each of the layerCount layers is filtered separately
+        void generateMipmaps(int width, int height, uint32_t layerCount = 1, VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+
+        // Levels 1..mipLevels-1 of an 8 bit per channel image, packed one after the other;
+        // extents gets the size of every level, it holds level 0 on entry
+        static std::vector<unsigned char> buildMipChain(const TextureInfo& info, uint32_t mipLevels, std::vector<VkExtent2D>& extents);
 
         void createTextureImageView(VkFormat format) {
-            vkHelper.createImageView(textureImageView, textureImage, format, VK_IMAGE_ASPECT_COLOR_BIT);
+            vkHelper.createImageView(textureImageView, textureImage, format, VK_IMAGE_ASPECT_COLOR_BIT, 1, mipLevels);
         }
 
         void createTextureSampler(
@@ -524,7 +593,7 @@ private:
             
             VkPhysicalDeviceProperties properties{};
             vkGetPhysicalDeviceProperties(physicalDevice, &properties);
-            samplerInfo.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
+            samplerInfo.maxAnisotropy = std::min(properties.limits.maxSamplerAnisotropy, MAX_SAMPLER_ANISOTROPY);
             samplerInfo.borderColor = borderColor;
             samplerInfo.unnormalizedCoordinates = VK_FALSE;
             samplerInfo.compareEnable = VK_FALSE;
@@ -545,7 +614,8 @@ private:
     struct VkTexture2D : VkTexture {
         VkTexture2D() : VkTexture() {}
 
-        TextureInfo loadLUTFromBinaryFile(const std::string texture_file_path);
+        // R16G16_SFLOAT image of the table as stored, sampled at its exact resolution
+        void load(const BrdfLut& lut);
 
         void load(const std::string texture_file_path, VkFormat format = VK_FORMAT_R8G8B8A8_UNORM);
 
@@ -603,6 +673,8 @@ private:
     };
 
     struct VkTextureCube : VkTexture {
+        uint32_t size = 0; // face size of level 0
+
         VkTextureCube() : VkTexture() {}
 
         void load(std::string texture_file_path, VkFormat format=VK_FORMAT_R8G8B8A8_UNORM, std::string type = "", bool isRgbe = false
@@ -610,8 +682,29 @@ private:
 
         void createCubeTextureImage(std::vector<TextureInfo>& info, VkFormat format);
 
+        // RGBE texels to VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 in place
         void convertToRadianceValue(TextureInfo& info);
 
+        // KTX2 file bin/compress writes for a cube of the given type (see load)
+        static std::string compressedPath(const std::string& texture_file_path, const std::string& type);
+
+        // Block compressed radiance in place of the RGBE PNGs, all mips and faces in one file
+        void loadCompressed(const std::string& texture_file_path, const std::string& type);
+
+        // Whether load finds the files of a prefiltered cube (type lambertian or pbr), compressed or not
+        static bool hasPrefiltered(const std::string& texture_file_path, const std::string& type);
+
+        // Uninitialized RGBA16F cube a compute shader writes through faceArrayView, with a view and
+        // sampler over every level for reading it after
+        void createFloatCube(uint32_t size_, uint32_t mipLevels_, VkImageUsageFlags usage);
+
+        // The 6 faces of one level as a 2D array, for storage image writes
+        VkImageView faceArrayView(VkFormat format, uint32_t level) {
+            VkImageView view;
+            vkHelper.createImageView(view, textureImage, format, VK_IMAGE_ASPECT_COLOR_BIT, 6, 1, VK_IMAGE_VIEW_TYPE_2D_ARRAY, 0, {VK_COMPONENT_SWIZZLE_IDENTITY}, static_cast<int>(level));
+            return view;
+        }
+
         void createCubeTextureImageView(VkFormat format, int mipLevel = 1) {
             vkHelper.createImageView(textureImageView, textureImage, format, VK_IMAGE_ASPECT_COLOR_BIT, 6, mipLevel, VK_IMAGE_VIEW_TYPE_CUBE);
         }
@@ -621,84 +714,114 @@ private:
         Material::Type type;
         std::shared_ptr<VkTexture2D> normalMap = nullptr; // default to constant (0,0,1)
         std::shared_ptr<VkTexture2D> displacementMap = nullptr; // default to constant 0
+        bool hasDisplacement = false; // selects the gbuffer variant with parallax occlusion mapping
 		// PBR texture maps
 		std::shared_ptr<VkTexture2D> albedo = nullptr; // default to constant (1,1,1) (also used by lambertian)
         std::shared_ptr<VkTexture2D> metalness = nullptr; // default to constant 0.0
 		std::shared_ptr<VkTexture2D> roughness = nullptr; // default to constant 1.0
 
-        void load(std::shared_ptr<Material> material_ptr) {
+        // Bindless materials are read from the material buffer instead of a per-model descriptor set.
+        // Their constant maps are not uploaded, the value is kept in data (texture indices are filled in by createBindlessDescriptorSet)
+        bool bindless = false;
+        MaterialData data = {};
+        uint32_t bindlessIndex = 0; // into the bindless material buffer
+        std::vector<VkDescriptorSet> descriptorSets; // per frame, only if not bindless
+
+        template<typename T>
+        std::shared_ptr<VkTexture2D> loadConstant(T constant) {
+            if(bindless) {
+                return nullptr;
+            }
+            auto texture = std::make_shared<VkTexture2D>();
+            texture->load(constant, VK_FORMAT_R8G8B8A8_UNORM);
+            return texture;
+        }
+
+        std::shared_ptr<VkTexture2D> loadTexture(const std::string& src) {
+            auto texture = std::make_shared<VkTexture2D>();
+            texture->load(src, VK_FORMAT_R8G8B8A8_UNORM);
+            return texture;
+        }
+
+        void load(std::shared_ptr<Material> material_ptr, bool bindless_ = false) {
             type = material_ptr->type;
+            bindless = bindless_;
+            data = {};
+            data.albedo = vec4(1.0f, 1.0f, 1.0f, 1.0f);
+            data.roughness = 1.0f;
+            data.metalness = 0.0f;
 
-            normalMap = std::make_shared<VkTexture2D>();
             if(material_ptr->normal_map.has_value()){
-                normalMap->load(material_ptr->normal_map->src, VK_FORMAT_R8G8B8A8_UNORM);
+                normalMap = loadTexture(material_ptr->normal_map->src);
             } else {
-                normalMap->load(vec3(0,0,1)*0.5+0.5,VK_FORMAT_R8G8B8A8_UNORM);
+                normalMap = loadConstant(vec3(0,0,1)*0.5+0.5);
             }
 
-            displacementMap = std::make_shared<VkTexture2D>();
+            hasDisplacement = material_ptr->displacement_map.has_value();
             if(material_ptr->displacement_map.has_value()){
-                displacementMap->load(material_ptr->displacement_map->src, VK_FORMAT_R8G8B8A8_UNORM);
+                displacementMap = loadTexture(material_ptr->displacement_map->src);
             } else {
-                displacementMap->load(0.0, VK_FORMAT_R8G8B8A8_UNORM);
+                displacementMap = loadConstant(0.0f);
             }
 
             if(type == Material::Type::LAMBERTIAN){
                 Lambertian lamber = material_ptr->lambertian();
 
-                albedo = std::make_shared<VkTexture2D>();
                 if(lamber.albedo.has_value()) {
-                    albedo->load(lamber.albedo.value(), VK_FORMAT_R8G8B8A8_UNORM);
+                    albedo = loadConstant(lamber.albedo.value());
+                    data.albedo = vec4(lamber.albedo.value()[0], lamber.albedo.value()[1], lamber.albedo.value()[2], 1.0f);
                 } else if (lamber.albedo_texture.has_value()) {
-                    albedo->load(lamber.albedo_texture->src, VK_FORMAT_R8G8B8A8_UNORM);
+                    albedo = loadTexture(lamber.albedo_texture->src);
                 } else {
                     // default to (1,1,1)
-                    albedo->load(vec3(1,1,1), VK_FORMAT_R8G8B8A8_UNORM);
+                    albedo = loadConstant(vec3(1,1,1));
                 } 
                 // load default roughness, metalness map
-                roughness = std::make_shared<VkTexture2D>();
-                roughness->load(1.0, VK_FORMAT_R8G8B8A8_UNORM);
-                metalness = std::make_shared<VkTexture2D>();
-                metalness->load(0.0, VK_FORMAT_R8G8B8A8_UNORM);
+                roughness = loadConstant(1.0f);
+                metalness = loadConstant(0.0f);
             } 
 
             if(type == Material::Type::PBR){
                 Pbr pbr = material_ptr->pbr();
-                 albedo = std::make_shared<VkTexture2D>();
                 if(pbr.albedo.has_value()) {
-                    albedo->load(pbr.albedo.value(), VK_FORMAT_R8G8B8A8_UNORM);
+                    albedo = loadConstant(pbr.albedo.value());
+                    data.albedo = vec4(pbr.albedo.value()[0], pbr.albedo.value()[1], pbr.albedo.value()[2], 1.0f);
                 } else if (pbr.albedo_texture.has_value()) {
-                    albedo->load(pbr.albedo_texture->src, VK_FORMAT_R8G8B8A8_UNORM);
+                    albedo = loadTexture(pbr.albedo_texture->src);
                 } else {
                     // default to (1,1,1)
-                    albedo->load(vec3(1,1,1), VK_FORMAT_R8G8B8A8_UNORM);
+                    albedo = loadConstant(vec3(1,1,1));
                 } 
 
-                roughness = std::make_shared<VkTexture2D>();
                 if(pbr.roughness.has_value()) {
-                    roughness->load(pbr.roughness.value(), VK_FORMAT_R8G8B8A8_UNORM);
+                    roughness = loadConstant(pbr.roughness.value());
+                    data.roughness = pbr.roughness.value();
                 } else if (pbr.roughness_texture.has_value()) {
-                    roughness->load(pbr.roughness_texture->src, VK_FORMAT_R8G8B8A8_UNORM);
+                    roughness = loadTexture(pbr.roughness_texture->src);
                 } else {
                     // default to 1.0
-                    roughness->load(1.0, VK_FORMAT_R8G8B8A8_UNORM);
+                    roughness = loadConstant(1.0f);
                 } 
 
-                metalness = std::make_shared<VkTexture2D>();
                 if(pbr.metalness.has_value()) {
-                    metalness->load(pbr.metalness.value(), VK_FORMAT_R8G8B8A8_UNORM);
+                    metalness = loadConstant(pbr.metalness.value());
+                    data.metalness = pbr.metalness.value();
                 } else if (pbr.metalness_texture.has_value()) {
-                    metalness->load(pbr.metalness_texture->src, VK_FORMAT_R8G8B8A8_UNORM);
+                    metalness = loadTexture(pbr.metalness_texture->src);
                 } else {
                     // default to 0.0
-                    metalness->load(0.0, VK_FORMAT_R8G8B8A8_UNORM);
+                    metalness = loadConstant(0.0f);
                 } 
             } 
         }
 
         void destroy() {
-            normalMap->destroy();
-            displacementMap->destroy();
+            if(normalMap!=nullptr){
+                normalMap->destroy();
+            }
+            if(displacementMap!=nullptr){
+                displacementMap->destroy();
+            }
             if(albedo!=nullptr){
                 albedo->destroy();
             }
@@ -716,132 +839,136 @@ private:
     VkTextureCube lambertianEnvironmentMap;
     VkTextureCube pbrEnvironmentMap;
     VkTexture2D lut; // pbr BRDF look up table
+    // Diffuse environment lighting comes from uboLight.irradianceSH instead of lambertianEnvironmentMap
+    bool irradiance_sh = false;
+    // Products generated at load (prefiltered cubes, BRDF LUT) are written to disk for the next run
+    bool environment_cache = false;
 
+    // Reads [name].lambertian.sh9 written by ./cube --sh into uboLight if it exists
+    void loadIrradianceSH();
     void loadEnvironment();
 
+    // Integrates the BRDF LUT into lut with brdf_lut.shader.comp, for environments without a
+    // [name].lut.bin. The compute pipeline only lives for the one dispatch
+    void generateBrdfLut();
+
+    // Prefilters the lambertian and / or GGX cube from environmentMap with env_prefilter.shader.comp,
+    // for environments without their files (see VkTextureCube::hasPrefiltered). The outputs are
+    // RGBA16F cubes; with environment_cache they are also saved as the RGBE PNGs bin/cube writes
+    void prefilterEnvironment(bool lambertian, bool pbr);
+
     void destroyEnvironment();
 
     /* ------------------- Model loading & rendering ------------------- */
-    struct VkModel {
-        PushConstantModel pc = {}; //model
-        std::shared_ptr<Transform> transform;
+    // Vertex and index buffers of one mesh, shared by every node that instances it
+    struct VkMesh {
         std::shared_ptr<Mesh> mesh;
-        VkBuffer vertexBuffer;
-        VkDeviceMemory vertexBufferMemory;
+        // One buffer per VertexStream in streams, the others are null
+        uint32_t streams = 0;
+        std::array<VkBuffer, VERTEX_STREAM_COUNT> vertexBuffers{};
+        std::array<VkDeviceMemory, VERTEX_STREAM_COUNT> vertexBufferMemories{};
         VkBuffer indexBuffer;
         VkDeviceMemory indexBufferMemory;
-        std::vector<VkDescriptorSet> descriptorSets; 
-        VkMaterial material;
-
-        VkModel() = default;
-
-        VkModel(std::shared_ptr<ModelInfo> info_){
-            mesh = info_->mesh;
-            transform = info_->transform;
-            updateModel();
-        }
+        // 16 bit whenever every vertex fits
+        VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+        VkDeviceSize indexBufferSize = 0;
+        std::vector<MeshLod> lods; // ranges of the index buffer
+        // Meshlets of lods[0] in clusterCullPass.meshletBuffer, none when the mesh is drawn whole
+        uint32_t firstMeshlet = 0;
+        uint32_t meshletCount = 0;
+        // PackedVertexFormat positions are quantized over the cube of side quantizationScale at quantizationOffset
+        bool packed = false;
+        vec3 quantizationOffset = vec3(0.0f, 0.0f, 0.0f);
+        float quantizationScale = 1.0f;
+        VkDeviceSize vertexBufferSize = 0; // over every stream
+
+        VkMesh() = default;
+
+        VkMesh(std::shared_ptr<Mesh> mesh_) : mesh(mesh_) {}
 
         void destroy(){
-            vkDestroyBuffer(device, vertexBuffer, nullptr);
-            vkFreeMemory(device, vertexBufferMemory, nullptr);
+            for(uint32_t s=0; s<VERTEX_STREAM_COUNT; s++) {
+                if(streams & (1u << s)) {
+                    vkDestroyBuffer(device, vertexBuffers[s], nullptr);
+                    vkFreeMemory(device, vertexBufferMemories[s], nullptr);
+                }
+            }
             vkDestroyBuffer(device, indexBuffer, nullptr);
             vkFreeMemory(device, indexBufferMemory, nullptr);
         }
 
-        void load(){
-            createVertexBuffer();
+        // streams: the VertexStreams read by the pipelines that draw this mesh
+        void load(bool packed_, uint32_t streams_){
+            packed = packed_;
+            streams = streams_;
+            createVertexBuffers();
             createIndexBuffer();
-            material = {};
-            material.load(mesh->material);
-        }
-
-        void updateModel() {
-            pc.model = transform->model();
-            pc.invModel = mat4::transpose(inverse(pc.model));
-        }
-
-        void render(VkCommandBuffer& commandBuffer, VkPipelineLayout& pipelineLayout){
-            vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstantModel), &pc);
-
-            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 1, 1, &descriptorSets[currentFrame], 0, nullptr);//?
-
-            VkBuffer vertexBuffers[] = {vertexBuffer};
-            VkDeviceSize offsets[] = {0};
-            vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-
-            vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-
-            vkCmdDrawIndexed(commandBuffer,
-                            static_cast<uint32_t>(mesh->indices.size()),
-                            1,/*number of instances*/
-                            0,/*offset into the index buffer*/
-                            0,//offset to add to the indices
-                                0);//offset for instancing
-
-            // With no index buffer:
-            // vkCmdDraw(commandBuffer, static_cast<uint32_t>(mesh->vertices.size()), 1, 0, 0);//vertexCount=3, instanceCount=1, firstVertex=0, firstInstance=0
-            
-        
+            lods = mesh->lods;
         }
 
-        void renderForShadowMap(VkCommandBuffer& commandBuffer, VkPipelineLayout& pipelineLayout, PushConstantShadow& pcShadow){
-            pcShadow.model = pc.model;
-            vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstantShadow), &pcShadow);
-
-            VkBuffer vertexBuffers[] = {vertexBuffer};
-            VkDeviceSize offsets[] = {0};
-            vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-
-            vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-
-            vkCmdDrawIndexed(commandBuffer,
-                            static_cast<uint32_t>(mesh->indices.size()),
-                            1,/*number of instances*/
-                            0,/*offset into the index buffer*/
-                            0,//offset to add to the indices
-                                0);//offset for instancing
+        // Object space from the position attribute, folded into the instance's model matrix
+        mat4 dequantization() const {
+            mat4 m = mat4::I;
+            if(packed) {
+                for(int i=0; i<3; i++) {
+                    m[i][i] = quantizationScale;
+                    m[3][i] = quantizationOffset[i];
+                }
+            }
+            return m;
         }
 
-        void renderForShadowMap(VkCommandBuffer& commandBuffer, VkPipelineLayout& pipelineLayout, PushConstantCubeShadow& pcCubeShadow){
-            pcCubeShadow.model = pc.model;
-            vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstantCubeShadow), &pcCubeShadow);
-
-            VkBuffer vertexBuffers[] = {vertexBuffer};
-            VkDeviceSize offsets[] = {0};
-            vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-
-            vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-
-            vkCmdDrawIndexed(commandBuffer,
-                            static_cast<uint32_t>(mesh->indices.size()),
-                            1,/*number of instances*/
-                            0,/*offset into the index buffer*/
-                            0,//offset to add to the indices
-                                0);//offset for instancing
-        }
+        void createVertexBuffers() {
+            // One scale for all axes keeps the quantized space uniformly scaled, so bounding spheres
+            // and normals stay valid in it
+            if(packed) {
+                quantizationOffset = mesh->bbox.min;
+                quantizationScale = std::max({mesh->bbox.max[0] - mesh->bbox.min[0], mesh->bbox.max[1] - mesh->bbox.min[1], mesh->bbox.max[2] - mesh->bbox.min[2]});
+                if(quantizationScale <= 0.0f) {
+                    quantizationScale = 1.0f;
+                }
+            }
+            VertexQuantization quantization{quantizationOffset, quantizationScale};
+            auto data = packed ? PackedVertexFormat::encode(streams, mesh->vertices, quantization)
+                               : FullVertexFormat::encode(streams, mesh->vertices, quantization);
+            vertexBufferSize = 0;
+            for(uint32_t s=0; s<VERTEX_STREAM_COUNT; s++) {
+                if(!(streams & (1u << s))) {
+                    continue;
+                }
+                VkDeviceSize bufferSize = data[s].size();
+                vertexBufferSize += bufferSize;
 
-        void createVertexBuffer() {
-            VkDeviceSize bufferSize = sizeof(mesh->vertices.at(0)) * mesh->vertices.size();
-            
-            VkBuffer stagingBuffer;
-            VkDeviceMemory stagingBufferMemory;
-            vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-            
-            void* data;
-            vkMapMemory(device, stagingBufferMemory, 0/*offset*/, bufferSize, 0/*flag*/, &data);
-            memcpy(data, mesh->vertices.data(), (size_t) bufferSize);
-            vkUnmapMemory(device, stagingBufferMemory);
-            
-            vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
-            
-            vkHelper.copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-            
-            vkDestroyBuffer(device, stagingBuffer, nullptr);
-            vkFreeMemory(device, stagingBufferMemory, nullptr);
+                VkBuffer stagingBuffer;
+                VkDeviceMemory stagingBufferMemory;
+                vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+                
+                void* mapped;
+                vkMapMemory(device, stagingBufferMemory, 0/*offset*/, bufferSize, 0/*flag*/, &mapped);
+                memcpy(mapped, data[s].data(), (size_t) bufferSize);
+                vkUnmapMemory(device, stagingBufferMemory);
+                
+                vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffers[s], vertexBufferMemories[s]);
+                
+                vkHelper.copyBuffer(stagingBuffer, vertexBuffers[s], bufferSize);
+                
+                vkDestroyBuffer(device, stagingBuffer, nullptr);
+                vkFreeMemory(device, stagingBufferMemory, nullptr);
+            }
         }
 
         void createIndexBuffer() {
+            std::vector<uint16_t> indices16;
+            const void* indices = mesh->indices.data();
             VkDeviceSize bufferSize = sizeof(mesh->indices[0]) * mesh->indices.size();
+            indexType = VK_INDEX_TYPE_UINT32;
+            if(mesh->vertices.size() <= 65536) {
+                indices16.assign(mesh->indices.begin(), mesh->indices.end());
+                indices = indices16.data();
+                bufferSize = sizeof(uint16_t) * indices16.size();
+                indexType = VK_INDEX_TYPE_UINT16;
+            }
+            indexBufferSize = bufferSize;
 
             VkBuffer stagingBuffer;
             VkDeviceMemory stagingBufferMemory;
@@ -849,7 +976,7 @@ private:
 
             void* data;
             vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-            memcpy(data, mesh->indices.data(), (size_t) bufferSize);
+            memcpy(data, indices, (size_t) bufferSize);
             vkUnmapMemory(device, stagingBufferMemory);
 
             vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
@@ -861,147 +988,15 @@ private:
         }
     };
 
-    struct VkModelList {
-        std::vector<std::shared_ptr<VkModel> > simple_models;
-        std::vector<std::shared_ptr<VkModel>> env_models;
-        std::vector<std::shared_ptr<VkModel>> mirror_models;
-        std::vector<std::shared_ptr<VkModel>> pbr_models;
-        std::vector<std::shared_ptr<VkModel>> lamber_models;
-
-        void renderForShadowMap(VkCommandBuffer& commandBuffer, VkPipelineLayout& pipelineLayout, PushConstantShadow& pcShadow) {
-            auto renderHelper = [&commandBuffer, &pipelineLayout, &pcShadow](std::vector<std::shared_ptr<VkModel>>& models){
-                if(models.empty()) {
-                    return;
-                }
-                for(auto model: models){
-                    model->updateModel();
-                    model->renderForShadowMap(commandBuffer, pipelineLayout, pcShadow);
-                }
-                
-            };
-            renderHelper(pbr_models);
-            renderHelper(lamber_models);
-        }
-
-        void renderForShadowMap(VkCommandBuffer& commandBuffer, VkPipelineLayout& pipelineLayout, PushConstantCubeShadow& pcShadow) {
-            auto renderHelper = [&commandBuffer, &pipelineLayout, &pcShadow](std::vector<std::shared_ptr<VkModel>>& models){
-                if(models.empty()) {
-                    return;
-                }
-                for(auto model: models){
-                    model->updateModel();
-                    model->renderForShadowMap(commandBuffer, pipelineLayout, pcShadow);
-                }
-                
-            };
-            renderHelper(pbr_models);
-            renderHelper(lamber_models);
-        }
-
-        void render(VkCommandBuffer& commandBuffer, VkPipelineLayout& pipelineLayout, const std::string culling=CULLING_NONE, mat4 VP=mat4::I){
-            auto renderHelper = [&commandBuffer, &pipelineLayout, &VP, &culling](std::vector<std::shared_ptr<VkModel>>& models, VkPipeline& pipeline){
-                if(models.empty()) {
-                    return;
-                }
-                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-                if(culling == CULLING_NONE) {
-                    for(auto model: models){
-                        model->updateModel();
-                        model->render(commandBuffer, pipelineLayout);
-                    }
-                } else {
-                    for(auto model: models){
-                        model->updateModel();
-                        mat4 MVP = VP * model->pc.model;
-                        if(frustum_cull_test(MVP, model->mesh->bbox)){
-                            model->render(commandBuffer, pipelineLayout);
-                        }
-                    }
-                }
-            };
-            renderHelper(simple_models, pipelines.simple);
-            renderHelper(env_models, pipelines.env);
-            renderHelper(mirror_models, pipelines.mirror);
-            renderHelper(pbr_models, pipelines.pbr);
-            renderHelper(lamber_models, pipelines.lamber);
-            
-        }
-
-        void renderForGBuffer(VkCommandBuffer& commandBuffer, VkPipelineLayout& pipelineLayout, const std::string culling=CULLING_NONE, mat4 VP=mat4::I){
-            auto renderHelper = [&commandBuffer, &pipelineLayout, &VP, &culling](std::vector<std::shared_ptr<VkModel>>& models, VkPipeline& pipeline){
-                if(models.empty()) {
-                    return;
-                }
-                if(culling == CULLING_NONE) {
-                    for(auto model: models){
-                        model->updateModel();
-                        model->render(commandBuffer, pipelineLayout);
-                    }
-                } else {
-                    for(auto model: models){
-                        model->updateModel();
-                        mat4 MVP = VP * model->pc.model;
-                        if(frustum_cull_test(MVP, model->mesh->bbox)){
-                            model->render(commandBuffer, pipelineLayout);
-                        }
-                    }
-                }
-            };
-            renderHelper(pbr_models, pipelines.pbr);
-            renderHelper(lamber_models, pipelines.lamber);
-        }
-
-        void renderForDeferred(VkCommandBuffer& commandBuffer){
-            auto renderHelper = [&commandBuffer](std::vector<std::shared_ptr<VkModel>>& models, VkPipeline& pipeline){
-                if(models.empty()) {
-                    return;
-                }
-                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-                vkCmdDraw(commandBuffer, 3, 1, 0, 0);
-                
-            };
-            renderHelper(pbr_models, pipelines.pbr);
-            renderHelper(lamber_models, pipelines.lamber);
-        }
-
-        std::vector<std::shared_ptr<VkModel>> getAllModels(){
-            std::vector<std::shared_ptr<VkModel>> models;
-            models.insert(models.end(), simple_models.begin(), simple_models.end());
-            models.insert(models.end(), env_models.begin(), env_models.end());
-            models.insert(models.end(), mirror_models.begin(), mirror_models.end());
-            models.insert(models.end(), pbr_models.begin(), pbr_models.end());
-            models.insert(models.end(), lamber_models.begin(), lamber_models.end());
-
-            return models;
-        }
-
-        void destroyMaterial() {
-            auto destroyMaterialHelper = [](std::vector<std::shared_ptr<VkModel>>& models) {
-                for(auto model: models){
-                    model->material.destroy();
-                }
-            };
-            destroyMaterialHelper(simple_models);
-            destroyMaterialHelper(env_models);
-            destroyMaterialHelper(mirror_models);
-            destroyMaterialHelper(pbr_models);
-            destroyMaterialHelper(lamber_models);
-        }
-
-        void destroy() {
-            auto destroyHelper = [](std::vector<std::shared_ptr<VkModel>>& models) {
-                for(auto model: models){
-                    model->destroy();
-                }
-            };
-            destroyHelper(simple_models);
-            destroyHelper(env_models);
-            destroyHelper(mirror_models);
-            destroyHelper(pbr_models);
-            destroyHelper(lamber_models);
-        }
-
-    } model_list;
+    // Loaded once per scene mesh and material, proxies index into them
+    std::vector<VkMesh> meshes;
+    // Upload every mesh in PackedVertexFormat
+    bool packed_vertices = false;
+    // Reorder indices and vertices of every mesh at load (--optimize-meshes), and for overdraw too
+    bool optimize_meshes = false;
+    bool optimize_overdraw = false;
+    std::vector<VkMaterial> materials;
+    RenderProxyTable proxies;
 
     /* ------------------- Shadow map ------------------- */
 
@@ -1017,7 +1012,6 @@ private:
         std::vector<VkFramebuffer> frameBuffers;
         std::vector<PushConstantCubeShadow> pcCubeShadow;
         std::vector<mat4> lightVPs;
-        UniformBufferObjectSphereLight* uboSphere;
 		
         int light_idx;
         float vfov;
@@ -1025,7 +1019,6 @@ private:
         float radius;
         float limit;
         std::shared_ptr<Transform> transform;
-        vec3 lightPos;
 
         VkFormat depthFormat{ VK_FORMAT_D16_UNORM };
         const VkFormat imageFormat{ VK_FORMAT_R32_SFLOAT };
@@ -1117,20 +1110,13 @@ private:
             VK_CHECK_RESULT(vkCreateFramebuffer(device, &frameBufferInfo, nullptr, &frameBuffer), "fail to create framebuffer for shadow mapping");
         }
 
-        void updatePushConstant() {
-            // Calculate view matrix for spot light
-            uboShadow.view = transform->worldToLocal();
-            pcShadow.lightVP = uboShadow.proj * uboShadow.view;
-        }
-
         // ========= For Cube Shadow Map ===========
 
-        void initCube(UniformBufferObjectSphereLight* uboSphere_, int shadow_res_, float radius_, float limit_, std::shared_ptr<Transform> transform_, VkRenderPass& renderPass, VkFormat depthFormat_) {
+        void initCube(int shadow_res_, float radius_, float limit_, std::shared_ptr<Transform> transform_, VkRenderPass& renderPass, VkFormat depthFormat_) {
             shadow_res = shadow_res_;
             radius = radius_;
             limit = limit_;
             transform = transform_;
-            uboSphere = uboSphere_;
             depthFormat = depthFormat_;
 
             uboShadow = {};
@@ -1139,7 +1125,6 @@ private:
             uboShadow.zFar = limit;
             if(transform_ != nullptr) {
                 uboShadow.view = transform->worldToLocal();
-                lightPos = transform->localToWorld() * vec4(0,0,0,1);
             }
             
             pcCubeShadow.resize(6);
@@ -1219,9 +1204,10 @@ private:
             vkHelper.createImageView( offscreenImageTexture.textureImageView, offscreenImageTexture.textureImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
         }
 
-        void updateSphereShadowData() {
+        // Writes the view projection of each face of this light's cube into uboSphere and returns the
+        // light's world position. Only reads the pass, so the simulation thread can fill a frame packet
+        vec3 updateSphereShadowData(UniformBufferObjectSphereLight& uboSphere) const {
             // Calculate view matrix for spot light
-            lightPos = transform->localToWorld() * vec4(0,0,0,1);
             int face_idx = (int)pcCubeShadow[0].lightData[1];
 
             mat4 proj = uboShadow.proj;
@@ -1233,23 +1219,24 @@ private:
             //POSITIVE_X
             viewMatrix = rotate(iden, degToRad(90.0f), vec3(0.0f, 1.0f, 0.0f));
             viewMatrix = rotate(viewMatrix, degToRad(180.0f), vec3(1.0f, 0.0f, 0.0f));
-            uboSphere->lightVPs[face_idx+0] = proj * viewMatrix * view;
+            uboSphere.lightVPs[face_idx+0] = proj * viewMatrix * view;
             // NEGATIVE_X
             viewMatrix = rotate(iden, degToRad(-90.0f), vec3(0.0f, 1.0f, 0.0f));
             viewMatrix = rotate(viewMatrix, degToRad(180.0f), vec3(1.0f, 0.0f, 0.0f));
-            uboSphere->lightVPs[face_idx+1] = proj * viewMatrix * view;
+            uboSphere.lightVPs[face_idx+1] = proj * viewMatrix * view;
             // POSITIVE_Y
             viewMatrix = rotate(iden, degToRad(-90.0f), vec3(1.0f, 0.0f, 0.0f));
-            uboSphere->lightVPs[face_idx+2] = proj * viewMatrix * view;
+            uboSphere.lightVPs[face_idx+2] = proj * viewMatrix * view;
             // NEGATIVE_Y
             viewMatrix = rotate(iden, degToRad(90.0f), vec3(1.0f, 0.0f, 0.0f));
-            uboSphere->lightVPs[face_idx+3] = proj * viewMatrix * view;
+            uboSphere.lightVPs[face_idx+3] = proj * viewMatrix * view;
             // POSITIVE_Z
             viewMatrix = rotate(iden, degToRad(180.0f), vec3(1.0f, 0.0f, 0.0f));
-            uboSphere->lightVPs[face_idx+4] = proj * viewMatrix * view;
+            uboSphere.lightVPs[face_idx+4] = proj * viewMatrix * view;
             // NEGATIVE_Z
             viewMatrix = rotate(iden, degToRad(180.0f), vec3(0.0f, 0.0f, 1.0f));
-            uboSphere->lightVPs[face_idx+5] = proj * viewMatrix * view;
+            uboSphere.lightVPs[face_idx+5] = proj * viewMatrix * view;
+            return transform->localToWorld() * vec4(0,0,0,1);
         }
     };
 
@@ -1265,11 +1252,10 @@ private:
         VkDescriptorSet debugDescriptorSet{ VK_NULL_HANDLE };
         vkBuffer shadowUniformBuffer;
 
-        // Sphere
-        VkDescriptorSet sphereDescriptorSet{ VK_NULL_HANDLE };
+        // Sphere, per frame so each one sees that frame's instance buffer
+        std::vector<VkDescriptorSet> sphereDescriptorSets;
         VkRenderPass renderPassSphere;
         vkBuffer sphereUniformBuffer;
-        UniformBufferObjectSphereLight uboSphere;
         ShadowMapPass defaultShadowMapPassSphere = {};
         std::vector<ShadowMapPass> shadowMapPassesSphere;
         std::vector<VkDescriptorImageInfo> descriptorImageInfosSphere;
@@ -1428,8 +1414,8 @@ private:
             memcpy(shadowUniformBuffer.bufferMapped, &uboShadow, sizeof(uboShadow));
         }
 
-        void copySphereUniformBuffer() {
-            memcpy(sphereUniformBuffer.bufferMapped, &uboSphere, sizeof(uboSphere));
+        void copySphereUniformBuffer(const UniformBufferObjectSphereLight& uboSphere_) {
+            memcpy(sphereUniformBuffer.bufferMapped, &uboSphere_, sizeof(uboSphere_));
         }
     };
 
@@ -1512,6 +1498,7 @@ private:
     /* -------------------- SSAO --------------------- */
 
     struct SSAOBasePass: BasePass {
+        VkFormat format = VK_FORMAT_UNDEFINED;
         VkFramebuffer frameBuffer;
         
         VkTexture colorAttachment;
@@ -1524,7 +1511,7 @@ private:
             colorAttachment.destroy();
         }
 
-        void init(VkRenderPass renderPass);
+        void init(VkRenderPass renderPass, VkFormat format_);
 
         void createFrameBuffer(VkRenderPass renderPass);
 
@@ -1532,14 +1519,44 @@ private:
     };
 
     struct SSAOPassList {
-        SSAOBasePass ssaoPass = {};
+        // ambient occlusion, written by the blur pass and by the SSAO pass outside temporal mode
+        static constexpr VkFormat format = VK_FORMAT_R8_UNORM;
+        // ambient occlusion and view space depth, read back as history in temporal mode
+        static constexpr VkFormat temporalFormat = VK_FORMAT_R16G16_SFLOAT;
+
+        // Temporal mode renders into a ping-pong pair: one is written this frame, the other holds
+        // last frame's AO as history. Otherwise only ssaoPasses[0] is created
+        std::array<SSAOBasePass, 2> ssaoPasses = {};
         SSAOBasePass ssaoBlurPass = {};
 
         VkTexture2D ssaoNoise;
         UniformBufferObjectSSAO uboSSAO;
 
-        vkBuffer ssaoUniformBuffer;
-        VkRenderPass renderPass;
+        std::vector<vkBuffer> ssaoUniformBuffers;
+        VkRenderPass renderPass; // format: the blur pass and the SSAO pass outside temporal mode
+        VkRenderPass temporalRenderPass = VK_NULL_HANDLE; // temporalFormat: the ping-pong pair
+
+        bool enabled = true;
+        bool temporal = false;
+        uint32_t frameIndex = 0;
+        bool historyValid = false;
+        mat4 viewProj;
+
+        uint32_t passCount() const {
+            return temporal ? 2 : 1;
+        }
+
+        VkRenderPass ssaoRenderPass() const {
+            return temporal ? temporalRenderPass : renderPass;
+        }
+
+        SSAOBasePass& currentPass() {
+            return ssaoPasses[frameIndex % passCount()];
+        }
+
+        SSAOBasePass& historyPass() {
+            return ssaoPasses[(frameIndex + 1) % 2];
+        }
 
         void init() {
             // Reference https://learnopengl.com/Advanced-Lighting/SSAO
@@ -1561,8 +1578,12 @@ private:
                 sample *= scale;
                 uboSSAO.samples[i] = sample;
             }
+            uboSSAO.prevViewProj = mat4::I;
+            uboSSAO.temporal = vec4(0, SSAO_SAMPLE_SIZE, 0, SSAO_TEMPORAL_DEPTH_THRESHOLD);
 
-            memcpy(ssaoUniformBuffer.bufferMapped, &uboSSAO, sizeof(uboSSAO));
+            for(auto& ssaoUniformBuffer: ssaoUniformBuffers) {
+                memcpy(ssaoUniformBuffer.bufferMapped, &uboSSAO, sizeof(uboSSAO));
+            }
             
             // Generate noise texture for random kernel rotation 
             float noises[16*4];
@@ -1589,27 +1610,84 @@ private:
             ssaoNoise.updateDescriptorImageInfo();
         }
 
+        // Update per frame parameters. In temporal mode only a rotating subset of the kernel 
+        // is evaluated each frame and blended with the reprojected result of the previous frame.
+        void update(uint32_t currentImage, const mat4& viewProj_) {
+            viewProj = viewProj_;
+            if(temporal) {
+                // Exponential history weight 1 - 8/64 = 7/8. The 8 frames that cover the kernel once only
+                // carry 1 - (7/8)^8, about 66% of the weight, the rest comes from older frames. A still view
+                // converges to the 8 kernel subsets weighted from about 19% (newest) down to 7% (oldest),
+                // not to the plain 64 sample average
+                float historyWeight = historyValid ? 1.0f - (float)SSAO_TEMPORAL_SAMPLE_SIZE / SSAO_SAMPLE_SIZE : 0.0f;
+                uboSSAO.temporal = vec4((float)frameIndex, SSAO_TEMPORAL_SAMPLE_SIZE, historyWeight, SSAO_TEMPORAL_DEPTH_THRESHOLD);
+            }
+            memcpy(ssaoUniformBuffers[currentImage].bufferMapped, &uboSSAO, sizeof(uboSSAO));
+        }
+
+        // Called after the SSAO pass is recorded: this frame's output becomes next frame's history
+        void swapHistory() {
+            if(!temporal) {
+                return;
+            }
+            uboSSAO.prevViewProj = viewProj;
+            historyValid = true;
+            frameIndex++;
+        }
+
         void destroy() {
             ssaoNoise.destroy();
-            ssaoPass.destroy();
+            for(uint32_t p=0; p<passCount(); p++) {
+                ssaoPasses[p].destroy();
+            }
             ssaoBlurPass.destroy();
-            ssaoUniformBuffer.destroy();
+            for(auto& ssaoUniformBuffer: ssaoUniformBuffers) {
+                ssaoUniformBuffer.destroy();
+            }
             vkDestroyRenderPass(device, renderPass, nullptr);
+            if(temporal) {
+                vkDestroyRenderPass(device, temporalRenderPass, nullptr);
+            }
         }
 
+        static VkRenderPass createColorRenderPass(VkFormat format);
+
         void createRenderPass();
 
         void recreateAttachments() {
-            ssaoPass.recreateAttachment(renderPass);
+            for(uint32_t p=0; p<passCount(); p++) {
+                ssaoPasses[p].recreateAttachment(ssaoRenderPass());
+            }
             ssaoBlurPass.recreateAttachment(renderPass);
+            historyValid = false;
+            if(temporal) {
+                makeHistoryReadable();
+            }
+        }
+
+        // Each ping-pong pass samples the other one as history, which on the first frame and after
+        // a resize has never been rendered, so both start out in the layout the SSAO shader reads
+        void makeHistoryReadable() {
+            for(auto& ssaoPass: ssaoPasses) {
+                vkHelper.transitionImageLayout(ssaoPass.colorAttachment.textureImage,
+                VK_IMAGE_LAYOUT_UNDEFINED,
+                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                0,
+                VK_ACCESS_SHADER_READ_BIT,
+                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+            }
         }
 
         void createUniformBuffer() {
             VkDeviceSize bufferSize = sizeof(UniformBufferObjectSSAO);
 
-            vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ssaoUniformBuffer.buffer, ssaoUniformBuffer.bufferMemory);
+            ssaoUniformBuffers.resize(framesInFlight);
+            for(auto& ssaoUniformBuffer: ssaoUniformBuffers) {
+                vkHelper.createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ssaoUniformBuffer.buffer, ssaoUniformBuffer.bufferMemory);
 
-            vkMapMemory(device, ssaoUniformBuffer.bufferMemory, 0, bufferSize, 0, &ssaoUniformBuffer.bufferMapped);
+                vkMapMemory(device, ssaoUniformBuffer.bufferMemory, 0, bufferSize, 0, &ssaoUniformBuffer.bufferMapped);
+            }
         }
     };
 
@@ -1619,6 +1697,8 @@ private:
 
     void createSSAOPassDescriptorSet();
 
+    const VkDescriptorImageInfo* ssaoHistoryImageInfo(uint32_t pass);
+
     void createSSAOBlurPassDescriptorSet();
 
     SSAOPassList ssaoPassList;
@@ -1626,6 +1706,140 @@ private:
     /* ---------------- Load models ---------------- */
     void createModels();
 
+    /* ---------------- Render queue ---------------- */
+    // Render thread: sorted gbuffer draws of the current packet (proxy indices).
+    // Shadow passes draw proxies.shadowCasters, which does not depend on the camera
+    std::vector<uint32_t> gbuffer_queue;
+    // LOD of every draw in gbuffer_queue and in proxies.shadowCasters per shadow map pass
+    std::vector<uint8_t> gbuffer_lods;
+    std::vector<std::vector<uint8_t>> spot_shadow_lods;
+    std::vector<std::vector<uint8_t>> sphere_shadow_lods;
+    // Projected error in pixels allowed when picking a mesh LOD, 0 draws every mesh at full resolution
+    float lod_pixel_error = 0.0f;
+
+    // Binds and draws recorded for one pass, reported with --measure
+    struct PassStats {
+        uint32_t pipelineBinds = 0;
+        uint32_t materialBinds = 0;
+        uint32_t vertexBinds = 0;
+        uint32_t indexBinds = 0;
+        uint32_t draws = 0;
+        uint32_t indirectDraws = 0; // cluster culled, one per draw
+        uint32_t meshlets = 0; // tested by the cluster culling pass
+        uint64_t triangles = 0; // submitted, before cluster culling
+
+        void print(const std::string& pass) const {
+            std::cout<<"MEASURE pass "<<pass<<" pipeline binds "<<pipelineBinds<<" material binds "<<materialBinds
+                <<" vertex binds "<<vertexBinds<<" index binds "<<indexBinds<<" draws "<<draws<<" indirect draws "<<indirectDraws
+                <<" meshlets "<<meshlets<<" triangles "<<triangles<<"\n";
+        }
+    };
+
+    // Records a sorted queue, skipping binds that repeat the previous draw. lods holds the LOD of each
+    // draw (empty for full resolution). With gbufferPipelines ({displacement, flat} variants) the pipeline
+    // and material are bound per draw, otherwise only geometry
+    void drawQueue(VkCommandBuffer commandBuffer, const std::vector<uint32_t>& queue, const std::vector<uint8_t>& lods, const VkPipeline* gbufferPipelines, PassStats& stats);
+
+    /* ---------------- Cluster culling ---------------- */
+    // Meshes are split into meshlets at load. Before the gbuffer pass a compute shader culls the
+    // meshlets of every visible LOD 0 draw against the frustum and by normal cone, and writes the
+    // survivors as compacted indexed indirect commands. Other draws are recorded directly
+
+    // One per clustered gbuffer draw and compute workgroup (std430, see cluster_cull.shader.comp)
+    struct ClusterDraw {
+        uint32_t instance; // proxy index
+        uint32_t firstMeshlet;
+        uint32_t meshletCount;
+        uint32_t firstCommand; // the draw owns meshletCount commands from here
+    };
+
+    struct PushConstantClusterCull {
+        mat4 viewProj;
+        vec4 eye;
+    };
+
+    struct ClusterCullPass {
+        bool enabled = false;
+        VkDescriptorSetLayout descriptorSetLayout = VK_NULL_HANDLE;
+        VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+        std::vector<VkDescriptorSet> descriptorSets; // per frame in flight
+
+        vkBuffer meshletBuffer = {}; // Meshlet of every mesh, written once
+        std::vector<vkBuffer> drawBuffers; // ClusterDraw per frame in flight, persistently mapped
+        std::vector<vkBuffer> commandBuffers; // VkDrawIndexedIndirectCommand per frame in flight, written by the compute pass
+        uint32_t maxDraws = 0; // gbuffer proxies with meshlets
+        uint32_t maxCommands = 0; // meshlets over all of them
+
+        // Render thread, current frame: the dispatched draws, and per gbuffer_queue entry the first
+        // command of its range (UINT32_MAX if the draw is not clustered)
+        uint32_t drawCount = 0;
+        uint32_t commandCount = 0;
+        std::vector<uint32_t> queueCommands;
+        PushConstantClusterCull pushConstant;
+
+        void destroy() {
+            if(!enabled) {
+                return;
+            }
+            meshletBuffer.destroy();
+            for(size_t i=0; i<drawBuffers.size(); i++) {
+                drawBuffers[i].destroy();
+                commandBuffers[i].destroy();
+            }
+            vkDestroyPipeline(device, pipeline, nullptr);
+            vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+            vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+            vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
+        }
+    };
+
+    ClusterCullPass clusterCullPass;
+
+    // Uploads the meshlets of every mesh and creates the per frame buffers, descriptor sets and compute pipeline.
+    // Disables the pass if no gbuffer mesh has meshlets
+    void createClusterCullPass();
+
+    // Render thread: the ClusterDraw list of gbuffer_queue for this frame
+    void updateClusterCullPass(uint32_t currentImage);
+
+    // Records the compute dispatch and the barrier to the indirect draws of the gbuffer pass
+    void recordClusterCullPass(VkCommandBuffer commandBuffer);
+
+    /* ---------------- Frame packets ---------------- */
+    // Immutable snapshot of one simulated frame. Produced by the simulation thread
+    // (input, animation, transforms, culling) and consumed by the render thread,
+    // which only touches GPU state.
+    struct FramePacket {
+        uint64_t frameId = 0;
+        std::chrono::high_resolution_clock::time_point inputTime;
+        UniformBufferObjectScene uboScene = {};
+        UniformBufferObjectLight uboLight = {};
+        UniformBufferObjectSphereLight uboSphere = {};
+        std::vector<mat4> spotLightVPs; // per shadowMapPassList.shadowMapPassesSpot
+        std::vector<vec3> sphereLightPositions; // per shadowMapPassList.shadowMapPassesSphere
+        std::vector<std::pair<uint32_t, InstanceData>> instanceUpdates; // proxies whose instance data changed since the previous packet
+        std::vector<uint32_t> gbufferQueue; // visible gbuffer draws in sort key order
+        std::vector<uint8_t> gbufferLods; // per gbufferQueue entry, empty without --lod
+        std::vector<std::vector<uint8_t>> spotShadowLods; // per spot shadow pass and shadow caster
+        std::vector<std::vector<uint8_t>> sphereShadowLods; // per sphere shadow pass and shadow caster
+    };
+
+    SPSCQueue<FramePacket> frame_queue;
+    uint64_t frame_id = 0;
+    std::atomic<bool> running{false};
+    // Swap chain extent published by the render thread for the camera aspect ratio
+    std::atomic<uint32_t> present_width{0};
+    std::atomic<uint32_t> present_height{0};
+    // Input-to-present latency, accumulated on the render thread
+    float total_latency = 0.0f;
+    int latency_count = 0;
+
+    void buildFramePacket(FramePacket& packet);
+
+    void renderLoop();
+
     /** ---------------- main steps ---------------- */
     
     void initVulkan();
@@ -1645,6 +1859,12 @@ private:
     bool isDeviceSuitable(VkPhysicalDevice device);
     
     bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+
+    // Checks VK_EXT_descriptor_indexing and sets bindlessTextureCapacity from the device limits
+    bool checkBindlessSupport(VkPhysicalDevice device);
+
+    // Multi draw indirect and compute on the graphics queue
+    bool checkClusterCullingSupport(VkPhysicalDevice device);
     
     void pickPysicalDevice();
     
@@ -1693,8 +1913,73 @@ private:
     
     /* ------------- Graphics Pipeline ------------- */
     void createGraphicsPipeline();
+
+    // Features baked into shaders as specialization constants (constant_id = member index).
+    // Pipelines are cached per variant so dead branches are compiled out
+    struct ShaderVariant {
+        int32_t sphereLightCount = MAX_LIGHT_COUNT;
+        int32_t spotLightCount = MAX_LIGHT_COUNT;
+        int32_t directionalLightCount = MAX_LIGHT_COUNT;
+        VkBool32 spotShadows = VK_TRUE;
+        VkBool32 sphereShadows = VK_TRUE;
+        VkBool32 ssao = VK_TRUE;
+        VkBool32 ibl = VK_TRUE;
+        VkBool32 displacement = VK_TRUE;
+        VkBool32 packedVertices = VK_FALSE; // vertex buffers are in PackedVertexFormat
+        VkBool32 irradianceSH = VK_FALSE; // diffuse environment lighting from SH coefficients, not a cube
+
+        uint64_t key() const {
+            // light counts are at most MAX_LIGHT_COUNT, 8 bits each is plenty
+            return static_cast<uint64_t>(sphereLightCount)
+                | static_cast<uint64_t>(spotLightCount) << 8
+                | static_cast<uint64_t>(directionalLightCount) << 16
+                | static_cast<uint64_t>(spotShadows) << 24
+                | static_cast<uint64_t>(sphereShadows) << 25
+                | static_cast<uint64_t>(ssao) << 26
+                | static_cast<uint64_t>(ibl) << 27
+                | static_cast<uint64_t>(displacement) << 28
+                | static_cast<uint64_t>(packedVertices) << 29
+                | static_cast<uint64_t>(irradianceSH) << 30;
+        }
+    };
+    // Variant used by the pipelines in Pipelines
+    ShaderVariant sceneVariant;
+    // Every other variant, keyed on pipeline name and variant key
+    std::map<std::pair<std::string, uint64_t>, VkPipeline> pipelineVariants;
+    // Whether the scene has materials with / without displacement map
+    bool hasDisplacedMaterials = false;
+    bool hasFlatMaterials = false;
+
+    // What differs between the pipelines
+    struct PipelineDesc {
+        std::string name;
+        VkPipeline* pipeline;
+        std::string vertShader;
+        std::string fragShader; // empty for depth only pipelines
+        VkRenderPass renderPass;
+        uint32_t vertexStreams; // VertexStreams bound, 0 for fullscreen passes that generate their vertices
+        VkCullModeFlags cullMode;
+        uint32_t colorAttachmentCount;
+        bool depthBias;
+        bool required; // created at startup, otherwise on first use
+    };
+    std::vector<PipelineDesc> pipelineDescs;
+
+    // Returns the creation time in ms
+    float createPipeline(const PipelineDesc& desc, const ShaderVariant& variant, VkPipeline* pipeline);
+
+    const PipelineDesc& findPipelineDesc(const VkPipeline& pipeline);
+
+    // Creates the pipeline first if it was not required at startup
+    VkPipeline getPipeline(VkPipeline& pipeline);
+
+    VkPipeline getPipeline(VkPipeline& pipeline, const ShaderVariant& variant);
+
+    void loadPipelineCache();
+
+    void savePipelineCache();
     
-    VkShaderModule createShaderModule(const std::vector<char>& code);
+    VkShaderModule createShaderModule(const uint32_t* code, size_t size);
 
     VkPipelineShaderStageCreateInfo loadShader(const std::string shaderFileName, VkShaderStageFlagBits stageFlag);
     
@@ -1711,7 +1996,7 @@ private:
     
     void recordCommandBuffer(VkCommandBuffer commandBuffer);
     
-    void drawFrame();
+    void drawFrame(const FramePacket& packet);
     
     VkViewport createViewPort(float width, float height, float minDepth, float maxDepth);
     VkRect2D createScissor(int32_t width, int32_t height, int32_t offsetX, int32_t offsetY);
@@ -1733,7 +2018,7 @@ private:
     /* --------------- Uniform buffers --------------- */
     void createUniformBuffers();
     
-    void updateUniformBuffer(uint32_t currentImage);
+    void updateUniformBuffer(uint32_t currentImage, const FramePacket& packet);
 
     /* --------------- Descriptor sets --------------- */
 
@@ -1747,10 +2032,12 @@ private:
 
     void allocateSingleDescriptorSet(VkDescriptorSet& descriptorSets, VkDescriptorSetLayout descriptorSetLayout);
     
-    void createModelDescriptorSets(std::shared_ptr<VkModel> model);
+    void createMaterialDescriptorSets(VkMaterial& material);
 
     void createDescriptorSets();
 
+    void createBindlessDescriptorSet();
+
     VkWriteDescriptorSet writeDescriptorSet(VkDescriptorSet descriptorSet, VkDescriptorType type, uint32_t binding, VkDescriptorBufferInfo* bufferInfo, uint32_t descriptorCount = 1);
 
     VkWriteDescriptorSet writeDescriptorSet(VkDescriptorSet descriptorSet, VkDescriptorType type, uint32_t binding, VkDescriptorImageInfo* imageInfo, uint32_t descriptorCount = 1);
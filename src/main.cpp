@@ -48,6 +48,26 @@ int main(int argc, char ** argv) {
     arg_parser.add_option(ANIMATION_NO_LOOP, false, 0);
     //enable measurement of frame time
     arg_parser.add_option(MEASURE, false, 0);
+    //accumulate SSAO over frames instead of evaluating the full kernel every frame
+    arg_parser.add_option(SSAO_TEMPORAL, false, 0);
+    //skip the SSAO passes entirely
+    arg_parser.add_option(NO_SSAO, false, 0);
+    //number of frames the CPU may record ahead of the GPU
+    arg_parser.add_option(FRAMES_IN_FLIGHT, false, 1);
+    //print pipeline creation times and time to first frame
+    arg_parser.add_option(STARTUP_REPORT, false, 0);
+    //bindless materials through descriptor indexing
+    arg_parser.add_option(BINDLESS, false, 0);
+    //build quadric simplified LODs per mesh and pick them by projected error (in pixels)
+    arg_parser.add_option(LOD, false, 1);
+    //split meshes into meshlets and cull them in a compute pass before the gbuffer pass
+    arg_parser.add_option(CLUSTER_CULLING, false, 0);
+    //quantized 24 byte vertices, decoded in the vertex shaders
+    arg_parser.add_option(PACKED_VERTICES, false, 0);
+    //reorder mesh triangles for the vertex cache (cache), or also for overdraw (overdraw), at load
+    arg_parser.add_option(OPTIMIZE_MESHES, false, 1, "", {MESH_OPTIMIZE_CACHE, MESH_OPTIMIZE_OVERDRAW});
+    //write the environment products prefiltered at load next to the environment map
+    arg_parser.add_option(CACHE_ENVIRONMENT, false, 0);
     
     arg_parser.parse(argc, argv);
 
@@ -105,6 +125,46 @@ int main(int argc, char ** argv) {
     if(pt) {
         app.enableMeasure();
     } 
+    pt = arg_parser.get_option(SSAO_TEMPORAL);
+    if(pt) {
+        app.enableTemporalSSAO();
+    } 
+    pt = arg_parser.get_option(NO_SSAO);
+    if(pt) {
+        app.disableSSAO();
+    } 
+    pt = arg_parser.get_option(FRAMES_IN_FLIGHT);
+    if(pt) {
+        app.setFramesInFlight(stoi((*pt)[0]));
+    } 
+    pt = arg_parser.get_option(STARTUP_REPORT);
+    if(pt) {
+        app.enableStartupReport();
+    } 
+    pt = arg_parser.get_option(BINDLESS);
+    if(pt) {
+        app.enableBindless();
+    } 
+    pt = arg_parser.get_option(LOD);
+    if(pt) {
+        app.setLodError(stof((*pt)[0]));
+    } 
+    pt = arg_parser.get_option(CLUSTER_CULLING);
+    if(pt) {
+        app.enableClusterCulling();
+    } 
+    pt = arg_parser.get_option(PACKED_VERTICES);
+    if(pt) {
+        app.enablePackedVertices();
+    } 
+    pt = arg_parser.get_option(OPTIMIZE_MESHES);
+    if(pt) {
+        app.setMeshOptimization((*pt)[0]);
+    } 
+    pt = arg_parser.get_option(CACHE_ENVIRONMENT);
+    if(pt) {
+        app.enableEnvironmentCache();
+    } 
 
     
     try {
@@ -29,18 +29,83 @@ vec3 toneMapping(in vec3 radiance) {
 	return uncharted2Tonemap(radiance);
 }
 
-/* ---------------------- RGBE ---------------------- */
-vec3 toRadiance(vec4 rgbe_) {
-    if(rgbe_ == vec4(0.0, 0.0, 0.0, 0.0)) {
-        return vec3(rgbe_);
-    }
+/* ---------------------- Normal map ---------------------- */
+// Tangent space normal from a normal map texel. z is rebuilt from x and y, so two channel
+// maps (BC5, which reads back z = 0) and RGB ones decode the same
+vec3 unpackNormalMap(vec4 texel) {
+	vec2 xy = 2.0 * texel.xy - 1.0;
+	return vec3(xy, sqrt(max(1.0 - dot(xy, xy), 0.0)));
+}
+
+/* ---------------------- Environment ---------------------- */
+// Diffuse environment lighting from L2 SH coefficients already convolved with the cosine lobe
+// (written by ./cube --sh, basis order as in shBasis in src/cube.cpp)
+vec3 irradianceSH(vec4 sh[9], vec3 n) {
+	vec3 irradiance = sh[0].rgb * 0.282095
+		+ sh[1].rgb * (0.488603 * n.y)
+		+ sh[2].rgb * (0.488603 * n.z)
+		+ sh[3].rgb * (0.488603 * n.x)
+		+ sh[4].rgb * (1.092548 * n.x * n.y)
+		+ sh[5].rgb * (1.092548 * n.y * n.z)
+		+ sh[6].rgb * (0.315392 * (3.0 * n.z * n.z - 1.0))
+		+ sh[7].rgb * (1.092548 * n.x * n.z)
+		+ sh[8].rgb * (0.546274 * (n.x * n.x - n.y * n.y));
+	return max(irradiance, vec3(0.0));
+}
 
-	vec4 rgbe = rgbe_ * 255.0f;
+/* ---------------------- Instance ---------------------- */
+// Top three rows of the affine model matrix and of its inverse transpose, see InstanceData in vertex.hpp
+struct InstanceData {
+    vec4 model[3];
+    vec4 normal[3];
+    uint material; // index into the bindless material buffer
+};
+
+vec4 instanceToWorld(InstanceData instance, vec3 pos) {
+    vec4 p = vec4(pos, 1.0);
+    return vec4(dot(instance.model[0], p), dot(instance.model[1], p), dot(instance.model[2], p), 1.0);
+}
 
-	int exp = int(rgbe[3]) - 128;
-	return vec3(ldexp((rgbe[0]+0.5)/256.0, exp), ldexp((rgbe[1]+0.5)/256.0, exp), ldexp((rgbe[2]+0.5)/256.0, exp));
+vec3 instanceNormal(InstanceData instance, vec3 n) {
+    return vec3(dot(instance.normal[0].xyz, n), dot(instance.normal[1].xyz, n), dot(instance.normal[2].xyz, n));
 }
 
+/* ---------------------- Vertex ---------------------- */
+// Attributes are declared as vec4 so one shader reads both vertex formats; formats with fewer
+// components fill in (0, 0, 1). Packed vertices (see PackedVertexFormat in vertex.hpp) have a position
+// quantized to [0, 1] that the model matrix scales back, octahedral normal and tangent and the
+// tangent sign in position.w
+vec3 octDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+vec3 decodeNormal(bool packed, vec4 normal) {
+    return packed ? octDecode(normal.xy) : normal.xyz;
+}
+
+vec4 decodeTangent(bool packed, vec4 tangent, vec4 position) {
+    return packed ? vec4(octDecode(tangent.xy), position.w * 2.0 - 1.0) : tangent;
+}
+
+/* ---------------------- Material ---------------------- */
+// Bindless material, see MaterialData in vertex.hpp
+#define NO_TEXTURE 0xFFFFFFFFu
+struct MaterialData {
+    vec4 albedo; // used when albedoTexture is NO_TEXTURE
+    float roughness; // used when roughnessTexture is NO_TEXTURE
+    float metalness; // used when metalnessTexture is NO_TEXTURE
+    uint normalTexture;
+    uint displacementTexture;
+    uint albedoTexture;
+    uint roughnessTexture;
+    uint metalnessTexture;
+    uint pad;
+};
+
 /* ---------------------- Light ---------------------- */
 
 struct SphereLight { //sphere
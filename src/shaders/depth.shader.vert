@@ -1,18 +1,18 @@
 #version 450
+#include "common.glsl"
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inColor;
-layout(location = 3) in vec4 inTangent;
-layout(location = 4) in vec2 inTexCoord;
+layout(location = 0) in vec4 inPosition;
 
 layout(push_constant) uniform pushConstant
 {
-	mat4 model;
     mat4 lightVP;
 } pc;
+
+layout(std430, set = 0, binding = 15) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
  
 void main()
 {
-	gl_Position =  pc.lightVP * pc.model * vec4(inPosition, 1.0);
+	gl_Position =  pc.lightVP * instanceToWorld(instances[gl_InstanceIndex], inPosition.xyz);
 }
\ No newline at end of file
@@ -28,7 +28,7 @@ mat3 computeTBN() {
 vec3 computeNormal(mat3 TBN, vec2 texCoords) {
 	// obtain normal from normal map in range [0,1]
 	// transform normal vector to range [-1,1]
-	vec3 sampledNormal = 2.0 * texture(normalMap, texCoords).rgb - 1.0;
+	vec3 sampledNormal = unpackNormalMap(texture(normalMap, texCoords));
 	
 	return normalize(TBN * sampledNormal);
 }
@@ -40,6 +40,10 @@ vec2 ParallaxMapping(vec3 viewDir)
    	const float minLayers = 8.0;
 	const float maxLayers = 32.0;
 	float numLayers = mix(maxLayers, minLayers, max(dot(vec3(0.0, 0.0, 1.0), viewDir), 0.0)); 
+	// Half the layers per mip level the displacement map is minified by, sampled at that level
+	// since implicit derivatives are undefined in the loop
+	float lod = textureQueryLod(displacementMap, inData.texCoord).x;
+	numLayers = max(floor(numLayers * exp2(-lod)), 2.0);
     // calculate the size of each layer
     float layerDepth = 1.0 / numLayers;
     // depth of current layer
@@ -49,14 +53,14 @@ vec2 ParallaxMapping(vec3 viewDir)
     vec2 deltaTexCoords = P / numLayers;
 
 	vec2 currentTexCoords = inData.texCoord;
-	float currentDepthMapValue = texture(displacementMap, currentTexCoords).r;
+	float currentDepthMapValue = textureLod(displacementMap, currentTexCoords, lod).r;
 	
 	while(currentLayerDepth < currentDepthMapValue)
 	{
 		// shift texture coordinates along direction of P
 		currentTexCoords -= deltaTexCoords;
 		// get displacement value at current texture coordinates
-		currentDepthMapValue = texture(displacementMap, currentTexCoords).r;  
+		currentDepthMapValue = textureLod(displacementMap, currentTexCoords, lod).r;  
 		// get depth of next layer
 		currentLayerDepth += layerDepth;  
 	}
@@ -67,7 +71,7 @@ vec2 ParallaxMapping(vec3 viewDir)
 
 	// get depth after and before collision for linear interpolation
 	float afterDepth  = currentDepthMapValue - currentLayerDepth;
-	float beforeDepth = texture(displacementMap, prevTexCoords).r - currentLayerDepth + layerDepth;
+	float beforeDepth = textureLod(displacementMap, prevTexCoords, lod).r - currentLayerDepth + layerDepth;
 	
 	// interpolation of texture coordinates
 	float weight = afterDepth / (afterDepth - beforeDepth);
@@ -88,8 +92,8 @@ void main() {
 	// Normal mapping
 	vec3 normal = computeNormal(TBN, texCoords);
 
-	// Compute radiance from rgbe
-	vec3 rad = toRadiance(texture(environmentMap, normalize(inData.light * normal)));
+	// Compute radiance
+	vec3 rad = texture(environmentMap, normalize(inData.light * normal)).rgb;
 
 	// Tonemapping
 	//outColor = vec4(toneMapping(rad), 1.0f);
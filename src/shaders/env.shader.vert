@@ -1,5 +1,7 @@
 #version 450
 
+#include "common.glsl"
+
 layout(set = 0, binding = 0) uniform UniformBufferObject {
     mat4 view;
     mat4 proj;
@@ -7,18 +9,17 @@ layout(set = 0, binding = 0) uniform UniformBufferObject {
     vec4 eye; //world space eye position
 } ubo;
 
-layout(push_constant) uniform pushConstant
-{
-	mat4 model;
-    mat4 invModel;
-} pc;
+layout(std430, set = 0, binding = 15) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inColor;
+layout(location = 0) in vec4 inPosition;
+layout(location = 1) in vec4 inNormal;
 layout(location = 3) in vec4 inTangent;
 layout(location = 4) in vec2 inTexCoord;
 
+layout (constant_id = 8) const bool PACKED_VERTICES = false;
+
 layout(location = 0) out struct data {
     mat3 light;
     vec3 normal; // in world space
@@ -28,12 +29,15 @@ layout(location = 0) out struct data {
 } outData;
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * pc.model * vec4(inPosition, 1.0);
+    InstanceData instance = instances[gl_InstanceIndex];
+    vec3 vertexNormal = decodeNormal(PACKED_VERTICES, inNormal);
+    vec4 vertexTangent = decodeTangent(PACKED_VERTICES, inTangent, inPosition);
+    vec4 worldPos = instanceToWorld(instance, inPosition.xyz);
+    gl_Position = ubo.proj * ubo.view * worldPos;
 
-    mat3 normalMatrix = mat3(pc.invModel);
     outData.light = mat3(ubo.light);
-    outData.normal = normalize(normalMatrix * inNormal);
-    outData.tangent = vec4(normalize(normalMatrix * inTangent.xyz), inTangent.w);
+    outData.normal = normalize(instanceNormal(instance, vertexNormal));
+    outData.tangent = vec4(normalize(instanceNormal(instance, vertexTangent.xyz)), vertexTangent.w);
     outData.texCoord = inTexCoord;
-    outData.view = normalize(vec3(ubo.eye - (pc.model * vec4(inPosition, 1.0))));
+    outData.view = normalize(vec3(ubo.eye - worldPos));
 }
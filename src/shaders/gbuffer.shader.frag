@@ -1,14 +1,57 @@
 #version 450
+#ifdef BINDLESS
+#extension GL_EXT_nonuniform_qualifier : require
+#endif
 
 #include "common.glsl"
 
+#ifdef BINDLESS
+// Compiled with -DBINDLESS into gbuffer.bindless.frag: all material textures live in one array
+// (set 2) and the material buffer selects them, so no material descriptor set is bound per draw
+layout (std430, set = 2, binding = 0) readonly buffer MaterialBuffer {
+	MaterialData materials[];
+};
+layout (set = 2, binding = 1) uniform sampler2D textures[];
 
+layout (location = 5) flat in uint inMaterial;
+
+// Constant maps are not uploaded, their value is stored in the material instead
+vec4 sampleMap(uint index, vec2 texCoords, vec4 constant) {
+	return index == NO_TEXTURE ? constant : texture(textures[nonuniformEXT(index)], texCoords);
+}
+
+vec4 sampleMapLod(uint index, vec2 texCoords, float lod, vec4 constant) {
+	return index == NO_TEXTURE ? constant : textureLod(textures[nonuniformEXT(index)], texCoords, lod);
+}
+
+float queryMapLod(uint index, vec2 texCoords) {
+	return index == NO_TEXTURE ? 0.0 : textureQueryLod(textures[nonuniformEXT(index)], texCoords).x;
+}
+
+#define NORMAL_MAP(uv) sampleMap(materials[inMaterial].normalTexture, uv, vec4(0.5, 0.5, 1.0, 0.0))
+#define DISPLACEMENT_MAP_LOD(uv, lod) sampleMapLod(materials[inMaterial].displacementTexture, uv, lod, vec4(0.0))
+#define DISPLACEMENT_QUERY_LOD(uv) queryMapLod(materials[inMaterial].displacementTexture, uv)
+#define ALBEDO_MAP(uv) sampleMap(materials[inMaterial].albedoTexture, uv, materials[inMaterial].albedo)
+#define ROUGHNESS_MAP(uv) sampleMap(materials[inMaterial].roughnessTexture, uv, vec4(materials[inMaterial].roughness))
+#define METALNESS_MAP(uv) sampleMap(materials[inMaterial].metalnessTexture, uv, vec4(materials[inMaterial].metalness))
+#else
 layout (set = 1, binding = 0) uniform sampler2D normalMap;
 layout (set = 1, binding = 1) uniform sampler2D displacementMap;
 layout (set = 1, binding = 2) uniform sampler2D albedoMap;
 layout (set = 1, binding = 3) uniform sampler2D metalnessMap;
 layout (set = 1, binding = 4) uniform sampler2D roughnessMap;
 
+#define NORMAL_MAP(uv) texture(normalMap, uv)
+#define DISPLACEMENT_MAP_LOD(uv, lod) textureLod(displacementMap, uv, lod)
+#define DISPLACEMENT_QUERY_LOD(uv) textureQueryLod(displacementMap, uv).x
+#define ALBEDO_MAP(uv) texture(albedoMap, uv)
+#define ROUGHNESS_MAP(uv) texture(roughnessMap, uv)
+#define METALNESS_MAP(uv) texture(metalnessMap, uv)
+#endif
+
+// Specialized per material (see ShaderVariant in viewer.h): without a displacement map POM is compiled out
+layout (constant_id = 7) const bool HAS_DISPLACEMENT = true;
+
 layout(location = 0) in struct data {
     vec3 N; // normal in world space
     vec4 T; // tangent in world space
@@ -35,7 +78,7 @@ mat3 computeTBN() {
 vec3 computeNormal(mat3 TBN, vec2 texCoords) {
 	// obtain normal from normal map in range [0,1]
 	// transform normal vector to range [-1,1]
-	vec3 sampledNormal = 2.0 * texture(normalMap, texCoords).rgb - 1.0;
+	vec3 sampledNormal = unpackNormalMap(NORMAL_MAP(texCoords));
 	
 	return normalize(TBN * sampledNormal);
 }
@@ -46,6 +89,11 @@ vec2 ParallaxMapping(vec3 viewDir){
    	const float minLayers = 8.0;
 	const float maxLayers = 32.0;
 	float numLayers = mix(maxLayers, minLayers, max(dot(vec3(0.0, 0.0, 1.0), viewDir), 0.0)); 
+	// The ray crosses half as many texels per mip level the displacement map is minified by, so it
+	// needs half the layers. The loop samples at that level explicitly, implicit derivatives are
+	// undefined in its non-uniform control flow
+	float lod = DISPLACEMENT_QUERY_LOD(inData.texCoord);
+	numLayers = max(floor(numLayers * exp2(-lod)), 2.0);
     // calculate the size of each layer
     float layerDepth = 1.0 / numLayers;
     // depth of current layer
@@ -55,14 +103,14 @@ vec2 ParallaxMapping(vec3 viewDir){
     vec2 deltaTexCoords = P / numLayers;
 
 	vec2 currentTexCoords = inData.texCoord;
-	float currentDepthMapValue = texture(displacementMap, currentTexCoords).r;
+	float currentDepthMapValue = DISPLACEMENT_MAP_LOD(currentTexCoords, lod).r;
 	
 	while(currentLayerDepth < currentDepthMapValue)
 	{
 		// shift texture coordinates along direction of P
 		currentTexCoords -= deltaTexCoords;
 		// get displacement value at current texture coordinates
-		currentDepthMapValue = texture(displacementMap, currentTexCoords).r;  
+		currentDepthMapValue = DISPLACEMENT_MAP_LOD(currentTexCoords, lod).r;  
 		// get depth of next layer
 		currentLayerDepth += layerDepth;  
 	}
@@ -73,7 +121,7 @@ vec2 ParallaxMapping(vec3 viewDir){
 
 	// get depth after and before collision for linear interpolation
 	float afterDepth  = currentDepthMapValue - currentLayerDepth;
-	float beforeDepth = texture(displacementMap, prevTexCoords).r - currentLayerDepth + layerDepth;
+	float beforeDepth = DISPLACEMENT_MAP_LOD(prevTexCoords, lod).r - currentLayerDepth + layerDepth;
 	
 	// interpolation of texture coordinates
 	float weight = afterDepth / (afterDepth - beforeDepth);
@@ -86,9 +134,12 @@ void main() {
 	mat3 TBN = computeTBN();
 
 	// Displacement mapping
-	vec2 texCoords = ParallaxMapping(transpose(TBN) * inData.V);
-	if(texCoords.x > 1.0 || texCoords.y > 1.0 || texCoords.x < 0.0 || texCoords.y < 0.0) {
-		discard;
+	vec2 texCoords = inData.texCoord;
+	if(HAS_DISPLACEMENT) {
+		texCoords = ParallaxMapping(transpose(TBN) * inData.V);
+		if(texCoords.x > 1.0 || texCoords.y > 1.0 || texCoords.x < 0.0 || texCoords.y < 0.0) {
+			discard;
+		}
 	}
 
 	// Normal mapping
@@ -96,7 +147,7 @@ void main() {
 
     outPosition = inData.fragPos;
     outNormal = vec4(N, 1.0);
-    outAlbedo = texture(albedoMap, texCoords);
-    outRoughness = texture(roughnessMap, texCoords).r;
-    outMetalness = texture(metalnessMap, texCoords).r;
+    outAlbedo = ALBEDO_MAP(texCoords);
+    outRoughness = ROUGHNESS_MAP(texCoords).r;
+    outMetalness = METALNESS_MAP(texCoords).r;
 }
\ No newline at end of file
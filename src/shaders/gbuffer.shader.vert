@@ -9,18 +9,17 @@ layout(set = 0, binding = 0) uniform UniformBufferObjectScene {
     vec4 eye; //world space eye position
 } ubo;
 
-layout(push_constant) uniform pushConstant
-{
-	mat4 model;
-    mat4 invModel;
-} pc;
-
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inColor;
+layout(std430, set = 0, binding = 15) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
+
+layout(location = 0) in vec4 inPosition;
+layout(location = 1) in vec4 inNormal;
 layout(location = 3) in vec4 inTangent;
 layout(location = 4) in vec2 inTexCoord;
 
+layout (constant_id = 8) const bool PACKED_VERTICES = false;
+
 layout(location = 0) out struct data {
     vec3 N; // normal in world space
     vec4 T; // tangent in world space
@@ -28,13 +27,17 @@ layout(location = 0) out struct data {
     vec2 texCoord;
     vec4 fragPos; // vertex position in world space
 } outData;
+layout(location = 5) flat out uint outMaterial;
 
 void main() {
-    mat3 normalMatrix = mat3(pc.invModel);
-    outData.N = normalize(normalMatrix * inNormal);
-    outData.T = vec4(normalize(normalMatrix * inTangent.xyz), inTangent.w);
+    InstanceData instance = instances[gl_InstanceIndex];
+    vec3 vertexNormal = decodeNormal(PACKED_VERTICES, inNormal);
+    vec4 vertexTangent = decodeTangent(PACKED_VERTICES, inTangent, inPosition);
+    outData.N = normalize(instanceNormal(instance, vertexNormal));
+    outData.T = vec4(normalize(instanceNormal(instance, vertexTangent.xyz)), vertexTangent.w);
     outData.texCoord = inTexCoord;
-    outData.fragPos = pc.model * vec4(inPosition, 1.0);
+    outData.fragPos = instanceToWorld(instance, inPosition.xyz);
+    outMaterial = instance.material;
     outData.V = normalize(vec3(ubo.eye - outData.fragPos));
 
     gl_Position = ubo.proj * ubo.view * outData.fragPos;
@@ -10,6 +10,7 @@ layout (std140, set = 0, binding = 1) uniform UniformBufferObjectLight {
 	SphereLight sphereLights[MAX_LIGHT_COUNT];
 	SpotLight spotLights[MAX_LIGHT_COUNT];
     DirectionalLight directionalLights[MAX_LIGHT_COUNT];
+	vec4 irradianceSH[9];
 } uboLight;
 layout(set = 0, binding = 2) uniform sampler shadowMapSampler;
 layout(set = 0, binding = 3) uniform texture2D shadowMaps[MAX_LIGHT_COUNT]; //Shadow map for spot light
@@ -20,6 +21,9 @@ layout (set = 0, binding = 7) uniform sampler2D normalMap;
 layout (set = 0, binding = 8) uniform sampler2D albedoMap;
 layout (set = 0, binding = 11) uniform samplerCube environmentMap;
 
+// See ShaderVariant in viewer.h
+layout (constant_id = 9) const bool IRRADIANCE_SH = false;
+
 
 layout (location = 0) in struct data {
     vec2 uv;
@@ -195,8 +199,9 @@ void main() {
 	vec3 V = normalize(inData.eye.xyz - fragPos.xyz);
 	vec3 R = normalize(reflect(-V, N)); 
 
-    // compute radiance from rgbe
-	vec3 rad = toRadiance(texture(environmentMap, normalize(inData.light * N)));
+    // compute radiance
+	vec3 rad = IRRADIANCE_SH ? irradianceSH(uboLight.irradianceSH, normalize(inData.light * N))
+		: texture(environmentMap, normalize(inData.light * N)).rgb;
 
     vec3 color = rad * albedo;
 
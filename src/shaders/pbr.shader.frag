@@ -10,6 +10,7 @@ layout (std140, set = 0, binding = 1) uniform UniformBufferObjectLight {
 	SphereLight sphereLights[MAX_LIGHT_COUNT];
 	SpotLight spotLights[MAX_LIGHT_COUNT];
     DirectionalLight directionalLights[MAX_LIGHT_COUNT];
+	vec4 irradianceSH[9];
 } uboLight;
 layout(set = 0, binding = 2) uniform sampler shadowMapSampler;
 layout(set = 0, binding = 3) uniform texture2D shadowMaps[MAX_LIGHT_COUNT]; //Shadow map for spot light
@@ -26,6 +27,16 @@ layout (set = 0, binding = 12) uniform samplerCube prefilteredMap;
 layout (set = 0, binding = 13) uniform sampler2D brdfLUT;
 layout (set = 0, binding = 14) uniform sampler2D ssaoBlurMap;
 
+// Specialized per scene (see ShaderVariant in viewer.h) so unused lights, shadows, SSAO and IBL compile out
+layout (constant_id = 0) const int SPHERE_LIGHT_COUNT = MAX_LIGHT_COUNT;
+layout (constant_id = 1) const int SPOT_LIGHT_COUNT = MAX_LIGHT_COUNT;
+layout (constant_id = 2) const int DIRECTIONAL_LIGHT_COUNT = MAX_LIGHT_COUNT;
+layout (constant_id = 3) const bool SPOT_SHADOWS = true;
+layout (constant_id = 4) const bool SPHERE_SHADOWS = true;
+layout (constant_id = 5) const bool SSAO_ENABLED = true;
+layout (constant_id = 6) const bool IBL_ENABLED = true;
+layout (constant_id = 9) const bool IRRADIANCE_SH = false;
+
 layout (location = 0) in struct data {
     vec2 uv;
     mat3 light;
@@ -37,12 +48,8 @@ layout(location = 0) out vec4 outColor;
 
 vec3 prefilteredReflection(vec3 R, float roughness) {
 	const float MAX_REFLECTION_LOD = 4.0; // lod = 0,1,2,3,4
-	float lod = roughness * MAX_REFLECTION_LOD;
-	float lodf = floor(lod);
-	float lodc = ceil(lod);
-	vec3 a = toRadiance(textureLod(prefilteredMap, R, lodf));
-	vec3 b = toRadiance(textureLod(prefilteredMap, R, lodc));
-	return mix(a, b, lod - lodf);
+	// The sampler blends the two nearest levels (trilinear)
+	return textureLod(prefilteredMap, R, roughness * MAX_REFLECTION_LOD).rgb;
 }
 
 vec3 fresnelSchlickRoughness(float cosTheta, vec3 F0, float roughness) {
@@ -266,7 +273,7 @@ vec3 calculateSphereLight(SphereLight l, vec3 F0, float metallness, float roughn
 	int shadow_res = int(l.shadow[0]);
 	int shadow_map_idx = int(l.shadow[1]);
 	float shadow = 0.0f;
-	if(shadow_res != 0) {
+	if(SPHERE_SHADOWS && shadow_res != 0) {
 		vec3 fragToLight = vec3(fragPos - l.pos);
 		shadow = calculateShadowCube(fragToLight, shadow_res, shadow_map_idx);
 	}
@@ -330,7 +337,7 @@ vec3 calculateSpotLight(SpotLight l, vec3 F0, float metallness, float roughness,
 	int shadow_res = int(l.shadow[0]);
 	int shadow_map_idx = int(l.shadow[1]);
 	float shadow = 0.0;
-	if(shadow_res != 0) {
+	if(SPOT_SHADOWS && shadow_res != 0) {
 		shadow = calculateShadow(l.lightVP * fragPos, shadow_res, shadow_map_idx, N, L);
 		//return vec3(shadow,0,0);
 	}
@@ -380,13 +387,13 @@ vec3 calculateDirLight(DirectionalLight l, vec3 F0, float metallness, float roug
 
 vec3 calculateLights(vec3 F0, float metallness, float roughness, vec3 N, vec3 V, vec3 R, vec4 fragPos) {
 	vec3 Lo = vec3(0.0);
-	for(int i=0; i<uboLight.sphereLightCount; i++) {
+	for(int i=0; i<SPHERE_LIGHT_COUNT && i<uboLight.sphereLightCount; i++) {
 		Lo += calculateSphereLight(uboLight.sphereLights[i], F0, metallness, roughness, N, V, R, fragPos);
 	}
-	for(int i=0; i<uboLight.spotLightCount; i++) {
+	for(int i=0; i<SPOT_LIGHT_COUNT && i<uboLight.spotLightCount; i++) {
 		Lo += calculateSpotLight(uboLight.spotLights[i], F0, metallness, roughness, N, V, R, fragPos);
 	}
-	for(int i=0; i<uboLight.directionalLightCount; i++) {
+	for(int i=0; i<DIRECTIONAL_LIGHT_COUNT && i<uboLight.directionalLightCount; i++) {
 		Lo += calculateDirLight(uboLight.directionalLights[i], F0, metallness, roughness, N, V, R, fragPos);
 	}
 	return Lo;
@@ -408,41 +415,47 @@ void main() {
 	vec3 V = normalize(inData.eye.xyz - fragPos.xyz);
 	vec3 R = normalize(reflect(-V, N)); 
 
-	// compute radiance from rgbe
-	vec3 irrad = toRadiance(texture(irradianceMap, normalize(inData.light * N)));
-
-	float NdotV = min(max(dot(N, V), 0.0),1.0);
-
-	vec2 brdf = texture(brdfLUT, vec2(NdotV,roughness)).rg;
-	vec3 prefilteredColor = prefilteredReflection(normalize(inData.light * R), roughness);
-
 	//Reference https://github.com/SaschaWillems/Vulkan/blob/master/shaders/glsl/pbrtexture/pbrtexture.frag
 	vec3 F0 = vec3(0.04); 
 	F0 = mix(F0, albedo, metallness);
 
-	vec3 F = fresnelSchlickRoughness(NdotV, F0, roughness);
+	vec3 color = vec3(0.0);
+	if(IBL_ENABLED) {
+		// compute radiance
+		vec3 irrad = IRRADIANCE_SH ? irradianceSH(uboLight.irradianceSH, normalize(inData.light * N))
+			: texture(irradianceMap, normalize(inData.light * N)).rgb;
 
-	vec3 kS = F;
-	vec3 kD = 1.0 - kS;
-	kD *= 1.0 - metallness;
+		float NdotV = min(max(dot(N, V), 0.0),1.0);
 
-	// Diffuse
-	vec3 diffuse = irrad * albedo;
+		vec2 brdf = texture(brdfLUT, vec2(NdotV,roughness)).rg;
+		vec3 prefilteredColor = prefilteredReflection(normalize(inData.light * R), roughness);
 
-	// Specular
-	vec3 specular = prefilteredColor * (F * brdf.x + brdf.y);
+		vec3 F = fresnelSchlickRoughness(NdotV, F0, roughness);
 
-	//vec3 color = ambient + kD * diffuse + specular;
-	vec3 color = kD * diffuse + specular;
-	color *= 0.3;
+		vec3 kS = F;
+		vec3 kD = 1.0 - kS;
+		kD *= 1.0 - metallness;
+
+		// Diffuse
+		vec3 diffuse = irrad * albedo;
+
+		// Specular
+		vec3 specular = prefilteredColor * (F * brdf.x + brdf.y);
+
+		//vec3 color = ambient + kD * diffuse + specular;
+		color = kD * diffuse + specular;
+		color *= 0.3;
+	}
 
 	// From light sources
 	vec3 Lo = calculateLights(F0, metallness, roughness, N, V, R, fragPos) * albedo;
 	color += Lo;
 
 	// Ambient
-	float ambientOcclusion = texture(ssaoBlurMap, inData.uv).r;
-	color *= ambientOcclusion;
+	if(SSAO_ENABLED) {
+		float ambientOcclusion = texture(ssaoBlurMap, inData.uv).r;
+		color *= ambientOcclusion;
+	}
 
 	// tone mapping
 	outColor = vec4(toneMapping(color), 1.0);
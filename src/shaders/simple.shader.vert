@@ -1,26 +1,27 @@
 #version 450
 
+#include "common.glsl"
+
 layout(set = 0, binding = 0) uniform UniformBufferObject {
     mat4 view;
     mat4 proj;
 } ubo;
 
-layout(push_constant) uniform pushConstant
-{
-	mat4 model;
-} pc;
+layout(std430, set = 0, binding = 15) readonly buffer InstanceBuffer {
+    InstanceData instances[];
+};
+
+layout(location = 0) in vec4 inPosition;
+layout(location = 1) in vec4 inNormal;
+layout(location = 2) in vec4 inColor;
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inColor;
-layout(location = 3) in vec4 inTangent;
-layout(location = 4) in vec2 inTexCoord;
+layout (constant_id = 8) const bool PACKED_VERTICES = false;
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec3 normal;
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * pc.model * vec4(inPosition, 1.0);
-    fragColor = inColor;
-    normal = inNormal;
+    gl_Position = ubo.proj * ubo.view * instanceToWorld(instances[gl_InstanceIndex], inPosition.xyz);
+    fragColor = inColor.rgb;
+    normal = decodeNormal(PACKED_VERTICES, inNormal);
 }
@@ -7,12 +7,15 @@
 layout (set = 0, binding = 6) uniform sampler2D positionMap;
 layout (set = 0, binding = 7) uniform sampler2D normalMap;
 layout (set = 0, binding = 8) uniform sampler2D ssaoNoise;
+layout (set = 0, binding = 9) uniform sampler2D ssaoHistory; // last frame's (ao, view depth), only read in temporal mode
 
 layout (set = 0, binding = 1) uniform UniformBufferObjectSSAO {
     vec4 samples[SSAO_SAMPLE_SIZE];
+    mat4 prevViewProj;
+    vec4 temporal; // frame index, samples per frame, history weight, depth rejection threshold
 } uboSSAO;
 
-layout(location = 0) out float outColor;
+layout(location = 0) out vec2 outColor; // ao, view space depth (the single channel target outside temporal mode keeps ao)
 
 layout (location = 0) in struct data {
     vec2 uv;
@@ -30,7 +33,8 @@ void main() {
 
     //vec3 fragPos = texture(positionMap, inData.uv).xyz;
     //fragPos = mat3(inData.view) * fragPos;
-    vec3 fragPos = (inData.view * texture(positionMap, inData.uv)).xyz;
+    vec4 worldPos = texture(positionMap, inData.uv);
+    vec3 fragPos = (inData.view * worldPos).xyz;
     
     vec3 normal = texture(normalMap, inData.uv).rgb;
     // tile noise texture over screen, based on screen dimensions divided by noise size
@@ -45,8 +49,14 @@ void main() {
     vec3 bitangent = cross(normal, tangent);
     mat3 TBN = mat3(tangent, bitangent, normal);
 
+    // Temporal mode evaluates an interleaved subset of the kernel, rotated every frame
+    int sampleCount = int(uboSSAO.temporal.y);
+    int stride = SSAO_SAMPLE_SIZE / sampleCount;
+    int sampleOffset = int(uboSSAO.temporal.x) % stride;
+
     float occlusion = 0.0;
-    for(int i=0; i<SSAO_SAMPLE_SIZE; i++){
+    for(int j=0; j<sampleCount; j++){
+        int i = j * stride + sampleOffset;
         vec3 samplePos = TBN * uboSSAO.samples[i].xyz; //convert samle from tangent space to view space
         samplePos = fragPos + samplePos * RADIUS;
 
@@ -64,5 +74,22 @@ void main() {
         }
     }
 
-    outColor = 1.0 - (occlusion / SSAO_SAMPLE_SIZE);
+    float ao = 1.0 - (occlusion / sampleCount);
+    float depth = -fragPos.z;
+
+    // Blend with the reprojected history, rejecting it where the depth does not match (disocclusion)
+    float historyWeight = uboSSAO.temporal.z;
+    if(historyWeight > 0.0 && worldPos != vec4(0,0,0,1)) {
+        vec4 prevClip = uboSSAO.prevViewProj * worldPos;
+        vec2 prevUV = prevClip.xy / prevClip.w * 0.5 + 0.5;
+        if(prevClip.w > 0.0 && all(greaterThanEqual(prevUV, vec2(0.0))) && all(lessThanEqual(prevUV, vec2(1.0)))) {
+            vec2 history = texture(ssaoHistory, prevUV).rg;
+            // for a perspective projection clip w is the view space depth
+            if(abs(history.g - prevClip.w) < uboSSAO.temporal.w * prevClip.w) {
+                ao = mix(ao, history.r, historyWeight);
+            }
+        }
+    }
+
+    outColor = vec2(ao, depth);
 }
\ No newline at end of file